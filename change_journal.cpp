@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "change_journal.hpp"
+#include "crc32c.hpp"
+
+using namespace std;
+
+struct journal_header_t {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t clean;     // 1 once closed properly, 0 while in use
+	uint32_t reserved;
+};
+
+const uint32_t g_journal_magic = 0x4a434f50; // POCJ
+
+
+static uint32_t entry_crc(const journal_entry_t &e)
+{
+	return crc32c(0, &e, offsetof(journal_entry_t, crc));
+}
+
+change_journal::change_journal() : fd(-1), nslots(0), next(1), oldest(1)
+{
+}
+
+change_journal::~change_journal()
+{
+	close();
+}
+
+/* Writes the clean flag and waits for it to reach flash */
+bool change_journal::mark(uint32_t clean)
+{
+	journal_header_t hdr;
+
+	memset(&hdr, 0, sizeof(hdr));
+	hdr.magic = g_journal_magic;
+	hdr.slots = nslots;
+	hdr.clean = clean;
+
+	return pwrite(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr) &&
+	       fdatasync(fd) == 0;
+}
+
+bool change_journal::open(int dirfd, const char *name, uint32_t slots)
+{
+	journal_header_t hdr;
+	uint64_t newest = 0;
+	bool clean;
+	ssize_t n;
+
+	close();
+
+	nslots = slots;
+	ring.assign(slots, journal_entry_t());
+	next = oldest = 1;
+
+	if (dirfd < 0)
+		return true;
+
+	fd = openat(dirfd, name, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		nslots = 0;
+		return false;
+	}
+
+	n = pread(fd, &hdr, sizeof(hdr), 0);
+	clean = n == sizeof(hdr) && hdr.magic == g_journal_magic &&
+		hdr.slots == slots && hdr.clean == 1;
+
+	if (n == sizeof(hdr) && hdr.magic == g_journal_magic &&
+	    hdr.slots == slots) {
+		n = pread(fd, ring.data(), slots * sizeof(journal_entry_t),
+			  sizeof(hdr));
+		if (n < 0)
+			n = 0;
+
+		// slots past a short read, or failing their crc, hold nothing
+		for (uint32_t i = 0; i < slots; i++) {
+			journal_entry_t &e = ring[i];
+
+			if ((size_t) n < (i + 1) * sizeof(e) || !e.seq ||
+			    e.seq % slots != i || e.crc != entry_crc(e)) {
+				memset(&e, 0, sizeof(e));
+				continue;
+			}
+
+			if (e.seq > newest)
+				newest = e.seq;
+		}
+	} else if (n != 0) {
+		syslog(LOG_WARNING, "change journal %s unusable, starting over",
+		       name);
+	}
+
+	next   = newest + 1;
+	oldest = next;
+
+	if (clean) {
+		// the run of changes ending with the newest
+		while (oldest > 1 && next - oldest < slots &&
+		       ring[(oldest - 1) % slots].seq == oldest - 1)
+			oldest--;
+	} else {
+		// changes may have been given out and lost, or the whole
+		// journal with them, so numbering starts past anything it
+		// could have reached.  Seconds since the epoch shifted up
+		// keep that true even when nothing of the old file is left.
+		next   = max<uint64_t>(next + slots, (uint64_t) time(NULL) << 16);
+		oldest = next;
+		if (newest)
+			syslog(LOG_WARNING, "change journal %s was not closed "
+			       "cleanly, readers will resync", name);
+	}
+
+	if (!mark(0)) {
+		syslog(LOG_ERR, "could not write change journal %s", name);
+		::close(fd);
+		fd = -1;
+		return false;
+	}
+
+	// the store is charged for all of it from the start
+	if (ftruncate(fd, file_size(slots)) < 0)
+		syslog(LOG_WARNING, "could not size change journal %s", name);
+
+	return true;
+}
+
+size_t change_journal::file_size(uint32_t slots)
+{
+	return sizeof(journal_header_t) + slots * sizeof(journal_entry_t);
+}
+
+void change_journal::close(void)
+{
+	if (fd < 0)
+		return;
+
+	mark(1);
+	::close(fd);
+	fd = -1;
+
+	return;
+}
+
+void change_journal::append(uint8_t op, uint16_t logid)
+{
+	journal_entry_t e;
+	uint32_t slot;
+
+	if (!nslots)
+		return;
+
+	memset(&e, 0, sizeof(e));
+	e.seq   = next++;
+	e.logid = logid;
+	e.op    = op;
+	e.crc   = entry_crc(e);
+
+	slot       = e.seq % nslots;
+	ring[slot] = e;
+
+	if (next - oldest > nslots)
+		oldest = next - nslots;
+
+	if (fd >= 0 &&
+	    pwrite(fd, &e, sizeof(e), sizeof(journal_header_t) +
+		   slot * sizeof(e)) != sizeof(e))
+		syslog(LOG_ERR, "could not write change %llu to the journal",
+		       (unsigned long long) e.seq);
+
+	return;
+}
+
+bool change_journal::since(uint64_t since, size_t max,
+			   vector<journal_entry_t> &out) const
+{
+	out.clear();
+
+	// 0 is where a reader with nothing starts, from a full listing
+	if (!since || since + 1 < oldest || since >= next)
+		return false;
+
+	for (uint64_t seq = since + 1; seq < next && out.size() < max; seq++)
+		out.push_back(ring[seq % nslots]);
+
+	return true;
+}
@@ -0,0 +1,61 @@
+#ifndef __CHANGE_JOURNAL_HPP__
+#define __CHANGE_JOURNAL_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* One create or delete, op is MESSAGE_LOG_ADDED or MESSAGE_LOG_REMOVED */
+struct journal_entry_t {
+	uint64_t seq;
+	uint16_t logid;
+	uint8_t  op;
+	uint8_t  reserved;
+	uint32_t crc;   // CRC32C of the fields above
+};
+
+/* Bounded, persistent journal of the changes made to a store, each   */
+/* numbered one higher than the last.  The file is a header and a     */
+/* ring of slots, the change numbered seq going to slot seq % slots,  */
+/* so it never grows and the newest slots() changes can always be     */
+/* read back.  Each change is one pwrite and is not synced; instead   */
+/* the header records a clean close, and after an unclean one the     */
+/* numbers jump past anything that may have been handed out and lost  */
+/* and the journal starts out empty, which sends every reader back to */
+/* a full resync rather than letting it miss a change.  The file is   */
+/* laid out at its full length when opened, which bytes() reports.    */
+class change_journal {
+	int      fd;
+	uint32_t nslots;
+	uint64_t next;     // number of the next change
+	uint64_t oldest;   // of the changes still held, next when none
+	std::vector<journal_entry_t> ring;
+
+	bool mark(uint32_t clean);
+
+public:
+	change_journal();
+	~change_journal();
+	change_journal(const change_journal &) = delete;
+	change_journal &operator=(const change_journal &) = delete;
+
+	// a dirfd of -1 keeps the journal in memory only
+	bool open(int dirfd, const char *name, uint32_t slots);
+	void close(void);
+
+	void     append(uint8_t op, uint16_t logid);
+	uint64_t last(void) const { return next - 1; }
+	uint32_t slots(void) const { return nslots; } // 0 when not open
+	size_t   bytes(void) const { return fd < 0 ? 0 : file_size(nslots); }
+
+	static size_t file_size(uint32_t slots);
+
+	// the changes after since, up to max of them.  false when since
+	// is 0, older than the journal reaches or newer than anything
+	// given out, and the caller has to start over from a full listing
+	// taken after asking for last()
+	bool since(uint64_t since, size_t max,
+		   std::vector<journal_entry_t> &out) const;
+};
+
+#endif
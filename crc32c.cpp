@@ -0,0 +1,156 @@
+#include "crc32c.hpp"
+#include <cstring>
+
+#if defined(__x86_64__) || defined(__i386__)
+	#include <nmmintrin.h>
+	#define HAVE_CRC32C_SSE42 1
+#elif defined(__aarch64__)
+	#include <sys/auxv.h>
+	#include <asm/hwcap.h>
+	#include <arm_acle.h>
+	#define HAVE_CRC32C_ARMV8 1
+#endif
+
+/*****************************************************************************/
+/* Three implementations, picked once at first use:                          */
+/*     SSE4.2 crc32 instruction on x86                                       */
+/*     ARMv8 crc32c instructions on aarch64 when the cpu advertises them     */
+/*     table driven slicing-by-8 everywhere else (AST2400/2500 class parts)  */
+/*****************************************************************************/
+
+static const uint32_t g_poly = 0x82F63B78; // reflected Castagnoli
+
+static uint32_t g_table[8][256];
+
+static void build_tables(void)
+{
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+
+		for (int k = 0; k < 8; k++)
+			c = (c & 1) ? (c >> 1) ^ g_poly : c >> 1;
+
+		g_table[0][i] = c;
+	}
+
+	for (uint32_t i = 0; i < 256; i++)
+		for (int t = 1; t < 8; t++)
+			g_table[t][i] = (g_table[t-1][i] >> 8) ^
+					g_table[0][g_table[t-1][i] & 0xff];
+
+	return;
+}
+
+static uint32_t crc32c_sw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len && ((uintptr_t) p & 7)) {
+		crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+		len--;
+	}
+
+	while (len >= 8) {
+		uint32_t lo, hi;
+
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		lo = __builtin_bswap32(lo);
+		hi = __builtin_bswap32(hi);
+#endif
+		lo ^= crc;
+		crc = g_table[7][lo & 0xff] ^
+		      g_table[6][(lo >> 8) & 0xff] ^
+		      g_table[5][(lo >> 16) & 0xff] ^
+		      g_table[4][lo >> 24] ^
+		      g_table[3][hi & 0xff] ^
+		      g_table[2][(hi >> 8) & 0xff] ^
+		      g_table[1][(hi >> 16) & 0xff] ^
+		      g_table[0][hi >> 24];
+		p   += 8;
+		len -= 8;
+	}
+
+	while (len--)
+		crc = (crc >> 8) ^ g_table[0][(crc ^ *p++) & 0xff];
+
+	return crc;
+}
+
+#ifdef HAVE_CRC32C_SSE42
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len && ((uintptr_t) p & 7)) {
+		crc = _mm_crc32_u8(crc, *p++);
+		len--;
+	}
+#ifdef __x86_64__
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = (uint32_t) _mm_crc32_u64(crc, v);
+	}
+#endif
+	for (; len >= 4; p += 4, len -= 4) {
+		uint32_t v;
+		memcpy(&v, p, 4);
+		crc = _mm_crc32_u32(crc, v);
+	}
+
+	while (len--)
+		crc = _mm_crc32_u8(crc, *p++);
+
+	return crc;
+}
+
+static bool have_hw(void)
+{
+	return __builtin_cpu_supports("sse4.2");
+}
+#endif
+
+#ifdef HAVE_CRC32C_ARMV8
+__attribute__((target("+crc")))
+static uint32_t crc32c_hw(uint32_t crc, const uint8_t *p, size_t len)
+{
+	while (len && ((uintptr_t) p & 7)) {
+		crc = __crc32cb(crc, *p++);
+		len--;
+	}
+
+	for (; len >= 8; p += 8, len -= 8) {
+		uint64_t v;
+		memcpy(&v, p, 8);
+		crc = __crc32cd(crc, v);
+	}
+
+	while (len--)
+		crc = __crc32cb(crc, *p++);
+
+	return crc;
+}
+
+static bool have_hw(void)
+{
+	return getauxval(AT_HWCAP) & HWCAP_CRC32;
+}
+#endif
+
+typedef uint32_t (*crc32c_fn)(uint32_t, const uint8_t *, size_t);
+
+static crc32c_fn select_impl(void)
+{
+#if defined(HAVE_CRC32C_SSE42) || defined(HAVE_CRC32C_ARMV8)
+	if (have_hw())
+		return crc32c_hw;
+#endif
+	build_tables();
+	return crc32c_sw;
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	static const crc32c_fn impl = select_impl();
+
+	return ~impl(~crc, (const uint8_t*) buf, len);
+}
@@ -0,0 +1,11 @@
+#ifndef __CRC32C_HPP__
+#define __CRC32C_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+/* CRC32C (Castagnoli).  Start with crc = 0 and feed the previous result */
+/* back in to checksum a record that is spread over several buffers.     */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,116 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "dir_scan.hpp"
+
+const size_t g_scan_bufsize = 32 * 1024;
+
+
+dir_scan::dir_scan() : fd(-1), len(0), pos(0)
+{
+}
+
+bool dir_scan::open(int dirfd)
+{
+	close();
+
+	fd = openat(dirfd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	buf.resize(g_scan_bufsize);
+	len = pos = 0;
+
+	return true;
+}
+
+void dir_scan::close(void)
+{
+	if (fd >= 0)
+		::close(fd);
+
+	fd = -1;
+	len = pos = 0;
+	std::vector<char>().swap(buf);
+
+	return;
+}
+
+const dirent64_t *dir_scan::next(void)
+{
+	const dirent64_t *ent;
+	long n;
+
+	if (fd < 0)
+		return NULL;
+
+	if (pos >= len) {
+		n = syscall(SYS_getdents64, fd, buf.data(), buf.size());
+		if (n <= 0) {
+			close();
+			return NULL;
+		}
+
+		len = n;
+		pos = 0;
+	}
+
+	ent = (const dirent64_t *) (buf.data() + pos);
+	pos += ent->d_reclen;
+
+	return ent;
+}
+
+uint16_t dir_scan::next_log(void)
+{
+	const dirent64_t *ent;
+	uint16_t id;
+
+	while ((ent = next()) != NULL) {
+		// only DT_UNKNOWN filesystems make the caller look any closer
+		if (ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN)
+			continue;
+
+		if ((id = parse_logid(ent->d_name)))
+			return id;
+	}
+
+	return 0;
+}
+
+uint16_t parse_logid(const char *name)
+{
+	uint32_t id = 0;
+
+	if (*name < '1' || *name > '9')
+		return 0;
+
+	for (; *name; name++) {
+		if (*name < '0' || *name > '9')
+			return 0;
+
+		id = id * 10 + (*name - '0');
+		if (id > UINT16_MAX)
+			return 0;
+	}
+
+	return id;
+}
+
+void log_name(uint16_t logid, char *name)
+{
+	char digits[5];
+	int n = 0;
+
+	do {
+		digits[n++] = '0' + logid % 10;
+		logid /= 10;
+	} while (logid);
+
+	while (n)
+		*name++ = digits[--n];
+	*name = 0;
+
+	return;
+}
@@ -0,0 +1,46 @@
+#ifndef __DIR_SCAN_HPP__
+#define __DIR_SCAN_HPP__
+
+#include <cstdint>
+#include <vector>
+
+/* Layout the kernel hands back from getdents64(2) */
+struct dirent64_t {
+	uint64_t       d_ino;
+	int64_t        d_off;
+	unsigned short d_reclen;
+	unsigned char  d_type;
+	char           d_name[1];
+};
+
+/* Lists a directory with getdents64 into one large buffer, so a store */
+/* of a few thousand records is read in a handful of syscalls instead  */
+/* of one per entry through readdir.                                   */
+class dir_scan {
+	int               fd;
+	std::vector<char> buf;
+	size_t            len;
+	size_t            pos;
+
+public:
+	dir_scan();
+
+	// dirfd is duplicated, the scan has its own file offset
+	bool open(int dirfd);
+	void close(void);
+	bool is_open(void) const { return fd >= 0; }
+
+	// NULL once the directory is exhausted
+	const dirent64_t *next(void);
+
+	// the next entry that may be a record, 0 at the end
+	uint16_t next_log(void);
+};
+
+/* logid named by a record file, 0 if name is not one */
+uint16_t parse_logid(const char *name);
+
+/* Writes the file name of a record into name, which holds at least 6 */
+void log_name(uint16_t logid, char *name);
+
+#endif
@@ -0,0 +1,665 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "crc32c.hpp"
+#include "lz4_block.hpp"
+#include "message.hpp"
+
+/*****************************************************************************/
+/* Archive of cold records.                                                 */
+/*                                                                           */
+/* Once a record is older than the archive age, archive() packs it with     */
+/* others into a segment in .archive and unlinks its own file.  A segment   */
+/* is a run of blocks of about g_archive_block bytes of records, each       */
+/* compressed with LZ4 and prefixed by a table of where each record sits.   */
+/* Segments are written whole to .tmp, synced and renamed into place, so a  */
+/* segment is either complete or absent; a record file left behind by a     */
+/* crash between the rename and the unlink is dropped at the next load.     */
+/*                                                                           */
+/* Segments are never modified.  Removing an archived record appends its    */
+/* logid to <segment>.dead, and the segment goes once nothing in it is      */
+/* live.  One that is mostly dead is rewritten with the next batch.  When a */
+/* logid turns up in more than one segment the newest copy wins.            */
+/*                                                                           */
+/* Each record is charged its share of the compressed block against        */
+/* maxsize.  open() goes through a small LRU cache of decompressed blocks,  */
+/* so reading neighbouring records, as a client listing events does, costs */
+/* one decompression per block rather than one per record.                 */
+/*****************************************************************************/
+
+const uint32_t g_archive_magic = 0x5341424F; // OBAS
+
+// records per block, by uncompressed size
+const size_t g_archive_block = 16 * 1024;
+
+// sanity limit when reading, a single record can exceed the block size
+const size_t g_archive_rawmax = 1024 * 1024;
+
+// records moved per archive() call, and fewer is not worth a segment
+const size_t g_archive_batch = 256;
+const size_t g_archive_min   = 16;
+
+// decompressed blocks kept for open()
+const size_t g_archive_cache = 4;
+
+struct archive_block_t {
+	uint32_t magic;
+	uint32_t rawlen;
+	uint32_t complen;
+	uint32_t crc;      // CRC32C of the entries and compressed data
+	uint32_t count;
+};
+
+
+static void segment_name(uint32_t segment, char *name, const char *suffix = "")
+{
+	snprintf(name, 24, "%u%s", segment, suffix);
+	return;
+}
+
+bool archive_segment_id(const char *name, uint32_t *segment)
+{
+	char *end;
+	unsigned long n;
+
+	if (*name < '1' || *name > '9')
+		return false;
+
+	n = strtoul(name, &end, 10);
+	if (*end != 0 || n > UINT32_MAX)
+		return false;
+
+	*segment = n;
+
+	return true;
+}
+
+int archive_read_block(int fd, uint64_t *off, vector<archive_entry_t> &entries,
+		       vector<uint8_t> &raw)
+{
+	archive_block_t hdr;
+	vector<uint8_t> body;
+	size_t tlen;
+
+	if (pread(fd, &hdr, sizeof(hdr), *off) != sizeof(hdr))
+		return 0;
+
+	if (hdr.magic != g_archive_magic || hdr.count == 0 ||
+	    hdr.rawlen > g_archive_rawmax || hdr.complen > lz4_bound(hdr.rawlen) ||
+	    hdr.count > hdr.rawlen)
+		return 0;
+
+	tlen = hdr.count * sizeof(archive_entry_t);
+	body.resize(tlen + hdr.complen);
+
+	if (pread(fd, body.data(), body.size(), *off + sizeof(hdr)) !=
+	    (ssize_t) body.size())
+		return 0;
+
+	*off += sizeof(hdr) + body.size();
+
+	if (crc32c(0, body.data(), body.size()) != hdr.crc)
+		return -1;
+
+	entries.resize(hdr.count);
+	memcpy(entries.data(), body.data(), tlen);
+
+	raw.resize(hdr.rawlen);
+	if (lz4_decompress(body.data() + tlen, hdr.complen, raw.data(),
+			   raw.size()) != (ssize_t) hdr.rawlen)
+		return -1;
+
+	for (const archive_entry_t &e : entries)
+		if (e.len == 0 || (uint64_t) e.offset + e.len > hdr.rawlen)
+			return -1;
+
+	return 1;
+}
+
+void archive_read_dead(int archfd, uint32_t segment, set<uint16_t> &dead)
+{
+	uint16_t ids[256];
+	char name[24];
+	ssize_t n;
+	int fd;
+
+	segment_name(segment, name, ".dead");
+
+	fd = openat(archfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+
+	while ((n = ::read(fd, ids, sizeof(ids))) > 0)
+		dead.insert(ids, ids + n / sizeof(ids[0]));
+
+	::close(fd);
+
+	return;
+}
+
+
+template <class Store>
+void basic_event_manager<Store>::set_archive_age(uint32_t seconds)
+{
+	archiveage = seconds;
+	return;
+}
+
+template <class Store>
+uint32_t basic_event_manager<Store>::archive_age(void)
+{
+	return archiveage;
+}
+
+/* Loads every segment, oldest first, indexing what is live in them */
+template <class Store>
+void basic_event_manager<Store>::archive_open(void)
+{
+	const dirent64_t *ent;
+	vector<uint32_t> ids;
+	dir_scan files;
+	uint32_t id;
+
+	mkdirat(store.dirfd(), MESSAGE_ARCHIVE_DIR, 0755);
+
+	archfd = openat(store.dirfd(), MESSAGE_ARCHIVE_DIR,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (archfd < 0 || !files.open(archfd)) {
+		syslog(LOG_WARNING, "no archive in %s, cold events stay in "
+		       "their own files: %s", eventpath.c_str(), strerror(errno));
+		return;
+	}
+
+	// a segment that never made it to its rename
+	unlinkat(archfd, ".tmp", 0);
+
+	while ((ent = files.next()) != NULL)
+		if (archive_segment_id(ent->d_name, &id))
+			ids.push_back(id);
+
+	sort(ids.begin(), ids.end());
+
+	for (uint32_t segment : ids)
+		archive_load(segment);
+
+	for (auto it = segments.begin(); it != segments.end(); ) {
+		uint32_t segment = it->first;
+
+		++it;
+		if (!segments[segment].live)
+			archive_unlink(segment);
+	}
+
+	return;
+}
+
+template <class Store>
+void basic_event_manager<Store>::archive_load(uint32_t segment)
+{
+	vector<archive_entry_t> entries;
+	vector<uint8_t> raw;
+	set<uint16_t> dead;
+	event_record_t rec;
+	blob_ref_t ref;
+	struct stat st;
+	uint64_t off = 0, next;
+	char name[24];
+	int fd, r;
+
+	segment_name(segment, name);
+
+	fd = openat(archfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		if (fd >= 0)
+			::close(fd);
+		return;
+	}
+
+	archive_read_dead(archfd, segment, dead);
+
+	archive_seg_t &seg = segments[segment];
+	seg = archive_seg_t();
+	seg.bytes = st.st_size;
+
+	for (;;) {
+		next = off;
+		r = archive_read_block(fd, &next, entries, raw);
+		if (r == 0)
+			break;
+
+		if (r < 0) {
+			syslog(LOG_ERR, "archive segment %u is damaged at %llu",
+			       segment, (unsigned long long) off);
+			corruptcount++;
+			off = next;
+			continue;
+		}
+
+		uint64_t blockbytes = next - off;
+
+		for (const archive_entry_t &e : entries) {
+			const uint8_t *image = raw.data() + e.offset;
+			uint32_t share = max<uint64_t>(1, blockbytes * e.len / raw.size());
+
+			seg.total++;
+
+			if (dead.count(e.logid))
+				continue;
+
+			if (!message_decode_log(image, e.len, &rec, &dict) ||
+			    (uint16_t) rec.logid != e.logid) {
+				syslog(LOG_ERR, "archived event log %u is corrupt",
+				       e.logid);
+				corruptcount++;
+				continue;
+			}
+
+			// a newer copy replaces the one an older segment holds
+			auto old = archived.find(e.logid);
+			if (old != archived.end()) {
+				int row = table.find(e.logid);
+
+				if (row >= 0) {
+					currentsize -= min(currentsize,
+							   (size_t) table.bytes(row));
+					logcount--;
+				}
+				unindex_log(e.logid);
+				segments[old->second.segment].live--;
+			}
+
+			index_log(&rec, share,
+				  record_blob(image, &rec, &ref) ? &ref : NULL);
+			currentsize += share;
+			logcount++;
+			note_log_id(e.logid);
+
+			archived[e.logid] = archive_loc_t{ segment, (uint32_t) off,
+							   e.offset, e.len };
+			seg.live++;
+		}
+
+		off = next;
+	}
+
+	::close(fd);
+
+	return;
+}
+
+/* Removes a segment and its tombstones, whatever it held is gone */
+template <class Store>
+void basic_event_manager<Store>::archive_unlink(uint32_t segment)
+{
+	char name[24];
+
+	segment_name(segment, name);
+	unlinkat(archfd, name, 0);
+	segment_name(segment, name, ".dead");
+	unlinkat(archfd, name, 0);
+
+	segments.erase(segment);
+
+	archcache.erase(remove_if(archcache.begin(), archcache.end(),
+				  [segment](const archive_cache_t &c) {
+					  return c.segment == segment;
+				  }),
+			archcache.end());
+
+	return;
+}
+
+/* Forgets where an archived record was, its accounting stays with the */
+/* caller.  The logid goes on the segment's tombstone list.            */
+template <class Store>
+void basic_event_manager<Store>::archive_drop(uint16_t logid)
+{
+	auto it = archived.find(logid);
+	char name[24];
+	int fd;
+
+	if (it == archived.end())
+		return;
+
+	uint32_t segment = it->second.segment;
+	archived.erase(it);
+
+	auto seg = segments.find(segment);
+	if (seg == segments.end())
+		return;
+
+	if (--seg->second.live == 0) {
+		archive_unlink(segment);
+		return;
+	}
+
+	segment_name(segment, name, ".dead");
+
+	fd = openat(archfd, name, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0 || ::write(fd, &logid, sizeof(logid)) != sizeof(logid))
+		syslog(LOG_ERR, "could not record removal of archived event %u",
+		       logid);
+	if (fd >= 0)
+		::close(fd);
+
+	return;
+}
+
+/* A decompressed block, from the cache if it is there */
+template <class Store>
+const vector<uint8_t> *
+basic_event_manager<Store>::archive_block(uint32_t segment, uint32_t block)
+{
+	vector<archive_entry_t> entries;
+	vector<uint8_t> raw;
+	uint64_t off = block;
+	char name[24];
+	int fd, r;
+
+	for (archive_cache_t &c : archcache) {
+		if (c.segment == segment && c.block == block) {
+			c.used = ++archclock;
+			return &c.data;
+		}
+	}
+
+	segment_name(segment, name);
+
+	fd = openat(archfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	r = archive_read_block(fd, &off, entries, raw);
+	::close(fd);
+
+	if (r <= 0)
+		return NULL;
+
+	if (archcache.size() < g_archive_cache)
+		archcache.emplace_back();
+
+	archive_cache_t &victim = *min_element(archcache.begin(), archcache.end(),
+		[](const archive_cache_t &a, const archive_cache_t &b) {
+			return a.used < b.used;
+		});
+
+	victim.segment = segment;
+	victim.block   = block;
+	victim.used    = ++archclock;
+	victim.data.swap(raw);
+
+	return &victim.data;
+}
+
+template <class Store>
+int basic_event_manager<Store>::read_archived(uint16_t logid,
+					      event_record_t **rec,
+					      size_t *size, bool verify)
+{
+	const archive_loc_t &loc = archived[logid];
+	const vector<uint8_t> *raw = archive_block(loc.segment, loc.block);
+	uint8_t *block;
+
+	if (!raw || (uint64_t) loc.offset + loc.len > raw->size()) {
+		syslog(LOG_ERR, "archived event log %d is unreadable", logid);
+		corruptcount++;
+		return 0;
+	}
+
+	block = new uint8_t[sizeof(event_record_t) + loc.len];
+	memcpy(block + sizeof(event_record_t), raw->data() + loc.offset, loc.len);
+
+	if (!parse_block(logid, block, loc.len, verify))
+		return 0;
+
+	*rec  = (event_record_t*) block;
+	*size = loc.len;
+
+	return logid;
+}
+
+/* Packs the images of ids into blocks and writes them out as a new   */
+/* segment.  locs and shares are filled in per image, shares being    */
+/* each record's part of its block's size on disk.                    */
+template <class Store>
+bool basic_event_manager<Store>::write_segment(uint32_t segment,
+					       const vector<uint16_t> &ids,
+					       const vector<vector<uint8_t>> &images,
+					       vector<archive_loc_t> &locs,
+					       vector<uint32_t> &shares,
+					       size_t *bytes)
+{
+	vector<uint8_t> file, raw, comp;
+	vector<archive_entry_t> entries;
+	char name[24];
+	size_t i = 0;
+	ssize_t n;
+	int fd;
+
+	locs.resize(images.size());
+	shares.resize(images.size());
+
+	while (i < images.size()) {
+		archive_block_t hdr;
+		size_t first = i, block = file.size(), tlen, blockbytes;
+
+		raw.clear();
+		entries.clear();
+
+		while (i < images.size() &&
+		       (i == first || raw.size() + images[i].size() <= g_archive_block)) {
+			archive_entry_t e;
+
+			memset(&e, 0, sizeof(e));
+			e.logid  = ids[i];
+			e.offset = raw.size();
+			e.len    = images[i].size();
+			entries.push_back(e);
+
+			raw.insert(raw.end(), images[i].begin(), images[i].end());
+			i++;
+		}
+
+		comp.resize(lz4_bound(raw.size()));
+		comp.resize(lz4_compress(raw.data(), raw.size(), comp.data(),
+					 comp.size()));
+
+		tlen = entries.size() * sizeof(archive_entry_t);
+
+		memset(&hdr, 0, sizeof(hdr));
+		hdr.magic   = g_archive_magic;
+		hdr.rawlen  = raw.size();
+		hdr.complen = comp.size();
+		hdr.count   = entries.size();
+		hdr.crc     = crc32c(crc32c(0, entries.data(), tlen),
+				     comp.data(), comp.size());
+
+		file.insert(file.end(), (uint8_t*) &hdr, (uint8_t*) (&hdr + 1));
+		file.insert(file.end(), (uint8_t*) entries.data(),
+			    (uint8_t*) entries.data() + tlen);
+		file.insert(file.end(), comp.begin(), comp.end());
+
+		blockbytes = file.size() - block;
+
+		for (size_t j = first; j < i; j++) {
+			const archive_entry_t &e = entries[j - first];
+
+			locs[j]   = archive_loc_t{ segment, (uint32_t) block,
+						   e.offset, e.len };
+			shares[j] = max<uint64_t>(1, (uint64_t) blockbytes * e.len /
+						     raw.size());
+		}
+	}
+
+	fd = openat(archfd, ".tmp", O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	n = ::write(fd, file.data(), file.size());
+
+	// the segment must be on flash before the record files go
+	if (n != (ssize_t) file.size() || fsync(fd) < 0) {
+		::close(fd);
+		unlinkat(archfd, ".tmp", 0);
+		return false;
+	}
+
+	::close(fd);
+
+	segment_name(segment, name);
+	if (renameat(archfd, ".tmp", archfd, name) < 0) {
+		unlinkat(archfd, ".tmp", 0);
+		return false;
+	}
+
+	fsync(archfd);
+	*bytes = file.size();
+
+	return true;
+}
+
+/* Moves up to g_archive_batch records older than the archive age into */
+/* a new segment, along with the live records of any segment that is   */
+/* mostly tombstones.  Returns how many records were moved.            */
+template <class Store>
+size_t basic_event_manager<Store>::archive(time_t now)
+{
+	vector<vector<uint8_t>> images;
+	vector<archive_loc_t> locs;
+	vector<uint32_t> shares;
+	vector<uint16_t> ids;
+	set<uint32_t> repack;
+	event_record_t *rec;
+	size_t size, loose = 0, bytes = 0, moving = 0;
+	uint32_t segment;
+
+	if (!archiveage || archfd < 0)
+		return 0;
+
+	for (auto &s : segments)
+		if (s.second.live * 2 < s.second.total &&
+		    moving + s.second.live <= g_archive_batch / 2) {
+			repack.insert(s.first);
+			moving += s.second.live;
+		}
+
+	for (size_t row = 0; row < table.size(); row++) {
+		uint16_t id = table.logid(row);
+		auto it = archived.find(id);
+
+		if (it != archived.end()) {
+			if (repack.count(it->second.segment))
+				ids.push_back(id);
+		} else if (!staged.count(id) && loose + moving < g_archive_batch &&
+			   table.timestamp(row) + archiveage <= now) {
+			ids.push_back(id);
+			loose++;
+		}
+	}
+
+	if (loose < g_archive_min && repack.empty())
+		return 0;
+
+	// a record that cannot be read stays where it is for fsck
+	size_t kept = 0;
+	for (uint16_t id : ids) {
+		if (!read_log(id, &rec, &size, true))
+			continue;
+
+		const uint8_t *image = (const uint8_t*) (rec + 1);
+		images.emplace_back(image, image + size);
+		close(rec);
+
+		ids[kept++] = id;
+	}
+	ids.resize(kept);
+
+	if (ids.empty())
+		return 0;
+
+	segment = segments.empty() ? 1 : segments.rbegin()->first + 1;
+
+	if (!write_segment(segment, ids, images, locs, shares, &bytes)) {
+		syslog(LOG_ERR, "could not write archive segment %u: %s",
+		       segment, strerror(errno));
+		return 0;
+	}
+
+	for (size_t i = 0; i < ids.size(); i++) {
+		uint16_t id = ids[i];
+		int row = table.find(id);
+		bool wasloose = !archived.count(id);
+
+		// in archived before the unlink, so the watch ignores it
+		archived[id] = locs[i];
+
+		if (wasloose)
+			store.unlink(id);
+
+		ssize_t delta = (ssize_t) shares[i] - (ssize_t) table.bytes(row);
+
+		account(table.reporter(row), delta, 0);
+		currentsize += delta;
+		table.set_bytes(row, shares[i]);
+	}
+
+	segments[segment] = archive_seg_t{ bytes, (uint32_t) ids.size(),
+					   (uint32_t) ids.size() };
+
+	// whatever is still in a rewritten segment could not be read back
+	for (uint32_t old : repack) {
+		for (auto it = archived.begin(); it != archived.end(); ) {
+			uint16_t id = it->first;
+
+			if ((it++)->second.segment != old)
+				continue;
+
+			int row = table.find(id);
+			if (row >= 0)
+				currentsize -= min(currentsize, (size_t) table.bytes(row));
+			if (logcount > 0)
+				logcount--;
+			archived.erase(id);
+			unindex_log(id);
+			note_change(MESSAGE_LOG_REMOVED, id);
+		}
+
+		archive_unlink(old);
+	}
+
+	collect_blobs();
+	publish();
+
+	syslog(LOG_INFO, "archived %zu events into segment %u, %zu bytes",
+	       ids.size(), segment, bytes);
+
+	return ids.size();
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::archive_disk_size(void)
+{
+	const dirent64_t *ent;
+	dir_scan files;
+	struct stat st;
+	size_t size = 0;
+
+	if (archfd < 0 || !files.open(archfd))
+		return 0;
+
+	while ((ent = files.next()) != NULL)
+		if (ent->d_name[0] != '.' &&
+		    fstatat(archfd, ent->d_name, &st, 0) == 0)
+			size += st.st_size;
+
+	return size;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
@@ -0,0 +1,390 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "message.hpp"
+
+/*****************************************************************************/
+/* Bulk operations on the store: loading at startup, clearing, deleting by  */
+/* predicate and flushing a batch of staged records.                        */
+/*                                                                           */
+/* With io_uring each batch goes to the kernel a round at a time, every     */
+/* open in one round, then every read or write in the next with its close   */
+/* hard linked behind it, so flash sees a queue of requests instead of one  */
+/* at a time and we pay one io_uring_enter per round rather than several    */
+/* syscalls per record.  Without it the same operations run one record at   */
+/* a time through the plain syscalls, with the same results.                */
+/*                                                                           */
+/* Only the bulk paths use the ring.  A single create() or remove() would   */
+/* be one request in a round, no cheaper than its syscall, and a flushed    */
+/* batch is made durable by one syncfs() rather than an fsync per record.   */
+/*****************************************************************************/
+
+const unsigned g_ring_depth = 64;
+
+// one read is enough for nearly every record, bigger ones are read again
+const size_t g_ring_readsize = 4096;
+
+
+/* A failed round may have left files open, either round: a close the */
+/* ring was not seen to run, or never got queued, is done here         */
+static void close_round(const vector<int> &fds, const vector<int> &res)
+{
+	for (size_t i = 0; i < fds.size(); i++)
+		if (fds[i] >= 0 && res[2 * i + 1] == -ECANCELED)
+			::close(fds[i]);
+
+	return;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::set_io_ring(bool enable)
+{
+	// the rounds below open record files by name
+	if (!enable || !Store::record_files)
+		ring.teardown();
+	else if (!ring.ready() && !ring.setup(g_ring_depth))
+		syslog(LOG_INFO, "io_uring not available, using plain syscalls");
+
+	return ring.ready();
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::open_logs(const uint16_t *ids, size_t n,
+					     event_record_t **recs, bool verify)
+{
+	size_t count = 0;
+	vector<size_t> sizes(n);
+
+	read_logs(ids, n, recs, sizes.data(), verify);
+
+	for (size_t i = 0; i < n; i++)
+		if (recs[i] && attach_blob(&recs[i], sizes[i], verify))
+			count++;
+
+	return count;
+}
+
+template <class Store>
+void basic_event_manager<Store>::read_logs(const uint16_t *ids, size_t n,
+					   event_record_t **recs, size_t *sizes,
+					   bool verify)
+{
+	size_t base = 0, count;
+
+	while (ring.ready() && base < n) {
+		count = min(n - base, (size_t) ring.depth() / 2);
+
+		if (!read_round(ids + base, count, recs + base, sizes + base,
+				verify)) {
+			ring.teardown();
+			break;
+		}
+
+		base += count;
+	}
+
+	for (; base < n; base++)
+		if (!read_log(ids[base], &recs[base], &sizes[base], verify))
+			recs[base] = NULL;
+
+	return;
+}
+
+/* One round of opens and one of reads for up to depth()/2 records.  */
+/* Returns false when the ring itself failed, which leaves the round */
+/* to be redone with plain syscalls.                                 */
+template <class Store>
+bool basic_event_manager<Store>::read_round(const uint16_t *ids, size_t count,
+					    event_record_t **recs,
+					    size_t *sizes, bool verify)
+{
+	vector<char> names(8 * count);
+	vector<int> fds(count, -1), res(2 * count, -ECANCELED);
+	vector<uint8_t*> blocks(count, NULL);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		if (staged.count(ids[i]) || archived.count(ids[i]))
+			continue;
+
+		log_name(ids[i], &names[8 * i]);
+		ring.prep_openat(i, store.dirfd(), &names[8 * i],
+				 O_RDONLY | O_CLOEXEC, 0);
+	}
+
+	if (ring.run(fds.data()) < 0) {
+		// some opens may have completed before the ring gave up
+		close_round(fds, res);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (fds[i] < 0)
+			continue;
+
+		blocks[i] = new uint8_t[sizeof(event_record_t) + g_ring_readsize];
+		ring.prep_read(2 * i, fds[i], blocks[i] + sizeof(event_record_t),
+			       g_ring_readsize);
+		ring.link_last();
+		ring.prep_close(2 * i + 1, fds[i]);
+	}
+
+	if (ring.run(res.data()) < 0) {
+		for (i = 0; i < count; i++)
+			delete[] blocks[i];
+		close_round(fds, res);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		bool opened = blocks[i] != NULL;
+		int got = res[2 * i];
+
+		recs[i] = NULL;
+
+		if (opened && got >= 0 && (size_t) got < g_ring_readsize) {
+			if (parse_block(ids[i], blocks[i], got, verify)) {
+				recs[i]  = (event_record_t*) blocks[i];
+				sizes[i] = got;
+			}
+			continue;
+		}
+
+		delete[] blocks[i];
+
+		// staged, archived, larger than one read or the read failed
+		if (opened || staged.count(ids[i]) ||
+		    archived.count(ids[i]))
+			if (!read_log(ids[i], &recs[i], &sizes[i], verify))
+				recs[i] = NULL;
+	}
+
+	return true;
+}
+
+/* Removes every listed record, returns how many were removed */
+template <class Store>
+size_t basic_event_manager<Store>::remove_logs(const uint16_t *ids, size_t n)
+{
+	vector<char> names(8 * ring.depth());
+	vector<int> res;
+	size_t removed = 0;
+
+	if (!ring.ready()) {
+		for (size_t i = 0; i < n; i++)
+			if (table.find(ids[i]) >= 0 && remove(ids[i]) == 0)
+				removed++;
+		return removed;
+	}
+
+	for (size_t base = 0; base < n; base += ring.depth()) {
+		size_t count = min(n - base, (size_t) ring.depth());
+		size_t i;
+
+		res.assign(count, 0);
+
+		for (i = 0; i < count; i++) {
+			if (staged.count(ids[base + i]) ||
+			    archived.count(ids[base + i]))
+				continue;
+
+			log_name(ids[base + i], &names[8 * i]);
+			ring.prep_unlinkat(i, store.dirfd(), &names[8 * i]);
+		}
+
+		if (ring.run(res.data()) < 0) {
+			ring.teardown();
+			return removed + remove_logs(ids + base, n - base);
+		}
+
+		for (i = 0; i < count; i++) {
+			uint16_t id = ids[base + i];
+			int row = table.find(id);
+			size_t event_size = row < 0 ? 0 : table.bytes(row);
+			auto it = staged.find(id);
+
+			if (row < 0)
+				continue;	// unknown, or removed already
+
+			if (it != staged.end()) {
+				// never reached flash, nothing was unlinked
+				stagedbytes -= it->second.size();
+				staged.erase(it);
+			} else if (archived.count(id)) {
+				archive_drop(id);
+			} else if (res[i] < 0 && res[i] != -ENOENT) {
+				continue;
+			}
+
+			currentsize -= min(currentsize, event_size);
+			if (unindex_log(id) && logcount > 0)
+				logcount--;
+
+			journal.append(MESSAGE_LOG_REMOVED, id);
+			removed++;
+		}
+	}
+
+	collect_blobs();
+	publish();
+
+	return removed;
+}
+
+/* True if one of the space separated paths starts with prefix */
+static bool association_has_prefix(const char *association, const char *prefix)
+{
+	size_t len = strlen(prefix);
+	const char *path = association;
+
+	while (path && *path) {
+		path += strspn(path, " ");
+		if (!strncmp(path, prefix, len))
+			return true;
+		path = strchr(path, ' ');
+	}
+
+	return false;
+}
+
+/* Removes every record f matches that has an association starting */
+/* with assocprefix, NULL or "" matching any.  The table resolves   */
+/* severity, reporter and time without touching flash; only the     */
+/* candidates are read, and only when there is a prefix to check.   */
+/* The lot then goes in one remove_logs() pass, removed getting     */
+/* each logid actually removed.                                     */
+template <class Store>
+size_t basic_event_manager<Store>::remove_where(const event_filter_t &f,
+						const char *assocprefix,
+						vector<uint16_t> &removed)
+{
+	const size_t batch = 32;
+	event_record_t *recs[batch];
+	size_t sizes[batch];
+	vector<uint16_t> ids;
+	size_t kept = 0;
+
+	removed.clear();
+	table.filter(f, ids);
+
+	if (assocprefix && *assocprefix) {
+		for (size_t base = 0; base < ids.size(); base += batch) {
+			size_t n = min(batch, ids.size() - base);
+
+			read_logs(&ids[base], n, recs, sizes, false);
+
+			for (size_t i = 0; i < n; i++) {
+				if (!recs[i])
+					continue;
+
+				if (association_has_prefix(recs[i]->association,
+							   assocprefix))
+					ids[kept++] = ids[base + i];
+				close(recs[i]);
+			}
+		}
+
+		ids.resize(kept);
+	}
+
+	if (ids.empty())
+		return 0;
+
+	remove_logs(ids.data(), ids.size());
+
+	for (auto id : ids)
+		if (table.find(id) < 0)
+			removed.push_back(id);
+
+	return removed.size();
+}
+
+/* written[i] is the result of writing the i'th staged record */
+template <class Store>
+void basic_event_manager<Store>::write_staged(vector<ssize_t> &written)
+{
+	vector<const vector<uint8_t>*> images;
+	vector<uint16_t> ids;
+	size_t base = 0, count;
+
+	written.assign(staged.size(), -1);
+
+	for (auto &it : staged) {
+		ids.push_back(it.first);
+		images.push_back(&it.second);
+		note_write(it.first);
+	}
+
+	while (ring.ready() && base < ids.size()) {
+		count = min(ids.size() - base, (size_t) ring.depth() / 2);
+
+		if (!write_round(&ids[base], &images[base], count, &written[base])) {
+			ring.teardown();
+			break;
+		}
+
+		base += count;
+	}
+
+	// one at a time, for whatever the ring did not get to
+	for (; base < ids.size(); base++) {
+		struct iovec iov = { (void*) images[base]->data(),
+				     images[base]->size() };
+
+		written[base] = store.write(ids[base], &iov, 1);
+		if (written[base] < 0)
+			ownwrites.erase(ids[base]);
+	}
+
+	return;
+}
+
+/* Same shape as read_round(), opens then writes each with its close */
+template <class Store>
+bool basic_event_manager<Store>::write_round(const uint16_t *ids,
+					     const vector<uint8_t> *const *images,
+					     size_t count, ssize_t *written)
+{
+	vector<char> names(8 * count);
+	vector<int> fds(count, -1), res(2 * count, -ECANCELED);
+	size_t i;
+
+	for (i = 0; i < count; i++) {
+		log_name(ids[i], &names[8 * i]);
+		ring.prep_openat(i, store.dirfd(), &names[8 * i],
+				 O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	}
+
+	if (ring.run(fds.data()) < 0) {
+		// some opens may have completed before the ring gave up
+		close_round(fds, res);
+		return false;
+	}
+
+	for (i = 0; i < count; i++) {
+		if (fds[i] < 0) {
+			ownwrites.erase(ids[i]);
+			continue;
+		}
+
+		ring.prep_write(2 * i, fds[i], images[i]->data(), images[i]->size());
+		ring.link_last();
+		ring.prep_close(2 * i + 1, fds[i]);
+	}
+
+	if (ring.run(res.data()) < 0) {
+		close_round(fds, res);
+		return false;
+	}
+
+	for (i = 0; i < count; i++)
+		written[i] = fds[i] < 0 ? -1 : res[2 * i];
+
+	return true;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
@@ -0,0 +1,393 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "message.hpp"
+#include "murmur3.hpp"
+
+/*****************************************************************************/
+/* Content addressed store for debug data.                                  */
+/*                                                                           */
+/* Host firmware tends to send the same eSEL over and over, so debug data   */
+/* of g_blob_min bytes or more is written once to .blobs/<hash>, named by   */
+/* its 128 bit murmur3 hash, and each record carries a blob_ref_t in its    */
+/* place.  Reference counts are not stored: they are rebuilt from the       */
+/* records while the store is loaded, and a blob nothing points at any      */
+/* more is swept then.  A hash hit is only shared once the bytes compare    */
+/* equal; data that merely collides stays in its own record.                */
+/*                                                                           */
+/* A blob is charged once against maxsize, when it is first written, and    */
+/* to the reporter whose record wrote it.  When that reporter's last record */
+/* referring to it goes, the charge moves to a reporter still referring to  */
+/* it, so a quota covers the debug data a reporter keeps alive.  Dropping   */
+/* the last reference only queues the blob; collect_blobs() unlinks it and  */
+/* lifts the charge once the operation that dropped it is done, which lets  */
+/* fsck unindex and reindex a record without losing the data under it.      */
+/*****************************************************************************/
+
+const char *blob_dir = ".blobs";
+
+
+void blob_name(const blob_ref_t &ref, char *name)
+{
+	snprintf(name, 33, "%016llx%016llx",
+		 (unsigned long long) ref.hash[0],
+		 (unsigned long long) ref.hash[1]);
+	return;
+}
+
+/* Inverse of blob_name(), false for anything it would not have made */
+static bool parse_blob_name(const char *name, blob_key_t *key)
+{
+	char check[33];
+	unsigned long long hi, lo;
+	blob_ref_t ref;
+
+	if (strlen(name) != 32 || sscanf(name, "%16llx%16llx", &hi, &lo) != 2)
+		return false;
+
+	ref.hash[0] = hi;
+	ref.hash[1] = lo;
+	blob_name(ref, check);
+
+	if (strcmp(check, name))
+		return false;
+
+	*key = blob_key_t(hi, lo);
+
+	return true;
+}
+
+template <class Store>
+void basic_event_manager<Store>::blob_open(void)
+{
+	mkdirat(store.dirfd(), blob_dir, 0755);
+
+	blobfd = openat(store.dirfd(), blob_dir,
+			O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (blobfd < 0)
+		syslog(LOG_WARNING, "no blob area in %s, debug data is kept "
+		       "in each record: %s", eventpath.c_str(), strerror(errno));
+
+	return;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::write_blob(const blob_ref_t &ref,
+					    const uint8_t *data)
+{
+	char name[40];
+	ssize_t n = -1;
+	int fd;
+
+	blob_name(ref, name);
+
+	fd = openat(blobfd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (fd < 0)
+		return false;
+
+	n = ::write(fd, data, ref.len);
+	::close(fd);
+
+	if (n != (ssize_t) ref.len) {
+		unlinkat(blobfd, name, 0);
+		return false;
+	}
+
+	return true;
+}
+
+/* True if the blob ref names is there and as long as ref says, which */
+/* is all a record read without verifying has to go on               */
+template <class Store>
+bool basic_event_manager<Store>::blob_intact(const blob_ref_t &ref)
+{
+	struct stat st;
+	char name[40];
+
+	if (blobfd < 0 || ref.len > MESSAGE_BLOB_MAX)
+		return false;
+
+	blob_name(ref, name);
+
+	return fstatat(blobfd, name, &st, 0) == 0 &&
+	       (uint64_t) st.st_size == ref.len;
+}
+
+/* True if the blob ref names holds exactly data.  Equal hashes are no */
+/* proof: murmur3 is not collision resistant and the host picks data.  */
+template <class Store>
+bool basic_event_manager<Store>::blob_matches(const blob_ref_t &ref,
+					      const uint8_t *data)
+{
+	uint8_t buf[4096];
+	char name[40];
+	uint64_t off = 0;
+	ssize_t n;
+	int fd;
+
+	blob_name(ref, name);
+
+	fd = openat(blobfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	while (off < ref.len) {
+		n = ::read(fd, buf, min((uint64_t) sizeof(buf), ref.len - off));
+		if (n <= 0 || memcmp(buf, data + off, n))
+			break;
+		off += n;
+	}
+
+	::close(fd);
+
+	return off == ref.len;
+}
+
+/* Moves the charge for b off an owner that no longer refers to it */
+template <class Store>
+void basic_event_manager<Store>::rehome_blob(blob_t &b)
+{
+	if (b.holders.empty() || b.holders.count(b.owner))
+		return;
+
+	account(b.owner, -(ssize_t) b.size, 0);
+	b.owner = b.holders.begin()->first;
+	account(b.owner, b.size, 0);
+
+	return;
+}
+
+template <class Store>
+void basic_event_manager<Store>::take_blob(uint16_t logid, uint16_t reporter,
+					   const blob_ref_t &ref)
+{
+	blob_key_t key(ref.hash[0], ref.hash[1]);
+
+	release_blob(logid, reporter);
+
+	// nothing is charged for a length the blob does not back up
+	auto known = blobs.find(key);
+	if (known == blobs.end() ? !blob_intact(ref)
+				 : known->second.size != ref.len) {
+		syslog(LOG_ERR, "debug data of event log %u is missing or "
+		       "corrupt", logid);
+		corruptcount++;
+		return;
+	}
+
+	auto it = blobs.emplace(key, blob_t{ 0, (size_t) ref.len, reporter,
+					     map<uint16_t, uint32_t>() });
+	if (it.second) {
+		blobbytes   += ref.len;
+		currentsize += ref.len;
+		account(reporter, ref.len, 0);
+	}
+
+	blob_t &b = it.first->second;
+
+	b.refs++;
+	b.holders[reporter]++;
+	blobrefs[logid] = key;
+
+	rehome_blob(b);
+
+	return;
+}
+
+template <class Store>
+void basic_event_manager<Store>::release_blob(uint16_t logid,
+					      uint16_t reporter)
+{
+	auto it = blobrefs.find(logid);
+
+	if (it == blobrefs.end())
+		return;
+
+	auto b = blobs.find(it->second);
+	if (b != blobs.end()) {
+		auto h = b->second.holders.find(reporter);
+
+		if (h != b->second.holders.end() && --h->second == 0)
+			b->second.holders.erase(h);
+
+		// the owner keeps the charge until the blob is collected
+		if (--b->second.refs == 0)
+			blobgc.push_back(it->second);
+		else
+			rehome_blob(b->second);
+	}
+
+	blobrefs.erase(it);
+
+	return;
+}
+
+/* Unlinks the queued blobs that are still unreferenced */
+template <class Store>
+void basic_event_manager<Store>::collect_blobs(void)
+{
+	blob_ref_t ref;
+	char name[40];
+
+	for (const blob_key_t &key : blobgc) {
+		auto it = blobs.find(key);
+
+		if (it == blobs.end() || it->second.refs)
+			continue;
+
+		ref.hash[0] = key.first;
+		ref.hash[1] = key.second;
+		blob_name(ref, name);
+
+		unlinkat(blobfd, name, 0);
+
+		blobbytes   -= it->second.size;
+		currentsize -= min(currentsize, it->second.size);
+		account(it->second.owner, -(ssize_t) it->second.size, 0);
+		blobs.erase(it);
+	}
+
+	blobgc.clear();
+
+	return;
+}
+
+/* Removes blobs no record refers to, after the store is loaded */
+template <class Store>
+void basic_event_manager<Store>::sweep_blobs(void)
+{
+	const dirent64_t *ent;
+	dir_scan files;
+	blob_key_t key;
+	size_t swept = 0;
+
+	if (blobfd < 0 || !files.open(blobfd))
+		return;
+
+	while ((ent = files.next()) != NULL) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		if (parse_blob_name(ent->d_name, &key) && blobs.count(key))
+			continue;
+
+		if (unlinkat(blobfd, ent->d_name, 0) == 0)
+			swept++;
+	}
+
+	if (swept)
+		syslog(LOG_INFO, "removed %zu unreferenced debug data blobs",
+		       swept);
+
+	return;
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::blob_disk_size(void)
+{
+	const dirent64_t *ent;
+	dir_scan files;
+	struct stat st;
+	size_t size = 0;
+
+	if (blobfd < 0 || !files.open(blobfd))
+		return 0;
+
+	while ((ent = files.next()) != NULL)
+		if (ent->d_name[0] != '.' &&
+		    fstatat(blobfd, ent->d_name, &st, 0) == 0)
+			size += st.st_size;
+
+	return size;
+}
+
+/* Swaps a record read with read_log() for one whose debug data is the */
+/* blob it refers to, in a single allocation as before.  size is the   */
+/* length of the image in the original block.  A record without a blob */
+/* is left alone.  On failure *rec is freed and set to NULL.           */
+template <class Store>
+bool basic_event_manager<Store>::attach_blob(event_record_t **rec, size_t size,
+					     bool verify)
+{
+	const uint8_t *image = (const uint8_t*) (*rec + 1);
+	uint64_t hash[2];
+	blob_ref_t ref;
+	uint8_t *block = NULL, *data = NULL;
+	char name[40];
+	ssize_t n = -1;
+	bool ok;
+	int fd;
+
+	if (!record_blob(image, *rec, &ref))
+		return true;
+
+	blob_name(ref, name);
+
+	// ref.len comes from the record, nothing is allocated for it
+	// until the blob is seen to be that long
+	ok = blob_intact(ref);
+
+	if (ok) {
+		block = new uint8_t[sizeof(event_record_t) + size + ref.len];
+		data  = block + sizeof(event_record_t) + size;
+		memcpy(block + sizeof(event_record_t), image, size);
+		message_decode_log(block + sizeof(event_record_t), size,
+				   (event_record_t*) block, &dict);
+
+		fd = openat(blobfd, name, O_RDONLY | O_CLOEXEC);
+		if (fd >= 0) {
+			n = ::read(fd, data, ref.len);
+			::close(fd);
+		}
+
+		ok = n == (ssize_t) ref.len;
+	}
+
+	if (ok && verify) {
+		murmur3_128(data, ref.len, 0, hash);
+		ok = hash[0] == ref.hash[0] && hash[1] == ref.hash[1];
+	}
+
+	if (!ok) {
+		syslog(LOG_ERR, "debug data of event log %d is missing or "
+		       "corrupt", (*rec)->logid);
+		corruptcount++;
+		close(*rec);
+		delete[] block;
+		*rec = NULL;
+		return false;
+	}
+
+	close(*rec);
+
+	*rec      = (event_record_t*) block;
+	(*rec)->p = data;
+	(*rec)->n = ref.len;
+
+	return true;
+}
+
+/* Sets path to the blob holding the debug data of rec, which was parsed */
+/* out of buf, relative to the store.  Returns 0 if the debug data is    */
+/* kept in the record itself.                                            */
+int message_blob_path(const uint8_t *buf, const event_record_t *rec, char *path)
+{
+	blob_ref_t ref;
+	char name[40];
+
+	if (!record_blob(buf, rec, &ref))
+		return 0;
+
+	blob_name(ref, name);
+	snprintf(path, MESSAGE_BLOB_PATH_MAX, "%s/%s", blob_dir, name);
+
+	return 1;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
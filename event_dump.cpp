@@ -0,0 +1,465 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <algorithm>
+#include <set>
+#include <string>
+#include <vector>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "message.hpp"
+#include "murmur3.hpp"
+
+/*****************************************************************************/
+/* phosphor-event-dump streams the records of an event store without the    */
+/* daemon or dbus.  The store is only ever opened read-only and each record */
+/* is mapped, decoded in place and unmapped again, so memory use does not   */
+/* depend on how many events there are.  Archived records come out first,  */
+/* a block at a time, then the rest in directory order.  Coded strings are */
+/* resolved through the store's dictionary and debug data kept in the blob */
+/* area is read in for the record that refers to it.  A damaged record is  */
+/* reported on stderr and skipped, which is what you want for a store      */
+/* copied off a failed board.                                               */
+/*****************************************************************************/
+
+const char *default_path = "/var/lib/obmc/events";
+
+enum dump_format {
+	FORMAT_JSON,
+	FORMAT_CBOR,
+};
+
+struct dump_filter {
+	unsigned long firstid, lastid;
+	time_t        since, until;
+	const char   *severity;
+	bool          verify;
+};
+
+
+static void json_string(FILE *out, const char *s)
+{
+	fputc('"', out);
+
+	for (; *s; s++) {
+		unsigned char c = *s;
+
+		if (c == '"' || c == '\\') {
+			fputc('\\', out);
+			fputc(c, out);
+		} else if (c < 0x20) {
+			fprintf(out, "\\u%04x", c);
+		} else {
+			fputc(c, out);
+		}
+	}
+
+	fputc('"', out);
+	return;
+}
+
+static void emit_json(FILE *out, const event_record_t *rec)
+{
+	fprintf(out, "{\"logid\":%u,\"timestamp\":%lld,\"severity\":",
+		rec->logid, (long long) rec->timestamp);
+	json_string(out, rec->severity);
+	fputs(",\"message\":", out);
+	json_string(out, rec->message);
+	fputs(",\"association\":", out);
+	json_string(out, rec->association);
+	fputs(",\"reported_by\":", out);
+	json_string(out, rec->reportedby);
+	fputs(",\"debug_data\":\"", out);
+	for (size_t i = 0; i < rec->n; i++)
+		fprintf(out, "%02x", rec->p[i]);
+	fputs("\"}\n", out);
+
+	return;
+}
+
+/* RFC 8949 item header, major type in the top 3 bits */
+static void cbor_head(FILE *out, uint8_t major, uint64_t v)
+{
+	major <<= 5;
+
+	if (v < 24) {
+		fputc(major | v, out);
+	} else if (v <= UINT8_MAX) {
+		fputc(major | 24, out);
+		fputc(v, out);
+	} else if (v <= UINT16_MAX) {
+		fputc(major | 25, out);
+		for (int i = 1; i >= 0; i--)
+			fputc(v >> (8 * i), out);
+	} else if (v <= UINT32_MAX) {
+		fputc(major | 26, out);
+		for (int i = 3; i >= 0; i--)
+			fputc(v >> (8 * i), out);
+	} else {
+		fputc(major | 27, out);
+		for (int i = 7; i >= 0; i--)
+			fputc(v >> (8 * i), out);
+	}
+
+	return;
+}
+
+static void cbor_text(FILE *out, const char *s)
+{
+	size_t len = strlen(s);
+
+	cbor_head(out, 3, len);
+	fwrite(s, 1, len, out);
+	return;
+}
+
+/* One map per record, written back to back as a CBOR sequence (RFC 8742) */
+static void emit_cbor(FILE *out, const event_record_t *rec)
+{
+	cbor_head(out, 5, 7);
+
+	cbor_text(out, "logid");
+	cbor_head(out, 0, rec->logid);
+	cbor_text(out, "timestamp");
+	if (rec->timestamp < 0)
+		cbor_head(out, 1, -1 - (int64_t) rec->timestamp);
+	else
+		cbor_head(out, 0, rec->timestamp);
+	cbor_text(out, "severity");
+	cbor_text(out, rec->severity);
+	cbor_text(out, "message");
+	cbor_text(out, rec->message);
+	cbor_text(out, "association");
+	cbor_text(out, rec->association);
+	cbor_text(out, "reported_by");
+	cbor_text(out, rec->reportedby);
+	cbor_text(out, "debug_data");
+	cbor_head(out, 2, rec->n);
+	fwrite(rec->p, 1, rec->n, out);
+
+	return;
+}
+
+
+static bool filter_match(const dump_filter &f, const event_record_t *rec)
+{
+	if (f.since && rec->timestamp < f.since)
+		return false;
+	if (f.until && rec->timestamp > f.until)
+		return false;
+	if (f.severity && strcmp(f.severity, rec->severity))
+		return false;
+
+	return true;
+}
+
+/* Reads the blob rec's debug data lives in, if any, and points rec at it */
+static bool load_blob(int dirfd, const char *name, const uint8_t *buf,
+		      event_record_t *rec, bool verify, std::vector<uint8_t> &data)
+{
+	char path[MESSAGE_BLOB_PATH_MAX], hex[33];
+	struct stat st;
+	uint64_t hash[2];
+	ssize_t n = -1;
+	int fd;
+
+	if (!message_blob_path(buf, rec, path))
+		return true;
+
+	fd = openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd >= 0 && fstat(fd, &st) == 0) {
+		data.resize(st.st_size);
+		n = ::read(fd, data.data(), st.st_size);
+	}
+	if (fd >= 0)
+		::close(fd);
+
+	if (n < 0 || (size_t) n != data.size()) {
+		fprintf(stderr, "%s: %s unreadable\n", name, path);
+		return false;
+	}
+
+	if (verify) {
+		murmur3_128(data.data(), data.size(), 0, hash);
+		snprintf(hex, sizeof(hex), "%016llx%016llx",
+			 (unsigned long long) hash[0],
+			 (unsigned long long) hash[1]);
+
+		if (strcmp(hex, strrchr(path, '/') + 1)) {
+			fprintf(stderr, "%s: %s checksum mismatch\n", name, path);
+			return false;
+		}
+	}
+
+	rec->p = data.data();
+	rec->n = data.size();
+
+	return true;
+}
+
+/* Decodes, checks and writes out the record image in buf, returns -1 */
+/* when it could not be read                                           */
+static int dump_image(int dirfd, const char *name, const uint8_t *buf,
+		      size_t len, const string_dict &dict, const dump_filter &f,
+		      dump_format format, FILE *out)
+{
+	event_record_t rec;
+	std::vector<uint8_t> blob;
+	size_t reclen;
+
+	reclen = message_decode_log(buf, len, &rec, &dict);
+
+	if (!reclen) {
+		fprintf(stderr, "%s: not a valid event log\n", name);
+		return -1;
+	}
+
+	if (f.verify && !message_verify_log(buf, reclen)) {
+		fprintf(stderr, "%s: checksum mismatch\n", name);
+		return -1;
+	}
+
+	if (!filter_match(f, &rec))
+		return 0;
+
+	if (!load_blob(dirfd, name, buf, &rec, f.verify, blob))
+		return -1;
+
+	if (format == FORMAT_CBOR)
+		emit_cbor(out, &rec);
+	else
+		emit_json(out, &rec);
+
+	return 0;
+}
+
+/* Returns -1 when the record could not be read */
+static int dump_log(int dirfd, const char *name, const string_dict &dict,
+		    const dump_filter &f, dump_format format, FILE *out)
+{
+	struct stat st;
+	void *map;
+	int fd, r;
+
+	fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "%s: %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		fprintf(stderr, "%s: empty or unreadable\n", name);
+		::close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	::close(fd);
+
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "%s: mmap %s\n", name, strerror(errno));
+		return -1;
+	}
+
+	r = dump_image(dirfd, name, (const uint8_t*) map, st.st_size, dict, f,
+		       format, out);
+
+	munmap(map, st.st_size);
+
+	return r;
+}
+
+/* Dumps the live records of every archive segment, newest segment first */
+/* so a record packed twice comes out once.  seen collects the logids,   */
+/* returns the number of records that could not be read.                 */
+static int dump_archive(int dirfd, const string_dict &dict, const dump_filter &f,
+			dump_format format, FILE *out, std::set<uint16_t> &seen)
+{
+	std::vector<archive_entry_t> entries;
+	std::vector<uint32_t> segments;
+	std::vector<uint8_t> raw;
+	struct dirent *ent;
+	uint32_t segment;
+	char name[32];
+	DIR *archp;
+	int archfd, fd, r, errors = 0;
+
+	archfd = openat(dirfd, MESSAGE_ARCHIVE_DIR, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (archfd < 0)
+		return 0;
+
+	archp = fdopendir(archfd);
+	if (!archp) {
+		::close(archfd);
+		return 0;
+	}
+
+	while ((ent = readdir(archp)) != NULL)
+		if (archive_segment_id(ent->d_name, &segment))
+			segments.push_back(segment);
+
+	sort(segments.rbegin(), segments.rend());
+
+	for (uint32_t seg : segments) {
+		std::set<uint16_t> dead;
+		uint64_t off = 0;
+
+		snprintf(name, sizeof(name), "%u", seg);
+		fd = openat(archfd, name, O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			fprintf(stderr, "%s/%s: %s\n", MESSAGE_ARCHIVE_DIR, name,
+				strerror(errno));
+			errors++;
+			continue;
+		}
+
+		archive_read_dead(archfd, seg, dead);
+
+		while ((r = archive_read_block(fd, &off, entries, raw)) != 0) {
+			if (r < 0) {
+				fprintf(stderr, "%s/%u: damaged block\n",
+					MESSAGE_ARCHIVE_DIR, seg);
+				errors++;
+				continue;
+			}
+
+			for (const archive_entry_t &e : entries) {
+				if (dead.count(e.logid) || !seen.insert(e.logid).second)
+					continue;
+				if (e.logid < f.firstid || e.logid > f.lastid)
+					continue;
+
+				snprintf(name, sizeof(name), "%s/%u:%u",
+					 MESSAGE_ARCHIVE_DIR, seg, e.logid);
+				if (dump_image(dirfd, name, raw.data() + e.offset,
+					       e.len, dict, f, format, out) < 0)
+					errors++;
+			}
+		}
+
+		::close(fd);
+	}
+
+	closedir(archp);
+
+	return errors;
+}
+
+static bool parse_id(const char *name, unsigned long *id)
+{
+	char *end;
+
+	if (*name < '0' || *name > '9')
+		return false;
+
+	*id = strtoul(name, &end, 10);
+
+	return (*end == 0 && *id <= UINT16_MAX);
+}
+
+void print_usage(void)
+{
+	fprintf(stderr,
+		"[-d <dir>]     : Event store to read (default %s)\n"
+		"[-f json|cbor] : Output JSON lines (default) or a CBOR sequence\n"
+		"[-i <x>[-<y>]] : Only logids in the range x..y\n"
+		"[-a <time>]    : Only events at or after time (seconds since epoch)\n"
+		"[-b <time>]    : Only events at or before time (seconds since epoch)\n"
+		"[-S <sev>]     : Only events with this severity\n"
+		"[-n]           : Do not verify record checksums\n",
+		default_path);
+	return;
+}
+
+
+int main(int argc, char *argv[])
+{
+	const char *path = default_path;
+	dump_format format = FORMAT_JSON;
+	dump_filter f = { 0, UINT16_MAX, 0, 0, NULL, true };
+	static char outbuf[64 * 1024];
+	unsigned long id;
+	struct dirent *ent;
+	std::set<uint16_t> archived;
+	string_dict dict;
+	DIR *dirp;
+	char *end;
+	int c, errors = 0;
+
+	while ((c = getopt(argc, argv, "d:f:i:a:b:S:nh")) != -1)
+		switch (c) {
+			case 'd':
+				path = optarg;
+				break;
+			case 'f':
+				if (!strcmp(optarg, "cbor")) {
+					format = FORMAT_CBOR;
+				} else if (strcmp(optarg, "json")) {
+					print_usage();
+					return 1;
+				}
+				break;
+			case 'i':
+				f.firstid = f.lastid = strtoul(optarg, &end, 10);
+				if (*end == '-')
+					f.lastid = strtoul(end + 1, NULL, 10);
+				break;
+			case 'a':
+				f.since = strtoll(optarg, NULL, 10);
+				break;
+			case 'b':
+				f.until = strtoll(optarg, NULL, 10);
+				break;
+			case 'S':
+				f.severity = optarg;
+				break;
+			case 'n':
+				f.verify = false;
+				break;
+			case 'h':
+			case '?':
+				print_usage();
+				return 1;
+		}
+
+	dirp = opendir(path);
+	if (!dirp) {
+		fprintf(stderr, "Error opening directory %s: %s\n",
+			path, strerror(errno));
+		return 1;
+	}
+
+	setvbuf(stdout, outbuf, _IOFBF, sizeof(outbuf));
+
+	// a store from before the dictionary has no codes to resolve
+	dict.open(dirfd(dirp), MESSAGE_DICT_FILE, false);
+
+	errors += dump_archive(dirfd(dirp), dict, f, format, stdout, archived);
+
+	while ((ent = readdir(dirp)) != NULL) {
+		if (!parse_id(ent->d_name, &id))
+			continue;
+		// left behind by a crash after the record was archived
+		if (archived.count(id))
+			continue;
+		if (id < f.firstid || id > f.lastid)
+			continue;
+		if (ent->d_type != DT_REG && ent->d_type != DT_UNKNOWN)
+			continue;
+
+		if (dump_log(dirfd(dirp), ent->d_name, dict, f, format, stdout) < 0)
+			errors++;
+	}
+
+	closedir(dirp);
+	fflush(stdout);
+
+	if (errors)
+		fprintf(stderr, "%d records could not be read\n", errors);
+
+	return errors ? 2 : 0;
+}
@@ -0,0 +1,82 @@
+#include <algorithm>
+#include <syslog.h>
+#include "message.hpp"
+
+/*****************************************************************************/
+/* Retention by severity.                                                    */
+/*                                                                           */
+/* Every indexed record whose severity has a time to live sits in a timing  */
+/* wheel under its stored timestamp plus that TTL.  Nothing about the       */
+/* schedule is written down: the wheel is refilled as the records are       */
+/* indexed at startup, so it is always what the TTLs say about the records  */
+/* on disk.  expire() pulls everything that is due out of the wheel and     */
+/* removes it as one batch.                                                  */
+/*****************************************************************************/
+
+template <class Store>
+void basic_event_manager<Store>::set_ttl(const char *severity, uint32_t seconds)
+{
+	uint16_t code = severities.intern(severity);
+
+	if (code >= ttls.size())
+		ttls.resize(code + 1, 0);
+
+	ttls[code] = seconds;
+
+	// the only walk over the table, done once when the TTL is configured
+	for (size_t row = 0; row < table.size(); row++)
+		if (table.severity(row) == code)
+			schedule_expiry(table.logid(row), table.timestamp(row), code);
+
+	return;
+}
+
+template <class Store>
+void basic_event_manager<Store>::schedule_expiry(uint16_t logid,
+						 time_t timestamp,
+						 uint16_t severity)
+{
+	uint64_t expiry;
+
+	if (severity >= ttls.size() || !ttls[severity]) {
+		expiries.cancel(logid);
+		return;
+	}
+
+	expiry = (uint64_t) max<time_t>(timestamp, 0) + ttls[severity];
+	expiries.add(logid, min<uint64_t>(expiry, UINT32_MAX));
+
+	return;
+}
+
+template <class Store>
+uint32_t basic_event_manager<Store>::next_expiry(void)
+{
+	return expiries.next_due();
+}
+
+/* Removes every record due by now, returns how many */
+template <class Store>
+size_t basic_event_manager<Store>::expire(time_t now)
+{
+	vector<uint16_t> due;
+	size_t removed;
+
+	expiries.advance(min<uint64_t>(max<time_t>(now, 0), UINT32_MAX), due);
+
+	if (due.empty())
+		return 0;
+
+	removed = remove_logs(due.data(), due.size());
+
+	for (uint16_t id : due)
+		if (table.find(id) < 0)
+			changes.emplace_back(MESSAGE_LOG_REMOVED, id);
+
+	syslog(LOG_INFO, "expired %zu events", removed);
+
+	return removed;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
@@ -0,0 +1,337 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "message.hpp"
+
+/*****************************************************************************/
+/* fsck and compaction of the event store.                                   */
+/*                                                                           */
+/* A pass runs in two phases.  The listing phase reads the directory and    */
+/* quarantines anything that cannot be a record (non numeric or out of      */
+/* range names).  The check phase then walks the logids it found in         */
+/* ascending order and for each file:                                        */
+/*     zero length                  -> removed                               */
+/*     unparsable, bad checksum,    -> moved to .quarantine                  */
+/*     logid not matching its name                                           */
+/*     or its debug data blob gone                                           */
+/*     trailing bytes after record  -> truncated to the record length        */
+/* Once every file is checked logcount, currentsize and latestid are        */
+/* rebuilt from the metadata table, which by then only holds good records,  */
+/* and the blobs those records refer to.  Archived records were checked    */
+/* against their block CRC when their segment was loaded and are left be. */
+/*                                                                           */
+/* Surviving records keep their logids, which are dbus object paths, and   */
+/* their files: trimming leaves every file exactly one record long, and    */
+/* the dense rewrite in logid order is what the archive does for records   */
+/* old enough to go cold (event_archive.cpp).                              */
+/*                                                                           */
+/* Both phases charge their I/O against the budget given to fsck_step() so  */
+/* the daemon can interleave a pass with bus traffic.  Records created or   */
+/* removed between steps are fine: they go through create()/remove() which  */
+/* keep the table current, and only logids up to latestid at the start of   */
+/* the pass are reconciled against the listing.                              */
+/*****************************************************************************/
+
+const char  *quarantine_dir = ".quarantine";
+
+// rough cost of an entry that needs no data read, in budget bytes
+const size_t g_fsck_entry_cost = 512;
+
+
+template <class Store>
+void basic_event_manager<Store>::fsck_start(void)
+{
+	// the listing has to see every record the table knows about
+	flush();
+
+	fsckstate.scan.close();
+
+	fsckstate        = fsck_state_t();
+	fsckstate.active = true;
+	fsckstate.maxid  = latestid;
+
+	// records written by others may use codes we have not seen yet
+	dict.refresh();
+	account_meta();
+
+	// only record files can be damaged behind our back
+	if (!Store::record_files) {
+		fsckstate.active = false;
+		return;
+	}
+
+	if (!fsckstate.scan.open(store.dirfd())) {
+		syslog(LOG_ERR, "fsck could not open %s", eventpath.c_str());
+		fsckstate.active = false;
+	}
+
+	return;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::fsck_active(void)
+{
+	return fsckstate.active;
+}
+
+template <class Store>
+const fsck_stats_t &basic_event_manager<Store>::fsck_stats(void)
+{
+	return fsckstate.stats;
+}
+
+template <class Store>
+void basic_event_manager<Store>::fsck(void)
+{
+	fsck_start();
+
+	while (fsckstate.active && !fsck_step((size_t) -1))
+		;
+
+	return;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::fsck_step(size_t budget)
+{
+	size_t spent = 0;
+
+	if (!fsckstate.active)
+		return true;
+
+	if (fsckstate.scan.is_open())
+		spent += fsck_list(budget);
+
+	while (!fsckstate.scan.is_open() && spent < budget) {
+		if (fsckstate.pos == fsckstate.ids.size()) {
+			fsck_finish();
+			publish();
+			return true;
+		}
+
+		spent += fsck_check(fsckstate.ids[fsckstate.pos++]);
+	}
+
+	publish();
+
+	return false;
+}
+
+/* Listing phase, returns the budget spent */
+template <class Store>
+size_t basic_event_manager<Store>::fsck_list(size_t budget)
+{
+	const dirent64_t *ent;
+	size_t spent = 0;
+	uint16_t id;
+
+	while (spent < budget) {
+		ent = fsckstate.scan.next();
+
+		if (ent == NULL) {
+			sort(fsckstate.ids.begin(), fsckstate.ids.end());
+			break;
+		}
+
+		spent += g_fsck_entry_cost / 8;
+
+		if (ent->d_name[0] == '.' || ent->d_type == DT_DIR)
+			continue;
+
+		id = parse_logid(ent->d_name);
+
+		if (!id) {
+			// nothing create_log_event() would ever have written
+			quarantine(ent->d_name);
+			spent += g_fsck_entry_cost;
+			continue;
+		}
+
+		// the archive holds the record, the file is left over
+		if (archived.count(id))
+			continue;
+
+		fsckstate.ids.push_back(id);
+	}
+
+	return spent;
+}
+
+/* Check phase for one record, returns the budget spent */
+template <class Store>
+size_t basic_event_manager<Store>::fsck_check(uint16_t logid)
+{
+	event_record_t rec;
+	struct stat st, bst;
+	blob_ref_t ref;
+	bool blob = false;
+	size_t reclen = 0;
+	char name[8], blobname[40];
+	int fd;
+
+	log_name(logid, name);
+
+	fd = openat(store.dirfd(), name, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return g_fsck_entry_cost; // removed since the listing
+
+	// opened for writing, so closing it raises a watch event
+	note_write(logid);
+
+	if (fstat(fd, &st) < 0) {
+		::close(fd);
+		return g_fsck_entry_cost;
+	}
+
+	fsckstate.stats.checked++;
+
+	if (st.st_size == 0) {
+		::close(fd);
+		unlinkat(store.dirfd(), name, 0);
+		fsckstate.stats.emptied++;
+		if (unindex_log(logid))
+			note_change(MESSAGE_LOG_REMOVED, logid);
+		return g_fsck_entry_cost;
+	}
+
+	vector<uint8_t> image(st.st_size);
+
+	if (::read(fd, image.data(), st.st_size) == st.st_size)
+		reclen = message_decode_log(image.data(), st.st_size, &rec,
+					    &dict);
+
+	if (reclen && !message_verify_log(image.data(), reclen))
+		reclen = 0;
+
+	if (reclen && (uint16_t) rec.logid != logid)
+		reclen = 0;
+
+	if (reclen && (blob = record_blob(image.data(), &rec, &ref))) {
+		blob_name(ref, blobname);
+		if (fstatat(blobfd, blobname, &bst, 0) < 0 ||
+		    (uint64_t) bst.st_size != ref.len)
+			reclen = 0;
+	}
+
+	if (!reclen) {
+		::close(fd);
+		quarantine(name);
+		if (unindex_log(logid))
+			note_change(MESSAGE_LOG_REMOVED, logid);
+		return g_fsck_entry_cost + st.st_size;
+	}
+
+	bool known = unindex_log(logid);
+
+	if (reclen < (size_t) st.st_size && ftruncate(fd, reclen) == 0)
+		fsckstate.stats.trimmed++;
+	else
+		reclen = st.st_size;
+
+	::close(fd);
+
+	// a good record the table did not know about was skipped at startup
+	index_log(&rec, reclen, blob ? &ref : NULL);
+	if (!known)
+		note_change(MESSAGE_LOG_ADDED, logid);
+
+	return g_fsck_entry_cost + st.st_size;
+}
+
+/* Drop table rows whose file was not found by the listing and rebuild */
+/* the accounting from what is left                                    */
+template <class Store>
+void basic_event_manager<Store>::fsck_finish(void)
+{
+	const vector<uint16_t> &seen = fsckstate.ids;
+	vector<uint16_t> stale;
+
+	for (size_t row = 0; row < table.size(); row++) {
+		uint16_t id = table.logid(row);
+
+		if (id <= fsckstate.maxid && !archived.count(id) &&
+		    !binary_search(seen.begin(), seen.end(), id))
+			stale.push_back(id);
+	}
+
+	for (uint16_t id : stale) {
+		unindex_log(id);
+		note_change(MESSAGE_LOG_REMOVED, id);
+	}
+
+	collect_blobs();
+
+	currentsize = table.total_bytes() + blobbytes + metabytes;
+	logcount    = table.size();
+
+	if (table.size())
+		note_log_id(table.logid(table.size() - 1));
+
+	syslog(LOG_INFO, "event store checked %u records, %u quarantined, "
+	       "%u empty, %u trimmed",
+	       fsckstate.stats.checked, fsckstate.stats.quarantined,
+	       fsckstate.stats.emptied, fsckstate.stats.trimmed);
+
+	fsckstate.active = false;
+	fsckstate.ids.clear();
+	fsckstate.ids.shrink_to_fit();
+
+	return;
+}
+
+// most suffixes tried on a name already in quarantine
+const int g_quarantine_tries = 100;
+
+/* renameat() that fails with EEXIST rather than replace to */
+static int rename_noreplace(int dirfd, const char *from, const char *to)
+{
+	if (renameat2(dirfd, from, dirfd, to, RENAME_NOREPLACE) == 0)
+		return 0;
+
+	if (errno != EINVAL && errno != ENOSYS)
+		return -1;
+
+	// the filesystem has no flags for rename, a link never replaces
+	if (linkat(dirfd, from, dirfd, to, 0) < 0)
+		return -1;
+
+	return unlinkat(dirfd, from, 0);
+}
+
+/* Move a file out of the way, keeping it for post mortem.  A name    */
+/* quarantined before gets a .1, .2 ... suffix, so a logid damaged    */
+/* twice keeps both files.                                            */
+template <class Store>
+void basic_event_manager<Store>::quarantine(const char *name)
+{
+	string base = string(quarantine_dir) + "/" + name;
+	string to = base;
+	int r, n = 0;
+
+	mkdirat(store.dirfd(), quarantine_dir, 0755);
+
+	while ((r = rename_noreplace(store.dirfd(), name, to.c_str())) < 0 &&
+	       errno == EEXIST && ++n < g_quarantine_tries)
+		to = base + "." + to_string(n);
+
+	if (r < 0) {
+		syslog(LOG_ERR, "could not quarantine %s/%s: %s",
+		       eventpath.c_str(), name, strerror(errno));
+		return;
+	}
+
+	syslog(LOG_WARNING, "quarantined damaged event file %s", name);
+	fsckstate.stats.quarantined++;
+
+	return;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
@@ -0,0 +1,234 @@
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <sys/eventfd.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "message.hpp"
+
+/*****************************************************************************/
+/* Ingest from other threads.                                               */
+/*                                                                           */
+/* submit() may be called from any thread.  It takes a logid straight away */
+/* with an atomic increment, copies the record into a node and pushes it   */
+/* onto an MPSC queue, then pokes an eventfd.  The writer thread polls     */
+/* that fd and commit_ingested() turns the queued nodes into records       */
+/* through the same create path as create(), publishing once per batch.    */
+/*                                                                           */
+/* Nothing on one ingest thread can hold up another, but admission only   */
+/* happens at commit: the writer may still refuse a record, for a quota,  */
+/* a full store or a failed write, and its logid then never appears.  So  */
+/* a submitter that has to answer for the record passes an ingest channel */
+/* and keeps the caller waiting: once the record is committed or refused  */
+/* its node goes back through the channel, logid 0 for a refusal, and the */
+/* channel's eventfd wakes the submitting thread to reply.                */
+/*****************************************************************************/
+
+struct ingest_t : mpsc_node {
+	string            message;
+	string            severity;
+	string            association;
+	string            reportedby;
+	vector<uint8_t>   data;
+	uint16_t          logid;
+	time_t            timestamp;
+	ingest_channel_t *channel;  // NULL if nobody waits for the result
+	void             *ctx;
+};
+
+
+/* NULL if there is no eventfd to be had */
+ingest_channel_t *ingest_channel_new(void)
+{
+	ingest_channel_t *ch = new ingest_channel_t;
+
+	ch->fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ch->fd < 0) {
+		delete ch;
+		return NULL;
+	}
+
+	return ch;
+}
+
+/* Only once nothing submitted with ch is left to commit */
+void ingest_channel_free(ingest_channel_t *ch)
+{
+	mpsc_node *node;
+
+	if (!ch)
+		return;
+
+	while ((node = ch->done.pop()) != NULL)
+		delete static_cast<ingest_t*>(node);
+
+	::close(ch->fd);
+	delete ch;
+
+	return;
+}
+
+/* Hands back one committed or refused record, on the submitting thread */
+bool ingest_channel_next(ingest_channel_t *ch, void **ctx, uint16_t *logid)
+{
+	uint64_t count;
+	mpsc_node *node;
+
+	if (::read(ch->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		return false;
+
+	// a push caught half way is followed by its own wakeup
+	node = ch->done.pop();
+	if (node == NULL)
+		return false;
+
+	ingest_t *in = static_cast<ingest_t*>(node);
+
+	*ctx   = in->ctx;
+	*logid = in->logid;
+	delete in;
+
+	return true;
+}
+
+
+/* Raises latestid to at least id, ingest threads may be taking ids */
+template <class Store>
+void basic_event_manager<Store>::note_log_id(uint16_t id)
+{
+	uint16_t cur = latestid.load();
+
+	while (id > cur && !latestid.compare_exchange_weak(cur, id))
+		;
+
+	return;
+}
+
+template <class Store>
+int basic_event_manager<Store>::ingest_start(void)
+{
+	if (ingestfd >= 0)
+		return ingestfd;
+
+	ingestfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (ingestfd < 0)
+		syslog(LOG_ERR, "could not set up ingest queue: %s",
+		       strerror(errno));
+
+	return ingestfd;
+}
+
+template <class Store>
+uint16_t basic_event_manager<Store>::submit(const event_record_t *rec,
+					    ingest_channel_t *ch, void *ctx)
+{
+	ingest_t *node = new ingest_t;
+	uint64_t one = 1;
+
+	node->message     = rec->message;
+	node->severity    = rec->severity;
+	node->association = rec->association;
+	node->reportedby  = rec->reportedby;
+	node->data.assign(rec->p, rec->p + rec->n);
+	node->logid       = new_log_id();
+	node->timestamp   = time(NULL);
+	node->channel     = ch;
+	node->ctx         = ctx;
+
+	uint16_t logid = node->logid;
+
+	ingestq.push(node);
+	ingestpending.fetch_add(1, memory_order_release);
+
+	// the writer may already have committed and freed node
+	if (ingestfd >= 0 && ::write(ingestfd, &one, sizeof(one)) < 0 &&
+	    errno != EAGAIN)
+		syslog(LOG_ERR, "could not wake the event writer: %s",
+		       strerror(errno));
+
+	return logid;
+}
+
+/* Commits up to max queued records, ids gets the logid of each one */
+/* that was stored.  Returns how many ids were filled in.            */
+template <class Store>
+size_t basic_event_manager<Store>::commit_ingested(uint16_t *ids, size_t max)
+{
+	event_record_t rec;
+	mpsc_node *node;
+	uint64_t count;
+	size_t n = 0, taken = 0;
+
+	if (ingestfd >= 0)
+		while (::read(ingestfd, &count, sizeof(count)) > 0)
+			;
+
+	while (taken < max && (node = ingestq.pop()) != NULL) {
+		ingest_t *in = static_cast<ingest_t*>(node);
+
+		rec.message     = (char*) in->message.c_str();
+		rec.severity    = (char*) in->severity.c_str();
+		rec.association = (char*) in->association.c_str();
+		rec.reportedby  = (char*) in->reportedby.c_str();
+		rec.p           = in->data.data();
+		rec.n           = in->data.size();
+		rec.logid       = in->logid;
+		rec.timestamp   = in->timestamp;
+
+		if (create_log_event(&rec)) {
+			ids[n++] = in->logid;
+		} else {
+			syslog(LOG_WARNING, "event %u from %s refused after it "
+			       "was submitted", in->logid, rec.reportedby);
+			ingestrefused++;
+			in->logid = 0;
+		}
+
+		taken++;
+
+		if (!in->channel) {
+			delete in;
+			continue;
+		}
+
+		ingest_channel_t *ch = in->channel;
+		uint64_t one = 1;
+
+		// the submitter may already have taken and freed in
+		ch->done.push(in);
+		if (::write(ch->fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			syslog(LOG_ERR, "could not wake an ingest thread: %s",
+			       strerror(errno));
+	}
+
+	ingestpending.fetch_sub(taken, memory_order_relaxed);
+
+	// a batch cut short by max, or a push caught half way, comes back
+	if (taken && ingestpending.load(memory_order_acquire) && ingestfd >= 0) {
+		uint64_t one = 1;
+
+		if (::write(ingestfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			syslog(LOG_ERR, "could not requeue ingest: %s",
+			       strerror(errno));
+	}
+
+	if (taken)
+		publish();
+
+	return n;
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::ingest_pending(void)
+{
+	return ingestpending.load();
+}
+
+template <class Store>
+uint32_t basic_event_manager<Store>::ingest_refused(void)
+{
+	return ingestrefused;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
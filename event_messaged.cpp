@@ -1,7 +1,10 @@
+#include <algorithm>
+#include <cerrno>
 #include <iostream>
 #include "message.hpp"
 #include "event_messaged_sdbus.h"
 #include <string>
+#include <cstring>
 #include <unistd.h>
 
 const char *path_to_messages = "/var/lib/obmc/events";
@@ -26,6 +29,10 @@ int message_load_log(event_manager *em,uint16_t logid, event_record_t **rec)
 {
 	return em->open(logid, rec);
 }
+int message_load_verified_log(event_manager *em, uint16_t logid, event_record_t **rec)
+{
+	return em->open(logid, rec, true);
+}
 void message_free_log(event_manager *em, event_record_t *rec)
 {
 	return em->close(rec);
@@ -34,27 +41,371 @@ int message_delete_log(event_manager *em, uint16_t logid)
 {
 	return em->remove(logid);
 }
+void message_compact_start(event_manager *em)
+{
+	em->fsck_start();
+}
+int message_compact_step(event_manager *em, size_t budget)
+{
+	return em->fsck_step(budget);
+}
+int message_next_change(event_manager *em, uint16_t *logid)
+{
+	return em->next_change(logid);
+}
+int message_flush(event_manager *em)
+{
+	return em->flush();
+}
+size_t message_staged_size(event_manager *em)
+{
+	return em->staged_size();
+}
+int message_watch_start(event_manager *em)
+{
+	return em->watch_start();
+}
+int message_watch_process(event_manager *em)
+{
+	return em->watch_process();
+}
+size_t message_source_count(event_manager *em)
+{
+	return em->source_count();
+}
+int message_source_usage(event_manager *em, size_t index, source_usage_t *usage)
+{
+	return em->source_usage(index, usage);
+}
+size_t message_load_logs(event_manager *em, const uint16_t *ids, size_t n, event_record_t **recs)
+{
+	return em->open_logs(ids, n, recs);
+}
+size_t message_delete_logs(event_manager *em, const uint16_t *ids, size_t n)
+{
+	return em->remove_logs(ids, n);
+}
+/* Empty strings match anything, a severity or reporter never seen */
+/* matches nothing                                                 */
+static event_filter_t where_filter(event_manager *em, const char *severity,
+				   const char *reportedby, uint64_t since,
+				   uint64_t until)
+{
+	event_filter_t f = event_filter_all();
 
-int load_existing_events(event_manager *em)
+	f.since = since;
+	f.until = until;
+	if (*severity)
+		f.severity = em->severity_code(severity);
+	if (*reportedby)
+		f.reporter = em->reporter_code(reportedby);
+
+	return f;
+}
+/* Only reads the snapshot, so safe from any thread */
+size_t message_count_where(event_manager *em, const char *severity,
+			   const char *reportedby, uint64_t since,
+			   uint64_t until)
 {
-	uint16_t id;
-	event_record_t *rec;
+	return em->count_logs(where_filter(em, severity, reportedby,
+					   since, until));
+}
+/* Same, *ids is malloc()ed for the caller to free(), NULL when *n is */
+/* 0.  Returns 0 or -ENOMEM.                                          */
+int message_list_where(event_manager *em, const char *severity,
+		       const char *reportedby, uint64_t since, uint64_t until,
+		       uint16_t **ids, size_t *n)
+{
+	vector<uint16_t> found;
+
+	em->filter_logs(where_filter(em, severity, reportedby, since, until),
+			found);
+
+	*ids = NULL;
+	*n   = found.size();
+	if (!*n)
+		return 0;
+
+	*ids = (uint16_t*) malloc(*n * sizeof(uint16_t));
+	if (!*ids)
+		return -ENOMEM;
+
+	memcpy(*ids, found.data(), *n * sizeof(uint16_t));
+
+	return 0;
+}
+/* *ids is malloc()ed, for the caller to free().  On -ENOMEM *n logs */
+/* were still removed, only which ones is lost                        */
+int message_delete_where(event_manager *em, const char *severity,
+			 const char *reportedby, uint64_t since,
+			 uint64_t until, const char *assocprefix,
+			 uint16_t **ids, size_t *n)
+{
+	event_filter_t f = where_filter(em, severity, reportedby, since, until);
+	vector<uint16_t> removed;
+
+	*ids = NULL;
+	*n   = 0;
+
+	if (!em->remove_where(f, assocprefix, removed))
+		return 0;
+
+	*n   = removed.size();
+	*ids = (uint16_t*) malloc(*n * sizeof(uint16_t));
+	if (!*ids)
+		return -ENOMEM;
+
+	memcpy(*ids, removed.data(), *n * sizeof(uint16_t));
+
+	return 0;
+}
+size_t message_expire(event_manager *em, time_t now)
+{
+	return em->expire(now);
+}
+uint32_t message_next_expiry(event_manager *em)
+{
+	return em->next_expiry();
+}
+size_t message_archive(event_manager *em, time_t now)
+{
+	return em->archive(now);
+}
+uint32_t message_archive_age(event_manager *em)
+{
+	return em->archive_age();
+}
+static char **copy_names(const vector<string> &names)
+{
+	char **out = (char**) calloc(names.size() + 1, sizeof(char*));
+
+	for (size_t i = 0; out && i < names.size(); i++)
+		out[i] = strdup(names[i].c_str());
+
+	return out;
+}
+static void free_names(char **names)
+{
+	for (size_t i = 0; names && names[i]; i++)
+		free(names[i]);
+	free(names);
+}
+/* Everything in r is malloc()ed, message_free_rollup() releases it */
+int message_rollup(event_manager *em, int resolution, time_t now,
+		   message_rollup_t *r)
+{
+	vector<string> sevnames, repnames;
+	vector<uint32_t> counts;
+
+	memset(r, 0, sizeof(*r));
+
+	if (resolution < 0 || resolution >= rollup_rings::resolutions)
+		return -EINVAL;
+
+	r->start     = em->rollup(resolution, now, counts, sevnames, repnames);
+	r->width     = rollup_rings::width(resolution);
+	r->periods   = rollup_rings::buckets(resolution);
+	r->nseverity = sevnames.size();
+	r->nreporter = repnames.size();
+	r->severity  = copy_names(sevnames);
+	r->reporter  = copy_names(repnames);
+
+	if (!r->severity || !r->reporter) {
+		message_free_rollup(r);
+		return -ENOMEM;
+	}
+
+	// nothing counted yet, counts stays NULL
+	if (counts.empty())
+		return 0;
+
+	r->counts = (uint32_t*) malloc(counts.size() * sizeof(uint32_t));
+	if (!r->counts) {
+		message_free_rollup(r);
+		return -ENOMEM;
+	}
+
+	copy(counts.begin(), counts.end(), r->counts);
+
+	return 0;
+}
+void message_free_rollup(message_rollup_t *r)
+{
+	free_names(r->severity);
+	free_names(r->reporter);
+	free(r->counts);
+	memset(r, 0, sizeof(*r));
+}
+size_t message_search(event_manager *em, const char *query, uint32_t fields,
+		      uint16_t *ids, size_t max, size_t *total)
+{
+	vector<uint16_t> found;
+
+	*total = em->search_logs(query, fields, max, found);
+	copy(found.begin(), found.end(), ids);
+
+	return found.size();
+}
+int message_changes_since(event_manager *em, uint64_t since,
+			  message_change_t *out, int max, uint64_t *next)
+{
+	vector<journal_entry_t> changes;
 
-	while ( (id = em->next_log()) != 0) {
+	if (!em->changes_since(since, max, changes, next))
+		return -1;
 
-		em->open(id, &rec);
-		send_log_to_dbus(em, id, rec->association);
-		em->close(rec);
+	for (size_t i = 0; i < changes.size(); i++) {
+		out[i].seq   = changes[i].seq;
+		out[i].logid = changes[i].logid;
+		out[i].op    = changes[i].op;
 	}
 
+	return changes.size();
+}
+int message_ingest_start(event_manager *em)
+{
+	return em->ingest_start();
+}
+uint16_t message_submit_log_event(event_manager *em, event_record_t *rec,
+				  ingest_channel_t *ch, void *ctx)
+{
+	return em->submit(rec, ch, ctx);
+}
+size_t message_commit_ingested(event_manager *em, uint16_t *ids, size_t max)
+{
+	return em->commit_ingested(ids, max);
+}
+size_t message_ingest_pending(event_manager *em)
+{
+	return em->ingest_pending();
+}
+ingest_channel_t *message_ingest_channel_new(void)
+{
+	return ingest_channel_new();
+}
+int message_ingest_channel_fd(ingest_channel_t *ch)
+{
+	return ch->fd;
+}
+/* 1 with what became of one submitted record, 0 when there is no more */
+int message_ingest_channel_next(ingest_channel_t *ch, void **ctx,
+				uint16_t *logid)
+{
+	return ingest_channel_next(ch, ctx, logid);
+}
+void message_ingest_channel_free(ingest_channel_t *ch)
+{
+	ingest_channel_free(ch);
+}
+int message_replicate_to(event_manager *em, int fd)
+{
+	return em->replicate_to(fd);
+}
+int message_replicate_from(event_manager *em, int fd)
+{
+	return em->replicate_from(fd);
+}
+int message_replication_process(event_manager *em)
+{
+	return em->replication_process();
+}
+void message_replication_stop(event_manager *em)
+{
+	em->replication_stop();
+}
+
+/* Records are read a batch at a time, see event_manager::open_logs */
+int load_existing_events(event_manager *em)
+{
+	const size_t batch = 32;
+	uint16_t id, ids[batch];
+	event_record_t *recs[batch];
+	size_t i, n;
+
+	do {
+		for (n = 0; n < batch && (id = em->next_log()) != 0; n++)
+			ids[n] = id;
+
+		em->open_logs(ids, n, recs);
+
+		for (i = 0; i < n; i++) {
+			if (!recs[i])
+				continue;
+
+			send_log_to_dbus(em, ids[i], recs[i]->association);
+			em->close(recs[i]);
+		}
+	} while (n == batch);
+
 	return 0;
 }
 
 
+/* Splits <reporter>:<bytes> as given to -q and -r */
+bool parse_source_limit(const char *arg, string &reporter, size_t *bytes)
+{
+	const char *sep = strrchr(arg, ':');
+	char *end;
+
+	if (!sep || sep == arg)
+		return false;
+
+	reporter.assign(arg, sep - arg);
+	*bytes = strtoul(sep + 1, &end, 10);
+
+	return *end == 0;
+}
+
+/* Parses <n>[smhd], plain n is in seconds */
+bool parse_duration(const char *arg, uint32_t *seconds)
+{
+	unsigned long n;
+	char *end;
+
+	n = strtoul(arg, &end, 10);
+
+	switch (*end) {
+		case 'd': n *= 24; /* fall through */
+		case 'h': n *= 60; /* fall through */
+		case 'm': n *= 60; /* fall through */
+		case 's': end++;   /* fall through */
+		case 0:   break;
+		default:  return false;
+	}
+
+	*seconds = n;
+
+	return *end == 0 && n && n <= UINT32_MAX;
+}
+
+/* Splits <severity>:<n>[smhd] as given to -e */
+bool parse_ttl(const char *arg, string &severity, uint32_t *seconds)
+{
+	const char *sep = strrchr(arg, ':');
+
+	if (!sep || sep == arg)
+		return false;
+
+	severity.assign(arg, sep - arg);
+
+	return parse_duration(sep + 1, seconds);
+}
+
 void print_usage(void)
 {
 	cout << "[-s <x>] : Maximum bytes to use for event logger"  << endl;
 	cout << "[-t <x>] : Limit total number of logs (will ignore newer)"  << endl;	
+	cout << "[-q <reporter>:<x>] : Limit a reporter to x bytes (repeatable)"  << endl;
+	cout << "[-r <reporter>:<x>] : Keep x bytes free for a reporter (repeatable)"  << endl;
+	cout << "[-e <severity>:<x>[smhd]] : Drop events of a severity older than x (repeatable)"  << endl;
+	cout << "[-a <x>[smhd]] : Pack events older than x into compressed segments"  << endl;
+	cout << "[-i <n>] : Serve ingest on n more bus connections, a thread each"  << endl;
+	cout << "[-c]     : Check and compact the event store before starting"  << endl;
+	cout << "[-b <x>] : Stage new logs in memory, flushing every x bytes"  << endl;
+	cout << "[-w <x>] : Flush staged logs at least every x ms (default 5000)"  << endl;
+	cout << "[-P <addr>] : Ship the store to a replica connecting on addr"  << endl;
+	cout << "[-R <addr>] : Run as a replica of the primary at addr"  << endl;
+	cout << "              addr is a socket path or [host]:port"  << endl;
 	return;
 }
 
@@ -62,9 +413,17 @@ void print_usage(void)
 int main(int argc, char *argv[])
 {
 	unsigned long maxsize=0, maxlogs=0;
+	unsigned long stagesize=0, flushms=5000, ingest=0;
+	vector<pair<string, size_t>> quotas, reserves;
+	vector<pair<string, uint32_t>> ttls;
+	uint32_t seconds, archiveage = 0;
+	uint16_t id;
+	bool compact = false, replica = false;
+	string name, repladdr;
+	size_t bytes;
 	int rc, c;
 
-	while ((c = getopt (argc, argv, "s:t:")) != -1)
+	while ((c = getopt (argc, argv, "s:t:q:r:e:a:i:cb:w:P:R:")) != -1)
 		switch (c) {
 			case 's':
 				maxsize =  strtoul(optarg, NULL, 10);
@@ -72,16 +431,82 @@ int main(int argc, char *argv[])
 			case 't':
 				maxlogs =  strtoul(optarg, NULL, 10);
 				break;
+			case 'q':
+			case 'r':
+				if (!parse_source_limit(optarg, name, &bytes)) {
+					print_usage();
+					return 1;
+				}
+				(c == 'q' ? quotas : reserves).emplace_back(name, bytes);
+				break;
+			case 'e':
+				if (!parse_ttl(optarg, name, &seconds)) {
+					print_usage();
+					return 1;
+				}
+				ttls.emplace_back(name, seconds);
+				break;
+			case 'a':
+				if (!parse_duration(optarg, &archiveage)) {
+					print_usage();
+					return 1;
+				}
+				break;
+			case 'i':
+				ingest = strtoul(optarg, NULL, 10);
+				break;
+			case 'c':
+				compact = true;
+				break;
+			case 'b':
+				stagesize = strtoul(optarg, NULL, 10);
+				break;
+			case 'w':
+				flushms = strtoul(optarg, NULL, 10);
+				break;
+			case 'P':
+			case 'R':
+				repladdr = optarg;
+				replica  = c == 'R';
+				break;
 			case 'h':
 			case '?':
 				print_usage();
 				return 1;
 		}
 
+	// a replica's records only ever come from its primary
+	if (replica && ingest) {
+		print_usage();
+		return 1;
+	}
 
 	cout << maxsize <<endl;
 	event_manager em(path_to_messages, maxsize, maxlogs);
 
+	for (auto &q : quotas)
+		em.set_quota(q.first.c_str(), q.second);
+	for (auto &r : reserves)
+		em.set_reserve(r.first.c_str(), r.second);
+	for (auto &t : ttls)
+		em.set_ttl(t.first.c_str(), t.second);
+	em.set_archive_age(archiveage);
+
+	// whatever expired while we were down goes before dbus sees it
+	em.expire(time(NULL));
+
+	if (compact)
+		em.fsck();
+
+	// nothing is on dbus yet, so there is nothing to catch up
+	while (em.next_change(&id))
+		;
+
+
+	if (stagesize) {
+		em.set_staging(stagesize);
+		set_flush_interval(&em, flushms * 1000);
+	}
 
 	rc = build_bus(&em);
 	if (rc < 0) {
@@ -89,6 +514,22 @@ int main(int argc, char *argv[])
 		goto finish;
 	}
 
+	if (ingest) {
+		rc = start_ingest(&em, ingest);
+		if (rc < 0) {
+			fprintf(stderr, "Event Messager failed to start ingest rc=%d", rc);
+			goto finish;
+		}
+	}
+
+	if (!repladdr.empty()) {
+		rc = start_replication(&em, repladdr.c_str(), replica);
+		if (rc < 0) {
+			fprintf(stderr, "Event Messager failed to start replication rc=%d", rc);
+			goto finish;
+		}
+	}
+
 	rc = load_existing_events(&em);
 	if (rc < 0) {
 		fprintf(stderr, "Event Messager failed add previous logs to dbus rc=%d", rc);
@@ -3,10 +3,24 @@
 #include <stdlib.h>
 #include <errno.h>
 #include <stddef.h>
+#include <string.h>
 #include <systemd/sd-bus.h>
+#include <systemd/sd-event.h>
+#include <systemd/sd-journal.h>
 #include "message.hpp"
 #include "event_messaged_sdbus.h"
+#include "log_queue.hpp"
 #include <syslog.h>
+#include <signal.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
 
 /*****************************************************************************/
 /* This set of functions are responsible for interactions with events over   */
@@ -25,9 +39,114 @@ const char *event_path = "/org/openbmc/records/events";
 
 sd_bus      *bus   = NULL;
 sd_bus_slot *slot  = NULL;
+sd_event    *gEvent = NULL;
 
 event_record_t *gCachedRec = NULL;
 
+/*****************************************************************************/
+/* Everything runs from one sd_event loop.  Sources are prioritized so that */
+/* callers on the bus are never queued behind background work:              */
+/*     bus dispatch        method calls and property reads                   */
+/*     publish             dbus objects and signals for accepted logs,      */
+/*                         records changed on disk by other processes       */
+/*     flush               staged logs going out to flash, expiry           */
+/*     idle                compaction and archiving of cold events, only    */
+/*                         when nothing else is pending                      */
+/* The loop also pings the systemd watchdog when WatchdogSec is set.        */
+/*****************************************************************************/
+#define PRIORITY_BUS     SD_EVENT_PRIORITY_IMPORTANT
+#define PRIORITY_PUBLISH SD_EVENT_PRIORITY_NORMAL
+#define PRIORITY_FLUSH   (SD_EVENT_PRIORITY_NORMAL + 10)
+#define PRIORITY_IDLE    SD_EVENT_PRIORITY_IDLE
+
+/* Logs accepted but not yet on the bus, see publish_pending_logs */
+static sd_event_source *gPublishSource = NULL;
+static uint16_t        *gPending       = NULL;
+static size_t           gPendingCount  = 0;
+static size_t           gPendingAlloc  = 0;
+
+/* Logs taken off the bus but not yet named in EventsDeleted, see */
+/* note_deleted                                                   */
+static uint16_t        *gDeleted       = NULL;
+static size_t           gDeletedCount  = 0;
+static size_t           gDeletedAlloc  = 0;
+
+/* Wall clock timer for the next record due to expire */
+static sd_event_source *gExpireSource = NULL;
+
+/* inotify watch on the store, see event_watch.cpp */
+static sd_event_source *gWatchSource = NULL;
+
+/* Background check/compaction of the store */
+static sd_event_source *gCompactSource = NULL;
+#define COMPACT_STEP_BUDGET (64 * 1024)
+
+/* Packing of cold events into the archive, a batch per run.  While */
+/* there is a backlog the next batch follows shortly.               */
+static sd_event_source *gArchiveSource = NULL;
+#define ARCHIVE_INTERVAL (600 * 1000000ULL)
+#define ARCHIVE_BACKLOG  (1000000ULL)
+
+/* Extra connections serving the accept methods and the snapshot      */
+/* queries, each dispatched by its own thread so a busy reader on the  */
+/* main connection, or on another of these, cannot hold up ingest.    */
+/* The threads hand records to the writer through the event manager's */
+/* queue and gCommitSource stores them on this thread.  Each call is  */
+/* only answered once its record is stored or refused, when it comes  */
+/* back through done.  CountWhere and ListWhere are answered straight */
+/* from the published snapshot, so readers spread over the threads.   */
+typedef struct ingestConn_t {
+	pthread_t         thread;
+	sd_bus           *bus;
+	event_manager    *em;
+	ingest_channel_t *done;
+	int               started;
+} ingestConn_t;
+
+static ingestConn_t    *gIngest      = NULL;
+static int              gIngestCount = 0;
+static int              gIngestStop  = -1; /* eventfd, readable on shutdown */
+static sd_event_source *gCommitSource = NULL;
+#define COMMIT_BATCH 64
+
+/* Most changes one GetChangesSince call returns */
+#define MAX_CHANGES 1024
+
+/* Most logids one Search call returns */
+#define MAX_SEARCH 1024
+
+/* Staged logs are flushed no later than gFlushInterval after the */
+/* first one is accepted, which bounds what a power loss can take */
+static sd_event_source *gFlushSource   = NULL;
+event_manager          *gFlushEm       = NULL;
+uint64_t                gFlushInterval = 0;
+
+/* Log shipping, see event_replicate.cpp.  A primary listens on gReplAddr */
+/* and serves one replica at a time, a new connection replacing the old.  */
+/* A replica connects to it, and again every REPL_RETRY while it cannot.  */
+/* The primary ships from a post source, so changes go out only once     */
+/* whatever made them has been answered.  A replica refuses every method */
+/* that would change its store, which is its primary's to change.        */
+static sd_event_source *gReplListen     = NULL;
+static sd_event_source *gReplLink       = NULL;
+static sd_event_source *gReplPost       = NULL;
+static sd_event_source *gReplRetry      = NULL;
+static char            *gReplAddr       = NULL;
+static int              gReplica        = 0;
+static int              gReplConnecting = 0;
+#define REPL_RETRY (2 * 1000000ULL)
+#define REPLICA_ERROR "org.openbmc.recordlog.Error.Replica"
+
+/* Accepted events go to the journal from gLog's own thread, see      */
+/* log_queue.hpp, so a storm neither blocks the bus on journald nor   */
+/* floods it: past LOG_REPEAT_BURST lines alike in LOG_REPEAT_INTERVAL */
+/* seconds there is one "suppressed" line, and past LOG_QUEUE_DEPTH   */
+/* lines waiting there is one "dropped" line.                         */
+static log_queue *gLog = NULL;
+#define LOG_QUEUE_DEPTH     1024
+#define LOG_REPEAT_INTERVAL 10
+#define LOG_REPEAT_BURST    5
+
 typedef struct messageEntry_t {
 
 	size_t         logid;
@@ -35,13 +154,28 @@ typedef struct messageEntry_t {
 	sd_bus_slot   *deleteslot;
 	sd_bus_slot   *associationslot;
 	event_manager *em;
+	unsigned       pass;      // see prune_dbus
+	struct messageEntry_t *next;
 
 } messageEntry_t;
 
+/* Every published log, hashed by logid, for changes the event */
+/* manager reports on its own (see apply_store_changes)        */
+#define ENTRY_BUCKETS 256
+static messageEntry_t *gEntries[ENTRY_BUCKETS];
+
 static int remove_log_from_dbus(messageEntry_t *node);
 
 static void message_entry_close(messageEntry_t *m)
 {
+	messageEntry_t **pp = &gEntries[m->logid % ENTRY_BUCKETS];
+
+	while (*pp && *pp != m)
+		pp = &(*pp)->next;
+
+	if (*pp)
+		*pp = m->next;
+
 	free(m);
 	return;
 }
@@ -51,9 +185,22 @@ static void message_entry_new(messageEntry_t **m, uint16_t logid, event_manager
 	*m          = malloc(sizeof(messageEntry_t));
 	(*m)->logid = logid;
 	(*m)->em    = em;
+	(*m)->pass  = 0;
+	(*m)->next  = gEntries[logid % ENTRY_BUCKETS];
+	gEntries[logid % ENTRY_BUCKETS] = *m;
 	return;
 }
 
+static messageEntry_t *message_entry_find(uint16_t logid)
+{
+	messageEntry_t *m = gEntries[logid % ENTRY_BUCKETS];
+
+	while (m && m->logid != logid)
+		m = m->next;
+
+	return m;
+}
+
 // After calling this function the gCachedRec will be set
 static event_record_t* message_record_open(event_manager *em, uint16_t logid)
 {
@@ -65,7 +212,7 @@ static event_record_t* message_record_open(event_manager *em, uint16_t logid)
 	// property needs to extract data from the
 	// same data blob.  
 	if (gCachedRec == NULL) {
-		if (message_load_log(em, logid, &rec)) {
+		if (message_load_verified_log(em, logid, &rec)) {
 			gCachedRec = rec;
 			return gCachedRec;
 		} else 
@@ -79,7 +226,7 @@ static event_record_t* message_record_open(event_manager *em, uint16_t logid)
 		message_free_log(em, gCachedRec);
 		gCachedRec = NULL;
 
-		r = message_load_log(em, logid, &rec);
+		r = message_load_verified_log(em, logid, &rec);
 		if (r)
 			gCachedRec = rec;
 	}
@@ -87,6 +234,18 @@ static event_record_t* message_record_open(event_manager *em, uint16_t logid)
 	return (r ? gCachedRec : NULL);
 }
 
+/* The record behind logid went or may have changed on disk, the next */
+/* property read loads it again                                       */
+static void message_record_forget(event_manager *em, uint16_t logid)
+{
+	if (gCachedRec && gCachedRec->logid == logid) {
+		message_free_log(em, gCachedRec);
+		gCachedRec = NULL;
+	}
+
+	return;
+}
+
 static int prop_message_assoc(sd_bus *bus,
 			const char *path,
 			const char *interface,
@@ -222,6 +381,234 @@ static int prop_message_dd(sd_bus *bus,
 	return sd_bus_message_append_array(reply, 'y', rec->p, rec->n);
 }
 
+/* One (qxsssasu) entry of an EventsLogged signal: logid, timestamp, */
+/* severity, message, reported by, associations, debug data length  */
+static int append_logged_event(sd_bus_message *sig, const event_record_t *rec)
+{
+	char *assoc, *token, *save;
+	int r;
+
+	r = sd_bus_message_open_container(sig, 'r', "qxsssasu");
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_append(sig, "qxsss",
+				  (uint16_t) rec->logid,
+				  (int64_t) rec->timestamp,
+				  rec->severity,
+				  rec->message,
+				  rec->reportedby);
+	if (r < 0)
+		return r;
+
+	assoc = strdup(rec->association);
+	if (!assoc)
+		return -ENOMEM;
+
+	r = sd_bus_message_open_container(sig, 'a', "s");
+	for (token = strtok_r(assoc, " ", &save); token && r >= 0;
+	     token = strtok_r(NULL, " ", &save))
+		r = sd_bus_message_append(sig, "s", token);
+	free(assoc);
+
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_close_container(sig);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_append(sig, "u", (uint32_t) rec->n);
+	if (r < 0)
+		return r;
+
+	return sd_bus_message_close_container(sig);
+}
+
+/* Announces new logs with everything a subscriber needs, so nobody */
+/* has to come back with GetAll for each InterfacesAdded            */
+static int emit_events_logged(event_record_t **recs, int count)
+{
+	sd_bus_message *sig = NULL;
+	int i, r;
+
+	r = sd_bus_message_new_signal(bus, &sig, event_path,
+				      "org.openbmc.recordlog", "EventsLogged");
+	if (r < 0)
+		goto finish;
+
+	r = sd_bus_message_open_container(sig, 'a', "(qxsssasu)");
+	for (i = 0; i < count && r >= 0; i++)
+		r = append_logged_event(sig, recs[i]);
+
+	if (r >= 0)
+		r = sd_bus_message_close_container(sig);
+
+	if (r >= 0)
+		r = sd_bus_send(bus, sig, NULL);
+
+finish:
+	if (r < 0)
+		fprintf(stderr, "Failed to emit EventsLogged %s\n", strerror(-r));
+
+	sd_bus_message_unref(sig);
+	return r;
+}
+
+/* Names every log one dispatch removed in a single signal, */
+/* the counterpart of EventsLogged                          */
+static int emit_events_deleted(const uint16_t *ids, size_t count)
+{
+	sd_bus_message *sig = NULL;
+	int r;
+
+	r = sd_bus_message_new_signal(bus, &sig, event_path,
+				      "org.openbmc.recordlog", "EventsDeleted");
+	if (r >= 0)
+		r = sd_bus_message_append_array(sig, 'q', ids,
+						count * sizeof(*ids));
+	if (r >= 0)
+		r = sd_bus_send(bus, sig, NULL);
+
+	if (r < 0)
+		fprintf(stderr, "Failed to emit EventsDeleted %s\n", strerror(-r));
+
+	sd_bus_message_unref(sig);
+	return r;
+}
+
+/* Every path that takes a log off the bus goes through here, and its */
+/* caller names the lot in one EventsDeleted with emit_deleted         */
+static void note_deleted(uint16_t logid)
+{
+	uint16_t *grown;
+
+	if (gDeletedCount == gDeletedAlloc) {
+		size_t alloc = gDeletedAlloc ? 2 * gDeletedAlloc : 16;
+
+		grown = realloc(gDeleted, alloc * sizeof(*gDeleted));
+		if (!grown) {
+			/* no room to batch it, name it on its own */
+			emit_events_deleted(&logid, 1);
+			return;
+		}
+
+		gDeleted      = grown;
+		gDeletedAlloc = alloc;
+	}
+
+	gDeleted[gDeletedCount++] = logid;
+
+	return;
+}
+
+static void emit_deleted(void)
+{
+	if (gDeletedCount)
+		emit_events_deleted(gDeleted, gDeletedCount);
+
+	gDeletedCount = 0;
+
+	return;
+}
+
+/* Arms the flush timer when something is staged and it is not running */
+static void schedule_flush(void)
+{
+	uint64_t now;
+	int enabled = SD_EVENT_OFF;
+
+	if (!gFlushSource || !message_staged_size(gFlushEm))
+		return;
+
+	sd_event_source_get_enabled(gFlushSource, &enabled);
+	if (enabled != SD_EVENT_OFF)
+		return;
+
+	sd_event_now(gEvent, CLOCK_MONOTONIC, &now);
+	sd_event_source_set_time(gFlushSource, now + gFlushInterval);
+	sd_event_source_set_enabled(gFlushSource, SD_EVENT_ONESHOT);
+
+	return;
+}
+
+/* Rearms the expiry timer for whatever is due first */
+static void schedule_expiry(event_manager *em)
+{
+	uint32_t due = message_next_expiry(em);
+
+	if (!gExpireSource)
+		return;
+
+	if (!due) {
+		sd_event_source_set_enabled(gExpireSource, SD_EVENT_OFF);
+		return;
+	}
+
+	sd_event_source_set_time(gExpireSource, due * 1000000ULL);
+	sd_event_source_set_enabled(gExpireSource, SD_EVENT_ONESHOT);
+
+	return;
+}
+
+/* The caller gets its reply straight away, the dbus objects and the */
+/* EventsLogged signal follow once the bus has nothing else queued   */
+static int queue_publication(event_manager *em, uint16_t logid)
+{
+	uint16_t *grown;
+
+	if (gPendingCount == gPendingAlloc) {
+		size_t alloc = gPendingAlloc ? 2 * gPendingAlloc : 16;
+
+		grown = realloc(gPending, alloc * sizeof(*gPending));
+		if (!grown)
+			return -ENOMEM;
+
+		gPending      = grown;
+		gPendingAlloc = alloc;
+	}
+
+	gPending[gPendingCount++] = logid;
+	schedule_flush();
+	schedule_expiry(em);
+
+	return sd_event_source_set_enabled(gPublishSource, SD_EVENT_ONESHOT);
+}
+
+/* Publishes everything accepted since the last run with one signal */
+static int publish_pending_logs(sd_event_source *s, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+	event_record_t **recs;
+	size_t i, n = 0;
+
+	recs = calloc(gPendingCount, sizeof(*recs));
+	if (!recs)
+		return -ENOMEM;
+
+	for (i = 0; i < gPendingCount; i++) {
+		/* a log deleted before it was published just drops out */
+		if (!message_load_log(em, gPending[i], &recs[n]))
+			continue;
+
+		if (send_log_to_dbus(em, gPending[i], recs[n]->association))
+			n++;
+		else
+			message_free_log(em, recs[n]);
+	}
+
+	if (n)
+		emit_events_logged(recs, n);
+
+	for (i = 0; i < n; i++)
+		message_free_log(em, recs[i]);
+
+	free(recs);
+	gPendingCount = 0;
+
+	return 0;
+}
+
 /////////////////////////////////////////////////////////////
 // Receives an array of bytes as an esel error log
 // returns the messageid in 2 byte format
@@ -232,18 +619,13 @@ static int prop_message_dd(sd_bus *bus,
 //  ay - Detailed data - developer debug information
 //
 /////////////////////////////////////////////////////////////
-static int accept_message(sd_bus_message *m,
-				      void *userdata,
-				      sd_bus_error *ret_error,
-				      char *reportedby)
+static int read_message(sd_bus_message *m, event_record_t *rec,
+			char *reportedby)
 {
 	char *message, *severity, *association;
 	size_t   n = 4;
 	uint8_t *p;
 	int r;
-	uint16_t logid;
-	event_record_t rec;
-	event_manager *em = (event_manager *) userdata;
 
 	r = sd_bus_message_read(m, "sss", &message, &severity, &association);
 	if (r < 0) {
@@ -257,23 +639,152 @@ static int accept_message(sd_bus_message *m,
 		return r;
 	}
 
-	rec.message     = (char*) message;
-	rec.severity    = (char*) severity;
-	rec.association = (char*) association;
-	rec.reportedby  = reportedby;
-	rec.p           = (uint8_t*) p;
-	rec.n           = n;
+	rec->message     = (char*) message;
+	rec->severity    = (char*) severity;
+	rec->association = (char*) association;
+	rec->reportedby  = reportedby;
+	rec->p           = (uint8_t*) p;
+	rec->n           = n;
+
+	return 0;
+}
+
+static void journal_sink(void *ctx, const log_queue_entry_t *e)
+{
+	switch (e->kind) {
+	case LOG_QUEUE_EVENT:
+		sd_journal_send("MESSAGE=%s %s (%s)", e->severity, e->message,
+				e->association,
+				"PRIORITY=%i", LOG_NOTICE,
+				"LOGID=%u", e->logid,
+				"SEVERITY=%s", e->severity,
+				"REPORTER=%s", e->reporter,
+				"ASSOCIATION=%s", e->association,
+				NULL);
+		break;
+	case LOG_QUEUE_SUPPRESSED:
+		sd_journal_send("MESSAGE=suppressed %u similar: %s %s",
+				e->count, e->severity, e->message,
+				"PRIORITY=%i", LOG_NOTICE,
+				"LOGID=%u", e->logid,
+				"SEVERITY=%s", e->severity,
+				"REPORTER=%s", e->reporter,
+				"ASSOCIATION=%s", e->association,
+				"SUPPRESSED=%u", e->count,
+				NULL);
+		break;
+	case LOG_QUEUE_DROPPED:
+		sd_journal_send("MESSAGE=dropped %u event log lines, "
+				"log queue full", e->count,
+				"PRIORITY=%i", LOG_WARNING,
+				"DROPPED=%u", e->count,
+				NULL);
+		break;
+	}
+
+	return;
+}
+
+/* logid is 0 for an event that was not stored */
+static void log_accepted(uint16_t logid, const event_record_t *rec)
+{
+	if (!gLog) {
+		syslog(LOG_NOTICE, "%s %s (%s)", rec->severity, rec->message,
+		       rec->association);
+		return;
+	}
+
+	log_queue_push(gLog, logid, rec->severity, rec->reportedby,
+		       rec->association, rec->message);
+
+	return;
+}
+
+static int accept_message(sd_bus_message *m,
+				      void *userdata,
+				      sd_bus_error *ret_error,
+				      char *reportedby)
+{
+	int r;
+	uint16_t logid;
+	event_record_t rec;
+	event_manager *em = (event_manager *) userdata;
+
+	if (gReplica)
+		return sd_bus_error_set(ret_error, REPLICA_ERROR,
+					"Events are logged on the primary");
 
-	syslog(LOG_NOTICE, "%s %s (%s)", rec.severity, rec.message, rec.association);
+	r = read_message(m, &rec, reportedby);
+	if (r < 0)
+		return r;
 
 	logid = message_create_new_log_event(em, &rec);
+	log_accepted(logid, &rec);
 
 	if (logid) 
-		r = send_log_to_dbus(em, logid, rec.association);
+		r = queue_publication(em, logid);
 
 	return sd_bus_reply_method_return(m, "q", logid);
 }
 
+/* Same as accept_message, on an ingest thread.  The reply waits for */
+/* the writer, see reply_ingested()                                  */
+static int ingest_message(sd_bus_message *m, void *userdata, char *reportedby)
+{
+	ingestConn_t *c = (ingestConn_t *) userdata;
+	event_record_t rec;
+	int r;
+
+	r = read_message(m, &rec, reportedby);
+	if (r < 0)
+		return r;
+
+	message_submit_log_event(c->em, &rec, c->done, sd_bus_message_ref(m));
+
+	return 1;
+}
+
+/* Answers the calls whose records the writer has stored, with their */
+/* logid, or refused, with 0                                         */
+static void reply_ingested(ingestConn_t *c)
+{
+	sd_bus_message *m;
+	event_record_t rec;
+	uint16_t logid;
+	void *ctx;
+	char *reportedby;
+
+	while (message_ingest_channel_next(c->done, &ctx, &logid)) {
+		m = (sd_bus_message *) ctx;
+		reportedby = sd_bus_message_is_method_call(m, NULL,
+				"acceptHostMessage") > 0 ? "Host" : "BMC";
+
+		/* read again for the log line, now the logid is known */
+		if (sd_bus_message_rewind(m, 1) >= 0 &&
+		    read_message(m, &rec, reportedby) >= 0)
+			log_accepted(logid, &rec);
+
+		sd_bus_reply_method_return(m, "q", logid);
+		sd_bus_message_unref(m);
+	}
+
+	return;
+}
+
+static int method_ingest_host_message(sd_bus_message *m,
+				      void *userdata,
+				      sd_bus_error *ret_error)
+{
+	return ingest_message(m, userdata, "Host");
+}
+
+static int method_ingest_bmc_message(sd_bus_message *m,
+				     void *userdata,
+				     sd_bus_error *ret_error)
+{
+	return ingest_message(m, userdata, "BMC");
+}
+
 static int method_accept_host_message(sd_bus_message *m,
 				      void *userdata,
 				      sd_bus_error *ret_error)
@@ -297,6 +808,10 @@ static int method_accept_test_message(sd_bus_message *m,
 	event_record_t rec;
 	event_manager *em = (event_manager *) userdata;
 
+	if (gReplica)
+		return sd_bus_error_set(ret_error, REPLICA_ERROR,
+					"Events are logged on the primary");
+
 	rec.message     = (char*) "A Test event log just happened";
 	rec.severity    = (char*) "Info";
 	rec.association = (char*) "/org/openbmc/inventory/system/chassis/motherboard/dimm3 " \
@@ -305,131 +820,482 @@ static int method_accept_test_message(sd_bus_message *m,
 	rec.p           = (uint8_t*) p;
 	rec.n           = 6;
 
-
-	syslog(LOG_NOTICE, "%s %s (%s)", rec.severity, rec.message, rec.association);
 	logid = message_create_new_log_event(em, &rec);
+	log_accepted(logid, &rec);
 
 	if (logid)
-		send_log_to_dbus(em, logid, rec.association);
+		queue_publication(em, logid);
 
 	return sd_bus_reply_method_return(m, "q", logid);
 }
 
-static int finish_delete_log(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
-{
-	return 0;
-}
-
+/* Everything goes in one batched removal rather than a delete call */
+/* per record back through the bus                                   */
 static int method_clearall(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
 	event_manager *em = (event_manager *) userdata;
-	uint16_t logid;
-	char buffer[32];
-	int r;
+	uint16_t *ids = NULL, *grown, logid;
+	size_t n = 0, alloc = 0, i;
+	messageEntry_t *p;
+
+	if (gReplica)
+		return sd_bus_error_set(ret_error, REPLICA_ERROR,
+					"Events are deleted on the primary");
 
 	message_refresh_events(em);
 
 	while ((logid = message_next_event(em))) {
-		snprintf(buffer, sizeof(buffer),
-			"%s/%d", event_path, logid);
-
-		r = sd_bus_call_method_async(bus,
-					     NULL,
-					     "org.openbmc.records.events",
-					     buffer,
-					     "org.openbmc.Object.Delete",
-					     "delete",
-					     finish_delete_log,
-					     NULL,
-					     NULL);
-		if (r < 0) {
-			fprintf(stderr,
-				"sd_bus_call_method_async Failed : %s\n",
-				strerror(-r));
-			return -1;
+		if (n == alloc) {
+			alloc = alloc ? 2 * alloc : 64;
+			grown = realloc(ids, alloc * sizeof(*ids));
+			if (!grown) {
+				free(ids);
+				return -ENOMEM;
+			}
+			ids = grown;
 		}
+
+		ids[n++] = logid;
 	}
 
-	return sd_bus_reply_method_return(m, "q", 0);
-}
+	message_delete_logs(em, ids, n);
 
+	for (i = 0; i < n; i++)
+		if ((p = message_entry_find(ids[i])))
+			remove_log_from_dbus(p);
 
-static int method_deletelog(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
-{
-	messageEntry_t *p = (messageEntry_t *) userdata;
+	emit_deleted();
+	free(ids);
 
-	message_delete_log(p->em, p->logid);
-	remove_log_from_dbus(p);
 	return sd_bus_reply_method_return(m, "q", 0);
 }
 
+/* Takes down every object whose log the store no longer has.  Walks */
+/* the store with message_next_event, so it needs no memory of its   */
+/* own.                                                              */
+static void prune_dbus(event_manager *em)
+{
+	static unsigned pass;
+	messageEntry_t *p, *next;
+	uint16_t logid;
+	size_t i;
 
+	pass++;
 
-static const sd_bus_vtable recordlog_vtable[] = {
-	SD_BUS_VTABLE_START(0),
-	SD_BUS_METHOD("acceptHostMessage", "sssay", "q", method_accept_host_message, SD_BUS_VTABLE_UNPRIVILEGED),
-	SD_BUS_METHOD("acceptBMCMessage", "sssay", "q", method_accept_bmc_message, SD_BUS_VTABLE_UNPRIVILEGED),
-	SD_BUS_METHOD("acceptTestMessage", NULL, "q", method_accept_test_message, SD_BUS_VTABLE_UNPRIVILEGED),
-	SD_BUS_METHOD("clear", NULL, "q", method_clearall, SD_BUS_VTABLE_UNPRIVILEGED),
-	SD_BUS_VTABLE_END
-};
-
-static const sd_bus_vtable log_vtable[] = {
-	SD_BUS_VTABLE_START(0),   
-	SD_BUS_PROPERTY("message",     "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
-	SD_BUS_PROPERTY("severity",    "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
-	SD_BUS_PROPERTY("reported_by", "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
-	SD_BUS_PROPERTY("time",        "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
-	SD_BUS_PROPERTY("debug_data",  "ay", prop_message_dd ,0, SD_BUS_VTABLE_PROPERTY_CONST),
-	SD_BUS_VTABLE_END
-};
-
-
-static const sd_bus_vtable recordlog_delete_vtable[] = {
-	SD_BUS_VTABLE_START(0),
-	SD_BUS_METHOD("delete", NULL, "q", method_deletelog, SD_BUS_VTABLE_UNPRIVILEGED),
-	SD_BUS_VTABLE_END
-};
+	message_refresh_events(em);
+	while ((logid = message_next_event(em)))
+		if ((p = message_entry_find(logid)))
+			p->pass = pass;
+
+	for (i = 0; i < ENTRY_BUCKETS; i++)
+		for (p = gEntries[i]; p; p = next) {
+			next = p->next;
+			if (p->pass != pass)
+				remove_log_from_dbus(p);
+		}
 
-static const sd_bus_vtable recordlog_association_vtable[] = {
-	SD_BUS_VTABLE_START(0),
-	SD_BUS_PROPERTY("associations", "a(sss)",  prop_message_assoc, 0, SD_BUS_VTABLE_PROPERTY_CONST),
-	SD_BUS_VTABLE_END
-};
+	return;
+}
 
-static int remove_log_from_dbus(messageEntry_t *p)
+/* Deletes every log matching all of severity, reporter, the time  */
+/* range and an association prefix in one pass; empty strings and  */
+/* 0 times match anything.  Replies with how many were deleted.     */
+static int method_delete_where(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
 {
+	event_manager *em = (event_manager *) userdata;
+	const char *severity, *reportedby, *prefix;
+	uint64_t since, until;
+	uint16_t *ids;
+	messageEntry_t *p;
+	size_t n, i;
 	int r;
-	char buffer[32];
 
-	snprintf(buffer, sizeof(buffer), "%s/%zu", event_path, p->logid);
+	if (gReplica)
+		return sd_bus_error_set(ret_error, REPLICA_ERROR,
+					"Events are deleted on the primary");
 
-	printf("Attempting to delete %s\n", buffer);
+	r = sd_bus_message_read(m, "sstts", &severity, &reportedby,
+				&since, &until, &prefix);
+	if (r < 0)
+		return r;
+
+	r = message_delete_where(em, severity, reportedby, since, until,
+				 prefix, &ids, &n);
 
-	r = sd_bus_emit_object_removed(bus, buffer);
 	if (r < 0) {
-		fprintf(stderr, "Failed to emit the delete signal %s\n", strerror(-r));
-		return -1;
-	}	
-	sd_bus_slot_unref(p->messageslot);
-	sd_bus_slot_unref(p->deleteslot);
+		/* which logs went is lost, check every object instead */
+		prune_dbus(em);
+	} else {
+		for (i = 0; i < n; i++)
+			if ((p = message_entry_find(ids[i])))
+				remove_log_from_dbus(p);
 
-	if (p->associationslot)
-		sd_bus_slot_unref(p->associationslot);
+		free(ids);
+	}
 
-	message_entry_close(p);
+	emit_deleted();
 
-	return 0;
+	return sd_bus_reply_method_return(m, "u", (uint32_t) n);
 }
 
-int send_log_to_dbus(event_manager *em, const uint16_t logid, const char *association)
+/* Counts or lists the logs matching severity, reporter and the time */
+/* range, empty strings and 0 times matching anything.  Both read the */
+/* published snapshot only, so the ingest threads answer them too.   */
+static int count_where(sd_bus_message *m, event_manager *em)
 {
-	char loglocation[64];
+	const char *severity, *reportedby;
+	uint64_t since, until;
+	size_t n;
 	int r;
-	messageEntry_t *m;
 
-	snprintf(loglocation, sizeof(loglocation), "%s/%d", event_path, logid);
+	r = sd_bus_message_read(m, "sstt", &severity, &reportedby,
+				&since, &until);
+	if (r < 0)
+		return r;
+
+	n = message_count_where(em, severity, reportedby, since, until);
+
+	return sd_bus_reply_method_return(m, "u", (uint32_t) n);
+}
+
+static int list_where(sd_bus_message *m, event_manager *em)
+{
+	const char *severity, *reportedby;
+	sd_bus_message *reply = NULL;
+	uint64_t since, until;
+	uint16_t *ids;
+	size_t n;
+	int r;
+
+	r = sd_bus_message_read(m, "sstt", &severity, &reportedby,
+				&since, &until);
+	if (r < 0)
+		return r;
+
+	r = message_list_where(em, severity, reportedby, since, until,
+			       &ids, &n);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0)
+		r = sd_bus_message_append_array(reply, 'q', ids, n * sizeof(*ids));
+	if (r >= 0)
+		r = sd_bus_send(NULL, reply, NULL);
+
+	sd_bus_message_unref(reply);
+	free(ids);
+
+	return r;
+}
+
+static int method_count_where(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	return count_where(m, (event_manager *) userdata);
+}
+
+static int method_list_where(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	return list_where(m, (event_manager *) userdata);
+}
+
+static int method_ingest_count_where(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	return count_where(m, ((ingestConn_t *) userdata)->em);
+}
+
+static int method_ingest_list_where(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	return list_where(m, ((ingestConn_t *) userdata)->em);
+}
+
+/* The pass itself runs a budget at a time from compact_step */
+static int method_compact(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	event_manager *em = (event_manager *) userdata;
+	int enabled = SD_EVENT_OFF;
+
+	sd_event_source_get_enabled(gCompactSource, &enabled);
+
+	if (enabled == SD_EVENT_OFF) {
+		message_compact_start(em);
+		sd_event_source_set_enabled(gCompactSource, SD_EVENT_ON);
+	}
+
+	return sd_bus_reply_method_return(m, "q", 0);
+}
+
+/* One (reporter, bytes, logs, rejected, quota, reserved) per reporter seen */
+static int method_quota_usage(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	event_manager *em = (event_manager *) userdata;
+	sd_bus_message *reply = NULL;
+	source_usage_t u;
+	size_t i;
+	int r;
+
+	r = sd_bus_message_new_method_return(m, &reply);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_message_open_container(reply, 'a', "(stuutt)");
+
+	for (i = 0; r >= 0 && message_source_usage(em, i, &u); i++)
+		r = sd_bus_message_append(reply, "(stuutt)", u.reporter,
+					  (uint64_t) u.bytes, u.logs, u.rejected,
+					  (uint64_t) u.quota, (uint64_t) u.reserved);
+
+	if (r >= 0)
+		r = sd_bus_message_close_container(reply);
+	if (r >= 0)
+		r = sd_bus_send(NULL, reply, NULL);
+
+	sd_bus_message_unref(reply);
+
+	return r;
+}
+
+/* Logids whose text holds query, ignoring case, newest first.  fields */
+/* is a mask of 1 message, 2 reporter, 4 association, 0 meaning the   */
+/* message.  Also replies with how many matched beyond the first max. */
+static int method_search(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	event_manager *em = (event_manager *) userdata;
+	sd_bus_message *reply = NULL;
+	const char *query;
+	uint32_t fields, max;
+	uint16_t *ids;
+	size_t n, total;
+	int r;
+
+	r = sd_bus_message_read(m, "suu", &query, &fields, &max);
+	if (r < 0)
+		return r;
+
+	if (!fields)
+		fields = MESSAGE_SEARCH_MESSAGE;
+	if (max > MAX_SEARCH || max == 0)
+		max = MAX_SEARCH;
+
+	ids = calloc(max, sizeof(*ids));
+	if (!ids)
+		return -ENOMEM;
+
+	n = message_search(em, query, fields, ids, max, &total);
 
+	r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0)
+		r = sd_bus_message_append_array(reply, 'q', ids, n * sizeof(*ids));
+	if (r >= 0)
+		r = sd_bus_message_append(reply, "u", (uint32_t) total);
+	if (r >= 0)
+		r = sd_bus_send(NULL, reply, NULL);
+
+	sd_bus_message_unref(reply);
+	free(ids);
+
+	return r;
+}
+
+/* Records per period for the last hour by minute (resolution 0), two */
+/* days by hour (1) or a month by day (2), never reading the store.    */
+/* Replies with the first period's start, its width, the number of    */
+/* periods, the severity and reporter names and the counts, laid out  */
+/* [severity][reporter][period] with the oldest period first.          */
+static int method_rollup(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	event_manager *em = (event_manager *) userdata;
+	sd_bus_message *reply = NULL;
+	message_rollup_t roll;
+	uint32_t resolution;
+	size_t n;
+	int r;
+
+	r = sd_bus_message_read(m, "u", &resolution);
+	if (r < 0)
+		return r;
+
+	r = message_rollup(em, resolution, time(NULL), &roll);
+	if (r == -EINVAL)
+		return sd_bus_error_set(ret_error, SD_BUS_ERROR_INVALID_ARGS,
+					"Unknown resolution");
+	if (r < 0)
+		return r;
+
+	n = (size_t) roll.nseverity * roll.nreporter * roll.periods;
+
+	r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0)
+		r = sd_bus_message_append(reply, "tuu", roll.start, roll.width,
+					  roll.periods);
+	if (r >= 0)
+		r = sd_bus_message_append_strv(reply, roll.severity);
+	if (r >= 0)
+		r = sd_bus_message_append_strv(reply, roll.reporter);
+	if (r >= 0)
+		r = sd_bus_message_append_array(reply, 'u', roll.counts,
+						n * sizeof(*roll.counts));
+	if (r >= 0)
+		r = sd_bus_send(NULL, reply, NULL);
+
+	sd_bus_message_unref(reply);
+	message_free_rollup(&roll);
+
+	return r;
+}
+
+/* Creates and deletes after cursor as (seq, logid, op), op 1 for a */
+/* create and 2 for a delete, with the cursor to pass next time.    */
+/* resync is set when cursor is 0 or too old for the journal; the   */
+/* caller then lists the event tree and carries on from the cursor. */
+static int method_changes_since(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	event_manager *em = (event_manager *) userdata;
+	sd_bus_message *reply = NULL;
+	message_change_t *changes;
+	uint64_t cursor, next;
+	uint32_t max;
+	int i, n, r;
+
+	r = sd_bus_message_read(m, "tu", &cursor, &max);
+	if (r < 0)
+		return r;
+
+	if (max > MAX_CHANGES || max == 0)
+		max = MAX_CHANGES;
+
+	changes = calloc(max, sizeof(*changes));
+	if (!changes)
+		return -ENOMEM;
+
+	n = message_changes_since(em, cursor, changes, max, &next);
+
+	r = sd_bus_message_new_method_return(m, &reply);
+	if (r >= 0)
+		r = sd_bus_message_open_container(reply, 'a', "(tqy)");
+
+	for (i = 0; r >= 0 && i < n; i++)
+		r = sd_bus_message_append(reply, "(tqy)", changes[i].seq,
+					  changes[i].logid, changes[i].op);
+
+	if (r >= 0)
+		r = sd_bus_message_close_container(reply);
+	if (r >= 0)
+		r = sd_bus_message_append(reply, "tb", next, n < 0);
+	if (r >= 0)
+		r = sd_bus_send(NULL, reply, NULL);
+
+	sd_bus_message_unref(reply);
+	free(changes);
+
+	return r;
+}
+
+static int method_deletelog(sd_bus_message *m, void *userdata, sd_bus_error *ret_error)
+{
+	messageEntry_t *p = (messageEntry_t *) userdata;
+
+	if (gReplica)
+		return sd_bus_error_set(ret_error, REPLICA_ERROR,
+					"Events are deleted on the primary");
+
+	message_delete_log(p->em, p->logid);
+	remove_log_from_dbus(p);
+	emit_deleted();
+	return sd_bus_reply_method_return(m, "q", 0);
+}
+
+
+
+static const sd_bus_vtable recordlog_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("acceptHostMessage", "sssay", "q", method_accept_host_message, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("acceptBMCMessage", "sssay", "q", method_accept_bmc_message, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("acceptTestMessage", NULL, "q", method_accept_test_message, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("clear", NULL, "q", method_clearall, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("DeleteWhere", "sstts", "u", method_delete_where, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("CountWhere", "sstt", "u", method_count_where, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("ListWhere", "sstt", "aq", method_list_where, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("compact", NULL, "q", method_compact, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("quotaUsage", NULL, "a(stuutt)", method_quota_usage, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("Search", "suu", "aqu", method_search, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("Rollup", "u", "tuuasasau", method_rollup, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("GetChangesSince", "tu", "a(tqy)tb", method_changes_since, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_SIGNAL("EventsLogged", "a(qxsssasu)", 0),
+	SD_BUS_SIGNAL("EventsDeleted", "aq", 0),
+	SD_BUS_VTABLE_END
+};
+
+/* What the ingest connections serve, the queries off the snapshot */
+static const sd_bus_vtable ingest_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("acceptHostMessage", "sssay", "q", method_ingest_host_message, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("acceptBMCMessage", "sssay", "q", method_ingest_bmc_message, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("CountWhere", "sstt", "u", method_ingest_count_where, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_METHOD("ListWhere", "sstt", "aq", method_ingest_list_where, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable log_vtable[] = {
+	SD_BUS_VTABLE_START(0),   
+	SD_BUS_PROPERTY("message",     "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("severity",    "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("reported_by", "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("time",        "s",  prop_message,    0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_PROPERTY("debug_data",  "ay", prop_message_dd ,0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_VTABLE_END
+};
+
+
+static const sd_bus_vtable recordlog_delete_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_METHOD("delete", NULL, "q", method_deletelog, SD_BUS_VTABLE_UNPRIVILEGED),
+	SD_BUS_VTABLE_END
+};
+
+static const sd_bus_vtable recordlog_association_vtable[] = {
+	SD_BUS_VTABLE_START(0),
+	SD_BUS_PROPERTY("associations", "a(sss)",  prop_message_assoc, 0, SD_BUS_VTABLE_PROPERTY_CONST),
+	SD_BUS_VTABLE_END
+};
+
+static int remove_log_from_dbus(messageEntry_t *p)
+{
+	int r;
+	char buffer[32];
+
+	snprintf(buffer, sizeof(buffer), "%s/%zu", event_path, p->logid);
+
+	printf("Attempting to delete %s\n", buffer);
+
+	message_record_forget(p->em, p->logid);
+	note_deleted(p->logid);
+
+	r = sd_bus_emit_object_removed(bus, buffer);
+	if (r < 0) {
+		fprintf(stderr, "Failed to emit the delete signal %s\n", strerror(-r));
+		return -1;
+	}	
+	sd_bus_slot_unref(p->messageslot);
+	sd_bus_slot_unref(p->deleteslot);
+
+	if (p->associationslot)
+		sd_bus_slot_unref(p->associationslot);
+
+	message_entry_close(p);
+
+	return 0;
+}
+
+int send_log_to_dbus(event_manager *em, const uint16_t logid, const char *association)
+{
+	char loglocation[64];
+	int r;
+	messageEntry_t *m;
+
+	snprintf(loglocation, sizeof(loglocation), "%s/%d", event_path, logid);
+
+	message_record_forget(em, logid);
 	message_entry_new(&m, logid, em);
 
 	r = sd_bus_add_object_vtable(bus,
@@ -486,31 +1352,438 @@ int send_log_to_dbus(event_manager *em, const uint16_t logid, const char *associ
 }
 
 
-int start_event_monitor(void)
+/* Bring dbus in line with changes the event manager made on its own, */
+/* such as records dropped or picked up by a compaction pass          */
+static void apply_store_changes(event_manager *em)
 {
-	int r;
+	event_record_t *rec;
+	messageEntry_t *m;
+	uint16_t logid;
+	int op;
 
-	for (;;) {
+	while ((op = message_next_change(em, &logid))) {
+		m = message_entry_find(logid);
+
+		// rewritten in place by another process or by fsck
+		message_record_forget(em, logid);
+
+		if (op == MESSAGE_LOG_REMOVED && m) {
+			remove_log_from_dbus(m);
+		} else if (op == MESSAGE_LOG_ADDED && !m) {
+			if (message_load_log(em, logid, &rec)) {
+				send_log_to_dbus(em, logid, rec->association);
+				message_free_log(em, rec);
+			}
+		}
+	}
+
+	emit_deleted();
+
+	return;
+}
+
+void set_flush_interval(event_manager *em, uint64_t usec)
+{
+	gFlushEm       = em;
+	gFlushInterval = usec;
+	return;
+}
+
+static int flush_staged_logs(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	message_flush(gFlushEm);
+	apply_store_changes(gFlushEm);
+	return 0;
+}
+
+static int expire_logs(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+
+	if (message_expire(em, time(NULL)))
+		apply_store_changes(em);
+
+	schedule_expiry(em);
+	return 0;
+}
+
+static int store_changed(sd_event_source *s, int fd, uint32_t revents,
+			 void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+
+	if (message_watch_process(em))
+		apply_store_changes(em);
+
+	return 0;
+}
+
+/* Idle source, one budget's worth of compaction per dispatch */
+static int compact_step(sd_event_source *s, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+
+	if (message_compact_step(em, COMPACT_STEP_BUDGET))
+		sd_event_source_set_enabled(s, SD_EVENT_OFF);
+
+	apply_store_changes(em);
+	return 0;
+}
+
+static int archive_logs(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+	uint64_t next;
+
+	next = message_archive(em, time(NULL)) ? ARCHIVE_BACKLOG : ARCHIVE_INTERVAL;
+	apply_store_changes(em);
+
+	sd_event_now(sd_event_source_get_event(s), CLOCK_MONOTONIC, &usec);
+	sd_event_source_set_time(s, usec + next);
+	sd_event_source_set_enabled(s, SD_EVENT_ONESHOT);
+	return 0;
+}
+
+/* Stores what the ingest threads accepted, a batch per dispatch */
+static int commit_ingested(sd_event_source *s, int fd, uint32_t revents,
+			   void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+	uint16_t ids[COMMIT_BATCH];
+	size_t i, n;
+
+	n = message_commit_ingested(em, ids, COMMIT_BATCH);
+
+	for (i = 0; i < n; i++)
+		queue_publication(em, ids[i]);
+
+	return 0;
+}
+
+/* A path is a Unix socket, anything else host:port, the host left out */
+/* to listen on every address.  Returns a non-blocking socket, its      */
+/* connect possibly still in progress, or -errno.                      */
+static int repl_socket(const char *addr, int listening)
+{
+	struct addrinfo hints, *ai, *p;
+	struct sockaddr_un un;
+	char host[256];
+	const char *port;
+	int fd, r, one = 1;
+
+	if (addr[0] == '/') {
+		memset(&un, 0, sizeof(un));
+		un.sun_family = AF_UNIX;
+		if (strlen(addr) >= sizeof(un.sun_path))
+			return -ENAMETOOLONG;
+		strcpy(un.sun_path, addr);
+
+		fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return -errno;
+
+		if (listening) {
+			unlink(addr);
+			r = bind(fd, (struct sockaddr *) &un, sizeof(un));
+			if (r == 0)
+				r = listen(fd, 1);
+		} else {
+			r = connect(fd, (struct sockaddr *) &un, sizeof(un));
+		}
 
-		r = sd_bus_process(bus, NULL);
 		if (r < 0) {
-			fprintf(stderr, "Error bus process: %s\n", strerror(-r));
-			break;
+			r = -errno;
+			close(fd);
+			return r;
 		}
 
-		if (r > 0)
+		return fd;
+	}
+
+	port = strrchr(addr, ':');
+	if (!port || (size_t) (port - addr) >= sizeof(host))
+		return -EINVAL;
+
+	/* [v6 address]:port */
+	if (addr[0] == '[' && port > addr + 1 && port[-1] == ']')
+		snprintf(host, sizeof(host), "%.*s", (int) (port - addr - 2), addr + 1);
+	else
+		snprintf(host, sizeof(host), "%.*s", (int) (port - addr), addr);
+	port++;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family   = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags    = listening ? AI_PASSIVE : 0;
+
+	r = getaddrinfo(host[0] ? host : NULL, port, &hints, &ai);
+	if (r)
+		return -EHOSTUNREACH;
+
+	fd = -1;
+	r  = -EHOSTUNREACH;
+	for (p = ai; p && fd < 0; p = p->ai_next) {
+		fd = socket(p->ai_family, p->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+			    p->ai_protocol);
+		if (fd < 0)
 			continue;
 
-		r = sd_bus_wait(bus, (uint64_t) -1);
-		if (r < 0) {
-			fprintf(stderr, "Error in sd_bus_wait: %s\n", strerror(-r));
+		if (listening) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+			if (bind(fd, p->ai_addr, p->ai_addrlen) == 0 &&
+			    listen(fd, 1) == 0)
+				break;
+		} else if (connect(fd, p->ai_addr, p->ai_addrlen) == 0 ||
+			   errno == EINPROGRESS) {
 			break;
 		}
+
+		r = -errno;
+		close(fd);
+		fd = -1;
+	}
+
+	freeaddrinfo(ai);
+
+	return fd >= 0 ? fd : r;
+}
+
+/* Closes the link, a replica trying again a little later */
+static void repl_drop(event_manager *em)
+{
+	uint64_t now;
+	int fd;
+
+	if (gReplLink) {
+		fd = sd_event_source_get_io_fd(gReplLink);
+		message_replication_stop(em);
+		gReplLink = sd_event_source_unref(gReplLink);
+		close(fd);
+	}
+
+	gReplConnecting = 0;
+
+	if (gReplica && gReplRetry) {
+		sd_event_now(gEvent, CLOCK_MONOTONIC, &now);
+		sd_event_source_set_time(gReplRetry, now + REPL_RETRY);
+		sd_event_source_set_enabled(gReplRetry, SD_EVENT_ONESHOT);
+	}
+
+	return;
+}
+
+/* r from message_replication_process(), 1 while there is more to send */
+static void repl_update(event_manager *em, int r)
+{
+	if (r < 0)
+		repl_drop(em);
+	else
+		sd_event_source_set_io_events(gReplLink, r ? EPOLLIN | EPOLLOUT : EPOLLIN);
+
+	return;
+}
+
+static int repl_io(sd_event_source *s, int fd, uint32_t revents, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+	socklen_t len = sizeof(int);
+	int err = 0;
+
+	if (gReplConnecting) {
+		getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err || message_replicate_from(em, fd) < 0) {
+			fprintf(stderr, "Error connecting to primary %s: %s\n",
+				gReplAddr, strerror(err ? err : EPIPE));
+			repl_drop(em);
+			return 0;
+		}
+		gReplConnecting = 0;
+		syslog(LOG_INFO, "replicating %s", gReplAddr);
 	}
 
+	repl_update(em, message_replication_process(em));
+
+	if (gReplica)
+		apply_store_changes(em);
+
+	return 0;
+}
+
+/* Runs after every other dispatch, ships whatever it changed */
+static int repl_post(sd_event_source *s, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+
+	if (gReplLink)
+		repl_update(em, message_replication_process(em));
+
+	return 0;
+}
+
+static int repl_accept(sd_event_source *s, int fd, uint32_t revents,
+		       void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+	int c, r;
+
+	c = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (c < 0)
+		return 0;
+
+	/* the newer connection is the replica that is still there */
+	repl_drop(em);
+
+	if (message_replicate_to(em, c) < 0) {
+		close(c);
+		return 0;
+	}
+
+	r = sd_event_add_io(gEvent, &gReplLink, c, EPOLLIN, repl_io, em);
+	if (r < 0) {
+		fprintf(stderr, "Error watching replica: %s\n", strerror(-r));
+		message_replication_stop(em);
+		close(c);
+		return 0;
+	}
+	sd_event_source_set_priority(gReplLink, PRIORITY_FLUSH);
+
+	return 0;
+}
+
+static int repl_connect(sd_event_source *s, uint64_t usec, void *userdata)
+{
+	event_manager *em = (event_manager *) userdata;
+	int fd, r;
+
+	fd = repl_socket(gReplAddr, 0);
+	if (fd < 0) {
+		repl_drop(em);
+		return 0;
+	}
+
+	/* writable once the connect has gone through, or failed */
+	r = sd_event_add_io(gEvent, &gReplLink, fd, EPOLLOUT, repl_io, em);
+	if (r < 0) {
+		close(fd);
+		repl_drop(em);
+		return 0;
+	}
+	sd_event_source_set_priority(gReplLink, PRIORITY_FLUSH);
+	gReplConnecting = 1;
+
+	return 0;
+}
+
+static int stop_handler(sd_event_source *s, const struct signalfd_siginfo *si,
+			void *userdata)
+{
+	/* main() unwinds from here, which flushes anything still staged */
+	return sd_event_exit(sd_event_source_get_event(s), 0);
+}
+
+int start_event_monitor(void)
+{
+	sigset_t ss;
+	int r;
+
+	sigemptyset(&ss);
+	sigaddset(&ss, SIGTERM);
+	sigaddset(&ss, SIGINT);
+	sigprocmask(SIG_BLOCK, &ss, NULL);
+
+	sd_event_add_signal(gEvent, NULL, SIGTERM, stop_handler, NULL);
+	sd_event_add_signal(gEvent, NULL, SIGINT, stop_handler, NULL);
+
+	r = sd_event_set_watchdog(gEvent, 1);
+	if (r < 0)
+		fprintf(stderr, "Error enabling watchdog: %s\n", strerror(-r));
+
+	r = sd_event_loop(gEvent);
+	if (r < 0)
+		fprintf(stderr, "Error in event loop: %s\n", strerror(-r));
+
 	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+/* Hooks the bus and the background work up to the event loop */
+static int build_event_loop(event_manager *em)
+{
+	int fd, r;
+
+	r = sd_event_default(&gEvent);
+	if (r < 0)
+		return r;
+
+	r = sd_bus_attach_event(bus, gEvent, PRIORITY_BUS);
+	if (r < 0)
+		return r;
+
+	r = sd_event_add_defer(gEvent, &gPublishSource, publish_pending_logs, em);
+	if (r < 0)
+		return r;
+	sd_event_source_set_priority(gPublishSource, PRIORITY_PUBLISH);
+	sd_event_source_set_enabled(gPublishSource, SD_EVENT_OFF);
+
+	r = sd_event_add_time(gEvent, &gExpireSource, CLOCK_REALTIME,
+			      0, 1000000, expire_logs, em);
+	if (r < 0)
+		return r;
+	sd_event_source_set_priority(gExpireSource, PRIORITY_FLUSH);
+	schedule_expiry(em);
+
+	fd = message_watch_start(em);
+	if (fd >= 0) {
+		r = sd_event_add_io(gEvent, &gWatchSource, fd, EPOLLIN,
+				    store_changed, em);
+		if (r < 0)
+			return r;
+		sd_event_source_set_priority(gWatchSource, PRIORITY_PUBLISH);
+	}
+
+	r = sd_event_add_defer(gEvent, &gCompactSource, compact_step, em);
+	if (r < 0)
+		return r;
+	sd_event_source_set_priority(gCompactSource, PRIORITY_IDLE);
+	sd_event_source_set_enabled(gCompactSource, SD_EVENT_OFF);
+
+	if (message_archive_age(em)) {
+		r = sd_event_add_time(gEvent, &gArchiveSource, CLOCK_MONOTONIC,
+				      0, 1000000, archive_logs, em);
+		if (r < 0)
+			return r;
+		sd_event_source_set_priority(gArchiveSource, PRIORITY_IDLE);
+	}
+
+	if (gFlushEm) {
+		r = sd_event_add_time(gEvent, &gFlushSource, CLOCK_MONOTONIC,
+				      0, 0, flush_staged_logs, NULL);
+		if (r < 0)
+			return r;
+		sd_event_source_set_priority(gFlushSource, PRIORITY_FLUSH);
+		sd_event_source_set_enabled(gFlushSource, SD_EVENT_OFF);
+	}
+
+	return 0;
+}
+
+
+/* Without gLog accepted events go to syslog as they come */
+static void start_event_log(void)
+{
+	sigset_t all, old;
+
+	/* signals stay with the main loop's signalfd */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+	gLog = log_queue_new(LOG_QUEUE_DEPTH, LOG_REPEAT_INTERVAL,
+			     LOG_REPEAT_BURST, journal_sink, NULL);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (!gLog)
+		fprintf(stderr, "Error starting event log thread\n");
+
+	return;
+}
 
 /* Only thing we are doing in this function is to get a connection on the dbus */
 int build_bus(event_manager *em)
@@ -518,6 +1791,8 @@ int build_bus(event_manager *em)
 
 	int r = 0;
 
+	start_event_log();
+
 	/* Connect to the system bus */
 	r = sd_bus_open_system(&bus);
 	if (r < 0) {
@@ -549,13 +1824,252 @@ int build_bus(event_manager *em)
 		fprintf(stderr, "Object Manager failure  %s\n", strerror(-r));
 	}
 
+	r = build_event_loop(em);
+	if (r < 0) {
+		fprintf(stderr, "Error setting up event loop: %s\n", strerror(-r));
+	}
+
 
 	finish:
 	return r < 0 ? EXIT_FAILURE : EXIT_SUCCESS;
 }
 
+/* Dispatch loop of one ingest connection, until gIngestStop fires */
+static void *ingest_thread(void *arg)
+{
+	ingestConn_t *c = (ingestConn_t *) arg;
+	struct pollfd fds[3];
+	struct timespec ts;
+	uint64_t until, now;
+	int r, timeout;
+
+	for (;;) {
+		reply_ingested(c);
+
+		do {
+			r = sd_bus_process(c->bus, NULL);
+		} while (r > 0);
+
+		if (r < 0) {
+			fprintf(stderr, "Ingest connection failed: %s\n", strerror(-r));
+			break;
+		}
+
+		fds[0].fd     = sd_bus_get_fd(c->bus);
+		fds[0].events = sd_bus_get_events(c->bus);
+		fds[1].fd     = gIngestStop;
+		fds[1].events = POLLIN;
+		fds[2].fd     = message_ingest_channel_fd(c->done);
+		fds[2].events = POLLIN;
+
+		/* sd-bus hands back an absolute CLOCK_MONOTONIC deadline */
+		timeout = -1;
+		if (sd_bus_get_timeout(c->bus, &until) >= 0 && until != UINT64_MAX) {
+			clock_gettime(CLOCK_MONOTONIC, &ts);
+			now = ts.tv_sec * 1000000ULL + ts.tv_nsec / 1000;
+			timeout = until > now ? (int) ((until - now + 999) / 1000) : 0;
+		}
+
+		if (poll(fds, 3, timeout) < 0 && errno != EINTR)
+			break;
+
+		if (fds[1].revents)
+			break;
+	}
+
+	return NULL;
+}
+
+/* Opens count more bus connections, each with its own thread, that */
+/* take acceptHostMessage, acceptBMCMessage, CountWhere and         */
+/* ListWhere as org.openbmc.records.events.ingest<n>                */
+int start_ingest(event_manager *em, int count)
+{
+	sigset_t all, old;
+	char name[64];
+	int fd, i, r;
+
+	fd = message_ingest_start(em);
+	if (fd < 0)
+		return -errno;
+
+	gIngestStop = eventfd(0, EFD_CLOEXEC);
+	if (gIngestStop < 0)
+		return -errno;
+
+	r = sd_event_add_io(gEvent, &gCommitSource, fd, EPOLLIN,
+			    commit_ingested, em);
+	if (r < 0)
+		return r;
+	sd_event_source_set_priority(gCommitSource, PRIORITY_PUBLISH);
+
+	gIngest = calloc(count, sizeof(*gIngest));
+	if (!gIngest)
+		return -ENOMEM;
+	gIngestCount = count;
+
+	/* signals stay with the main loop's signalfd */
+	sigfillset(&all);
+	pthread_sigmask(SIG_BLOCK, &all, &old);
+
+	for (i = 0; i < count; i++) {
+		ingestConn_t *c = &gIngest[i];
+
+		c->em   = em;
+		c->done = message_ingest_channel_new();
+		if (!c->done) {
+			r = -ENOMEM;
+			break;
+		}
+
+		r = sd_bus_open_system(&c->bus);
+		if (r < 0)
+			break;
+
+		r = sd_bus_add_object_vtable(c->bus, NULL, event_path,
+					     "org.openbmc.recordlog",
+					     ingest_vtable, c);
+		if (r < 0)
+			break;
+
+		snprintf(name, sizeof(name), "org.openbmc.records.events.ingest%d", i);
+		r = sd_bus_request_name(c->bus, name, 0);
+		if (r < 0)
+			break;
+
+		r = -pthread_create(&c->thread, NULL, ingest_thread, c);
+		if (r < 0)
+			break;
+		c->started = 1;
+	}
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if (r < 0)
+		fprintf(stderr, "Error starting ingest connection %d: %s\n",
+			i, strerror(-r));
+
+	return r < 0 ? r : 0;
+}
+
+/* Ships the store to a replica connecting on addr or, as a replica, */
+/* follows the primary at addr                                        */
+int start_replication(event_manager *em, const char *addr, int replica)
+{
+	int fd, r;
+
+	gReplAddr = strdup(addr);
+	gReplica  = replica;
+	if (!gReplAddr)
+		return -ENOMEM;
+
+	if (replica) {
+		r = sd_event_add_time(gEvent, &gReplRetry, CLOCK_MONOTONIC,
+				      0, 0, repl_connect, em);
+		if (r < 0)
+			return r;
+		sd_event_source_set_priority(gReplRetry, PRIORITY_FLUSH);
+		return 0;
+	}
+
+	fd = repl_socket(addr, 1);
+	if (fd < 0)
+		return fd;
+
+	r = sd_event_add_io(gEvent, &gReplListen, fd, EPOLLIN, repl_accept, em);
+	if (r < 0) {
+		close(fd);
+		return r;
+	}
+	sd_event_source_set_priority(gReplListen, PRIORITY_FLUSH);
+
+	r = sd_event_add_post(gEvent, &gReplPost, repl_post, em);
+	if (r < 0)
+		return r;
+	sd_event_source_set_priority(gReplPost, PRIORITY_FLUSH);
+
+	return 0;
+}
+
+static void stop_replication(void)
+{
+	if (gReplLink) {
+		close(sd_event_source_get_io_fd(gReplLink));
+		gReplLink = sd_event_source_unref(gReplLink);
+	}
+
+	if (gReplListen) {
+		close(sd_event_source_get_io_fd(gReplListen));
+		gReplListen = sd_event_source_unref(gReplListen);
+	}
+
+	sd_event_source_unref(gReplPost);
+	sd_event_source_unref(gReplRetry);
+	free(gReplAddr);
+	gReplAddr = NULL;
+
+	return;
+}
+
+static void stop_ingest(void)
+{
+	uint16_t ids[COMMIT_BATCH];
+	uint64_t one = 1;
+	uint16_t logid;
+	void *ctx;
+	int i;
+
+	if (gIngestStop >= 0 && write(gIngestStop, &one, sizeof(one)) < 0)
+		fprintf(stderr, "Error stopping ingest: %s\n", strerror(errno));
+
+	for (i = 0; i < gIngestCount; i++)
+		if (gIngest[i].started)
+			pthread_join(gIngest[i].thread, NULL);
+
+	/* what was submitted is stored before the channels go, the */
+	/* callers are not waiting any more                         */
+	if (gIngestCount)
+		while (message_ingest_pending(gIngest[0].em))
+			message_commit_ingested(gIngest[0].em, ids, COMMIT_BATCH);
+
+	for (i = 0; i < gIngestCount; i++) {
+		if (gIngest[i].done) {
+			while (message_ingest_channel_next(gIngest[i].done,
+							   &ctx, &logid))
+				sd_bus_message_unref((sd_bus_message *) ctx);
+			message_ingest_channel_free(gIngest[i].done);
+		}
+		sd_bus_flush_close_unref(gIngest[i].bus);
+	}
+
+	free(gIngest);
+	gIngest      = NULL;
+	gIngestCount = 0;
+
+	if (gIngestStop >= 0)
+		close(gIngestStop);
+	gIngestStop = -1;
+
+	return;
+}
+
 void cleanup_event_monitor(void)
 {
+	stop_ingest();
+	stop_replication();
+	/* after ingest, so its last lines are in */
+	log_queue_free(gLog);
+	gLog = NULL;
+	sd_event_source_unref(gCommitSource);
+	sd_event_source_unref(gPublishSource);
+	sd_event_source_unref(gExpireSource);
+	sd_event_source_unref(gWatchSource);
+	sd_event_source_unref(gCompactSource);
+	sd_event_source_unref(gArchiveSource);
+	sd_event_source_unref(gFlushSource);
 	sd_bus_slot_unref(slot);
 	sd_bus_unref(bus);
+	sd_event_unref(gEvent);
+	free(gPending);
+	free(gDeleted);
 }
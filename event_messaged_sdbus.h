@@ -5,8 +5,11 @@ extern "C" {
 #endif
 	int start_event_monitor(void);
 	int build_bus(event_manager *em);
+	int start_ingest(event_manager *em, int count);
+	int start_replication(event_manager *em, const char *addr, int replica);
 	int send_log_to_dbus(event_manager *em, const uint16_t logid, const char* association);
 	void cleanup_event_monitor(void);
+	void set_flush_interval(event_manager *em, uint64_t usec);
 #ifdef __cplusplus
 }
 #endif
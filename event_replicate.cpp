@@ -0,0 +1,554 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <syslog.h>
+#include <unistd.h>
+#include "crc32c.hpp"
+#include "message.hpp"
+
+/*****************************************************************************/
+/* Log shipping to a standby.                                                */
+/*                                                                           */
+/* The replica connects and says which store it last followed and how far, */
+/* in that store's change journal numbers.  If that is this store and the   */
+/* journal still reaches back there, the primary carries on from it;        */
+/* otherwise it sends a resync, every logid it holds followed by each of    */
+/* those records and a SYNCED mark, and carries on from the journal number */
+/* taken before the listing.  After that every journal entry goes out in   */
+/* order, a batch at a time, as the record itself or as a deletion.  None  */
+/* of it happens while a caller waits: the daemon calls                     */
+/* replication_process() once the loop has nothing more urgent to do.      */
+/*                                                                           */
+/* The replica applies each frame to its own store under the same logid    */
+/* and timestamp, syncs once per read and then acknowledges the last        */
+/* change applied, which it also records in MESSAGE_REPL_FILE.  A change   */
+/* applied twice after a reconnect finds the same record already there or  */
+/* a deletion with nothing to delete, so replaying from an older position  */
+/* is harmless.  Every applied change is queued for message_next_change()  */
+/* so dbus on the replica follows along.  The primary has already admitted */
+/* each record, so the replica's own quotas, reservations and maxlogs do   */
+/* not apply to it, though it still has to fit within the replica's        */
+/* maxsize.  A record the replica cannot parse, fit or store drops the     */
+/* link before its change counts as applied, and the primary sends it      */
+/* again from the last acknowledged change once the link is back.          */
+/*****************************************************************************/
+
+const uint32_t g_repl_state_magic = 0x53504552; // REPS
+const uint32_t g_repl_version     = 1;
+
+// journal entries, and records read, per round
+const size_t g_repl_batch = 32;
+
+// bytes queued for the socket before the primary waits for it to drain
+const size_t g_repl_window = 256 * 1024;
+
+/* Payload of REPL_HELLO */
+struct repl_hello_t {
+	uint64_t source;   // repl_state_t.source of the replica
+	uint32_t version;
+	uint32_t reserved;
+};
+
+/* Payload of REPL_PUT, the strings with their NULs and the debug data */
+/* follow in this order                                                 */
+struct repl_record_t {
+	uint64_t timestamp;
+	uint32_t debugdatalen;
+	uint16_t messagelen;
+	uint16_t severitylen;
+	uint16_t associationlen;
+	uint16_t reportedbylen;
+};
+
+
+static uint32_t state_crc(const repl_state_t &s)
+{
+	return crc32c(0, &s.self, sizeof(s) - offsetof(repl_state_t, self));
+}
+
+/* Reads MESSAGE_REPL_FILE, giving the store an identity the first time */
+template <class Store>
+void basic_event_manager<Store>::repl_load(void)
+{
+	repl_state_t st;
+
+	if (repl.state.self)
+		return;
+
+	if (store.dirfd() >= 0)
+		repl.statefd = openat(store.dirfd(), MESSAGE_REPL_FILE,
+				      O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+
+	if (repl.statefd >= 0 &&
+	    pread(repl.statefd, &st, sizeof(st), 0) == sizeof(st) &&
+	    st.magic == g_repl_state_magic && st.crc == state_crc(st))
+		repl.state = st;
+
+	while (!repl.state.self) {
+		random_device rd;
+
+		repl.state.self = (uint64_t) rd() << 32 | rd();
+		repl_save();
+	}
+
+	account_meta();
+
+	return;
+}
+
+/* Not synced by itself, repl_commit() syncs the records it describes */
+/* first and an older position only means replaying a little          */
+template <class Store>
+void basic_event_manager<Store>::repl_save(void)
+{
+	repl.state.magic = g_repl_state_magic;
+	repl.state.crc   = state_crc(repl.state);
+
+	if (repl.statefd >= 0 &&
+	    pwrite(repl.statefd, &repl.state, sizeof(repl.state), 0) !=
+	    sizeof(repl.state))
+		syslog(LOG_ERR, "could not write %s: %s", MESSAGE_REPL_FILE,
+		       strerror(errno));
+
+	return;
+}
+
+template <class Store>
+int basic_event_manager<Store>::replicate_to(int fd)
+{
+	// without the journal nothing after the first listing could follow
+	if (!journal.slots()) {
+		syslog(LOG_ERR, "no change journal, cannot replicate");
+		return -1;
+	}
+
+	replication_stop();
+	repl_load();
+
+	repl.link.attach(fd);
+	repl.primary = true;
+
+	return 0;
+}
+
+template <class Store>
+int basic_event_manager<Store>::replicate_from(int fd)
+{
+	repl_hello_t h;
+
+	replication_stop();
+	repl_load();
+
+	repl.link.attach(fd);
+	repl.primary = false;
+
+	memset(&h, 0, sizeof(h));
+	h.source  = repl.state.source;
+	h.version = g_repl_version;
+
+	struct iovec iov = { &h, sizeof(h) };
+	repl.link.queue(REPL_HELLO, repl.state.applied, 0, &iov, 1);
+
+	if (!repl.link.flush()) {
+		replication_stop();
+		return -1;
+	}
+
+	return 0;
+}
+
+template <class Store>
+void basic_event_manager<Store>::replication_stop(void)
+{
+	repl.link.close();
+	repl.hello = false;
+	repl.resyncing = false;
+	repl.resync.clear();
+	repl.resyncpos = 0;
+	repl.pending = 0;
+
+	return;
+}
+
+template <class Store>
+const repl_stats_t &basic_event_manager<Store>::replication_stats(void)
+{
+	repl.stats.applied = repl.state.applied;
+
+	return repl.stats;
+}
+
+template <class Store>
+int basic_event_manager<Store>::replication_process(void)
+{
+	const uint8_t *payload;
+	repl_frame_t f;
+	bool alive, ok = true;
+	size_t frames = 0;
+	int r = 0;
+
+	if (!repl.link.is_open())
+		return -1;
+
+	alive = repl.link.fill();
+
+	while (ok && (r = repl.link.next(&f, &payload)) > 0) {
+		ok = repl.primary ? repl_primary_frame(f, payload)
+				  : repl_replica_frame(f, payload);
+		frames++;
+	}
+
+	if (!ok || r < 0) {
+		syslog(LOG_ERR, "replication stream damaged, dropping it");
+		alive = false;
+	}
+
+	if (repl.primary)
+		repl_ship();
+	else if (frames)
+		repl_commit();
+
+	if (!repl.link.flush() || !alive) {
+		syslog(LOG_WARNING, "replication link closed");
+		replication_stop();
+		return -1;
+	}
+
+	return repl.link.queued() ? 1 : 0;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::repl_primary_frame(const repl_frame_t &f,
+						    const uint8_t *payload)
+{
+	vector<journal_entry_t> probe;
+	repl_hello_t h;
+	uint64_t next;
+
+	switch (f.type) {
+	case REPL_HELLO:
+		if (f.len != sizeof(h))
+			return false;
+		memcpy(&h, payload, sizeof(h));
+
+		if (h.version != g_repl_version) {
+			syslog(LOG_ERR, "replica speaks version %u, not %u",
+			       h.version, g_repl_version);
+			return false;
+		}
+
+		repl.hello = true;
+
+		if (h.source == repl.state.self &&
+		    (f.seq == journal.last() ||
+		     changes_since(f.seq, 1, probe, &next))) {
+			syslog(LOG_INFO, "replica connected at change %llu",
+			       (unsigned long long) f.seq);
+			repl.stats.shipped = repl.stats.acked = f.seq;
+		} else {
+			syslog(LOG_INFO, "replica connected, resyncing it");
+			repl_resync_start();
+		}
+		return true;
+
+	case REPL_ACK:
+		repl.stats.acked = max(repl.stats.acked, f.seq);
+		return true;
+	}
+
+	return false;
+}
+
+/* Lists every record, the journal number first so no change can slip */
+/* in between unseen                                                   */
+template <class Store>
+void basic_event_manager<Store>::repl_resync_start(void)
+{
+	vector<uint16_t> ids;
+
+	repl.resyncseq = journal.last();
+	filter_logs(event_filter_all(), ids);
+
+	struct iovec iov[] = {
+		{ &repl.state.self, sizeof(repl.state.self) },
+		{ ids.data(),       ids.size() * sizeof(uint16_t) },
+	};
+	repl.link.queue(REPL_RESYNC, repl.resyncseq, 0, iov, 2);
+
+	repl.resync.swap(ids);
+	repl.resyncpos = 0;
+	repl.resyncing = true;
+	repl.stats.resyncs++;
+
+	return;
+}
+
+static uint16_t text_len(const char *s)
+{
+	return strlen(s) + 1;
+}
+
+template <class Store>
+void basic_event_manager<Store>::repl_put(uint64_t seq,
+					  const event_record_t *rec)
+{
+	repl_record_t r;
+
+	memset(&r, 0, sizeof(r));
+	r.timestamp      = rec->timestamp;
+	r.debugdatalen   = rec->n;
+	r.messagelen     = text_len(rec->message);
+	r.severitylen    = text_len(rec->severity);
+	r.associationlen = text_len(rec->association);
+	r.reportedbylen  = text_len(rec->reportedby);
+
+	struct iovec iov[] = {
+		{ &r,               sizeof(r) },
+		{ rec->message,     r.messagelen },
+		{ rec->severity,    r.severitylen },
+		{ rec->association, r.associationlen },
+		{ rec->reportedby,  r.reportedbylen },
+		{ rec->p,           rec->n },
+	};
+	repl.link.queue(REPL_PUT, seq, rec->logid, iov, 6);
+	repl.stats.records++;
+
+	return;
+}
+
+/* Queues changes until the window is full or there are none left, a */
+/* batch of records read with one open_logs() at a time               */
+template <class Store>
+void basic_event_manager<Store>::repl_ship(void)
+{
+	vector<journal_entry_t> batch;
+	event_record_t *recs[g_repl_batch];
+	uint16_t ids[g_repl_batch];
+	uint64_t next;
+	size_t i, n;
+
+	while (repl.hello && repl.link.queued() < g_repl_window) {
+		if (repl.resyncing) {
+			n = min(g_repl_batch,
+				repl.resync.size() - repl.resyncpos);
+			open_logs(&repl.resync[repl.resyncpos], n, recs);
+
+			// one that went meanwhile has its deletion coming
+			for (i = 0; i < n; i++) {
+				if (recs[i]) {
+					repl_put(repl.resyncseq, recs[i]);
+					close(recs[i]);
+				}
+			}
+
+			repl.resyncpos += n;
+			if (repl.resyncpos < repl.resync.size())
+				continue;
+
+			repl.link.queue(REPL_SYNCED, repl.resyncseq, 0,
+					NULL, 0);
+			repl.stats.shipped = repl.resyncseq;
+			repl.resync.clear();
+			repl.resyncing = false;
+			continue;
+		}
+
+		if (repl.stats.shipped == journal.last())
+			break;
+
+		if (!changes_since(repl.stats.shipped, g_repl_batch, batch,
+				   &next)) {
+			syslog(LOG_WARNING, "replica fell out of the change "
+			       "journal, resyncing it");
+			repl_resync_start();
+			continue;
+		}
+
+		for (i = n = 0; i < batch.size(); i++)
+			if (batch[i].op == MESSAGE_LOG_ADDED)
+				ids[n++] = batch[i].logid;
+
+		open_logs(ids, n, recs);
+
+		// an added record that is gone by now goes as its deletion
+		for (i = n = 0; i < batch.size(); i++) {
+			const journal_entry_t &e = batch[i];
+			event_record_t *rec = NULL;
+
+			if (e.op == MESSAGE_LOG_ADDED)
+				rec = recs[n++];
+
+			if (rec) {
+				repl_put(e.seq, rec);
+				close(rec);
+			} else {
+				repl.link.queue(REPL_DEL, e.seq, e.logid,
+						NULL, 0);
+			}
+		}
+
+		repl.stats.shipped = batch.back().seq;
+	}
+
+	return;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::repl_replica_frame(const repl_frame_t &f,
+						    const uint8_t *payload)
+{
+	vector<uint16_t> held, keep;
+	uint64_t source;
+
+	switch (f.type) {
+	case REPL_RESYNC:
+		if (f.len < sizeof(source) || (f.len - sizeof(source)) % 2)
+			return false;
+		memcpy(&source, payload, sizeof(source));
+
+		keep.resize((f.len - sizeof(source)) / 2);
+		memcpy(keep.data(), payload + sizeof(source),
+		       f.len - sizeof(source));
+		sort(keep.begin(), keep.end());
+
+		// whatever the primary does not have goes now, the rest
+		// follows as records.  Until SYNCED this store is not a
+		// copy of anything, should the link drop half way.
+		filter_logs(event_filter_all(), held);
+		for (uint16_t id : held)
+			if (!binary_search(keep.begin(), keep.end(), id))
+				repl_apply_del(id);
+
+		repl.pending       = source;
+		repl.state.source  = 0;
+		repl.state.applied = 0;
+		repl.stats.resyncs++;
+		break;
+
+	case REPL_PUT:
+		if (!repl_apply_put(f.logid, payload, f.len))
+			return false;
+		break;
+
+	case REPL_DEL:
+		repl_apply_del(f.logid);
+		break;
+
+	case REPL_SYNCED:
+		if (!repl.pending)
+			return false;
+		repl.state.source = repl.pending;
+		repl.pending      = 0;
+		break;
+
+	default:
+		return false;
+	}
+
+	if (!repl.pending)
+		repl.state.applied = f.seq;
+
+	return true;
+}
+
+/* False if the record is malformed or could not be stored */
+template <class Store>
+bool basic_event_manager<Store>::repl_apply_put(uint16_t logid,
+						const uint8_t *payload,
+						size_t len)
+{
+	event_record_t rec;
+	repl_record_t r;
+	int row;
+
+	if (len < sizeof(r))
+		return false;
+	memcpy(&r, payload, sizeof(r));
+
+	const char *s[4];
+	const uint16_t lens[] = { r.messagelen, r.severitylen,
+				  r.associationlen, r.reportedbylen };
+	size_t off = sizeof(r);
+
+	for (int i = 0; i < 4; i++) {
+		if (!lens[i] || off + lens[i] > len ||
+		    payload[off + lens[i] - 1] != 0) {
+			syslog(LOG_ERR, "malformed replicated event %u", logid);
+			return false;
+		}
+		s[i] = (const char*) payload + off;
+		off += lens[i];
+	}
+
+	if (off + r.debugdatalen != len) {
+		syslog(LOG_ERR, "malformed replicated event %u", logid);
+		return false;
+	}
+
+	// sent again after a reconnect, nothing to do
+	row = table.find(logid);
+	if (row >= 0 && table.timestamp(row) == (time_t) r.timestamp)
+		return true;
+
+	if (row >= 0)
+		repl_apply_del(logid);
+
+	rec.message     = (char*) s[0];
+	rec.severity    = (char*) s[1];
+	rec.association = (char*) s[2];
+	rec.reportedby  = (char*) s[3];
+	rec.p           = (uint8_t*) payload + off;
+	rec.n           = r.debugdatalen;
+	rec.logid       = logid;
+	rec.timestamp   = r.timestamp;
+
+	if (!create_log_event(&rec, true)) {
+		syslog(LOG_ERR, "could not store replicated event %u", logid);
+		return false;
+	}
+
+	note_log_id(logid);
+	changes.emplace_back(MESSAGE_LOG_ADDED, logid);
+	repl.stats.records++;
+
+	return true;
+}
+
+template <class Store>
+void basic_event_manager<Store>::repl_apply_del(uint16_t logid)
+{
+	if (table.find(logid) < 0)
+		return;
+
+	remove(logid);
+	changes.emplace_back(MESSAGE_LOG_REMOVED, logid);
+
+	return;
+}
+
+/* Makes what was applied durable, then tells the primary */
+template <class Store>
+void basic_event_manager<Store>::repl_commit(void)
+{
+	if (!staged.empty())
+		flush();
+	else
+		store.sync();
+
+	collect_blobs();
+	publish();
+	repl_save();
+
+	if (repl.pending || repl.state.applied == repl.stats.acked)
+		return;
+
+	repl.link.queue(REPL_ACK, repl.state.applied, 0, NULL, 0);
+	repl.stats.acked = repl.state.applied;
+
+	return;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
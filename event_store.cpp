@@ -0,0 +1,261 @@
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "event_store.hpp"
+
+using namespace std;
+
+
+file_store::file_store() : fd(-1)
+{
+}
+
+file_store::~file_store()
+{
+	close();
+}
+
+bool file_store::open(const string &path)
+{
+	close();
+
+	fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+
+	return fd >= 0;
+}
+
+void file_store::close(void)
+{
+	if (fd >= 0)
+		::close(fd);
+
+	fd = -1;
+
+	return;
+}
+
+/* A single pwritev() straight from the caller's buffers */
+ssize_t file_store::write(uint16_t logid, const struct iovec *iov, int iovcnt)
+{
+	char name[8];
+	size_t len = 0;
+	ssize_t n;
+	int wfd, err;
+
+	log_name(logid, name);
+
+	for (int i = 0; i < iovcnt; i++)
+		len += iov[i].iov_len;
+
+	wfd = openat(fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+	if (wfd < 0)
+		return -1;
+
+	n = pwritev(wfd, iov, iovcnt, 0);
+	err = n < 0 ? errno : EIO;
+	::close(wfd);
+
+	if (n != (ssize_t) len) {
+		unlinkat(fd, name, 0);
+		errno = err;
+		return -1;
+	}
+
+	return n;
+}
+
+/* One open, fstat and read, into a block the caller frees */
+uint8_t *file_store::load(uint16_t logid, size_t room, size_t *len)
+{
+	struct stat st;
+	char name[8];
+	uint8_t *block;
+	ssize_t n;
+	int rfd;
+
+	log_name(logid, name);
+
+	rfd = openat(fd, name, O_RDONLY | O_CLOEXEC);
+	if (rfd < 0)
+		return NULL;
+
+	if (fstat(rfd, &st) < 0) {
+		::close(rfd);
+		return NULL;
+	}
+
+	block = new uint8_t[room + st.st_size];
+	n = ::read(rfd, block + room, st.st_size);
+	::close(rfd);
+
+	if (n != st.st_size) {
+		delete[] block;
+		return NULL;
+	}
+
+	*len = st.st_size;
+
+	return block;
+}
+
+bool file_store::peek(uint16_t logid, void *buf, size_t n, size_t *len)
+{
+	struct stat st;
+	char name[8];
+	int rfd;
+	bool ok;
+
+	log_name(logid, name);
+
+	rfd = openat(fd, name, O_RDONLY | O_CLOEXEC);
+	if (rfd < 0)
+		return false;
+
+	ok = ::read(rfd, buf, n) == (ssize_t) n;
+
+	if (ok && len)
+		*len = fstat(rfd, &st) == 0 ? st.st_size : 0;
+
+	::close(rfd);
+
+	return ok;
+}
+
+ssize_t file_store::size(uint16_t logid)
+{
+	struct stat st;
+	char name[8];
+
+	log_name(logid, name);
+
+	if (fstatat(fd, name, &st, 0) < 0)
+		return -1;
+
+	return st.st_size;
+}
+
+int file_store::unlink(uint16_t logid)
+{
+	char name[8];
+
+	log_name(logid, name);
+
+	return unlinkat(fd, name, 0);
+}
+
+void file_store::sync(void)
+{
+	syncfs(fd);
+
+	return;
+}
+
+
+uint16_t memory_store::scan_type::next_log(void)
+{
+	if (!store)
+		return 0;
+
+	auto it = store->records.upper_bound(pos);
+
+	// closes itself at the end, as a dir_scan does
+	if (it == store->records.end()) {
+		close();
+		return 0;
+	}
+
+	pos = it->first;
+
+	return pos;
+}
+
+// nothing to open, the records only ever live in memory
+bool memory_store::open(const string &)
+{
+	records.clear();
+
+	return true;
+}
+
+void memory_store::close(void)
+{
+	records.clear();
+
+	return;
+}
+
+bool memory_store::open_scan(scan_type &s) const
+{
+	s.store = this;
+	s.pos   = 0;
+
+	return true;
+}
+
+ssize_t memory_store::write(uint16_t logid, const struct iovec *iov, int iovcnt)
+{
+	vector<uint8_t> &image = records[logid];
+
+	image.clear();
+
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *base = (const uint8_t*) iov[i].iov_base;
+
+		image.insert(image.end(), base, base + iov[i].iov_len);
+	}
+
+	return image.size();
+}
+
+uint8_t *memory_store::load(uint16_t logid, size_t room, size_t *len)
+{
+	auto it = records.find(logid);
+	uint8_t *block;
+
+	if (it == records.end())
+		return NULL;
+
+	block = new uint8_t[room + it->second.size()];
+	memcpy(block + room, it->second.data(), it->second.size());
+	*len = it->second.size();
+
+	return block;
+}
+
+bool memory_store::peek(uint16_t logid, void *buf, size_t n, size_t *len)
+{
+	auto it = records.find(logid);
+
+	if (it == records.end() || it->second.size() < n)
+		return false;
+
+	memcpy(buf, it->second.data(), n);
+	if (len)
+		*len = it->second.size();
+
+	return true;
+}
+
+ssize_t memory_store::size(uint16_t logid)
+{
+	auto it = records.find(logid);
+
+	if (it == records.end()) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return it->second.size();
+}
+
+int memory_store::unlink(uint16_t logid)
+{
+	if (!records.erase(logid)) {
+		errno = ENOENT;
+		return -1;
+	}
+
+	return 0;
+}
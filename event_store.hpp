@@ -0,0 +1,104 @@
+#ifndef __EVENT_STORE_HPP__
+#define __EVENT_STORE_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <string>
+#include <vector>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "dir_scan.hpp"
+
+/*****************************************************************************/
+/* Where basic_event_manager keeps its records.  The store is a template    */
+/* parameter, so every call below is a direct call the compiler can see     */
+/* through, with no vtable in the way.  A store provides:                   */
+/*                                                                           */
+/*   record_files    true when each record is the file log_name(logid) in   */
+/*                   dirfd(); the io_uring batches, fsck and the inotify    */
+/*                   watch work on those files and are left out otherwise   */
+/*   scan_type       a listing with next_log(), close() and is_open()       */
+/*                                                                           */
+/*   open(path)      false if the store cannot be used at all               */
+/*   close()                                                                */
+/*   dirfd()         directory for the dictionary, blobs, archive and       */
+/*                   journal, -1 to go without them                         */
+/*   open_scan(s)    starts a listing of every record                       */
+/*   write(id, iov)  stores a whole record, replacing any old one, and      */
+/*                   returns its length; on failure returns -1 with errno   */
+/*                   set and leaves nothing behind                          */
+/*   load(id, room, &len)  a new[]ed block of room bytes followed by the    */
+/*                   record, NULL if it is missing or could not be read     */
+/*   peek(id, buf, n, &len) the first n bytes and the record's length       */
+/*   size(id)        the record's length, -1 if there is none               */
+/*   unlink(id)      0, or -1 with errno set                                */
+/*   sync()          makes every write so far durable                       */
+/*                                                                           */
+/* A new on-disk format is another class with these members, instantiated  */
+/* alongside the others at the end of each file defining basic_event_       */
+/* manager members.                                                         */
+/*****************************************************************************/
+
+/* The layout the daemon has always used, one file per record */
+class file_store {
+	int fd;
+
+public:
+	static const bool record_files = true;
+	typedef dir_scan scan_type;
+
+	file_store();
+	~file_store();
+	file_store(const file_store &) = delete;
+	file_store &operator=(const file_store &) = delete;
+
+	bool    open(const std::string &path);
+	void    close(void);
+	int     dirfd(void) const { return fd; }
+	bool    open_scan(scan_type &s) const { return s.open(fd); }
+
+	ssize_t  write(uint16_t logid, const struct iovec *iov, int iovcnt);
+	uint8_t *load(uint16_t logid, size_t room, size_t *len);
+	bool     peek(uint16_t logid, void *buf, size_t n, size_t *len);
+	ssize_t  size(uint16_t logid);
+	int      unlink(uint16_t logid);
+	void     sync(void);
+};
+
+/* Records held in memory for as long as the store is open, for tests */
+/* and benchmarks that should not depend on a filesystem               */
+class memory_store {
+	std::map<uint16_t, std::vector<uint8_t>> records;
+
+public:
+	static const bool record_files = false;
+
+	class scan_type {
+		const memory_store *store;
+		uint16_t pos;
+
+		friend class memory_store;
+
+	public:
+		scan_type() : store(NULL), pos(0) {}
+
+		void     close(void) { store = NULL; }
+		bool     is_open(void) const { return store != NULL; }
+		uint16_t next_log(void);
+	};
+
+	bool    open(const std::string &path);
+	void    close(void);
+	int     dirfd(void) const { return -1; }
+	bool    open_scan(scan_type &s) const;
+
+	ssize_t  write(uint16_t logid, const struct iovec *iov, int iovcnt);
+	uint8_t *load(uint16_t logid, size_t room, size_t *len);
+	bool     peek(uint16_t logid, void *buf, size_t n, size_t *len);
+	ssize_t  size(uint16_t logid);
+	int      unlink(uint16_t logid);
+	void     sync(void) {}
+};
+
+#endif
@@ -0,0 +1,427 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <limits>
+#include "event_table.hpp"
+
+using namespace std;
+
+uint16_t string_table::intern(const char *s)
+{
+	auto it = codes.find(s);
+
+	if (it != codes.end())
+		return it->second;
+
+	uint16_t code = (uint16_t) strings.size();
+	strings.emplace_back(s);
+	codes.emplace(strings.back(), code);
+
+	return code;
+}
+
+int string_table::lookup(const char *s) const
+{
+	auto it = codes.find(s);
+
+	return (it == codes.end()) ? -1 : it->second;
+}
+
+const char *string_table::str(uint16_t code) const
+{
+	return (code < strings.size()) ? strings[code].c_str() : "";
+}
+
+size_t string_table::size(void) const
+{
+	return strings.size();
+}
+
+
+/* Timestamps are held as unsigned 32 bit seconds, which is good until */
+/* 2106 and keeps the column scans in 32 bit lanes                     */
+static inline uint32_t clamp_time(time_t t)
+{
+	if (t < 0)
+		return 0;
+	if ((uint64_t) t > UINT32_MAX)
+		return UINT32_MAX;
+	return (uint32_t) t;
+}
+
+event_filter_t event_filter_all(void)
+{
+	return event_filter_t{0, 0, g_filter_any, g_filter_any};
+}
+
+
+event_table::event_table()
+{
+	rows = 0;
+}
+
+/* Chunk holding row, which must exist */
+size_t event_table::chunk_of(size_t row) const
+{
+	return upper_bound(starts.begin(), starts.end(), row) - starts.begin() - 1;
+}
+
+/* Chunk c, cloned first if a copy of the table still holds it.  The  */
+/* count of a shared chunk only drops behind our back, never rises,   */
+/* so a count of one means it is ours; the fence orders our writes    */
+/* after the reads of whoever let go of it last.                      */
+table_chunk &event_table::writable(size_t c)
+{
+	if (chunks[c].use_count() > 1)
+		chunks[c] = make_shared<table_chunk>(*chunks[c]);
+	else
+		atomic_thread_fence(memory_order_acquire);
+
+	return *chunks[c];
+}
+
+/* Recomputes starts from chunk c on, after rows came or went there */
+void event_table::renumber(size_t c)
+{
+	starts.resize(chunks.size());
+
+	for (; c < chunks.size(); c++)
+		starts[c] = c ? starts[c - 1] + chunks[c - 1]->n : 0;
+
+	return;
+}
+
+template <typename T>
+static inline void open_slot(T *col, size_t at, size_t n)
+{
+	memmove(col + at + 1, col + at, (n - at) * sizeof(T));
+}
+
+template <typename T>
+static inline void close_slot(T *col, size_t at, size_t n)
+{
+	memmove(col + at, col + at + 1, (n - at - 1) * sizeof(T));
+}
+
+template <typename T>
+static inline void move_rows(T *to, const T *from, size_t n)
+{
+	memcpy(to, from, n * sizeof(T));
+}
+
+void event_table::insert(uint16_t logid, time_t timestamp, uint16_t severity,
+			 uint16_t reporter, uint32_t size)
+{
+	size_t c = chunks.size() ? chunks.size() - 1 : 0;
+	size_t at;
+
+	// new ids come in ascending order, so this is normally an append
+	if (chunks.empty() ||
+	    (chunks[c]->n == g_table_chunk &&
+	     chunks[c]->logids[g_table_chunk - 1] < logid)) {
+		chunks.push_back(make_shared<table_chunk>());
+		chunks.back()->n = 0;
+		c = chunks.size() - 1;
+	} else if (chunks[c]->logids[chunks[c]->n - 1] > logid) {
+		while (c && chunks[c]->logids[0] > logid)
+			c--;
+	}
+
+	// a full chunk in the middle is split, the upper half moving on
+	if (chunks[c]->n == g_table_chunk) {
+		table_chunk &full = writable(c);
+		auto upper = make_shared<table_chunk>();
+		size_t half = g_table_chunk / 2;
+
+		upper->n = g_table_chunk - half;
+		move_rows(upper->logids, full.logids + half, upper->n);
+		move_rows(upper->timestamps, full.timestamps + half, upper->n);
+		move_rows(upper->severities, full.severities + half, upper->n);
+		move_rows(upper->reporters, full.reporters + half, upper->n);
+		move_rows(upper->sizes, full.sizes + half, upper->n);
+		full.n = half;
+
+		chunks.insert(chunks.begin() + c + 1, upper);
+		if (logid > full.logids[half - 1])
+			c++;
+	}
+
+	table_chunk &k = writable(c);
+
+	at = lower_bound(k.logids, k.logids + k.n, logid) - k.logids;
+
+	open_slot(k.logids, at, k.n);
+	open_slot(k.timestamps, at, k.n);
+	open_slot(k.severities, at, k.n);
+	open_slot(k.reporters, at, k.n);
+	open_slot(k.sizes, at, k.n);
+
+	k.logids[at]     = logid;
+	k.timestamps[at] = clamp_time(timestamp);
+	k.severities[at] = severity;
+	k.reporters[at]  = reporter;
+	k.sizes[at]      = size;
+	k.n++;
+
+	rows++;
+	renumber(c);
+
+	return;
+}
+
+bool event_table::erase(uint16_t logid)
+{
+	int row = find(logid);
+	size_t c, at;
+
+	if (row < 0)
+		return false;
+
+	c  = chunk_of(row);
+	at = row - starts[c];
+
+	table_chunk &k = writable(c);
+
+	close_slot(k.logids, at, k.n);
+	close_slot(k.timestamps, at, k.n);
+	close_slot(k.severities, at, k.n);
+	close_slot(k.reporters, at, k.n);
+	close_slot(k.sizes, at, k.n);
+	k.n--;
+
+	// a chunk that ran dry goes, one that ran low takes in the next
+	if (k.n == 0) {
+		chunks.erase(chunks.begin() + c);
+	} else if (k.n < g_table_chunk / 4 && c + 1 < chunks.size() &&
+		   k.n + chunks[c + 1]->n <= g_table_chunk) {
+		const table_chunk &next = *chunks[c + 1];
+
+		move_rows(k.logids + k.n, next.logids, next.n);
+		move_rows(k.timestamps + k.n, next.timestamps, next.n);
+		move_rows(k.severities + k.n, next.severities, next.n);
+		move_rows(k.reporters + k.n, next.reporters, next.n);
+		move_rows(k.sizes + k.n, next.sizes, next.n);
+		k.n += next.n;
+
+		chunks.erase(chunks.begin() + c + 1);
+	}
+
+	rows--;
+	renumber(c);
+
+	return true;
+}
+
+void event_table::clear(void)
+{
+	chunks.clear();
+	starts.clear();
+	rows = 0;
+
+	return;
+}
+
+size_t event_table::size(void) const
+{
+	return rows;
+}
+
+size_t event_table::total_bytes(void) const
+{
+	size_t total = 0;
+
+	for (auto &k : chunks)
+		for (size_t i = 0; i < k->n; i++)
+			total += k->sizes[i];
+
+	return total;
+}
+
+int event_table::find(uint16_t logid) const
+{
+	size_t lo = 0, hi = chunks.size();
+
+	// last chunk starting at or below logid
+	while (hi - lo > 1) {
+		size_t mid = (lo + hi) / 2;
+
+		if (chunks[mid]->logids[0] <= logid)
+			lo = mid;
+		else
+			hi = mid;
+	}
+
+	if (chunks.empty())
+		return -1;
+
+	const table_chunk &k = *chunks[lo];
+	const uint16_t *it = lower_bound(k.logids, k.logids + k.n, logid);
+
+	if (it == k.logids + k.n || *it != logid)
+		return -1;
+
+	return starts[lo] + (it - k.logids);
+}
+
+uint16_t event_table::logid(size_t row) const
+{
+	size_t c = chunk_of(row);
+	return chunks[c]->logids[row - starts[c]];
+}
+
+time_t event_table::timestamp(size_t row) const
+{
+	size_t c = chunk_of(row);
+	return chunks[c]->timestamps[row - starts[c]];
+}
+
+uint16_t event_table::severity(size_t row) const
+{
+	size_t c = chunk_of(row);
+	return chunks[c]->severities[row - starts[c]];
+}
+
+uint16_t event_table::reporter(size_t row) const
+{
+	size_t c = chunk_of(row);
+	return chunks[c]->reporters[row - starts[c]];
+}
+
+uint32_t event_table::bytes(size_t row) const
+{
+	size_t c = chunk_of(row);
+	return chunks[c]->sizes[row - starts[c]];
+}
+
+void event_table::set_bytes(size_t row, uint32_t size)
+{
+	size_t c = chunk_of(row);
+
+	writable(c).sizes[row - starts[c]] = size;
+
+	return;
+}
+
+
+/* The scans below avoid branches in the loop body; every predicate */
+/* is evaluated for every row and combined with '&'.  An unused code  */
+/* predicate gets a zero mask, turning it into an always true         */
+/* (x & 0) == 0 compare.  Rows are scanned in fixed size blocks so    */
+/* the inner loops have a constant trip count, which is what lets     */
+/* the vectorizer take them at -O2.                                   */
+static const size_t scan_block = 64;
+
+struct scan_bounds {
+	uint32_t lo, hi;
+	uint16_t sevmask, sev;
+	uint16_t repmask, rep;
+
+	scan_bounds(const event_filter_t &f)
+	{
+		lo      = clamp_time(f.since);
+		hi      = f.until ? clamp_time(f.until) : UINT32_MAX;
+		sevmask = (f.severity == g_filter_any) ? 0 : 0xffff;
+		sev     = f.severity & sevmask;
+		repmask = (f.reporter == g_filter_any) ? 0 : 0xffff;
+		rep     = f.reporter & repmask;
+	}
+};
+
+static inline uint8_t row_match(const scan_bounds &b, uint32_t ts,
+				uint16_t sv, uint16_t rp)
+{
+	return (ts >= b.lo) & (ts <= b.hi) &
+	       ((sv & b.sevmask) == b.sev) &
+	       ((rp & b.repmask) == b.rep);
+}
+
+static size_t count_rows(const scan_bounds &b, const table_chunk &k)
+{
+	const uint32_t *ts = k.timestamps;
+	const uint16_t *sv = k.severities;
+	const uint16_t *rp = k.reporters;
+	const size_t    n  = k.n;
+	size_t hits = 0;
+	size_t i = 0;
+
+	for (; i + scan_block <= n; i += scan_block) {
+		uint32_t blockhits = 0;
+
+		for (size_t j = i; j < i + scan_block; j++)
+			blockhits += row_match(b, ts[j], sv[j], rp[j]);
+
+		hits += blockhits;
+	}
+
+	for (; i < n; i++)
+		hits += row_match(b, ts[i], sv[i], rp[i]);
+
+	return hits;
+}
+
+static size_t filter_rows(const scan_bounds &b, const table_chunk &k,
+			  vector<uint16_t> &ids)
+{
+	const uint16_t *id = k.logids;
+	const uint32_t *ts = k.timestamps;
+	const uint16_t *sv = k.severities;
+	const uint16_t *rp = k.reporters;
+	const size_t    n  = k.n;
+	uint8_t hit[scan_block];
+	size_t hits = 0;
+
+	for (size_t i = 0; i < n; i += scan_block) {
+		size_t len = min(scan_block, n - i);
+
+		// vectorized predicate pass, then a cheap compaction
+		if (len == scan_block) {
+			for (size_t j = 0; j < scan_block; j++)
+				hit[j] = row_match(b, ts[i+j], sv[i+j], rp[i+j]);
+		} else {
+			for (size_t j = 0; j < len; j++)
+				hit[j] = row_match(b, ts[i+j], sv[i+j], rp[i+j]);
+		}
+
+		for (size_t j = 0; j < len; j++) {
+			if (hit[j]) {
+				ids.push_back(id[i+j]);
+				hits++;
+			}
+		}
+	}
+
+	return hits;
+}
+
+static bool filter_empty(const event_filter_t &f)
+{
+	return f.severity == g_filter_none || f.reporter == g_filter_none;
+}
+
+size_t event_table::count(const event_filter_t &f) const
+{
+	const scan_bounds b(f);
+	size_t hits = 0;
+
+	if (filter_empty(f))
+		return 0;
+
+	for (auto &k : chunks)
+		hits += count_rows(b, *k);
+
+	return hits;
+}
+
+size_t event_table::filter(const event_filter_t &f, vector<uint16_t> &ids) const
+{
+	const scan_bounds b(f);
+	size_t hits = 0;
+
+	if (filter_empty(f))
+		return 0;
+
+	for (auto &k : chunks)
+		hits += filter_rows(b, *k, ids);
+
+	return hits;
+}
@@ -0,0 +1,94 @@
+#ifndef __EVENT_TABLE_HPP__
+#define __EVENT_TABLE_HPP__
+
+#include <cstdint>
+#include <ctime>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Interns the handful of distinct strings (severities, reporters)    */
+/* seen in records so the metadata table can hold small integer codes */
+class string_table {
+	std::vector<std::string> strings;
+	std::unordered_map<std::string, uint16_t> codes;
+
+public:
+	uint16_t    intern(const char *s);
+	int         lookup(const char *s) const; // -1 if never interned
+	const char *str(uint16_t code) const;
+	size_t      size(void) const;
+};
+
+/* Codes a filter takes besides the real ones: g_filter_none is what */
+/* a severity or reporter never seen resolves to, and matches nothing */
+const int g_filter_any  = -1;
+const int g_filter_none = -2;
+
+/* since/until of 0 are open ended, severity/reporter of g_filter_any */
+/* match any                                                          */
+struct event_filter_t {
+	time_t since;
+	time_t until;
+	int    severity;
+	int    reporter;
+};
+
+event_filter_t event_filter_all(void);
+
+/* A run of up to g_table_chunk consecutive rows of an event_table */
+const size_t g_table_chunk = 512;
+
+struct table_chunk {
+	size_t   n;
+	uint16_t logids[g_table_chunk];
+	uint32_t timestamps[g_table_chunk];
+	uint16_t severities[g_table_chunk];
+	uint16_t reporters[g_table_chunk];
+	uint32_t sizes[g_table_chunk];
+};
+
+/* Columnar copy of the metadata of every managed event, sorted by    */
+/* logid.  Each field lives in its own contiguous array so counting   */
+/* and filtering are straight line scans the compiler can vectorize   */
+/* instead of a decode of every record on disk.                       */
+/*                                                                    */
+/* The rows are split into refcounted chunks.  Copying a table only   */
+/* copies the chunk pointers, and a change to a chunk that another    */
+/* copy still holds clones that one chunk first, so a copy is a cheap */
+/* immutable snapshot that can be read on another thread while this  */
+/* one carries on changing.                                           */
+class event_table {
+	std::vector<std::shared_ptr<table_chunk>> chunks;
+	std::vector<size_t> starts; // first row of each chunk
+	size_t rows;
+
+	size_t       chunk_of(size_t row) const;
+	table_chunk &writable(size_t c);
+	void         renumber(size_t c);
+
+public:
+	event_table();
+
+	void   insert(uint16_t logid, time_t timestamp, uint16_t severity,
+		      uint16_t reporter, uint32_t size);
+	bool   erase(uint16_t logid);
+	void   clear(void);
+
+	size_t size(void) const;
+	size_t total_bytes(void) const;
+	int    find(uint16_t logid) const; // row or -1
+
+	uint16_t logid(size_t row) const;
+	time_t   timestamp(size_t row) const;
+	uint16_t severity(size_t row) const;
+	uint16_t reporter(size_t row) const;
+	uint32_t bytes(size_t row) const;
+	void     set_bytes(size_t row, uint32_t size);
+
+	size_t count(const event_filter_t &f) const;
+	size_t filter(const event_filter_t &f, std::vector<uint16_t> &ids) const;
+};
+
+#endif
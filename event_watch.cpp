@@ -0,0 +1,171 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/inotify.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "message.hpp"
+
+/*****************************************************************************/
+/* Records written into the store by other tools while we are running.     */
+/*                                                                           */
+/* An inotify watch on eventpath reports every file closed after writing,   */
+/* moved in, deleted or moved out.  Each event names exactly one record, so */
+/* it is applied on its own: a new or rewritten file is read and indexed,   */
+/* a vanished one is dropped from the table, and logcount, currentsize and  */
+/* latestid are adjusted by that one record.  The directory is never        */
+/* walked again.  Whatever dbus has to do about it is queued as a change    */
+/* for message_next_change().                                                */
+/*                                                                           */
+/* Our own writes raise the same events.  Each logid we write is noted in   */
+/* ownwrites and the close it causes is swallowed; our own removals are     */
+/* already gone from the table by the time their event is read.             */
+/*****************************************************************************/
+
+const uint32_t g_watch_mask = IN_CLOSE_WRITE | IN_MOVED_TO |
+			      IN_DELETE | IN_MOVED_FROM;
+
+
+template <class Store>
+int basic_event_manager<Store>::watch_start(void)
+{
+	if (watchfd >= 0)
+		return watchfd;
+
+	// nothing but this process can change a store without files
+	if (!Store::record_files)
+		return -1;
+
+	watchfd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (watchfd < 0) {
+		syslog(LOG_ERR, "inotify_init1 failed: %s", strerror(errno));
+		return -1;
+	}
+
+	if (inotify_add_watch(watchfd, eventpath.c_str(), g_watch_mask) < 0) {
+		syslog(LOG_ERR, "could not watch %s: %s",
+		       eventpath.c_str(), strerror(errno));
+		::close(watchfd);
+		watchfd = -1;
+	}
+
+	return watchfd;
+}
+
+/* Called before each write to a record file while the watch is running */
+template <class Store>
+void basic_event_manager<Store>::note_write(uint16_t logid)
+{
+	if (watchfd >= 0)
+		ownwrites.insert(logid);
+
+	return;
+}
+
+/* Reads every pending event, returns how many changes were queued */
+template <class Store>
+int basic_event_manager<Store>::watch_process(void)
+{
+	alignas(struct inotify_event) char buf[4096];
+	size_t before = changes.size();
+	ssize_t len;
+
+	if (watchfd < 0)
+		return 0;
+
+	while ((len = ::read(watchfd, buf, sizeof(buf))) > 0) {
+		const struct inotify_event *ev;
+
+		for (char *p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+			ev = (const struct inotify_event *) p;
+
+			if (ev->mask & IN_Q_OVERFLOW) {
+				// events were lost, only a full pass can recover
+				syslog(LOG_WARNING, "event store watch overflowed");
+				if (!fsckstate.active)
+					fsck_start();
+				continue;
+			}
+
+			if (ev->len)
+				watch_event(ev->mask, ev->name);
+		}
+	}
+
+	collect_blobs();
+	publish();
+
+	return changes.size() - before;
+}
+
+template <class Store>
+void basic_event_manager<Store>::watch_event(uint32_t mask, const char *name)
+{
+	event_record_t *rec;
+	uint16_t id;
+	size_t size;
+
+	if (!(id = parse_logid(name)))
+		return;
+
+	if (mask & (IN_DELETE | IN_MOVED_FROM)) {
+		// a staged record has no file yet and an archived one no
+		// longer has one, whatever went was not it
+		if (!staged.count(id) && !archived.count(id))
+			forget_log(id);
+		return;
+	}
+
+	if (ownwrites.erase(id))
+		return;
+
+	if (staged.count(id)) {
+		syslog(LOG_WARNING, "event %u written behind our back while "
+		       "staged, it will be overwritten", id);
+		return;
+	}
+
+	forget_log(id);
+
+	if (!read_log(id, &rec, &size, true))
+		return;
+
+	blob_ref_t ref;
+
+	index_log(rec, size,
+		  record_blob((uint8_t*) (rec + 1), rec, &ref) ? &ref : NULL);
+	close(rec);
+
+	currentsize += size;
+	logcount++;
+	note_log_id(id);
+
+	note_change(MESSAGE_LOG_ADDED, id);
+
+	return;
+}
+
+/* Drops a record whose file is gone or replaced, true if it was known */
+template <class Store>
+bool basic_event_manager<Store>::forget_log(uint16_t logid)
+{
+	int row = table.find(logid);
+
+	if (row < 0)
+		return false;
+
+	currentsize -= min(currentsize, (size_t) table.bytes(row));
+	if (logcount > 0)
+		logcount--;
+
+	archive_drop(logid);
+	unindex_log(logid);
+	note_change(MESSAGE_LOG_REMOVED, logid);
+
+	return true;
+}
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
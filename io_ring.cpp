@@ -0,0 +1,325 @@
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include "io_ring.hpp"
+
+#ifdef HAVE_IO_URING
+
+static int ring_setup(unsigned entries, io_uring_params *p)
+{
+	return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int ring_enter(int fd, unsigned submit, unsigned complete, unsigned flags)
+{
+	return syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int ring_register(int fd, unsigned op, void *arg, unsigned nargs)
+{
+	return syscall(__NR_io_uring_register, fd, op, arg, nargs);
+}
+
+static void *ring_map(int fd, size_t len, off_t offset)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_POPULATE, fd, offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+
+io_ring::io_ring() : fd(-1), entries(0), queued(0),
+		     sqring(NULL), cqring(NULL), sqlen(0), cqlen(0), sqeslen(0),
+		     sqes(NULL), cqes(NULL)
+{
+}
+
+io_ring::~io_ring()
+{
+	teardown();
+}
+
+bool io_ring::setup(unsigned depth)
+{
+	io_uring_params p;
+	uint8_t *sq, *cq;
+
+	teardown();
+	memset(&p, 0, sizeof(p));
+
+	fd = ring_setup(depth, &p);
+	if (fd < 0)
+		return false;
+
+	sqlen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cqlen = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sqlen = cqlen = sqlen > cqlen ? sqlen : cqlen;
+		sqring = ring_map(fd, sqlen, IORING_OFF_SQ_RING);
+		cqring = sqring;
+	} else {
+		sqring = ring_map(fd, sqlen, IORING_OFF_SQ_RING);
+		cqring = ring_map(fd, cqlen, IORING_OFF_CQ_RING);
+	}
+
+	// teardown() unmaps these before entries is known
+	sqeslen = p.sq_entries * sizeof(io_uring_sqe);
+	sqes    = (io_uring_sqe *) ring_map(fd, sqeslen, IORING_OFF_SQES);
+
+	if (!sqring || !cqring || !sqes) {
+		teardown();
+		return false;
+	}
+
+	sq = (uint8_t *) sqring;
+	cq = (uint8_t *) cqring;
+
+	sqhead  = (unsigned *) (sq + p.sq_off.head);
+	sqtail  = (unsigned *) (sq + p.sq_off.tail);
+	sqmask  = (unsigned *) (sq + p.sq_off.ring_mask);
+	sqarray = (unsigned *) (sq + p.sq_off.array);
+	cqhead  = (unsigned *) (cq + p.cq_off.head);
+	cqtail  = (unsigned *) (cq + p.cq_off.tail);
+	cqmask  = (unsigned *) (cq + p.cq_off.ring_mask);
+	cqes    = (io_uring_cqe *) (cq + p.cq_off.cqes);
+	entries = p.sq_entries;
+
+	if (!probe()) {
+		teardown();
+		return false;
+	}
+
+	return true;
+}
+
+/* The file opcodes arrived over several releases, check for all of them */
+bool io_ring::probe(void)
+{
+	const uint8_t needed[] = { IORING_OP_OPENAT, IORING_OP_READ,
+				   IORING_OP_WRITE, IORING_OP_CLOSE,
+				   IORING_OP_UNLINKAT };
+	const size_t nops = 256;
+	io_uring_probe *pr;
+	bool ok = true;
+
+	pr = (io_uring_probe *) calloc(1, sizeof(*pr) + nops * sizeof(io_uring_probe_op));
+	if (!pr)
+		return false;
+
+	if (ring_register(fd, IORING_REGISTER_PROBE, pr, nops) < 0) {
+		free(pr);
+		return false;
+	}
+
+	for (uint8_t op : needed)
+		if (op > pr->last_op || !(pr->ops[op].flags & IO_URING_OP_SUPPORTED))
+			ok = false;
+
+	free(pr);
+
+	return ok;
+}
+
+void io_ring::teardown(void)
+{
+	if (sqes)
+		munmap(sqes, sqeslen);
+	if (cqring && cqring != sqring)
+		munmap(cqring, cqlen);
+	if (sqring)
+		munmap(sqring, sqlen);
+	if (fd >= 0)
+		close(fd);
+
+	fd = -1;
+	entries = queued = 0;
+	sqring = cqring = NULL;
+	sqes = NULL;
+	sqlen = cqlen = sqeslen = 0;
+
+	return;
+}
+
+// NULL once depth() requests are queued
+io_uring_sqe *io_ring::get(uint32_t index)
+{
+	unsigned tail = *sqtail;
+	io_uring_sqe *sqe;
+
+	if (queued == entries)
+		return NULL;
+
+	sqe = &sqes[tail & *sqmask];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = index;
+
+	sqarray[tail & *sqmask] = tail & *sqmask;
+	__atomic_store_n(sqtail, tail + 1, __ATOMIC_RELEASE);
+	queued++;
+
+	return sqe;
+}
+
+void io_ring::link_last(void)
+{
+	unsigned tail = *sqtail;
+
+	sqes[(tail - 1) & *sqmask].flags |= IOSQE_IO_HARDLINK;
+
+	return;
+}
+
+int io_ring::run(int *res)
+{
+	unsigned want = queued, done = 0, submit, head;
+	int r;
+
+	while (done < want) {
+		// whatever the kernel has not consumed yet still needs submitting
+		submit = *sqtail - __atomic_load_n(sqhead, __ATOMIC_ACQUIRE);
+
+		r = ring_enter(fd, submit, want - done, IORING_ENTER_GETEVENTS);
+		if (r < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+			queued = 0;
+			return -errno;
+		}
+
+		head = *cqhead;
+		while (head != __atomic_load_n(cqtail, __ATOMIC_ACQUIRE)) {
+			io_uring_cqe *cqe = &cqes[head & *cqmask];
+
+			res[cqe->user_data] = cqe->res;
+			head++;
+			done++;
+		}
+		__atomic_store_n(cqhead, head, __ATOMIC_RELEASE);
+	}
+
+	queued = 0;
+
+	return 0;
+}
+
+void io_ring::prep_openat(uint32_t index, int dirfd, const char *name,
+			  int flags, mode_t mode)
+{
+	io_uring_sqe *sqe = get(index);
+
+	sqe->opcode     = IORING_OP_OPENAT;
+	sqe->fd         = dirfd;
+	sqe->addr       = (uintptr_t) name;
+	sqe->open_flags = flags;
+	sqe->len        = mode;
+
+	return;
+}
+
+void io_ring::prep_read(uint32_t index, int fd, void *buf, size_t len)
+{
+	io_uring_sqe *sqe = get(index);
+
+	sqe->opcode = IORING_OP_READ;
+	sqe->fd     = fd;
+	sqe->addr   = (uintptr_t) buf;
+	sqe->len    = len;
+
+	return;
+}
+
+void io_ring::prep_write(uint32_t index, int fd, const void *buf, size_t len)
+{
+	io_uring_sqe *sqe = get(index);
+
+	sqe->opcode = IORING_OP_WRITE;
+	sqe->fd     = fd;
+	sqe->addr   = (uintptr_t) buf;
+	sqe->len    = len;
+
+	return;
+}
+
+void io_ring::prep_close(uint32_t index, int fd)
+{
+	io_uring_sqe *sqe = get(index);
+
+	sqe->opcode = IORING_OP_CLOSE;
+	sqe->fd     = fd;
+
+	return;
+}
+
+void io_ring::prep_unlinkat(uint32_t index, int dirfd, const char *name)
+{
+	io_uring_sqe *sqe = get(index);
+
+	sqe->opcode = IORING_OP_UNLINKAT;
+	sqe->fd     = dirfd;
+	sqe->addr   = (uintptr_t) name;
+
+	return;
+}
+
+#else
+
+/* Built without io_uring: never ready, so none of the rest is reached */
+io_ring::io_ring() : fd(-1), entries(0), queued(0)
+{
+}
+
+io_ring::~io_ring()
+{
+}
+
+bool io_ring::setup(unsigned depth)
+{
+	return false;
+}
+
+void io_ring::teardown(void)
+{
+	return;
+}
+
+void io_ring::link_last(void)
+{
+	return;
+}
+
+int io_ring::run(int *res)
+{
+	return -ENOSYS;
+}
+
+void io_ring::prep_openat(uint32_t index, int dirfd, const char *name,
+			  int flags, mode_t mode)
+{
+	return;
+}
+
+void io_ring::prep_read(uint32_t index, int fd, void *buf, size_t len)
+{
+	return;
+}
+
+void io_ring::prep_write(uint32_t index, int fd, const void *buf, size_t len)
+{
+	return;
+}
+
+void io_ring::prep_close(uint32_t index, int fd)
+{
+	return;
+}
+
+void io_ring::prep_unlinkat(uint32_t index, int dirfd, const char *name)
+{
+	return;
+}
+
+#endif
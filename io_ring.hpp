@@ -0,0 +1,69 @@
+#ifndef __IO_RING_HPP__
+#define __IO_RING_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+#ifdef HAVE_CONFIG_H
+	#include "config.h"
+#endif
+#ifdef HAVE_IO_URING
+	#include <linux/io_uring.h>
+#endif
+
+/* Minimal io_uring ring driven with the raw syscalls, there is no    */
+/* liburing on the BMC.  Callers queue up to depth() requests, each   */
+/* tagged with an index, and run() submits them with one              */
+/* io_uring_enter and collects every result into res[index].          */
+/*                                                                     */
+/* setup() fails on kernels without io_uring, or without the opcodes */
+/* the event store needs, and callers then use plain syscalls.  When  */
+/* the kernel headers predate IORING_OP_UNLINKAT configure leaves     */
+/* HAVE_IO_URING out and the ring is never ready.                     */
+class io_ring {
+	int            fd;
+	unsigned       entries;
+	unsigned       queued;
+
+#ifdef HAVE_IO_URING
+	void          *sqring, *cqring;
+	size_t         sqlen, cqlen, sqeslen;
+	unsigned      *sqhead, *sqtail, *sqmask, *sqarray;
+	unsigned      *cqhead, *cqtail, *cqmask;
+	io_uring_sqe  *sqes;
+	io_uring_cqe  *cqes;
+
+	bool probe(void);
+	io_uring_sqe *get(uint32_t index);
+#endif
+
+public:
+	io_ring();
+	~io_ring();
+	io_ring(const io_ring &) = delete;
+	io_ring &operator=(const io_ring &) = delete;
+
+	bool     setup(unsigned depth);
+	void     teardown(void);
+#ifdef HAVE_IO_URING
+	bool     ready(void) const { return fd >= 0; }
+#else
+	bool     ready(void) const { return false; }
+#endif
+	unsigned depth(void) const { return entries; }
+
+	// submit everything queued and wait for all of it, 0 or -errno
+	int      run(int *res);
+
+	void     prep_openat(uint32_t index, int dirfd, const char *name,
+			     int flags, mode_t mode);
+	void     prep_read(uint32_t index, int fd, void *buf, size_t len);
+	void     prep_write(uint32_t index, int fd, const void *buf, size_t len);
+	void     prep_close(uint32_t index, int fd);
+	void     prep_unlinkat(uint32_t index, int dirfd, const char *name);
+
+	// the next request only runs once this one has, whatever its result
+	void     link_last(void);
+};
+
+#endif
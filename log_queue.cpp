@@ -0,0 +1,226 @@
+#include <chrono>
+#include <new>
+#include "log_queue.hpp"
+
+using namespace std;
+
+// fingerprints tracked at once, past that new lines are not limited
+const size_t g_log_windows = 256;
+
+const uint64_t g_never = UINT64_MAX;
+
+
+static uint64_t steady_seconds(void)
+{
+	return chrono::duration_cast<chrono::seconds>(
+		chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+log_queue::log_queue(size_t depth, uint32_t interval, uint32_t burst,
+		     log_queue_sink_t sink, void *ctx)
+	: sink(sink), ctx(ctx), depth(depth), interval(interval),
+	  burst(burst), dropped(0), stopping(false), counters()
+{
+	worker = thread(&log_queue::run, this);
+}
+
+log_queue::~log_queue()
+{
+	{
+		lock_guard<mutex> l(lock);
+		stopping = true;
+	}
+
+	wake.notify_one();
+	worker.join();
+}
+
+void log_queue::push(uint16_t logid, const char *severity,
+		     const char *reporter, const char *association,
+		     const char *message)
+{
+	entry_t e{ LOG_QUEUE_EVENT, logid, 0, severity, reporter,
+		   association, message };
+	string key = e.severity + '\0' + e.reporter + '\0' + e.message;
+	bool first;
+
+	lock_guard<mutex> l(lock);
+
+	uint64_t now = steady_seconds();
+	auto it = windows.find(key);
+
+	if (it != windows.end() && now - it->second.start < interval) {
+		window_t &w = it->second;
+
+		if (++w.seen > burst) {
+			// the worker has a summary to wait for now
+			first = !w.suppressed++;
+			w.last = move(e);
+			counters.suppressed++;
+			if (first)
+				wake.notify_one();
+			return;
+		}
+	} else if (it != windows.end()) {
+		window_t &w = it->second;
+
+		// the worker has not got round to it yet
+		if (w.suppressed) {
+			w.last.kind  = LOG_QUEUE_SUPPRESSED;
+			w.last.count = w.suppressed;
+			pending.push_back(move(w.last));
+		}
+
+		w.start      = now;
+		w.seen       = 1;
+		w.suppressed = 0;
+	} else if (windows.size() < g_log_windows) {
+		windows.emplace(key, window_t{ now, 1, 0, entry_t() });
+	}
+
+	if (pending.size() >= depth) {
+		dropped++;
+		counters.dropped++;
+		return;
+	}
+
+	pending.push_back(move(e));
+	counters.queued++;
+
+	if (pending.size() == 1)
+		wake.notify_one();
+
+	return;
+}
+
+/* Summaries of the windows that are over, or all of them, and idle  */
+/* windows dropped.  Returns when the next one with repeats ends.    */
+uint64_t log_queue::sweep(uint64_t now, bool all, vector<entry_t> &out)
+{
+	uint64_t next = g_never;
+
+	for (auto it = windows.begin(); it != windows.end(); ) {
+		window_t &w = it->second;
+
+		if (!all && now - w.start < interval) {
+			if (w.suppressed)
+				next = min(next, w.start + interval);
+			++it;
+			continue;
+		}
+
+		if (w.suppressed) {
+			w.last.kind  = LOG_QUEUE_SUPPRESSED;
+			w.last.count = w.suppressed;
+			out.push_back(move(w.last));
+		}
+
+		it = windows.erase(it);
+	}
+
+	return next;
+}
+
+void log_queue::deliver(const entry_t &e)
+{
+	log_queue_entry_t out;
+
+	out.kind        = e.kind;
+	out.logid       = e.logid;
+	out.count       = e.count;
+	out.severity    = e.severity.c_str();
+	out.reporter    = e.reporter.c_str();
+	out.association = e.association.c_str();
+	out.message     = e.message.c_str();
+
+	sink(ctx, &out);
+
+	return;
+}
+
+void log_queue::run(void)
+{
+	vector<entry_t> batch;
+	unique_lock<mutex> l(lock);
+	uint64_t next = g_never;
+	uint32_t lost;
+	bool stop;
+
+	for (;;) {
+		if (pending.empty() && !stopping && !dropped) {
+			if (next == g_never)
+				wake.wait(l);
+			else
+				wake.wait_for(l, chrono::seconds(next -
+					min(next, steady_seconds())));
+		}
+
+		stop = stopping;
+		batch.assign(make_move_iterator(pending.begin()),
+			     make_move_iterator(pending.end()));
+		pending.clear();
+		next = sweep(steady_seconds(), stop, batch);
+		lost = dropped;
+		dropped = 0;
+
+		// the journal is only ever waited on with the lock let go
+		l.unlock();
+
+		for (const entry_t &e : batch)
+			deliver(e);
+
+		if (lost) {
+			log_queue_entry_t out = { LOG_QUEUE_DROPPED, 0, lost,
+						  NULL, NULL, NULL, NULL };
+			sink(ctx, &out);
+		}
+
+		batch.clear();
+		l.lock();
+
+		if (stop && pending.empty() && !dropped)
+			break;
+	}
+
+	return;
+}
+
+log_queue_stats_t log_queue::stats(void)
+{
+	lock_guard<mutex> l(lock);
+
+	return counters;
+}
+
+
+/* NULL if the thread could not be started */
+log_queue *log_queue_new(size_t depth, uint32_t interval, uint32_t burst,
+			 log_queue_sink_t sink, void *ctx)
+{
+	try {
+		return new log_queue(depth, interval, burst, sink, ctx);
+	} catch (...) {
+		return NULL;
+	}
+}
+
+void log_queue_free(log_queue *q)
+{
+	delete q;
+}
+
+void log_queue_push(log_queue *q, uint16_t logid, const char *severity,
+		    const char *reporter, const char *association,
+		    const char *message)
+{
+	try {
+		q->push(logid, severity, reporter, association, message);
+	} catch (const bad_alloc &) {
+		// a line is not worth failing an event over
+	}
+}
+
+void log_queue_stats(log_queue *q, log_queue_stats_t *stats)
+{
+	*stats = q->stats();
+}
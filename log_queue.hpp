@@ -0,0 +1,122 @@
+#ifndef __LOG_QUEUE_HPP__
+#define __LOG_QUEUE_HPP__
+
+#ifdef __cplusplus
+	#include <condition_variable>
+	#include <cstddef>
+	#include <cstdint>
+	#include <deque>
+	#include <mutex>
+	#include <string>
+	#include <thread>
+	#include <unordered_map>
+	#include <vector>
+#else
+	#include <stddef.h>
+	#include <stdint.h>
+#endif
+
+/* What the sink is handed, kind is one of these */
+#define LOG_QUEUE_EVENT      1  // an accepted event
+#define LOG_QUEUE_SUPPRESSED 2  // count repeats of it were left out
+#define LOG_QUEUE_DROPPED    3  // count lines did not fit in the queue
+
+typedef struct log_queue_entry_t {
+	int         kind;
+	uint16_t    logid;        // for a summary, of the last repeat
+	uint32_t    count;
+	const char *severity;     // NULL for LOG_QUEUE_DROPPED
+	const char *reporter;
+	const char *association;
+	const char *message;
+} log_queue_entry_t;
+
+typedef void (*log_queue_sink_t)(void *ctx, const log_queue_entry_t *e);
+
+typedef struct log_queue_stats_t {
+	uint64_t queued;
+	uint64_t suppressed;
+	uint64_t dropped;
+} log_queue_stats_t;
+
+#ifdef __cplusplus
+
+/* Log lines for accepted events, written by a thread of their own so   */
+/* the threads accepting events never wait on the journal.  push() is   */
+/* safe from any thread and only ever takes a short lock to copy the    */
+/* line in; a full queue drops the line and counts it, and the count    */
+/* goes out as one line of its own once there is room.                  */
+/*                                                                      */
+/* Lines with the same severity, reporter and message are repeats: the  */
+/* first burst of them in each interval seconds goes out, the rest are  */
+/* counted and summed up in one LOG_QUEUE_SUPPRESSED line when the      */
+/* interval ends.  Whatever is queued or counted is delivered before    */
+/* the destructor returns.                                              */
+class log_queue {
+	struct entry_t {
+		int         kind;
+		uint16_t    logid;
+		uint32_t    count;
+		std::string severity;
+		std::string reporter;
+		std::string association;
+		std::string message;
+	};
+
+	struct window_t {
+		uint64_t start;       // steady clock seconds
+		uint32_t seen;
+		uint32_t suppressed;
+		entry_t  last;        // the latest repeat left out
+	};
+
+	log_queue_sink_t sink;
+	void    *ctx;
+	size_t   depth;
+	uint32_t interval;
+	uint32_t burst;
+
+	std::mutex              lock;
+	std::condition_variable wake;
+	std::deque<entry_t>     pending;
+	std::unordered_map<std::string, window_t> windows;
+	uint32_t dropped;     // since the last report of it
+	bool     stopping;
+	log_queue_stats_t counters;
+	std::thread worker;
+
+	void     run(void);
+	uint64_t sweep(uint64_t now, bool all, std::vector<entry_t> &out);
+	void     deliver(const entry_t &e);
+
+public:
+	log_queue(size_t depth, uint32_t interval, uint32_t burst,
+		  log_queue_sink_t sink, void *ctx);
+	~log_queue();
+	log_queue(const log_queue &) = delete;
+	log_queue &operator=(const log_queue &) = delete;
+
+	void push(uint16_t logid, const char *severity, const char *reporter,
+		  const char *association, const char *message);
+	log_queue_stats_t stats(void);
+};
+
+#else
+typedef struct log_queue log_queue;
+#endif
+
+#ifdef __cplusplus
+extern "C"  {
+#endif
+log_queue *log_queue_new(size_t depth, uint32_t interval, uint32_t burst,
+			 log_queue_sink_t sink, void *ctx);
+void       log_queue_free(log_queue *q);
+void       log_queue_push(log_queue *q, uint16_t logid, const char *severity,
+			  const char *reporter, const char *association,
+			  const char *message);
+void       log_queue_stats(log_queue *q, log_queue_stats_t *stats);
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,182 @@
+#include <cstring>
+#include "lz4_block.hpp"
+
+/*****************************************************************************/
+/* A block is a run of sequences, each a token byte (literal count in the   */
+/* high nibble, match length - 4 in the low one, 15 meaning more length     */
+/* bytes follow), the literals, then a 2 byte little endian match offset    */
+/* and any extra length bytes.  The last sequence is literals only and the  */
+/* last 5 bytes are always literals, as the format requires, so the output  */
+/* is readable by any LZ4 decoder.                                          */
+/*****************************************************************************/
+
+const size_t g_minmatch   = 4;
+const size_t g_mflimit    = 12;  // no match starts closer than this to the end
+const size_t g_lastlits   = 5;   // nor reaches closer than this
+const size_t g_maxoffset  = 65535;
+const int    g_hashbits   = 12;
+
+
+static inline uint32_t load32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, 4);
+	return v;
+}
+
+static inline uint32_t hash32(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - g_hashbits);
+}
+
+static uint8_t *put_length(uint8_t *op, size_t len)
+{
+	for (; len >= 255; len -= 255)
+		*op++ = 255;
+	*op++ = len;
+
+	return op;
+}
+
+/* One sequence, mlen of 0 for the closing literals only one */
+static bool put_sequence(uint8_t **op, uint8_t *oend, const uint8_t *lit,
+			 size_t litlen, size_t offset, size_t mlen)
+{
+	size_t ml = mlen ? mlen - g_minmatch : 0;
+	uint8_t *p = *op, *token;
+
+	if ((size_t) (oend - p) < 1 + litlen / 255 + 1 + litlen + 2 + ml / 255 + 1)
+		return false;
+
+	token  = p++;
+	*token = (litlen >= 15 ? 15 : litlen) << 4;
+	if (litlen >= 15)
+		p = put_length(p, litlen - 15);
+
+	memcpy(p, lit, litlen);
+	p += litlen;
+
+	if (mlen) {
+		*p++ = offset;
+		*p++ = offset >> 8;
+		*token |= ml >= 15 ? 15 : ml;
+		if (ml >= 15)
+			p = put_length(p, ml - 15);
+	}
+
+	*op = p;
+
+	return true;
+}
+
+size_t lz4_bound(size_t n)
+{
+	return n + n / 255 + 16;
+}
+
+size_t lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	uint32_t table[1 << g_hashbits];
+	const uint8_t *ip = src, *anchor = src, *end = src + n;
+	uint8_t *op = dst, *oend = dst + cap;
+
+	memset(table, 0, sizeof(table));
+
+	if (n > g_mflimit) {
+		const uint8_t *limit = end - g_mflimit;
+		const uint8_t *matchend = end - g_lastlits;
+
+		while (ip < limit) {
+			uint32_t seq = load32(ip);
+			uint32_t h = hash32(seq);
+			const uint8_t *ref = src + table[h];
+
+			table[h] = ip - src;
+
+			if (ref >= ip || (size_t) (ip - ref) > g_maxoffset ||
+			    load32(ref) != seq) {
+				ip++;
+				continue;
+			}
+
+			const uint8_t *mp = ip + g_minmatch, *rp = ref + g_minmatch;
+
+			while (mp < matchend && *mp == *rp) {
+				mp++;
+				rp++;
+			}
+
+			if (!put_sequence(&op, oend, anchor, ip - anchor,
+					  ip - ref, mp - ip))
+				return 0;
+
+			ip = anchor = mp;
+		}
+	}
+
+	if (!put_sequence(&op, oend, anchor, end - anchor, 0, 0))
+		return 0;
+
+	return op - dst;
+}
+
+/* Every length and offset is checked, src may be anything */
+static bool get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	do {
+		if (*ip >= iend)
+			return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+ssize_t lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = src + n;
+	uint8_t *op = dst, *oend = dst + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t len = token >> 4, offset;
+
+		if (len == 15 && !get_length(&ip, iend, &len))
+			return -1;
+		if (len > (size_t) (iend - ip) || len > (size_t) (oend - op))
+			return -1;
+
+		memcpy(op, ip, len);
+		ip += len;
+		op += len;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		if (offset == 0 || offset > (size_t) (op - dst))
+			return -1;
+
+		len = token & 15;
+		if (len == 15 && !get_length(&ip, iend, &len))
+			return -1;
+		len += g_minmatch;
+
+		if (len > (size_t) (oend - op))
+			return -1;
+
+		// byte at a time, the match may overlap what it produces
+		for (const uint8_t *m = op - offset; len; len--)
+			*op++ = *m++;
+	}
+
+	return op - dst;
+}
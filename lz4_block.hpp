@@ -0,0 +1,22 @@
+#ifndef __LZ4_BLOCK_HPP__
+#define __LZ4_BLOCK_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <sys/types.h>
+
+/* LZ4 block format (no frame), greedy single pass compressor.  Speed */
+/* over ratio: records are text and small binary blobs where a 64 KiB */
+/* window of 4 byte matches already does most of the work.            */
+
+// worst case compressed size of n bytes
+size_t  lz4_bound(size_t n);
+
+// returns the compressed length, 0 if it does not fit in cap
+size_t  lz4_compress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+// returns the decompressed length, -1 if src is not a valid block or
+// decompresses to more than cap
+ssize_t lz4_decompress(const uint8_t *src, size_t n, uint8_t *dst, size_t cap);
+
+#endif
@@ -1,21 +1,40 @@
 #include <iostream>
-#include <fstream>
 #include <iomanip>
 #include <cstdint>
 #include <string>
 #include <sys/types.h> 
 #include <dirent.h> 
-#include <sstream>
 #include <sys/stat.h>
 #include <cstring>
 #include "message.hpp"
+#include "crc32c.hpp"
+#include "murmur3.hpp"
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
 #include <time.h>
 #include <stddef.h>
 #include <cstdio>
 #include <syslog.h>
+#include <algorithm>
 
 const uint32_t g_eyecatcher = 0x4F424D43; // OBMC
-const uint16_t g_version    = 1;
+const uint16_t g_version    = 3;
+
+// flags, version 3
+const uint32_t LOG_DEBUG_BLOB        = 0x1; // debug data is a blob_ref_t
+const uint32_t LOG_CODED_SEVERITY    = 0x2; // the ...len field holds a
+const uint32_t LOG_CODED_ASSOCIATION = 0x4; // dictionary code and the
+const uint32_t LOG_CODED_REPORTER    = 0x8; // string is not in the record
+const uint32_t LOG_KNOWN_FLAGS       = 0xf;
+
+// debug data this long or longer goes to the blob area
+const size_t g_blob_min = 128;
+
+// associations come from the host and are rarely repeated, they are
+// only given a code this short and while the dictionary is this small
+const size_t g_dict_assoc_maxlen = 48;
+const size_t g_dict_assoc_max    = 64;
 
 struct logheader_t {
 	uint32_t eyecatcher;
@@ -24,25 +43,84 @@ struct logheader_t {
 	time_t   timestamp;
 	uint16_t detailsoffset;
 	uint16_t messagelen;
-	uint16_t severitylen;
-	uint16_t associationlen;
+	uint16_t severitylen;    // these three are dictionary codes
+	uint16_t associationlen; // when their LOG_CODED_ flag is set
 	uint16_t reportedbylen;
 	uint16_t debugdatalen;
+	uint32_t crc;            // version 2, CRC32C of header and payload
+	uint32_t flags;          // version 3
 };
 
-size_t get_file_size(string fn);
+// records read per round trip while loading the store
+const size_t g_load_batch = 32;
+
+/* Each version's header ends where the next one's first field starts, */
+/* padded out to the struct alignment.  On 64 bit targets crc sits in  */
+/* what used to be padding so versions 1 and 2 are the same size       */
+/* there.  Version 3 is only written when a flag is set, so a record   */
+/* that needs none stays byte for byte what version 2 wrote.           */
+static size_t header_size(uint16_t version)
+{
+	const size_t align = alignof(logheader_t);
+
+	if (version < 2)
+		return (offsetof(logheader_t, crc) + align - 1) & ~(align - 1);
+	if (version < 3)
+		return (offsetof(logheader_t, flags) + align - 1) & ~(align - 1);
+
+	return sizeof(logheader_t);
+}
 
+/* Checksum of a record, computed with hdr->crc zeroed */
+static uint32_t log_crc(const logheader_t *hdr, const uint8_t *payload, size_t len)
+{
+	return crc32c(crc32c(0, hdr, header_size(hdr->version)), payload, len);
+}
 
-event_manager::event_manager(string path, size_t reqmaxsize, uint16_t reqmaxlogs)
+template <class Store>
+basic_event_manager<Store>::basic_event_manager(string path, size_t reqmaxsize,
+						uint16_t reqmaxlogs)
 {
-	uint16_t x;
+	uint16_t x, ids[g_load_batch];
+	event_record_t *recs[g_load_batch];
+	size_t sizes[g_load_batch];
+	typename Store::scan_type files;
+	size_t i, n;
 	eventpath = path;
 	latestid = 0;
-	dirp = NULL;
 	logcount = 0;
+	corruptcount = 0;
+	fsckstate = fsck_state_t();
+	stagedbytes = 0;
+	stagelimit = 0;
+	stagedscan = false;
+	stagedpos = 0;
+	watchfd = -1;
+	repl.primary = false;
+	repl.statefd = -1;
+	memset(&repl.state, 0, sizeof(repl.state));
+	repl.hello = false;
+	repl.resyncing = false;
+	repl.resyncpos = 0;
+	repl.resyncseq = 0;
+	repl.pending = 0;
+	repl.stats = repl_stats_t();
+	blobfd = -1;
+	blobbytes = 0;
+	metabytes = 0;
+	archfd = -1;
+	archiveage = 0;
+	archclock = 0;
+	archscan = false;
+	archpos = 0;
+	ingestpending = 0;
+	ingestfd = -1;
+	ingestrefused = 0;
+	reservedowed = 0;
 	maxsize = -1;
 	maxlogs = -1;
-	currentsize = get_managed_size();
+	currentsize = 0;
+	expiries = timing_wheel(time(NULL));
 
 	if (reqmaxsize)
 		maxsize = reqmaxsize;
@@ -50,130 +128,272 @@ event_manager::event_manager(string path, size_t reqmaxsize, uint16_t reqmaxlogs
 	if (reqmaxlogs)
 		maxlogs = reqmaxlogs;
 
-	// examine the files being managed and advance latestid to that value
-	while ( (x = next_log()) ) {
-		logcount++;
-		if ( x > latestid )
-			latestid = x;
+	if (!store.open(eventpath) || !store.open_scan(files)) {
+		cerr << "Error opening directory " << eventpath << endl;
+		publish();
+		return;
+	}
+
+	set_io_ring(true);
+
+	if (!journal.open(store.dirfd(), MESSAGE_JOURNAL_FILE,
+			  MESSAGE_JOURNAL_SLOTS))
+		syslog(LOG_WARNING, "no change journal in %s, readers must "
+		       "list the store to catch up: %s", eventpath.c_str(),
+		       strerror(errno));
+
+	// a store with nowhere to put them goes without the side areas
+	if (store.dirfd() >= 0) {
+		blob_open();
+
+		if (!dict.open(store.dirfd(), MESSAGE_DICT_FILE, true))
+			syslog(LOG_WARNING, "no string dictionary in %s, "
+			       "strings are kept in each record: %s",
+			       eventpath.c_str(), strerror(errno));
+
+		archive_open();
+
+		// a store that has replicated before is charged for its state
+		if (faccessat(store.dirfd(), MESSAGE_REPL_FILE, F_OK, 0) == 0)
+			repl_load();
 	}
 
+	account_meta();
+
+	// examine the files being managed and advance latestid to that value,
+	// a good record is read once, only a damaged one is looked at again
+	do {
+		n = 0;
+		while (n < g_load_batch && (x = files.next_log())) {
+			// archived, but the crash came before the unlink
+			if (archived.count(x)) {
+				store.unlink(x);
+				continue;
+			}
+			ids[n++] = x;
+		}
+
+		read_logs(ids, n, recs, sizes, false);
+
+		for (i = 0; i < n; i++) {
+			if (recs[i]) {
+				blob_ref_t ref;
+
+				index_log(recs[i], sizes[i],
+					  record_blob((uint8_t*) (recs[i] + 1),
+						      recs[i], &ref) ? &ref : NULL);
+				close(recs[i]);
+			} else if (!is_log(ids[i], &sizes[i])) {
+				continue;
+			}
+
+			logcount++;
+			currentsize += sizes[i];
+			note_log_id(ids[i]);
+		}
+	} while (n == g_load_batch);
+
+	// blobs whose records went while we were not running
+	sweep_blobs();
+
+	publish();
+
 	return;
 }
 
-event_manager::~event_manager()
+template <class Store>
+basic_event_manager<Store>::~basic_event_manager()
 {
-	if (dirp)
-		closedir(dirp);
+	uint16_t ids[64];
 
-	return;
-}
+	// whatever was submitted has been promised a logid, and the
+	// threads submitting it are gone by now
+	while (ingestpending.load())
+		commit_ingested(ids, 64);
 
+	flush();
 
-bool event_manager::is_logid_a_log(uint16_t logid)
-{
-	std::ostringstream buffer;
-	buffer  << int(logid);
-	return is_file_a_log(buffer.str());
-}
+	scan.close();
+	fsckstate.scan.close();
 
+	if (watchfd >= 0)
+		::close(watchfd);
 
-bool event_manager::is_file_a_log(string str)
-{
-	std::ostringstream buffer;
-	ifstream f;
-	logheader_t hdr;
+	if (repl.statefd >= 0)
+		::close(repl.statefd);
 
-	if (!str.compare("."))
-		return 0;
+	if (blobfd >= 0)
+		::close(blobfd);
 
-	if (!str.compare(".."))
-		return 0;
+	if (archfd >= 0)
+		::close(archfd);
 
-	buffer << eventpath << "/" << str;
+	if (ingestfd >= 0)
+		::close(ingestfd);
 
-	f.open( buffer.str(), ios::binary);
+	store.close();
 
-	if (!f.good()) {
-		f.close();
-		return 0;
-	}
+	return;
+}
 
-	f.read((char*)&hdr, sizeof(hdr));
-	f.close();
 
-	if (hdr.eyecatcher != g_eyecatcher)
-		return 0;
+/* size, when given, is set to the length of the record */
+template <class Store>
+bool basic_event_manager<Store>::is_log(uint16_t logid, size_t *size)
+{
+	uint32_t eyecatcher = 0;
 
-	return 1;
+	return store.peek(logid, &eyecatcher, sizeof(eyecatcher), size) &&
+	       eyecatcher == g_eyecatcher;
 }
 
-uint16_t event_manager::log_count(void)
+template <class Store>
+uint16_t basic_event_manager<Store>::log_count(void)
 {
-	return logcount;
+	return snapshot()->logcount;
 }
-uint16_t event_manager::latest_log_id(void)
+template <class Store>
+uint16_t basic_event_manager<Store>::latest_log_id(void)
 {
-	return latestid;
+	return snapshot()->latestid;
 }
-uint16_t event_manager::new_log_id(void)
+template <class Store>
+uint32_t basic_event_manager<Store>::corrupt_count(void)
 {
-	return ++latestid;
+	return corruptcount;
 }
-void event_manager::next_log_refresh(void)
+template <class Store>
+int basic_event_manager<Store>::next_change(uint16_t *logid)
+{
+	int op;
+
+	if (changes.empty())
+		return 0;
+
+	op     = changes.front().first;
+	*logid = changes.front().second;
+	changes.pop_front();
+
+	return op;
+}
+/* A change made behind the caller's back, both for the daemon to */
+/* catch up on and for journal readers                             */
+template <class Store>
+void basic_event_manager<Store>::note_change(int op, uint16_t logid)
+{
+	changes.emplace_back(op, logid);
+	journal.append(op, logid);
+
+	return;
+}
+
+template <class Store>
+bool basic_event_manager<Store>::changes_since(uint64_t since, size_t max,
+					       vector<journal_entry_t> &out,
+					       uint64_t *next)
 {
-	if (dirp) {
-		closedir(dirp);
-		dirp = NULL;
+	if (!journal.since(since, max, out)) {
+		*next = journal.last();
+		return false;
 	}
 
+	*next = out.empty() ? since : out.back().seq;
+
+	return true;
+}
+template <class Store>
+uint16_t basic_event_manager<Store>::new_log_id(void)
+{
+	return ++latestid;
+}
+template <class Store>
+void basic_event_manager<Store>::next_log_refresh(void)
+{
+	scan.close();
+	archscan = false;
+	stagedscan = false;
+
 	return;
 }
 
-uint16_t event_manager::next_log(void)
+/* Walks the store, then the archive, then whatever is still     */
+/* staged in memory                                               */
+template <class Store>
+uint16_t basic_event_manager<Store>::next_log(void)
 {
-	std::ostringstream buffer;
-	struct dirent *ent;
 	uint16_t id;
 
-	if (dirp == NULL)
-		dirp = opendir(eventpath.c_str());
+	if (archscan) {
+		auto it = archived.upper_bound(archpos);
 
-	if (dirp) {
-		do {
-			ent = readdir(dirp);
+		if (it != archived.end()) {
+			archpos = it->first;
+			return archpos;
+		}
 
-			if (ent == NULL)
-				break;
+		archscan = false;
+		if (staged.empty())
+			return 0;
 
-			string str(ent->d_name);
+		stagedscan = true;
+		stagedpos  = 0;
+		return next_log();
+	}
 
-			if (is_file_a_log(str)) {
-				id = (uint16_t) atoi(str.c_str());
-				break;
-			}
+	if (stagedscan) {
+		auto it = staged.upper_bound(stagedpos);
 
-		} while( 1 );
-	} else {
+		if (it == staged.end()) {
+			stagedscan = false;
+			return 0;
+		}
+
+		stagedpos = it->first;
+		return stagedpos;
+	}
+
+	if (!scan.is_open() && !store.open_scan(scan)) {
 		cerr << "Error opening directory " << eventpath << endl;
-		ent = NULL;
-		id = 0;
+		return 0;
+	}
+
+	while ((id = scan.next_log())) {
+		if (archived.count(id))
+			continue;
+
+		if (is_log(id))
+			return id;
 	}
 
-	if (ent == NULL) {
-		closedir(dirp);
-		dirp = NULL;
+	// scan closes itself at the end of the store
+	if (!archived.empty()) {
+		archscan = true;
+		archpos  = 0;
+		return next_log();
 	}
 
-	return  ((ent == NULL) ? 0 : id);
+	if (!staged.empty()) {
+		stagedscan = true;
+		stagedpos  = 0;
+		return next_log();
+	}
+
+	return 0;
 }
 
 
-uint16_t event_manager::create(event_record_t *rec)
+template <class Store>
+uint16_t basic_event_manager<Store>::create(event_record_t *rec)
 {
+	uint16_t logid;
+
 	rec->logid = new_log_id();
 	rec->timestamp = time(NULL);
 
-	return create_log_event(rec);
+	logid = create_log_event(rec);
+	publish();
+
+	return logid;
 }
 
 inline uint16_t getlen(const char *s)
@@ -181,67 +401,331 @@ inline uint16_t getlen(const char *s)
 	return (uint16_t) (1 + strlen(s));
 }
 
+/* Bytes a string takes in the record, none once it is a code */
+static uint16_t field_len(const logheader_t &hdr, uint32_t flag, uint16_t len)
+{
+	return (hdr.flags & flag) ? 0 : len;
+}
 
-/* If everything is working correctly, return file size, */
-/* Otherwise return 0 */
-size_t get_file_size(string fn)
+template <class Store>
+void basic_event_manager<Store>::index_log(event_record_t *rec, size_t size,
+					   const blob_ref_t *ref)
 {
-	struct stat f_stat;
-	int r = -1;
+	uint16_t reporter = reporters.intern(rec->reportedby);
+	uint16_t severity = severities.intern(rec->severity);
+
+	const char *text[] = { rec->message, rec->reportedby, rec->association };
+
+	table.insert(rec->logid, rec->timestamp, severity, reporter, size);
+	textindex.insert(rec->logid, rec->timestamp, text);
+	rollups.add(severity, reporter, rec->timestamp);
+	account(reporter, size, 1);
+	schedule_expiry(rec->logid, rec->timestamp, severity);
+	if (ref)
+		take_blob(rec->logid, reporter, *ref);
+	return;
+}
 
-	r = stat(fn.c_str(), &f_stat);
+/* Every record leaving the table goes through here so the per */
+/* reporter accounting stays in step with it                   */
+template <class Store>
+bool basic_event_manager<Store>::unindex_log(uint16_t logid)
+{
+	int row = table.find(logid);
 
-	if (r < 0) {
-		fprintf(stderr, "Error get_file_size() for %s, %s\n",
-				fn.c_str(),
-				strerror(errno));
-		return 0;
-	}
+	if (row < 0)
+		return false;
+
+	account(table.reporter(row), -(ssize_t) table.bytes(row), -1);
+	rollups.remove(table.severity(row), table.reporter(row),
+		       table.timestamp(row));
+	expiries.cancel(logid);
+	release_blob(logid, table.reporter(row));
+	textindex.erase(logid);
+	table.erase(logid);
 
-	return (f_stat.st_size);
+	return true;
 }
 
 
-size_t event_manager::get_managed_size(void)
+/*****************************************************************************/
+/* Per reporter quotas.  Each reporter keeps a running total of what it     */
+/* has stored, adjusted as records enter and leave the table.  A quota caps */
+/* that total.  A reservation keeps bytes free for its reporter: every      */
+/* other reporter sees maxsize shrunk by whatever part of the reservation   */
+/* is still unused.  The sum of those unused parts is kept in reservedowed  */
+/* and moved along with each total, so admitting a record is a handful of   */
+/* additions no matter how many reporters or records there are.             */
+/*****************************************************************************/
+
+static size_t shortfall(const source_usage_t &s, size_t extra = 0)
 {
-	DIR *dirp;
-	std::ostringstream buffer;
-	struct dirent *ent;
-	ifstream f;
+	return s.reserved > s.bytes + extra ? s.reserved - s.bytes - extra : 0;
+}
 
-	size_t db_size = 0;
+/* The dictionary, the change journal and the replication state */
+template <class Store>
+size_t basic_event_manager<Store>::meta_bytes(void)
+{
+	return dict.bytes() + journal.bytes() +
+	       (repl.statefd >= 0 ? sizeof(repl.state) : 0);
+}
 
-	dirp = opendir(eventpath.c_str());
+/* Those files are store space like any record, though no reporter's */
+template <class Store>
+void basic_event_manager<Store>::account_meta(void)
+{
+	size_t bytes = meta_bytes();
 
-	if (dirp) {
-		while ( (ent = readdir(dirp)) != NULL ) {
+	currentsize += bytes - metabytes;
+	metabytes    = bytes;
 
-			string str(ent->d_name);
+	return;
+}
 
-			if (is_file_a_log(str)) {
-				buffer.str("");
-				buffer << eventpath << "/" << str.c_str();
-				db_size += get_file_size(buffer.str());
-			}
+template <class Store>
+source_usage_t &basic_event_manager<Store>::source(uint16_t code)
+{
+	if (code >= sources.size())
+		sources.resize(code + 1, source_usage_t());
+
+	return sources[code];
+}
+
+template <class Store>
+void basic_event_manager<Store>::account(uint16_t code, ssize_t bytes, int logs)
+{
+	source_usage_t &s = source(code);
+
+	reservedowed -= shortfall(s);
+	s.bytes += bytes;
+	s.logs  += logs;
+	reservedowed += shortfall(s);
+
+	return;
+}
+
+/* Without quotas only maxsize itself is checked, reservations being */
+/* the same kind of per reporter policy                               */
+template <class Store>
+bool basic_event_manager<Store>::admit(const char *reportedby, size_t size,
+				       bool quotas)
+{
+	int code = reporters.lookup(reportedby);
+	source_usage_t *s = NULL;
+	size_t owed = quotas ? reservedowed : 0;
+
+	if (code >= 0)
+		s = &source(code);
+
+	if (s && quotas) {
+		if (s->quota && s->bytes + size > s->quota) {
+			syslog(LOG_ERR, "event logger quota for %s reached, "
+			       "event not logged", reportedby);
+			s->rejected++;
+			return false;
 		}
+
+		// its own reservation is what this record may use up
+		owed = owed - shortfall(*s) + shortfall(*s, size);
+	}
+
+	if ((size + currentsize + owed) >= maxsize) {
+		syslog(LOG_ERR, "event logger reached maximum capacity, event not logged");
+		if (s)
+			s->rejected++;
+		return false;
 	}
 
-	closedir(dirp);
+	return true;
+}
+
+template <class Store>
+void basic_event_manager<Store>::set_quota(const char *reportedby, size_t bytes)
+{
+	source(reporters.intern(reportedby)).quota = bytes;
+	return;
+}
+
+template <class Store>
+void basic_event_manager<Store>::set_reserve(const char *reportedby,
+					     size_t bytes)
+{
+	source_usage_t &s = source(reporters.intern(reportedby));
+
+	reservedowed -= shortfall(s);
+	s.reserved = bytes;
+	reservedowed += shortfall(s);
+
+	return;
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::source_count(void)
+{
+	return sources.size();
+}
+
+template <class Store>
+bool basic_event_manager<Store>::source_usage(size_t index,
+					      source_usage_t *usage)
+{
+	if (index >= sources.size())
+		return false;
+
+	*usage = sources[index];
+	usage->reporter = reporters.str(index);
+
+	return true;
+}
+
+/*****************************************************************************/
+/* Snapshots for readers.  Only the writer thread touches the live index.  */
+/* Once it is done with a change, publish() swaps in a new snapshot, which  */
+/* shares all but the changed chunks of the table with the one before, so   */
+/* publishing costs a pointer per chunk whatever the size of the store.    */
+/* Readers load the current snapshot with one atomic shared_ptr copy and    */
+/* keep it as long as they need; the chunks they hold are cloned rather    */
+/* than changed under them.  The string tables are shared the same way     */
+/* and only copied when a new severity or reporter turned up.              */
+/*****************************************************************************/
+
+template <class Store>
+void basic_event_manager<Store>::publish(void)
+{
+	auto snap = make_shared<index_snapshot_t>();
+
+	snap->table       = table;
+	snap->logcount    = logcount;
+	snap->latestid    = latestid;
+	snap->currentsize = currentsize;
+
+	if (published && published->severities->size() == severities.size())
+		snap->severities = published->severities;
+	else
+		snap->severities = make_shared<const string_table>(severities);
+
+	if (published && published->reporters->size() == reporters.size())
+		snap->reporters = published->reporters;
+	else
+		snap->reporters = make_shared<const string_table>(reporters);
 
-	return (db_size);
+	atomic_store(&published, shared_ptr<const index_snapshot_t>(snap));
+
+	return;
 }
 
-uint16_t event_manager::create_log_event(event_record_t *rec)
+template <class Store>
+shared_ptr<const index_snapshot_t>
+basic_event_manager<Store>::snapshot(void) const
 {
-	std::ostringstream buffer;
-	ofstream myfile;
-	logheader_t hdr = {0};
+	return atomic_load(&published);
+}
+
+template <class Store>
+int basic_event_manager<Store>::severity_code(const char *severity)
+{
+	int code = snapshot()->severities->lookup(severity);
+
+	return code < 0 ? g_filter_none : code;
+}
+
+template <class Store>
+int basic_event_manager<Store>::reporter_code(const char *reportedby)
+{
+	int code = snapshot()->reporters->lookup(reportedby);
+
+	return code < 0 ? g_filter_none : code;
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::count_logs(const event_filter_t &f)
+{
+	return snapshot()->table.count(f);
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::filter_logs(const event_filter_t &f,
+					       vector<uint16_t> &ids)
+{
+	return snapshot()->table.filter(f, ids);
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::search_logs(const char *query,
+					       unsigned fields, size_t max,
+					       vector<uint16_t> &ids)
+{
+	return textindex.search(query, fields, max, ids);
+}
+
+template <class Store>
+time_t basic_event_manager<Store>::rollup(int resolution, time_t now,
+					  vector<uint32_t> &counts,
+					  vector<string> &severitynames,
+					  vector<string> &reporternames)
+{
+	severitynames.clear();
+	reporternames.clear();
+
+	for (size_t i = 0; i < severities.size(); i++)
+		severitynames.push_back(severities.str(i));
+	for (size_t i = 0; i < reporters.size(); i++)
+		reporternames.push_back(reporters.str(i));
+
+	return rollups.series(resolution, now, severities.size(),
+			      reporters.size(), counts);
+}
+
+
+template <class Store>
+size_t basic_event_manager<Store>::get_managed_size(void)
+{
+	typename Store::scan_type files;
+	size_t db_size = 0;
+	size_t size;
+	uint16_t id;
+
+	if (store.open_scan(files)) {
+		while ((id = files.next_log()))
+			if (is_log(id, &size))
+				db_size += size;
+	}
+
+	return (db_size + blob_disk_size() + archive_disk_size() + stagedbytes +
+		meta_bytes());
+}
+
+/* The record goes to the store as an iovec of the caller's buffers, */
+/* for the daemon those are the sd-bus message itself, so the file   */
+/* store writes it with one pwritev() and nothing is copied.  The    */
+/* write either lands in full or nothing is left of it.  Large debug */
+/* data is replaced by a reference to its blob, which is only        */
+/* written the first time those bytes are seen.  A record already    */
+/* admitted elsewhere, by a replication primary, skips the quotas,  */
+/* reservations and maxlogs, but still has to fit within maxsize.   */
+template <class Store>
+uint16_t basic_event_manager<Store>::create_log_event(event_record_t *rec,
+						      bool admitted)
+{
+	logheader_t hdr;
+	blob_ref_t ref;
+	bool blob = false, newblob = false;
 	size_t event_size=0;
+	char blobname[40];
+	ssize_t n;
 
-	buffer << eventpath << "/" << int(rec->logid) ;
+	if (rec->n > MESSAGE_BLOB_MAX) {
+		syslog(LOG_ERR, "debug data of event %u is %zu bytes, more "
+		       "than %d, event not logged", rec->logid, rec->n,
+		       MESSAGE_BLOB_MAX);
+		rec->logid = 0;
+		return 0;
+	}
 
+	memset(&hdr, 0, sizeof(hdr));
 	hdr.eyecatcher     = g_eyecatcher;
-	hdr.version        = g_version;
+	hdr.version        = 2;
 	hdr.logid          = rec->logid;
 	hdr.timestamp      = rec->timestamp;
 	hdr.detailsoffset  = offsetof(logheader_t, messagelen);
@@ -251,36 +735,113 @@ uint16_t event_manager::create_log_event(event_record_t *rec)
 	hdr.reportedbylen  = getlen(rec->reportedby);
 	hdr.debugdatalen   = rec->n;
 
-	event_size = sizeof(logheader_t) + \
-			hdr.messagelen     + \
-			hdr.severitylen    + \
-			hdr.associationlen + \
-			hdr.reportedbylen  + \
-			hdr.debugdatalen;
+	// strings the dictionary knows are stored as their code
+	char *strs[] = { rec->severity, rec->association, rec->reportedby };
+	uint16_t *lens[] = { &hdr.severitylen, &hdr.associationlen,
+			     &hdr.reportedbylen };
+	const uint32_t coded[] = { LOG_CODED_SEVERITY, LOG_CODED_ASSOCIATION,
+				   LOG_CODED_REPORTER };
+
+	for (int i = 0; i < 3; i++) {
+		bool add = coded[i] != LOG_CODED_ASSOCIATION ||
+			   (strlen(strs[i]) < g_dict_assoc_maxlen &&
+			    dict.size() < g_dict_assoc_max);
+		int code = add ? dict.code(strs[i]) : dict.lookup(strs[i]);
+
+		if (code < 0)
+			continue;
+
+		hdr.version   = 3;
+		hdr.flags    |= coded[i];
+		*lens[i]      = code;
+	}
 
-	if((event_size + currentsize)  >= maxsize) {
-		syslog(LOG_ERR, "event logger reached maximum capacity, event not logged");
+	// a new code stays in the dictionary whatever becomes of the record
+	account_meta();
+
+	if (rec->n >= g_blob_min && blobfd >= 0) {
+		murmur3_128(rec->p, rec->n, 0, ref.hash);
+		ref.len = rec->n;
+		blob_name(ref, blobname);
+
+		newblob = !blobs.count(blob_key_t(ref.hash[0], ref.hash[1]));
+		blob    = newblob || blob_matches(ref, rec->p);
+
+		if (!blob)
+			syslog(LOG_WARNING, "debug data of event %u collides "
+			       "with a stored blob, kept in the record",
+			       rec->logid);
+	}
+
+	if (blob) {
+		hdr.version      = 3;
+		hdr.flags       |= LOG_DEBUG_BLOB;
+		hdr.debugdatalen = sizeof(ref);
+
+	} else if (rec->n > UINT16_MAX) {
+		syslog(LOG_ERR, "debug data of event %u is too long to keep "
+		       "in the record, event not logged", rec->logid);
+		rec->logid = 0;
+		return 0;
+	}
+
+	struct iovec iov[] = {
+		{ &hdr,             header_size(hdr.version) },
+		{ rec->message,     hdr.messagelen },
+		{ rec->severity,    field_len(hdr, LOG_CODED_SEVERITY,
+					      hdr.severitylen) },
+		{ rec->association, field_len(hdr, LOG_CODED_ASSOCIATION,
+					      hdr.associationlen) },
+		{ rec->reportedby,  field_len(hdr, LOG_CODED_REPORTER,
+					      hdr.reportedbylen) },
+		{ blob ? (void*) &ref : rec->p, hdr.debugdatalen },
+	};
+	const int iovcnt = sizeof(iov) / sizeof(iov[0]);
+
+	for (int i = 0; i < iovcnt; i++) {
+		hdr.crc = crc32c(hdr.crc, iov[i].iov_base, iov[i].iov_len);
+		event_size += iov[i].iov_len;
+	}
+
+	if (!admit(rec->reportedby, event_size + (newblob ? rec->n : 0),
+		   !admitted)) {
 		rec->logid = 0;
 
-	} else if (logcount >= maxlogs) {
+	} else if (!admitted && logcount >= maxlogs) {
 		syslog(LOG_ERR, "event logger reached maximum log events, event not logged");
 		rec->logid = 0;
 
-	} else {
+	} else if (newblob && !write_blob(ref, rec->p)) {
+		syslog(LOG_ERR, "failed to store debug data of event %d: %s",
+		       rec->logid, strerror(errno));
+		rec->logid = 0;
+
+	} else if (stagelimit) {
 		currentsize += event_size;
-		myfile.open(buffer.str() , ios::out|ios::binary);
-		myfile.write((char*) &hdr, sizeof(hdr));
-		myfile.write((char*) rec->message, hdr.messagelen);
-		myfile.write((char*) rec->severity, hdr.severitylen);
-		myfile.write((char*) rec->association, hdr.associationlen);
-		myfile.write((char*) rec->reportedby, hdr.reportedbylen);
-		myfile.write((char*) rec->p, hdr.debugdatalen);
-		myfile.close();
-
-		if (is_logid_a_log(rec->logid)) {
+		logcount++;
+		index_log(rec, event_size, blob ? &ref : NULL);
+		journal.append(MESSAGE_LOG_ADDED, rec->logid);
+		stage_log(rec->logid, iov, iovcnt, event_size);
+
+		if (stagedbytes >= stagelimit)
+			flush();
+
+	} else {
+		note_write(rec->logid);
+
+		n = store.write(rec->logid, iov, iovcnt);
+
+		if (n == (ssize_t) event_size) {
+			currentsize += event_size;
 			logcount++;
+			index_log(rec, event_size, blob ? &ref : NULL);
+			journal.append(MESSAGE_LOG_ADDED, rec->logid);
 		} else {
-			cout << "Warning: Event not logged, failed to store data" << endl;
+			syslog(LOG_ERR, "failed to store event %d: %s",
+			       rec->logid, strerror(errno));
+			ownwrites.erase(rec->logid);
+			if (newblob)
+				unlinkat(blobfd, blobname, 0);
 			rec->logid = 0;
 		}
 	}
@@ -288,73 +849,326 @@ uint16_t event_manager::create_log_event(event_record_t *rec)
 	return rec->logid;
 }
 
-int event_manager::open(uint16_t logid, event_record_t **rec)
+/* Serializes the record into the staging map, iov already has its crc */
+template <class Store>
+void basic_event_manager<Store>::stage_log(uint16_t logid,
+					   const struct iovec *iov, int iovcnt,
+					   size_t event_size)
 {
-	std::ostringstream buffer;
-	ifstream f;
-	logheader_t hdr;
+	vector<uint8_t> &image = staged[logid];
+
+	image.reserve(event_size);
+
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *base = (const uint8_t*) iov[i].iov_base;
+
+		image.insert(image.end(), base, base + iov[i].iov_len);
+	}
 
-	buffer << eventpath << "/" << int(logid);
+	stagedbytes += image.size();
 
-	f.open( buffer.str(), ios::binary );
+	return;
+}
+
+template <class Store>
+void basic_event_manager<Store>::set_staging(size_t limit)
+{
+	stagelimit = limit;
+
+	if (!stagelimit)
+		flush();
 
-	if (!f.good()) {
+	return;
+}
+
+template <class Store>
+size_t basic_event_manager<Store>::staged_size(void)
+{
+	return stagedbytes;
+}
+
+/* Writes every staged record out back to back, in logid order, and  */
+/* makes the whole batch durable with one sync, a syncfs() for files, */
+/* instead of paying for a journal commit per record.  A record that */
+/* cannot be written is dropped from the accounting and reported as  */
+/* a change.                                                          */
+template <class Store>
+int basic_event_manager<Store>::flush(void)
+{
+	vector<ssize_t> written;
+	size_t i = 0;
+	int r = 0;
+
+	if (staged.empty())
 		return 0;
+
+	write_staged(written);
+
+	for (auto &it : staged) {
+		const vector<uint8_t> &image = it.second;
+		ssize_t n = written[i++];
+
+		if (n != (ssize_t) image.size()) {
+			syslog(LOG_ERR, "failed to flush event %d: %s",
+			       it.first, strerror(errno));
+			store.unlink(it.first);
+			currentsize -= min(currentsize, image.size());
+			if (logcount > 0)
+				logcount--;
+			unindex_log(it.first);
+			note_change(MESSAGE_LOG_REMOVED, it.first);
+			r = -1;
+		}
 	}
 
-	*rec = new event_record_t;
+	store.sync();
+
+	staged.clear();
+	stagedbytes = 0;
+	stagedscan = false;
+
+	collect_blobs();
+	publish();
+
+	return r;
+}
+
+template <class Store>
+int basic_event_manager<Store>::open(uint16_t logid, event_record_t **rec,
+				     bool verify)
+{
+	size_t size;
 
-	f.read((char*)&hdr, sizeof(hdr));
+	if (!read_log(logid, rec, &size, verify))
+		return 0;
 
-	(*rec)->logid     = hdr.logid;
-	(*rec)->timestamp = hdr.timestamp;
+	if (!attach_blob(rec, size, verify))
+		return 0;
 
+	return logid;
+}
 
-	(*rec)->message = new char[hdr.messagelen];
-	f.read((*rec)->message, hdr.messagelen);
+/* The record is loaded into a single allocation that holds the     */
+/* event_record_t followed by the record image its fields point     */
+/* into, so close() has exactly one thing to free.                  */
+template <class Store>
+int basic_event_manager<Store>::read_log(uint16_t logid, event_record_t **rec,
+					 size_t *size, bool verify)
+{
+	uint8_t *block;
+	size_t n;
 
-	(*rec)->severity = new char[hdr.severitylen];
-	f.read((*rec)->severity, hdr.severitylen);
+	if (archived.count(logid))
+		return read_archived(logid, rec, size, verify);
 
-	(*rec)->association = new char[hdr.associationlen];
-	f.read((*rec)->association, hdr.associationlen);
+	auto it = staged.find(logid);
+	if (it != staged.end()) {
+		n = it->second.size();
+		block = new uint8_t[sizeof(event_record_t) + n];
+		memcpy(block + sizeof(event_record_t), it->second.data(), n);
+	} else {
+		block = store.load(logid, sizeof(event_record_t), &n);
+		if (!block)
+			return 0;
+	}
 
-	(*rec)->reportedby = new char[hdr.reportedbylen];
-	f.read((*rec)->reportedby, hdr.reportedbylen);
+	*rec = (event_record_t*) block;
 
-	(*rec)->p = new uint8_t[hdr.debugdatalen];
-	f.read((char*)(*rec)->p, hdr.debugdatalen);
-	(*rec)->n = hdr.debugdatalen;
+	if (!parse_block(logid, block, n, verify))
+		return 0;
 
+	*size = n;
 
-	f.close();
 	return logid;
 }
 
-void event_manager::close(event_record_t *rec)
+/* Second half of a read, block holds n bytes of file image after the  */
+/* event_record_t.  On failure block is freed and false returned.      */
+template <class Store>
+bool basic_event_manager<Store>::parse_block(uint16_t logid, uint8_t *block,
+					     size_t n, bool verify)
 {
-	delete[] rec->message;
-	delete[] rec->severity;
-	delete[] rec->association;
-	delete[] rec->reportedby;
-	delete[] rec->p;
-	delete rec;
+	uint8_t *image = block + sizeof(event_record_t);
+	size_t reclen;
 
-	return ;
+	reclen = message_decode_log(image, n, (event_record_t*) block, &dict);
+
+	// another writer may have added strings to the dictionary
+	if (!reclen && dict.refresh())
+		reclen = message_decode_log(image, n, (event_record_t*) block,
+					    &dict);
+
+	if (reclen && verify && !message_verify_log(image, reclen))
+		reclen = 0;
+
+	if (!reclen) {
+		// without the eyecatcher it never was a log, nothing was lost
+		if (n >= 4 && !memcmp(image, &g_eyecatcher, 4)) {
+			syslog(LOG_ERR, "event log %d is corrupt", logid);
+			corruptcount++;
+		}
+		delete[] block;
+		return false;
+	}
+
+	return true;
+}
+
+/* Points the fields of rec into a record image already in memory.   */
+/* Nothing in the image is trusted: every length is checked against  */
+/* len and every string must be terminated inside its own field.     */
+/* Coded strings are looked up in dict and point into it, a record   */
+/* with codes the dictionary does not know, or no dictionary, fails. */
+/* Returns the length of the record, 0 if buf does not hold a        */
+/* complete log.                                                      */
+int message_decode_log(const uint8_t *buf, size_t len, event_record_t *rec,
+		       const string_dict *dict)
+{
+	logheader_t hdr;
+	char **fields[] = { &rec->message, &rec->severity,
+			    &rec->association, &rec->reportedby };
+	const uint32_t coded[] = { 0, LOG_CODED_SEVERITY,
+				   LOG_CODED_ASSOCIATION, LOG_CODED_REPORTER };
+	size_t offset;
+
+	if (len < header_size(1))
+		return 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(&hdr, buf, header_size(1));
+
+	if (hdr.eyecatcher != g_eyecatcher)
+		return 0;
+
+	if (hdr.version == 0 || hdr.version > g_version)
+		return 0;
+
+	offset = header_size(hdr.version);
+	if (len < offset)
+		return 0;
+
+	memcpy(&hdr, buf, offset);
+
+	if (hdr.flags & ~LOG_KNOWN_FLAGS)
+		return 0;
+
+	const uint16_t lens[] = { hdr.messagelen, hdr.severitylen,
+				  hdr.associationlen, hdr.reportedbylen };
+
+	for (int i = 0; i < 4; i++) {
+		if (hdr.flags & coded[i]) {
+			const char *s = dict ? dict->str(lens[i]) : NULL;
+
+			if (!s)
+				return 0;
+
+			*fields[i] = (char*) s;
+			continue;
+		}
+
+		if (lens[i] == 0 || offset + lens[i] > len)
+			return 0;
+		if (buf[offset + lens[i] - 1] != 0)
+			return 0;
+
+		*fields[i] = (char*) buf + offset;
+		offset += lens[i];
+	}
+
+	if (offset + hdr.debugdatalen > len)
+		return 0;
+
+	rec->p         = (uint8_t*) buf + offset;
+	rec->n         = hdr.debugdatalen;
+	rec->logid     = hdr.logid;
+	rec->timestamp = hdr.timestamp;
+
+	return offset + hdr.debugdatalen;
+}
+
+int message_parse_log(const uint8_t *buf, size_t len, event_record_t *rec)
+{
+	return message_decode_log(buf, len, rec, NULL);
+}
+
+/* len is the record length returned by message_parse_log().  Records */
+/* written before checksums existed have nothing to verify and pass.  */
+int message_verify_log(const uint8_t *buf, size_t len)
+{
+	logheader_t hdr;
+	uint32_t crc;
+
+	size_t hlen;
+
+	memcpy(&hdr, buf, header_size(1));
+
+	if (hdr.version < 2)
+		return 1;
+
+	hlen = header_size(hdr.version);
+	memcpy(&hdr, buf, hlen);
+	crc = hdr.crc;
+	hdr.crc = 0;
+
+	return crc == log_crc(&hdr, buf + hlen, len - hlen);
 }
 
-int event_manager::remove(uint16_t logid)
+/* Fills in ref when the debug data of rec, parsed out of buf, lives  */
+/* in the blob area                                                   */
+bool record_blob(const uint8_t *buf, const event_record_t *rec, blob_ref_t *ref)
 {
-	std::stringstream buffer;
-	string s;
-	size_t event_size;
+	logheader_t hdr;
+
+	memcpy(&hdr, buf, header_size(1));
+
+	if (hdr.version < 3)
+		return false;
+
+	memcpy(&hdr, buf, sizeof(hdr));
 
-	buffer << eventpath << "/" << int(logid);
+	if (!(hdr.flags & LOG_DEBUG_BLOB) || rec->n != sizeof(*ref))
+		return false;
 
-	s = buffer.str();
+	memcpy(ref, rec->p, sizeof(*ref));
 
-	event_size = get_file_size(s);
-	std::remove(s.c_str());
+	return true;
+}
+
+template <class Store>
+void basic_event_manager<Store>::close(event_record_t *rec)
+{
+	delete[] (uint8_t*) rec;
+
+	return ;
+}
+
+template <class Store>
+int basic_event_manager<Store>::remove(uint16_t logid)
+{
+	size_t event_size = 0;
+	ssize_t size;
+
+	auto it = staged.find(logid);
+	if (it != staged.end()) {
+		// never reached flash, nothing to unlink
+		event_size = it->second.size();
+		stagedbytes -= event_size;
+		staged.erase(it);
+	} else if (archived.count(logid)) {
+		// charged its share of a segment, not a file
+		int row = table.find(logid);
+
+		event_size = row < 0 ? 0 : table.bytes(row);
+		archive_drop(logid);
+	} else {
+		if ((size = store.size(logid)) >= 0)
+			event_size = size;
+		else
+			fprintf(stderr, "Error sizing event %u, %s\n",
+				logid, strerror(errno));
+
+		store.unlink(logid);
+	}
 
 	/* If everything is working correctly deleting all the logs would */ 
 	/* result in currentsize being zero.  But  since size_t is unsigned */
@@ -364,8 +1178,18 @@ int event_manager::remove(uint16_t logid)
 	else
 		currentsize -= event_size;
 
-	if (logcount > 0)
-		logcount--;
+	// an id that was never indexed is no change to report
+	if (unindex_log(logid)) {
+		if (logcount > 0)
+			logcount--;
+		journal.append(MESSAGE_LOG_REMOVED, logid);
+	}
+
+	collect_blobs();
+	publish();
 
 	return 0;
 }
+
+template class basic_event_manager<file_store>;
+template class basic_event_manager<memory_store>;
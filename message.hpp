@@ -3,8 +3,26 @@
 #include <time.h>
 
 #ifdef __cplusplus
+	#include <atomic>
 	#include <cstdint>
+	#include <deque>
+	#include <map>
+	#include <memory>
+	#include <set>
 	#include <string>
+	#include <utility>
+	#include <vector>
+	#include "change_journal.hpp"
+	#include "rollup_rings.hpp"
+	#include "dir_scan.hpp"
+	#include "event_store.hpp"
+	#include "event_table.hpp"
+	#include "io_ring.hpp"
+	#include "mpsc_queue.hpp"
+	#include "repl_link.hpp"
+	#include "string_dict.hpp"
+	#include "timing_wheel.hpp"
+	#include "trigram_index.hpp"
 
 	using namespace std;
 #else
@@ -34,42 +52,510 @@
 #endif
 
 
+/* Storage used by one reporter, see event_manager::set_quota() */
+typedef struct source_usage_t {
+	const char *reporter;
+	size_t      bytes;     // currently stored
+	uint32_t    logs;
+	uint32_t    rejected;  // creates refused since startup
+	size_t      quota;     // most it may store, 0 for no limit
+	size_t      reserved;  // kept free for it out of maxsize
+} source_usage_t;
+
+
+/* Changes to the store that did not come through create()/remove(), */
+/* reported by message_next_change() so dbus can be kept in step     */
+#define MESSAGE_LOG_ADDED   1
+#define MESSAGE_LOG_REMOVED 2
+
+/* Dictionary of the strings records store as codes, in the store */
+#define MESSAGE_DICT_FILE ".dict"
+
+/* Compressed segments cold records are packed into, in the store */
+#define MESSAGE_ARCHIVE_DIR ".archive"
+
+/* Identity of the store and how far it has replicated its source */
+#define MESSAGE_REPL_FILE ".replication"
+
+/* Journal of changes in the store, a reader can fall this many behind */
+/* before it has to resync                                              */
+#define MESSAGE_JOURNAL_FILE  ".journal"
+#define MESSAGE_JOURNAL_SLOTS 4096
+
+/* A change from message_changes_since(), op is one of the above */
+typedef struct message_change_t {
+	uint64_t seq;
+	uint16_t logid;
+	uint8_t  op;
+} message_change_t;
+
+/* Fields message_search() looks in */
+#define MESSAGE_SEARCH_MESSAGE     1
+#define MESSAGE_SEARCH_REPORTER    2
+#define MESSAGE_SEARCH_ASSOCIATION 4
+
+/* Records per period by severity and reporter, from message_rollup() */
+#define MESSAGE_ROLLUP_MINUTES 0
+#define MESSAGE_ROLLUP_HOURS   1
+#define MESSAGE_ROLLUP_DAYS    2
+
+typedef struct message_rollup_t {
+	uint64_t  start;      // of the oldest period
+	uint32_t  width;      // seconds in a period
+	uint32_t  periods;
+	uint32_t  nseverity;
+	uint32_t  nreporter;
+	char    **severity;   // names, indexed by code
+	char    **reporter;
+	uint32_t *counts;     // [severity][reporter][period], oldest first,
+	                      // NULL when nothing is counted
+} message_rollup_t;
+
+/* Room for a path from message_blob_path() */
+#define MESSAGE_BLOB_PATH_MAX 48
+
+/* Debug data longer than this is refused, a record claiming a longer */
+/* blob is corrupt                                                    */
+#define MESSAGE_BLOB_MAX (1024 * 1024)
+
 #ifdef __cplusplus
 
-class event_manager {
+struct logheader_t;
+
+struct fsck_stats_t {
+	uint32_t checked;      // records validated
+	uint32_t quarantined;  // moved to .quarantine
+	uint32_t emptied;      // zero length files removed
+	uint32_t trimmed;      // records with trailing garbage cut back
+};
+
+/* Debug data kept in the blob area, what a record holds in its place */
+struct blob_ref_t {
+	uint64_t hash[2];  // murmur3_128 of the data, names the blob file
+	uint64_t len;
+};
+
+typedef pair<uint64_t, uint64_t> blob_key_t;
+
+struct blob_t {
+	uint32_t refs;     // records pointing at it, 0 once it can go
+	size_t   size;
+	uint16_t owner;    // reporter code its size is charged to
+	map<uint16_t, uint32_t> holders;  // refs by reporter code
+};
+
+bool record_blob(const uint8_t *buf, const event_record_t *rec, blob_ref_t *ref);
+void blob_name(const blob_ref_t &ref, char *name);
+
+/* Archive segments are a run of blocks, each an archive_block_t, its */
+/* entries and then the LZ4 compressed records.  See event_archive.cpp */
+struct archive_entry_t {
+	uint16_t logid;
+	uint16_t reserved;
+	uint32_t offset;   // into the decompressed block
+	uint32_t len;
+};
+
+struct archive_loc_t {
+	uint32_t segment;
+	uint32_t block;    // file offset of the block
+	uint32_t offset;
+	uint32_t len;
+};
+
+struct archive_seg_t {
+	size_t   bytes;
+	uint32_t total;    // records written to it
+	uint32_t live;     // of those, not yet removed or superseded
+};
+
+struct archive_cache_t {
+	uint32_t segment;
+	uint32_t block;
+	uint32_t used;     // LRU stamp
+	vector<uint8_t> data;
+};
+
+// 1 with the block at *off read and *off moved past it, 0 at the end of
+// the segment, -1 for a damaged block that was skipped
+int  archive_read_block(int fd, uint64_t *off, vector<archive_entry_t> &entries,
+			vector<uint8_t> &raw);
+bool archive_segment_id(const char *name, uint32_t *segment);
+void archive_read_dead(int archfd, uint32_t segment, set<uint16_t> &dead);
+
+/* Where commit_ingested() hands back what became of records submitted */
+/* with it, to the thread that submitted them, see event_ingest.cpp    */
+struct ingest_channel_t {
+	mpsc_queue done;
+	int        fd;   // eventfd, readable once something is done
+};
+
+ingest_channel_t *ingest_channel_new(void);
+void ingest_channel_free(ingest_channel_t *ch);
+bool ingest_channel_next(ingest_channel_t *ch, void **ctx, uint16_t *logid);
+
+/* An immutable view of the index as of one publish().  Chunks of the */
+/* table are shared with the live index, see event_table.             */
+struct index_snapshot_t {
+	event_table table;
+	shared_ptr<const string_table> severities;
+	shared_ptr<const string_table> reporters;
+	uint16_t logcount;
 	uint16_t latestid;
+	size_t   currentsize;
+};
+
+/* Progress of an incremental fsck pass, see event_manager::fsck_step */
+struct fsck_state_t {
+	bool             active;
+	dir_scan         scan;    // listing phase, closed once it is done
+	vector<uint16_t> ids;     // logids found by the listing, sorted
+	size_t           pos;     // next entry of ids to check
+	uint16_t         maxid;   // latestid when the pass started
+	fsck_stats_t     stats;
+};
+
+/* Identity of a store and its position in the store it replicates, */
+/* kept in MESSAGE_REPL_FILE                                          */
+struct repl_state_t {
+	uint32_t magic;
+	uint32_t crc;      // CRC32C of the fields below
+	uint64_t self;     // random, what replicas of this store know it by
+	uint64_t source;   // self of the store replicated here, 0 for none
+	uint64_t applied;  // last change of source applied here
+};
+
+struct repl_stats_t {
+	uint64_t shipped;  // primary: last change sent to the replica
+	uint64_t acked;    // primary: last change the replica has synced
+	uint64_t applied;  // replica: last change of the primary applied
+	uint32_t resyncs;  // full listings sent or received
+	uint32_t records;  // records sent or applied
+};
+
+/* Either end of a replication link, see event_replicate.cpp */
+struct replication_t {
+	repl_link    link;
+	bool         primary;
+	int          statefd;   // MESSAGE_REPL_FILE, -1 when not kept
+	repl_state_t state;
+	bool         hello;     // primary: the replica said where it is
+	bool         resyncing; // primary: resync ids still being sent
+	vector<uint16_t> resync;
+	size_t       resyncpos;
+	uint64_t     resyncseq; // primary: the change the resync is as of
+	uint64_t     pending;   // replica: source of a resync under way
+	repl_stats_t stats;
+};
+
+/* The event store, over records kept by Store, see event_store.hpp. */
+/* The daemon and the C API use event_manager, the file per record    */
+/* layout; members are defined across the event_*.cpp files, each of  */
+/* which instantiates them for every store.                           */
+template <class Store>
+class basic_event_manager {
+	atomic<uint16_t> latestid; // taken by submit() on any thread
 	string   eventpath;
-	DIR      *dirp;
+	Store    store;     // the records, side areas go in its dirfd()
+	typename Store::scan_type scan; // next_log() position
 	uint16_t logcount;
 	uint16_t maxlogs;
 	size_t   maxsize;
 	size_t   currentsize;
+	atomic<uint32_t> corruptcount;
+
+	string_table severities;
+	string_table reporters;
+	event_table  table;
+
+	// what readers on other threads see, replaced by publish()
+	shared_ptr<const index_snapshot_t> published;
+
+	// codes records store for severity, association and reporter
+	string_dict  dict;
+
+	// .dict, .journal and .replication counted in currentsize
+	size_t       metabytes;
+
+	// substring search over the text of every managed record
+	trigram_index textindex;
+
+	// counts per minute, hour and day by severity and reporter
+	rollup_rings  rollups;
+
+	fsck_state_t fsckstate;
+	deque<pair<int, uint16_t>> changes;
+
+	// every create and delete, numbered, for readers that poll
+	change_journal journal;
+
+	// staging tier, records held in memory until the next flush()
+	map<uint16_t, vector<uint8_t>> staged;
+	size_t   stagedbytes;
+	size_t   stagelimit;  // 0 when staging is off
+	bool     stagedscan;  // next_log() has moved on to staged records
+	uint16_t stagedpos;
+
+	// per reporter accounting, indexed by reporter code
+	vector<source_usage_t> sources;
+	size_t   reservedowed; // reserved bytes not yet used by their owners
+
+	// retention, ttls is indexed by severity code, 0 keeps forever
+	vector<uint32_t> ttls;
+	timing_wheel     expiries;
+
+	// shared debug data, refcounted by the records that point at it
+	int      blobfd;   // the .blobs directory, -1 if it is unusable
+	map<blob_key_t, blob_t>     blobs;
+	map<uint16_t, blob_key_t>   blobrefs;
+	vector<blob_key_t>          blobgc;   // may have dropped to 0 refs
+	size_t   blobbytes;
+
+	// cold records packed into compressed segments
+	int      archfd;      // the .archive directory, -1 if it is unusable
+	uint32_t archiveage;  // 0 leaves every record in its own file
+	map<uint16_t, archive_loc_t> archived;
+	map<uint32_t, archive_seg_t> segments;
+	vector<archive_cache_t>      archcache; // decompressed blocks
+	uint32_t archclock;
+	bool     archscan;    // next_log() has moved on to archived records
+	uint16_t archpos;
+
+	// batched I/O, not ready() when the kernel has no io_uring
+	io_ring  ring;
+
+	// records from submit(), committed by commit_ingested()
+	mpsc_queue     ingestq;
+	atomic<size_t> ingestpending;
+	int            ingestfd;      // eventfd, -1 until ingest_start()
+	uint32_t       ingestrefused;
+
+	// inotify watch on eventpath, -1 until watch_start()
+	int           watchfd;
+	set<uint16_t> ownwrites;
+
+	// log shipping to a replica, or from a primary
+	replication_t repl;
 
 public:
-	event_manager(string path, size_t reqmaxsize, uint16_t reqmaxlogs);
-	~event_manager();
+	basic_event_manager(string path, size_t reqmaxsize,
+			    uint16_t reqmaxlogs);
+	~basic_event_manager();
 
 	uint16_t next_log(void);
 	void     next_log_refresh(void);
 
+	// the index as of the last change, safe from any thread.  Readers
+	// hold on to it as long as they like and never block the writer,
+	// every other method belongs to the one thread that writes.
+	shared_ptr<const index_snapshot_t> snapshot(void) const;
+
+	// these read the snapshot, or an atomic for corrupt_count, and
+	// are safe from any thread too
 	uint16_t latest_log_id(void);
 	uint16_t log_count(void);
+	uint32_t corrupt_count(void);
+
+	// walks the store and the live blob, archive and staging state,
+	// so only on the writer thread
 	size_t   get_managed_size(void);
 
-	int      open(uint16_t logid, event_record_t **rec); // must call close
+	// must call close, verify checks the record checksum as well
+	int      open(uint16_t logid, event_record_t **rec, bool verify = false);
 	void     close(event_record_t *rec);
 
 	uint16_t create(event_record_t *rec);
 	int      remove(uint16_t logid);
 
+	// metadata queries, answered from the snapshot and so safe from
+	// any thread; a name never seen gets g_filter_none, which a
+	// filter matches nothing on
+	int      severity_code(const char *severity);
+	int      reporter_code(const char *reportedby);
+	size_t   count_logs(const event_filter_t &f);
+	size_t   filter_logs(const event_filter_t &f, vector<uint16_t> &ids);
+
+	// records holding query in one of fields (MESSAGE_SEARCH_*), ignoring
+	// case, newest first and at most max.  Returns the number matching.
+	// The text index is not in the snapshot, this is the writer's.
+	size_t   search_logs(const char *query, unsigned fields, size_t max,
+			     vector<uint16_t> &ids);
+
+	// records per period of a rollup_rings resolution up to now, by
+	// severity and reporter as laid out by rollup_rings::series(),
+	// with the names of each code.  Returns the first period's start.
+	time_t   rollup(int resolution, time_t now, vector<uint32_t> &counts,
+			vector<string> &severitynames,
+			vector<string> &reporternames);
+
+	// check and compact the store, all at once or a budget at a time
+	void     fsck(void);
+	void     fsck_start(void);
+	bool     fsck_step(size_t budget); // true once the pass completed
+	bool     fsck_active(void);
+	const fsck_stats_t &fsck_stats(void);
+
+	int      next_change(uint16_t *logid);
+
+	// up to max creates and deletes after the change numbered since,
+	// *next being the number to ask from next time.  false when
+	// since has dropped out of the journal (or is 0): the caller
+	// lists the store again and carries on from *next.
+	bool     changes_since(uint64_t since, size_t max,
+			       vector<journal_entry_t> &out, uint64_t *next);
+
+	// hold new records in memory, flushing once limit bytes are staged
+	void     set_staging(size_t limit);
+	size_t   staged_size(void);
+	int      flush(void);
+
+	// follow records written and removed by other processes, returns
+	// the fd to poll for watch_process()
+	int      watch_start(void);
+	int      watch_process(void);
+
+	// stream every change to a replica, or apply a primary's, over a
+	// connected socket that stays the caller's.  replication_process()
+	// is called when it is readable, when writable while it returned
+	// 1, and on a primary after anything that may change the store.
+	// -1 once the link has failed and been dropped.
+	int      replicate_to(int fd);
+	int      replicate_from(int fd);
+	int      replication_process(void);
+	void     replication_stop(void);
+	const repl_stats_t &replication_stats(void);
+
+	// ingest from other threads.  submit() is safe from any thread and
+	// returns the logid the record is meant to have; the writer polls
+	// the fd from ingest_start() and stores what was submitted with
+	// commit_ingested(), ids getting the logids actually stored.  A
+	// record submitted with a channel comes back through it with ctx
+	// and its logid, 0 if the writer refused it.
+	int      ingest_start(void);
+	uint16_t submit(const event_record_t *rec, ingest_channel_t *ch = NULL,
+			void *ctx = NULL);
+	size_t   commit_ingested(uint16_t *ids, size_t max);
+	size_t   ingest_pending(void);
+	uint32_t ingest_refused(void);
+
+	// batched variants, each round of up to ring depth requests costs
+	// one io_uring_enter when the kernel supports it.  recs[i] is NULL
+	// for a record that could not be read, the rest must be closed.
+	size_t   open_logs(const uint16_t *ids, size_t n, event_record_t **recs,
+			   bool verify = false);
+	size_t   remove_logs(const uint16_t *ids, size_t n);
+	size_t   remove_where(const event_filter_t &f, const char *assocprefix,
+			      vector<uint16_t> &removed);
+	bool     set_io_ring(bool enable); // true if io_uring is in use
+
+	// drop records of a severity once they are older than seconds
+	void     set_ttl(const char *severity, uint32_t seconds);
+	size_t   expire(time_t now);
+	uint32_t next_expiry(void); // 0 if nothing will expire
+
+	// pack records older than seconds into compressed segments, a
+	// batch per call to archive()
+	void     set_archive_age(uint32_t seconds);
+	uint32_t archive_age(void);
+	size_t   archive(time_t now); // records moved
+
+	// per reporter limits, checked on every create
+	void     set_quota(const char *reportedby, size_t bytes);
+	void     set_reserve(const char *reportedby, size_t bytes);
+	size_t   source_count(void);
+	bool     source_usage(size_t index, source_usage_t *usage);
+
 private:
-	bool is_file_a_log(string str);
-	uint16_t create_log_event(event_record_t *rec);
+	bool     is_log(uint16_t logid, size_t *size = NULL);
+	void     publish(void);
+	uint16_t create_log_event(event_record_t *rec, bool admitted = false);
 	uint16_t new_log_id(void);
-	bool     is_logid_a_log(uint16_t logid);
+	void     note_log_id(uint16_t id);
+	void     note_change(int op, uint16_t logid);
+	int      read_log(uint16_t logid, event_record_t **rec,
+			  size_t *size, bool verify);
+	bool     parse_block(uint16_t logid, uint8_t *block, size_t n,
+			     bool verify);
+	void     read_logs(const uint16_t *ids, size_t n, event_record_t **recs,
+			   size_t *sizes, bool verify);
+	bool     read_round(const uint16_t *ids, size_t count,
+			    event_record_t **recs, size_t *sizes, bool verify);
+	void     write_staged(vector<ssize_t> &written);
+	bool     write_round(const uint16_t *ids,
+			     const vector<uint8_t> *const *images,
+			     size_t count, ssize_t *written);
+	void     index_log(event_record_t *rec, size_t size,
+			   const blob_ref_t *ref = NULL);
+	bool     unindex_log(uint16_t logid);
+	void     schedule_expiry(uint16_t logid, time_t timestamp,
+				 uint16_t severity);
+	source_usage_t &source(uint16_t code);
+	void     account(uint16_t code, ssize_t bytes, int logs);
+	bool     admit(const char *reportedby, size_t size,
+		       bool quotas = true);
+	void     stage_log(uint16_t logid, const struct iovec *iov, int iovcnt,
+			   size_t event_size);
+
+	void     blob_open(void);
+	bool     write_blob(const blob_ref_t &ref, const uint8_t *data);
+	bool     blob_intact(const blob_ref_t &ref);
+	bool     blob_matches(const blob_ref_t &ref, const uint8_t *data);
+	void     take_blob(uint16_t logid, uint16_t reporter,
+			   const blob_ref_t &ref);
+	void     release_blob(uint16_t logid, uint16_t reporter);
+	void     rehome_blob(blob_t &b);
+	void     collect_blobs(void);
+	size_t   meta_bytes(void);
+	void     account_meta(void);
+	void     sweep_blobs(void);
+	size_t   blob_disk_size(void);
+	bool     attach_blob(event_record_t **rec, size_t size, bool verify);
+
+	void     archive_open(void);
+	void     archive_load(uint32_t segment);
+	bool     write_segment(uint32_t segment, const vector<uint16_t> &ids,
+			       const vector<vector<uint8_t>> &images,
+			       vector<archive_loc_t> &locs,
+			       vector<uint32_t> &shares, size_t *bytes);
+	const vector<uint8_t> *archive_block(uint32_t segment, uint32_t block);
+	int      read_archived(uint16_t logid, event_record_t **rec,
+			       size_t *size, bool verify);
+	void     archive_drop(uint16_t logid);
+	void     archive_unlink(uint32_t segment);
+	size_t   archive_disk_size(void);
+
+	size_t   fsck_list(size_t budget);
+	size_t   fsck_check(uint16_t logid);
+	void     fsck_finish(void);
+	void     quarantine(const char *name);
+
+	void     note_write(uint16_t logid);
+	void     watch_event(uint32_t mask, const char *name);
+	bool     forget_log(uint16_t logid);
+
+	void     repl_load(void);
+	void     repl_save(void);
+	bool     repl_primary_frame(const repl_frame_t &f,
+				    const uint8_t *payload);
+	bool     repl_replica_frame(const repl_frame_t &f,
+				    const uint8_t *payload);
+	void     repl_resync_start(void);
+	void     repl_ship(void);
+	void     repl_put(uint64_t seq, const event_record_t *rec);
+	bool     repl_apply_put(uint16_t logid, const uint8_t *payload,
+				size_t len);
+	void     repl_apply_del(uint16_t logid);
+	void     repl_commit(void);
 };
+
+extern template class basic_event_manager<file_store>;
+extern template class basic_event_manager<memory_store>;
+
+typedef basic_event_manager<file_store> event_manager;
 #else
 typedef struct event_manager event_manager;
+typedef struct string_dict string_dict;
+typedef struct ingest_channel_t ingest_channel_t;
 #endif
 
 #ifdef __cplusplus
@@ -77,10 +563,62 @@ extern "C"  {
 #endif
 uint16_t message_create_new_log_event(event_manager *em, event_record_t *rec);
 int      message_load_log(event_manager *em, uint16_t logid, event_record_t **rec);
+int      message_load_verified_log(event_manager *em, uint16_t logid, event_record_t **rec);
 void     message_free_log(event_manager *em, event_record_t *rec);
 int      message_delete_log(event_manager *em, uint16_t logid);
 void     message_refresh_events(event_manager *em);
 uint16_t message_next_event(event_manager *em);
+int      message_parse_log(const uint8_t *buf, size_t len, event_record_t *rec);
+int      message_decode_log(const uint8_t *buf, size_t len, event_record_t *rec,
+			    const string_dict *dict);
+int      message_verify_log(const uint8_t *buf, size_t len);
+void     message_compact_start(event_manager *em);
+int      message_compact_step(event_manager *em, size_t budget);
+int      message_next_change(event_manager *em, uint16_t *logid);
+int      message_flush(event_manager *em);
+size_t   message_staged_size(event_manager *em);
+int      message_watch_start(event_manager *em);
+int      message_watch_process(event_manager *em);
+size_t   message_source_count(event_manager *em);
+int      message_source_usage(event_manager *em, size_t index, source_usage_t *usage);
+size_t   message_load_logs(event_manager *em, const uint16_t *ids, size_t n, event_record_t **recs);
+size_t   message_delete_logs(event_manager *em, const uint16_t *ids, size_t n);
+size_t   message_count_where(event_manager *em, const char *severity,
+			     const char *reportedby, uint64_t since,
+			     uint64_t until);
+int      message_list_where(event_manager *em, const char *severity,
+			    const char *reportedby, uint64_t since,
+			    uint64_t until, uint16_t **ids, size_t *n);
+int      message_delete_where(event_manager *em, const char *severity,
+			      const char *reportedby, uint64_t since,
+			      uint64_t until, const char *assocprefix,
+			      uint16_t **ids, size_t *n);
+size_t   message_expire(event_manager *em, time_t now);
+uint32_t message_next_expiry(event_manager *em);
+size_t   message_archive(event_manager *em, time_t now);
+int      message_rollup(event_manager *em, int resolution, time_t now,
+			message_rollup_t *r);
+void     message_free_rollup(message_rollup_t *r);
+size_t   message_search(event_manager *em, const char *query, uint32_t fields,
+			uint16_t *ids, size_t max, size_t *total);
+int      message_changes_since(event_manager *em, uint64_t since,
+			       message_change_t *out, int max, uint64_t *next);
+int      message_ingest_start(event_manager *em);
+uint16_t message_submit_log_event(event_manager *em, event_record_t *rec,
+				  ingest_channel_t *ch, void *ctx);
+size_t   message_commit_ingested(event_manager *em, uint16_t *ids, size_t max);
+size_t   message_ingest_pending(event_manager *em);
+ingest_channel_t *message_ingest_channel_new(void);
+int      message_ingest_channel_fd(ingest_channel_t *ch);
+int      message_ingest_channel_next(ingest_channel_t *ch, void **ctx,
+				     uint16_t *logid);
+void     message_ingest_channel_free(ingest_channel_t *ch);
+uint32_t message_archive_age(event_manager *em);
+int      message_replicate_to(event_manager *em, int fd);
+int      message_replicate_from(event_manager *em, int fd);
+int      message_replication_process(event_manager *em);
+void     message_replication_stop(event_manager *em);
+int      message_blob_path(const uint8_t *buf, const event_record_t *rec, char *path);
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,59 @@
+#include <cstddef>
+#include "mpsc_queue.hpp"
+
+using namespace std;
+
+mpsc_queue::mpsc_queue()
+{
+	stub.next.store(NULL, memory_order_relaxed);
+	head.store(&stub, memory_order_relaxed);
+	tail = &stub;
+}
+
+void mpsc_queue::push(mpsc_node *node)
+{
+	mpsc_node *prev;
+
+	node->next.store(NULL, memory_order_relaxed);
+	prev = head.exchange(node, memory_order_acq_rel);
+
+	// between the exchange and this store the queue looks cut short
+	prev->next.store(node, memory_order_release);
+
+	return;
+}
+
+mpsc_node *mpsc_queue::pop(void)
+{
+	mpsc_node *first = tail;
+	mpsc_node *next  = first->next.load(memory_order_acquire);
+
+	if (first == &stub) {
+		if (!next)
+			return NULL;
+
+		tail  = next;
+		first = next;
+		next  = next->next.load(memory_order_acquire);
+	}
+
+	if (next) {
+		tail = next;
+		return first;
+	}
+
+	// first looks like the last node, unless a push is under way
+	if (first != head.load(memory_order_acquire))
+		return NULL;
+
+	// put the stub behind it so first can be handed out
+	push(&stub);
+
+	next = first->next.load(memory_order_acquire);
+	if (next) {
+		tail = next;
+		return first;
+	}
+
+	return NULL;
+}
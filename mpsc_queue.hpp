@@ -0,0 +1,28 @@
+#ifndef __MPSC_QUEUE_HPP__
+#define __MPSC_QUEUE_HPP__
+
+#include <atomic>
+
+/* Intrusive multi producer, single consumer queue (Vyukov).  push()   */
+/* is one atomic exchange and a store, so producers never wait on each */
+/* other or on the consumer.  pop() belongs to a single thread and can */
+/* return NULL while a push is half done; the producer finishes it     */
+/* within a few instructions, so the consumer simply tries again on    */
+/* its next wakeup.                                                    */
+struct mpsc_node {
+	std::atomic<mpsc_node*> next;
+};
+
+class mpsc_queue {
+	std::atomic<mpsc_node*> head; // most recently pushed
+	mpsc_node *tail;              // next to pop, consumer only
+	mpsc_node  stub;
+
+public:
+	mpsc_queue();
+
+	void       push(mpsc_node *node);
+	mpsc_node *pop(void);
+};
+
+#endif
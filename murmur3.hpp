@@ -0,0 +1,11 @@
+#ifndef __MURMUR3_HPP__
+#define __MURMUR3_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+/* MurmurHash3_x64_128, identical output to the reference implementation */
+/* on little endian targets.  Not cryptographic, used to name blobs.     */
+void murmur3_128(const void *buf, size_t len, uint32_t seed, uint64_t out[2]);
+
+#endif
@@ -0,0 +1,152 @@
+#include <cerrno>
+#include <cstring>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "crc32c.hpp"
+#include "repl_link.hpp"
+
+using namespace std;
+
+const uint32_t g_repl_magic = 0x4c504552; // REPL
+
+// sanity limit on a payload, well past any record the daemon accepts
+const uint32_t g_repl_maxframe = 16 * 1024 * 1024;
+
+// most read by one fill(), so a fast peer cannot hog the loop
+const size_t g_repl_maxfill = 1024 * 1024;
+
+
+static uint32_t frame_crc(const repl_frame_t &f, const uint8_t *payload)
+{
+	uint32_t crc = crc32c(0, &f, offsetof(repl_frame_t, crc));
+
+	return crc32c(crc, payload, f.len);
+}
+
+repl_link::repl_link() : fd(-1), outpos(0), inpos(0)
+{
+}
+
+void repl_link::attach(int sock)
+{
+	close();
+	fd = sock;
+
+	return;
+}
+
+void repl_link::close(void)
+{
+	fd = -1;
+	out.clear();
+	in.clear();
+	outpos = inpos = 0;
+
+	return;
+}
+
+void repl_link::queue(uint8_t type, uint64_t seq, uint16_t logid,
+		      const struct iovec *iov, int iovcnt)
+{
+	repl_frame_t f;
+	size_t at;
+
+	memset(&f, 0, sizeof(f));
+	f.magic = g_repl_magic;
+	f.type  = type;
+	f.logid = logid;
+	f.seq   = seq;
+
+	for (int i = 0; i < iovcnt; i++)
+		f.len += iov[i].iov_len;
+
+	// the header goes in first and gets its crc once the payload is in
+	at = out.size();
+	out.resize(at + sizeof(f));
+
+	for (int i = 0; i < iovcnt; i++) {
+		const uint8_t *base = (const uint8_t*) iov[i].iov_base;
+
+		out.insert(out.end(), base, base + iov[i].iov_len);
+	}
+
+	f.crc = frame_crc(f, &out[at + sizeof(f)]);
+	memcpy(&out[at], &f, sizeof(f));
+
+	return;
+}
+
+bool repl_link::flush(void)
+{
+	ssize_t n;
+
+	while (fd >= 0 && outpos < out.size()) {
+		n = send(fd, &out[outpos], out.size() - outpos, MSG_NOSIGNAL);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+
+		outpos += n;
+	}
+
+	if (outpos == out.size()) {
+		out.clear();
+		outpos = 0;
+	}
+
+	return fd >= 0;
+}
+
+bool repl_link::fill(void)
+{
+	size_t got = 0;
+	ssize_t n;
+
+	if (fd < 0)
+		return false;
+
+	// frames handed out by next() are done with now
+	in.erase(in.begin(), in.begin() + inpos);
+	inpos = 0;
+
+	while (got < g_repl_maxfill) {
+		size_t at = in.size();
+
+		in.resize(at + 64 * 1024);
+		n = recv(fd, &in[at], 64 * 1024, 0);
+		in.resize(at + (n > 0 ? n : 0));
+
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK;
+		if (n == 0)
+			return false;
+
+		got += n;
+	}
+
+	return true;
+}
+
+int repl_link::next(repl_frame_t *f, const uint8_t **payload)
+{
+	if (in.size() - inpos < sizeof(*f))
+		return 0;
+
+	memcpy(f, &in[inpos], sizeof(*f));
+
+	if (f->magic != g_repl_magic || f->len > g_repl_maxframe)
+		return -1;
+	if (in.size() - inpos - sizeof(*f) < f->len)
+		return 0;
+
+	*payload = &in[inpos + sizeof(*f)];
+	if (f->crc != frame_crc(*f, *payload))
+		return -1;
+
+	inpos += sizeof(*f) + f->len;
+
+	return 1;
+}
@@ -0,0 +1,65 @@
+#ifndef __REPL_LINK_HPP__
+#define __REPL_LINK_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <sys/uio.h>
+
+/* Frames sent between a primary and its replica, see event_replicate.cpp */
+enum {
+	REPL_HELLO = 1,  // replica: where it is, a repl_hello_t
+	REPL_ACK,        // replica: everything up to seq is on its flash
+	REPL_RESYNC,     // primary: source id, then every logid it holds
+	REPL_PUT,        // primary: the record logid, a repl_record_t
+	REPL_DEL,        // primary: logid is gone
+	REPL_SYNCED,     // primary: the resync is complete as of seq
+};
+
+/* Every frame starts with this, its payload follows.  Both ends are  */
+/* the same kind of BMC, so fields are in host byte order as they are */
+/* in the records themselves.                                         */
+struct repl_frame_t {
+	uint32_t magic;
+	uint8_t  type;
+	uint8_t  reserved;
+	uint16_t logid;
+	uint32_t len;     // of the payload
+	uint32_t crc;     // CRC32C of the header up to here and the payload
+	uint64_t seq;     // journal number of the primary's change
+};
+
+/* Buffered, non-blocking framing over a connected stream socket.  The */
+/* fd stays the caller's, close() only forgets it.  Frames are queued  */
+/* whole and written as the socket takes them; what is read is kept    */
+/* until a whole frame is there.                                       */
+class repl_link {
+	int fd;
+	std::vector<uint8_t> out;
+	size_t outpos;     // sent so far
+	std::vector<uint8_t> in;
+	size_t inpos;      // parsed so far
+
+public:
+	repl_link();
+	repl_link(const repl_link &) = delete;
+	repl_link &operator=(const repl_link &) = delete;
+
+	void attach(int fd);
+	void close(void);
+	bool is_open(void) const { return fd >= 0; }
+
+	void   queue(uint8_t type, uint64_t seq, uint16_t logid,
+		     const struct iovec *iov, int iovcnt);
+	size_t queued(void) const { return out.size() - outpos; }
+
+	// false when the peer has gone or the socket failed
+	bool flush(void);
+	bool fill(void);
+
+	// 1 with the next frame, its payload valid until the next fill(),
+	// 0 until a whole one has arrived, -1 if the stream is damaged
+	int next(repl_frame_t *f, const uint8_t **payload);
+};
+
+#endif
@@ -0,0 +1,120 @@
+#include "rollup_rings.hpp"
+
+using namespace std;
+
+// an hour of minutes, two days of hours and a month of days
+static const uint32_t g_widths[]  = { 60, 3600, 86400 };
+static const uint32_t g_buckets[] = { 60, 48, 31 };
+static const uint32_t g_offsets[] = { 0, 60, 108, 139 };
+
+
+uint32_t rollup_rings::width(int res)
+{
+	return g_widths[res];
+}
+
+uint32_t rollup_rings::buckets(int res)
+{
+	return g_buckets[res];
+}
+
+rollup_rings::rollup_rings()
+{
+}
+
+void rollup_rings::clear(void)
+{
+	cells.clear();
+
+	return;
+}
+
+vector<rollup_rings::bucket_t> &rollup_rings::cell(uint16_t severity,
+						   uint16_t reporter)
+{
+	if (severity >= cells.size())
+		cells.resize(severity + 1);
+
+	auto &row = cells[severity];
+
+	if (reporter >= row.size())
+		row.resize(reporter + 1);
+
+	// period 0 is 1970, nothing that old is ever counted
+	if (row[reporter].empty())
+		row[reporter].assign(g_offsets[resolutions], bucket_t{0, 0});
+
+	return row[reporter];
+}
+
+void rollup_rings::add(uint16_t severity, uint16_t reporter, uint32_t timestamp)
+{
+	vector<bucket_t> &c = cell(severity, reporter);
+
+	for (int res = 0; res < resolutions; res++) {
+		uint32_t period = timestamp / g_widths[res];
+		bucket_t &b = c[g_offsets[res] + period % g_buckets[res]];
+
+		// the ring has moved past this event already
+		if (period < b.period)
+			continue;
+
+		if (period > b.period) {
+			b.period = period;
+			b.count  = 0;
+		}
+
+		b.count++;
+	}
+
+	return;
+}
+
+void rollup_rings::remove(uint16_t severity, uint16_t reporter,
+			  uint32_t timestamp)
+{
+	if (severity >= cells.size() || reporter >= cells[severity].size() ||
+	    cells[severity][reporter].empty())
+		return;
+
+	vector<bucket_t> &c = cells[severity][reporter];
+
+	for (int res = 0; res < resolutions; res++) {
+		uint32_t period = timestamp / g_widths[res];
+		bucket_t &b = c[g_offsets[res] + period % g_buckets[res]];
+
+		if (period == b.period && b.count)
+			b.count--;
+	}
+
+	return;
+}
+
+uint32_t rollup_rings::series(int res, uint32_t now, size_t severities,
+			      size_t reporters, vector<uint32_t> &counts) const
+{
+	uint32_t n = g_buckets[res];
+	uint32_t last = now / g_widths[res];
+	uint32_t first = last >= n - 1 ? last - (n - 1) : 0;
+
+	counts.assign(severities * reporters * n, 0);
+
+	for (size_t s = 0; s < severities && s < cells.size(); s++) {
+		for (size_t r = 0; r < reporters && r < cells[s].size(); r++) {
+			const vector<bucket_t> &c = cells[s][r];
+			uint32_t *out = &counts[(s * reporters + r) * n];
+
+			if (c.empty())
+				continue;
+
+			for (uint32_t p = first; p <= last; p++) {
+				const bucket_t &b = c[g_offsets[res] + p % n];
+
+				if (b.period == p)
+					out[p - first] = b.count;
+			}
+		}
+	}
+
+	return first * g_widths[res];
+}
@@ -0,0 +1,48 @@
+#ifndef __ROLLUP_RINGS_HPP__
+#define __ROLLUP_RINGS_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/* Event counts by severity and reporter code over recent minutes,    */
+/* hours and days.  Each (severity, reporter) cell has a ring of       */
+/* buckets per resolution; a bucket remembers which period it counts,  */
+/* so one that has come round again is reset the first time it is     */
+/* written and reads as 0 until then.  Adding or removing an event is  */
+/* a bucket update per resolution, and nothing ever has to be aged     */
+/* out.  Events older than a ring reaches are not counted in it.      */
+class rollup_rings {
+public:
+	enum { minutes, hours, days, resolutions };
+
+	static uint32_t width(int res);    // seconds per bucket
+	static uint32_t buckets(int res);  // buckets in the ring
+
+private:
+	struct bucket_t {
+		uint32_t period;  // timestamp / width of what count covers
+		uint32_t count;
+	};
+
+	// cells[severity][reporter], every ring of a cell back to back
+	std::vector<std::vector<std::vector<bucket_t>>> cells;
+
+	std::vector<bucket_t> &cell(uint16_t severity, uint16_t reporter);
+
+public:
+	rollup_rings();
+
+	void add(uint16_t severity, uint16_t reporter, uint32_t timestamp);
+	void remove(uint16_t severity, uint16_t reporter, uint32_t timestamp);
+	void clear(void);
+
+	// the buckets(res) periods ending with the one holding now, oldest
+	// first, as counts[(severity * reporters + reporter) * buckets(res)
+	// + bucket] for every code below severities and reporters.
+	// Returns the start of the oldest period.
+	uint32_t series(int res, uint32_t now, size_t severities,
+			size_t reporters, std::vector<uint32_t> &counts) const;
+};
+
+#endif
@@ -0,0 +1,186 @@
+#include <cstring>
+#include <vector>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "crc32c.hpp"
+#include "string_dict.hpp"
+
+/* Entry layout, the string follows with its terminating NUL */
+struct dict_entry_t {
+	uint32_t crc;   // CRC32C of the string
+	uint16_t len;   // including the NUL
+	uint16_t reserved;
+};
+
+// longer strings are stored in the record itself
+const size_t g_dict_maxlen = 64;
+
+// a full dictionary stops handing out codes, which bounds its size
+const size_t g_dict_max = 512;
+
+
+string_dict::string_dict() : fd(-1), writable(false), loaded(0)
+{
+}
+
+string_dict::~string_dict()
+{
+	close();
+}
+
+bool string_dict::open(int dirfd, const char *name, bool rw)
+{
+	struct stat st;
+
+	close();
+
+	writable = rw;
+	fd = openat(dirfd, name, rw ? O_RDWR | O_CREAT | O_CLOEXEC
+				    : O_RDONLY | O_CLOEXEC, 0644);
+	if (fd < 0)
+		return false;
+
+	if (!writable) {
+		read_tail();
+		return true;
+	}
+
+	// a torn append is cut off before anyone can write after it
+	flock(fd, LOCK_EX);
+	read_tail();
+
+	if (fstat(fd, &st) == 0 && (size_t) st.st_size > loaded) {
+		syslog(LOG_WARNING, "string dictionary %s has %zu bytes of "
+		       "damaged tail, truncating", name, st.st_size - loaded);
+		if (ftruncate(fd, loaded) < 0)
+			syslog(LOG_ERR, "could not truncate %s", name);
+	}
+
+	flock(fd, LOCK_UN);
+
+	return true;
+}
+
+void string_dict::close(void)
+{
+	if (fd >= 0)
+		::close(fd);
+
+	fd = -1;
+	loaded = 0;
+	strings.clear();
+	codes.clear();
+
+	return;
+}
+
+/* Parses whatever follows the entries already loaded, stopping at the */
+/* first one that is incomplete or damaged                             */
+bool string_dict::read_tail(void)
+{
+	struct stat st;
+	dict_entry_t ent;
+	size_t pos = 0, before = strings.size();
+
+	if (fd < 0 || fstat(fd, &st) < 0 || (size_t) st.st_size <= loaded)
+		return false;
+
+	std::vector<uint8_t> buf(st.st_size - loaded);
+
+	if (pread(fd, buf.data(), buf.size(), loaded) != (ssize_t) buf.size())
+		return false;
+
+	while (pos + sizeof(ent) <= buf.size()) {
+		const char *s = (const char*) buf.data() + pos + sizeof(ent);
+
+		memcpy(&ent, buf.data() + pos, sizeof(ent));
+
+		if (ent.len == 0 || pos + sizeof(ent) + ent.len > buf.size())
+			break;
+		if (strnlen(s, ent.len) != (size_t) ent.len - 1)
+			break;
+		if (ent.crc != crc32c(0, s, ent.len))
+			break;
+		if (strings.size() > UINT16_MAX)
+			break;
+
+		strings.emplace_back(s);
+		codes.emplace(strings.back(), strings.size() - 1);
+		pos += sizeof(ent) + ent.len;
+	}
+
+	loaded += pos;
+
+	return strings.size() != before;
+}
+
+bool string_dict::refresh(void)
+{
+	return read_tail();
+}
+
+int string_dict::code(const char *s)
+{
+	std::vector<uint8_t> buf;
+	dict_entry_t ent;
+	struct stat st;
+	size_t len = strlen(s) + 1;
+	int c;
+
+	if ((c = lookup(s)) >= 0)
+		return c;
+
+	if (fd < 0 || !writable || len > g_dict_maxlen)
+		return -1;
+
+	if (flock(fd, LOCK_EX) < 0)
+		return -1;
+
+	// someone else may have added it, or anything else, meanwhile
+	read_tail();
+
+	if ((c = lookup(s)) < 0 && strings.size() < g_dict_max) {
+		memset(&ent, 0, sizeof(ent));
+		ent.len = len;
+		ent.crc = crc32c(0, s, len);
+
+		buf.resize(sizeof(ent) + len);
+		memcpy(buf.data(), &ent, sizeof(ent));
+		memcpy(buf.data() + sizeof(ent), s, len);
+
+		if (fstat(fd, &st) == 0 && (size_t) st.st_size != loaded &&
+		    ftruncate(fd, loaded) < 0)
+			buf.clear();
+
+		// records will refer to the code, it has to be on flash first
+		if (!buf.empty() &&
+		    pwrite(fd, buf.data(), buf.size(), loaded) == (ssize_t) buf.size() &&
+		    fdatasync(fd) == 0) {
+			strings.emplace_back(s);
+			codes.emplace(strings.back(), strings.size() - 1);
+			loaded += buf.size();
+			c = strings.size() - 1;
+		} else if (ftruncate(fd, loaded) < 0) {
+			syslog(LOG_ERR, "string dictionary append failed");
+		}
+	}
+
+	flock(fd, LOCK_UN);
+
+	return c;
+}
+
+int string_dict::lookup(const char *s) const
+{
+	auto it = codes.find(s);
+
+	return it == codes.end() ? -1 : it->second;
+}
+
+const char *string_dict::str(uint16_t code) const
+{
+	return code < strings.size() ? strings[code].c_str() : NULL;
+}
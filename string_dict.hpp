@@ -0,0 +1,49 @@
+#ifndef __STRING_DICT_HPP__
+#define __STRING_DICT_HPP__
+
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+
+/* Persistent string dictionary.  Each distinct string is appended to  */
+/* the file once and its code is its position there, so codes never   */
+/* change and can be stored in records.  Appends are taken under an    */
+/* flock and the tail written by other processes is read first, so     */
+/* several writers of one store agree on every code.  The strings are  */
+/* held in a deque and never move: str() pointers stay valid for the   */
+/* life of the dictionary and are shared by every record decoded       */
+/* through it.                                                         */
+class string_dict {
+	int    fd;
+	bool   writable;
+	size_t loaded;  // bytes of the file parsed so far
+
+	std::deque<std::string> strings;
+	std::unordered_map<std::string, uint16_t> codes;
+
+	bool read_tail(void);
+
+public:
+	string_dict();
+	~string_dict();
+	string_dict(const string_dict &) = delete;
+	string_dict &operator=(const string_dict &) = delete;
+
+	// the file is created when writable is set
+	bool open(int dirfd, const char *name, bool writable);
+	void close(void);
+	bool is_open(void) const { return fd >= 0; }
+
+	// picks up entries appended by others, true if there were any
+	bool refresh(void);
+
+	// adds s if it is new, -1 when it cannot be stored
+	int         code(const char *s);
+	int         lookup(const char *s) const;
+	const char *str(uint16_t code) const; // NULL if unknown
+	size_t      size(void) const { return strings.size(); }
+	size_t      bytes(void) const { return loaded; }
+};
+
+#endif
@@ -1,10 +1,30 @@
 #include "message.hpp"
+#include "log_queue.hpp"
+#include "murmur3.hpp"
 #include <gtest/gtest.h>
 #include <stdlib.h>
+#include <fstream>
+#include <iterator>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <numeric>
+#include <random>
+#include <thread>
 
 namespace {
     uint8_t p[] ={0x3, 0x32, 0x34, 0x36};
 
+    // the change journal is charged at its full length from the start
+    const size_t g_journal_bytes =
+        change_journal::file_size(MESSAGE_JOURNAL_SLOTS);
+
 event_record_t build_event_record(
         const char* message,
         const char* severity,
@@ -79,6 +99,32 @@ public:
         }
         free(cmd);
     }
+    size_t dictBytes()
+    {
+        std::string path = std::string(eventsDir) + "/" + MESSAGE_DICT_FILE;
+        struct stat st;
+
+        return stat(path.c_str(), &st) == 0 ? st.st_size : 0;
+    }
+    /* everything besides the records the store is charged for */
+    size_t metaBytes()
+    {
+        return metaBytes(eventsDir);
+    }
+    size_t metaBytes(const char *dir)
+    {
+        const char *files[] = { MESSAGE_DICT_FILE, MESSAGE_JOURNAL_FILE,
+                                MESSAGE_REPL_FILE };
+        size_t bytes = 0;
+        struct stat st;
+
+        for (const char *f : files) {
+            std::string path = std::string(dir) + "/" + f;
+            if (stat(path.c_str(), &st) == 0)
+                bytes += st.st_size;
+        }
+        return bytes;
+    }
 };
 
 class TestEventManager : public TestEnv
@@ -108,7 +154,7 @@ TEST_F(TestEventManager, ConstructDestruct)
 }
 
 TEST_F(TestEventManager, BuildEventLogZero) {
-   EXPECT_EQ(0, eventManager.get_managed_size());
+   EXPECT_EQ(metaBytes(), eventManager.get_managed_size());
    EXPECT_EQ(0, eventManager.next_log());
    eventManager.next_log_refresh();
    EXPECT_EQ(0, eventManager.next_log());
@@ -119,7 +165,7 @@ TEST_F(TestEventManager, BuildEventLogZero) {
 TEST_F(TestEventManager, BuildEventLogOne) {
    auto msgId = prepareEventLog1();
    EXPECT_EQ(1,  msgId);
-   EXPECT_EQ(75, eventManager.get_managed_size());
+   EXPECT_EQ(61 + metaBytes(), eventManager.get_managed_size());
    EXPECT_EQ(1,  eventManager.log_count());
    EXPECT_EQ(1,  eventManager.latest_log_id());
    eventManager.next_log_refresh();
@@ -134,7 +180,7 @@ TEST_F(TestEventManager, BuildEventLogTwo) {
    EXPECT_EQ(1, msgId);
    msgId = prepareEventLog2();
    EXPECT_EQ(2, msgId);
-   EXPECT_EQ(150, eventManager.get_managed_size());
+   EXPECT_EQ(122 + metaBytes(), eventManager.get_managed_size());
    EXPECT_EQ(2,   eventManager.log_count());
    EXPECT_EQ(2,   eventManager.latest_log_id());
    eventManager.next_log_refresh();
@@ -169,7 +215,7 @@ TEST_F(TestEventManager, DeleteLogOne) {
    msgId = prepareEventLog2();
    EXPECT_EQ(2, msgId);
    EXPECT_EQ(0, eventManager.remove(1));
-   EXPECT_EQ(75, eventManager.get_managed_size());
+   EXPECT_EQ(61 + metaBytes(), eventManager.get_managed_size());
 
    event_manager eventq(eventsDir, 0, 0);
    EXPECT_EQ(2, eventq.latest_log_id());
@@ -193,21 +239,21 @@ TEST_F(TestEventManager, TraverseLogListOne) {
    EXPECT_NE(0, eventb.next_log());
 }
 
-TEST_F(TestEnv, MaxLimitSize76) {
+TEST_F(TestEnv, MaxLimitSize62) {
 
-   event_manager eventd(eventsDir, 75, 0);
+   event_manager eventd(eventsDir, 61 + 46 + g_journal_bytes, 0);
    auto rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(0, eventd.create(&rec));
 
-   event_manager evente(eventsDir, 76, 0);
+   event_manager evente(eventsDir, 62 + 46 + g_journal_bytes, 0);
    rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(1, evente.create(&rec));
 }
 
-TEST_F(TestEnv, MaxLimitSize149) {
-   event_manager eventf(eventsDir, 149, 0);
+TEST_F(TestEnv, MaxLimitSize122) {
+   event_manager eventf(eventsDir, 122 + g_journal_bytes, 0);
    auto rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(1, eventf.create(&rec));
@@ -215,7 +261,7 @@ TEST_F(TestEnv, MaxLimitSize149) {
 }
 
 TEST_F(TestEnv, MaxLimitLog1) {
-   event_manager eventg(eventsDir, 300, 1);
+   event_manager eventg(eventsDir, 300 + g_journal_bytes, 1);
    auto rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(1, eventg.create(&rec));
@@ -224,7 +270,7 @@ TEST_F(TestEnv, MaxLimitLog1) {
 }
 
 TEST_F(TestEnv, MaxLimitLog3) {
-   event_manager eventh(eventsDir, 600, 3);
+   event_manager eventh(eventsDir, 600 + g_journal_bytes, 3);
    auto rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(1, eventh.create(&rec));
@@ -238,7 +284,7 @@ TEST_F(TestEnv, MaxLimitLog3) {
 /* You should not be able to create new logs until the log size  */
 /* dips below the request number                                 */
 TEST_F(TestEnv, CreateLogsRestartSetOne) {
-   event_manager eventi(eventsDir, 600, 3);
+   event_manager eventi(eventsDir, 600 + g_journal_bytes, 3);
    auto rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(1, eventi.create(&rec));
@@ -247,7 +293,7 @@ TEST_F(TestEnv, CreateLogsRestartSetOne) {
    EXPECT_EQ(0, eventi.create(&rec));
    EXPECT_EQ(3, eventi.log_count());
 
-   event_manager eventj(eventsDir, 600, 1);
+   event_manager eventj(eventsDir, 600 + g_journal_bytes, 1);
    EXPECT_EQ(3, eventj.log_count());
    EXPECT_EQ(0, eventj.create(&rec));
    EXPECT_EQ(3, eventj.log_count());
@@ -268,14 +314,1433 @@ TEST_F(TestEnv, CreateLogsRestartSetOne) {
 /* You should not be able to create new logs until the log size  */
 /* dips below the request number                                 */
 TEST_F(TestEnv, CreateLogsRestartSetTwo) {
-   event_manager eventk(eventsDir, 600, 100);
+   event_manager eventk(eventsDir, 600 + g_journal_bytes, 100);
    auto rec = build_event_record("Testing Message1", "Info",
                             "Association", "Test", p, 4);
    EXPECT_EQ(1, eventk.create(&rec));
    EXPECT_EQ(2, eventk.create(&rec));
-   /* Now we have consumed 150 bytes */
-   event_manager eventl(eventsDir, 151, 100);
+   /* Now we have consumed 122 bytes, 46 of .dict and the journal */
+   event_manager eventl(eventsDir, 123 + 46 + g_journal_bytes, 100);
    EXPECT_EQ(0, eventl.create(&rec));
    EXPECT_EQ(0, eventl.remove(2));
    EXPECT_EQ(4, eventl.create(&rec));
 }
+
+/* The metadata table answers counts without touching the records */
+TEST_F(TestEventManager, CountBySeverity) {
+   auto info = build_event_record("Testing Message1", "Info",
+                            "Association", "Test", p, 4);
+   auto crit = build_event_record("Testing Message2", "Critical",
+                            "Association", "Host", p, 4);
+   EXPECT_EQ(1, eventManager.create(&info));
+   EXPECT_EQ(2, eventManager.create(&crit));
+   EXPECT_EQ(3, eventManager.create(&crit));
+
+   event_filter_t f = event_filter_all();
+   EXPECT_EQ(3, eventManager.count_logs(f));
+
+   f.severity = eventManager.severity_code("Critical");
+   EXPECT_EQ(2, eventManager.count_logs(f));
+
+   std::vector<uint16_t> ids;
+   EXPECT_EQ(2, eventManager.filter_logs(f, ids));
+   EXPECT_EQ(2, ids[0]);
+   EXPECT_EQ(3, ids[1]);
+
+   f = event_filter_all();
+   f.reporter = eventManager.reporter_code("Test");
+   EXPECT_EQ(1, eventManager.count_logs(f));
+
+   f = event_filter_all();
+   f.severity = eventManager.severity_code("Warning");
+   EXPECT_EQ(g_filter_none, f.severity);
+   EXPECT_EQ(0, eventManager.count_logs(f));
+   ids.clear();
+   EXPECT_EQ(0, eventManager.filter_logs(f, ids));
+
+   EXPECT_EQ(0, eventManager.remove(2));
+   f = event_filter_all();
+   f.severity = eventManager.severity_code("Critical");
+   EXPECT_EQ(1, eventManager.count_logs(f));
+}
+
+/* A restarted manager rebuilds the table from the stored records */
+TEST_F(TestEventManager, CountAfterRestart) {
+   auto crit = build_event_record("Testing Message1", "Critical",
+                            "Association", "Test", p, 4);
+   EXPECT_EQ(1, eventManager.create(&crit));
+   EXPECT_EQ(2, eventManager.create(&crit));
+
+   event_manager eventq(eventsDir, 0, 0);
+   event_filter_t f = event_filter_all();
+   f.severity = eventq.severity_code("Critical");
+   f.since = crit.timestamp;
+   EXPECT_EQ(2, eventq.count_logs(f));
+   f.since = crit.timestamp + 1;
+   EXPECT_EQ(0, eventq.count_logs(f));
+}
+
+/* Parsing an in memory image must never trust the stored lengths */
+TEST_F(TestEventManager, ParseTruncatedLog) {
+   EXPECT_EQ(1, prepareEventLog1());
+
+   std::string fn = std::string(eventsDir) + "/1";
+   std::ifstream f(fn, std::ios::binary);
+   std::vector<uint8_t> image((std::istreambuf_iterator<char>(f)),
+                              std::istreambuf_iterator<char>());
+   ASSERT_EQ(61, image.size());
+
+   string_dict dict;
+   int dirfd = open(eventsDir, O_RDONLY | O_DIRECTORY);
+   ASSERT_TRUE(dict.open(dirfd, MESSAGE_DICT_FILE, false));
+   close(dirfd);
+
+   event_record_t rec;
+   EXPECT_EQ(61, message_decode_log(image.data(), image.size(), &rec, &dict));
+   EXPECT_STREQ("Testing Message1", rec.message);
+   EXPECT_STREQ("Test", rec.reportedby);
+   EXPECT_EQ(4, rec.n);
+
+   /* coded strings cannot be resolved without the dictionary */
+   EXPECT_EQ(0, message_parse_log(image.data(), image.size(), &rec));
+
+   EXPECT_EQ(0, message_decode_log(image.data(), image.size() - 1, &rec, &dict));
+   EXPECT_EQ(0, message_decode_log(image.data(), 20, &rec, &dict));
+}
+
+/* A flipped bit is only caught when the caller asks for verification */
+TEST_F(TestEventManager, VerifyCorruptLog) {
+   EXPECT_EQ(1, prepareEventLog1());
+
+   std::string fn = std::string(eventsDir) + "/1";
+   std::fstream f(fn, std::ios::binary | std::ios::in | std::ios::out);
+   f.seekp(40);
+   f.put('X');
+   f.close();
+
+   event_record_t *prec;
+   EXPECT_EQ(0, eventManager.corrupt_count());
+   EXPECT_EQ(1, eventManager.open(1, &prec));
+   eventManager.close(prec);
+   EXPECT_EQ(0, eventManager.open(1, &prec, true));
+   EXPECT_EQ(1, eventManager.corrupt_count());
+
+   EXPECT_EQ(2, prepareEventLog2());
+   EXPECT_EQ(2, eventManager.open(2, &prec, true));
+   EXPECT_STREQ("Testing Message2", prec->message);
+   eventManager.close(prec);
+}
+
+/* A record whose lengths run past the end of the file is rejected */
+TEST_F(TestEventManager, OpenTruncatedLog) {
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(0, truncate((std::string(eventsDir) + "/1").c_str(), 60));
+
+   event_record_t *prec;
+   EXPECT_EQ(0, eventManager.open(1, &prec));
+   EXPECT_EQ(1, eventManager.corrupt_count());
+}
+
+/* fsck quarantines damaged records, drops empty ones, trims slack and */
+/* fixes up the accounting the constructor derived from the directory  */
+TEST_F(TestEventManager, FsckRepairsStore) {
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, prepareEventLog2());
+   EXPECT_EQ(3, prepareEventLog1());
+   std::string dir(eventsDir);
+
+   /* 1 gets trailing garbage, 2 a flipped bit, 9 is empty, plus a stray */
+   std::ofstream(dir + "/1", std::ios::app | std::ios::binary) << "junk";
+   std::fstream f(dir + "/2", std::ios::binary | std::ios::in | std::ios::out);
+   f.seekp(40);
+   f.put('X');
+   f.close();
+   std::ofstream(dir + "/9").close();
+   std::ofstream(dir + "/core.1234") << "x";
+
+   event_manager eventq(eventsDir, 0, 0);
+   EXPECT_EQ(3, eventq.log_count());
+   EXPECT_EQ(187 + metaBytes(), eventq.get_managed_size());
+
+   eventq.fsck();
+   EXPECT_FALSE(eventq.fsck_active());
+   EXPECT_EQ(4, eventq.fsck_stats().checked);
+   EXPECT_EQ(2, eventq.fsck_stats().quarantined);
+   EXPECT_EQ(1, eventq.fsck_stats().emptied);
+   EXPECT_EQ(1, eventq.fsck_stats().trimmed);
+
+   EXPECT_EQ(2, eventq.log_count());
+   EXPECT_EQ(122 + metaBytes(), eventq.get_managed_size());
+   EXPECT_EQ(3, eventq.latest_log_id());
+
+   uint16_t id;
+   EXPECT_EQ(MESSAGE_LOG_REMOVED, eventq.next_change(&id));
+   EXPECT_EQ(2, id);
+   EXPECT_EQ(0, eventq.next_change(&id));
+
+   event_record_t *prec;
+   EXPECT_EQ(1, eventq.open(1, &prec, true));
+   eventq.close(prec);
+
+   /* a logid damaged again keeps the earlier evidence */
+   std::ofstream(dir + "/2") << "still not a record";
+   eventq.fsck();
+   EXPECT_EQ(1, eventq.fsck_stats().quarantined);
+   struct stat st;
+   EXPECT_EQ(0, stat((dir + "/.quarantine/2").c_str(), &st));
+   EXPECT_EQ(0, stat((dir + "/.quarantine/2.1").c_str(), &st));
+   EXPECT_EQ((off_t) strlen("still not a record"), st.st_size);
+}
+
+/* A pass can be spread over many small steps */
+TEST_F(TestEventManager, FsckIncremental) {
+   for (int i = 1; i <= 10; i++)
+      EXPECT_EQ(i, prepareEventLog1());
+   EXPECT_EQ(0, truncate((std::string(eventsDir) + "/4").c_str(), 10));
+
+   eventManager.fsck_start();
+   int steps = 1;
+   while (!eventManager.fsck_step(100))
+      steps++;
+   EXPECT_GT(steps, 5);
+   EXPECT_EQ(1, eventManager.fsck_stats().quarantined);
+   EXPECT_EQ(9, eventManager.log_count());
+   EXPECT_EQ(9 * 61 + metaBytes(), eventManager.get_managed_size());
+}
+
+/* Staged logs read back like flushed ones and only hit disk on flush */
+TEST_F(TestEventManager, StagedLogs) {
+   eventManager.set_staging(1000);
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, prepareEventLog2());
+   EXPECT_EQ(122, eventManager.staged_size());
+   EXPECT_EQ(122 + metaBytes(), eventManager.get_managed_size());
+   EXPECT_EQ(2, eventManager.log_count());
+
+   struct stat st;
+   std::string fn = std::string(eventsDir) + "/1";
+   EXPECT_NE(0, stat(fn.c_str(), &st));
+
+   event_record_t *prec;
+   EXPECT_EQ(2, eventManager.open(2, &prec, true));
+   EXPECT_STREQ("Testing Message2", prec->message);
+   eventManager.close(prec);
+
+   eventManager.next_log_refresh();
+   EXPECT_NE(0, eventManager.next_log());
+   EXPECT_NE(0, eventManager.next_log());
+   EXPECT_EQ(0, eventManager.next_log());
+
+   /* removed before the flush, so it never reaches the disk */
+   EXPECT_EQ(0, eventManager.remove(2));
+   EXPECT_EQ(0, eventManager.flush());
+   EXPECT_EQ(0, eventManager.staged_size());
+   EXPECT_EQ(0, stat(fn.c_str(), &st));
+   EXPECT_NE(0, stat((std::string(eventsDir) + "/2").c_str(), &st));
+
+   event_manager eventq(eventsDir, 0, 0);
+   EXPECT_EQ(1, eventq.log_count());
+   EXPECT_EQ(61 + metaBytes(), eventq.get_managed_size());
+}
+
+/* Crossing the watermark flushes the whole batch */
+TEST_F(TestEventManager, StagedWatermark) {
+   eventManager.set_staging(150);
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, prepareEventLog1());
+   EXPECT_EQ(122, eventManager.staged_size());
+   EXPECT_EQ(3, prepareEventLog1());
+   EXPECT_EQ(0, eventManager.staged_size());
+   EXPECT_EQ(183 + metaBytes(), eventManager.get_managed_size());
+}
+
+TEST_F(TestEventManager, WatchExternalLogs) {
+   EXPECT_LE(0, eventManager.watch_start());
+   EXPECT_EQ(1, prepareEventLog1());
+
+   /* our own write is not reported back */
+   EXPECT_EQ(0, eventManager.watch_process());
+
+   /* a second writer stands in for another tool on the BMC */
+   auto rec = build_event_record("Testing Message2", "Info",
+                       "Association", "Test", p, 4);
+   {
+      event_manager other(eventsDir, 0, 0);
+      EXPECT_EQ(2, other.create(&rec));
+   }
+
+   uint16_t logid;
+   EXPECT_EQ(1, eventManager.watch_process());
+   EXPECT_EQ(MESSAGE_LOG_ADDED, eventManager.next_change(&logid));
+   EXPECT_EQ(2, logid);
+   EXPECT_EQ(2, eventManager.latest_log_id());
+   EXPECT_EQ(2, eventManager.log_count());
+   EXPECT_EQ(122 + metaBytes(), eventManager.get_managed_size());
+
+   std::string fn = std::string(eventsDir) + "/1";
+   unlink(fn.c_str());
+   EXPECT_EQ(1, eventManager.watch_process());
+   EXPECT_EQ(MESSAGE_LOG_REMOVED, eventManager.next_change(&logid));
+   EXPECT_EQ(1, logid);
+   EXPECT_EQ(1, eventManager.log_count());
+   EXPECT_EQ(61 + metaBytes(), eventManager.get_managed_size());
+
+   /* removals through the manager are already accounted for */
+   EXPECT_EQ(0, eventManager.remove(2));
+   EXPECT_EQ(0, eventManager.watch_process());
+   EXPECT_EQ(0, eventManager.log_count());
+   EXPECT_EQ(3, eventManager.create(&rec));
+}
+
+TEST_F(TestEnv, SourceQuota) {
+   event_manager eventq(eventsDir, 0, 0);
+   auto rec = build_event_record("Testing Message1", "Info",
+                            "Association", "Test", p, 4);
+   eventq.set_quota("Test", 100);
+   EXPECT_EQ(1, eventq.create(&rec));
+   EXPECT_EQ(0, eventq.create(&rec));
+
+   source_usage_t u;
+   ASSERT_EQ(1, eventq.source_count());
+   EXPECT_TRUE(eventq.source_usage(0, &u));
+   EXPECT_STREQ("Test", u.reporter);
+   EXPECT_EQ(61, u.bytes);
+   EXPECT_EQ(1, u.logs);
+   EXPECT_EQ(1, u.rejected);
+
+   /* freeing space under the quota lets the reporter back in */
+   EXPECT_EQ(0, eventq.remove(1));
+   EXPECT_EQ(3, eventq.create(&rec));
+}
+
+/* Debug data in the blob area counts against the reporter keeping it */
+TEST_F(TestEnv, SourceQuotaBlobs) {
+   event_manager eventq(eventsDir, 0, 0);
+   std::vector<uint8_t> esel(1000, 0xe5), other(1000, 0x5e);
+   auto host = build_event_record("Testing Storm", "Info",
+                            "Association", "Host", esel.data(), esel.size());
+   auto bmc = build_event_record("Testing Storm", "Info",
+                            "Association", "BMC", esel.data(), esel.size());
+   eventq.set_quota("Host", 2000);
+
+   EXPECT_EQ(1, eventq.create(&host));
+   source_usage_t u;
+   EXPECT_TRUE(eventq.source_usage(0, &u));
+   EXPECT_GT(u.bytes, esel.size());
+   size_t charged = u.bytes;
+
+   /* a second eSEL would take it past its quota */
+   host.p = other.data();
+   EXPECT_EQ(0, eventq.create(&host));
+   EXPECT_TRUE(eventq.source_usage(0, &u));
+   EXPECT_EQ(1, u.rejected);
+   EXPECT_EQ(charged, u.bytes);
+
+   /* a record sharing the blob adds only its own bytes */
+   EXPECT_EQ(3, eventq.create(&bmc));
+   EXPECT_TRUE(eventq.source_usage(1, &u));
+   EXPECT_LT(u.bytes, esel.size());
+
+   /* the charge follows the blob to the reporter still using it */
+   EXPECT_EQ(0, eventq.remove(1));
+   EXPECT_TRUE(eventq.source_usage(0, &u));
+   EXPECT_EQ(0, u.bytes);
+   EXPECT_TRUE(eventq.source_usage(1, &u));
+   EXPECT_GT(u.bytes, esel.size());
+
+   EXPECT_EQ(0, eventq.remove(3));
+   EXPECT_TRUE(eventq.source_usage(1, &u));
+   EXPECT_EQ(0, u.bytes);
+   EXPECT_EQ(metaBytes(), eventq.get_managed_size());
+}
+
+TEST_F(TestEnv, SourceReserve) {
+   event_manager eventr(eventsDir, 240 + 46 + g_journal_bytes, 0);
+   auto host = build_event_record("Testing Message1", "Info",
+                            "Association", "Test", p, 4);
+   auto bmc = build_event_record("Testing Message1", "Info",
+                            "Association", "BMC", p, 4);
+   eventr.set_reserve("BMC", 122);
+
+   /* 61 stored plus 122 held back for BMC leaves no room for another, */
+   /* all of it past .dict and the journal                             */
+   EXPECT_EQ(1, eventr.create(&host));
+   EXPECT_EQ(0, eventr.create(&host));
+
+   /* BMC records come out of the reservation first */
+   EXPECT_EQ(3, eventr.create(&bmc));
+   EXPECT_EQ(4, eventr.create(&bmc));
+   EXPECT_EQ(0, eventr.create(&bmc));
+
+   /* the accounting survives a restart */
+   event_manager events(eventsDir, 240 + 46 + g_journal_bytes, 0);
+   events.set_reserve("BMC", 122);
+   EXPECT_EQ(0, events.create(&host));
+   source_usage_t u;
+   for (size_t i = 0; events.source_usage(i, &u); i++) {
+      if (!strcmp(u.reporter, "BMC")) {
+         EXPECT_EQ(122, u.bytes);
+      }
+   }
+}
+
+/* Same results with and without io_uring */
+TEST_F(TestEnv, BatchOpenRemove) {
+   std::vector<uint8_t> big(5000, 0x5a);
+
+   for (bool ring : { true, false }) {
+      event_manager eventb(eventsDir, 0, 0);
+      eventb.set_io_ring(ring);
+
+      auto rec = build_event_record("Testing Message1", "Info",
+                               "Association", "Test", p, 4);
+      uint16_t first = eventb.create(&rec);
+      eventb.create(&rec);
+      rec = build_event_record("Testing Big", "Info",
+                               "Association", "Test", big.data(), big.size());
+      uint16_t last = eventb.create(&rec);
+
+      uint16_t ids[] = { first, uint16_t(first + 1), last, uint16_t(last + 1) };
+      event_record_t *recs[4];
+      EXPECT_EQ(3, eventb.open_logs(ids, 4, recs));
+      EXPECT_STREQ("Testing Message1", recs[1]->message);
+      EXPECT_STREQ("Testing Big", recs[2]->message);
+      EXPECT_EQ(5000, recs[2]->n);
+      EXPECT_EQ(nullptr, recs[3]);
+      for (int i = 0; i < 3; i++)
+         eventb.close(recs[i]);
+
+      event_manager eventc(eventsDir, 0, 0);
+      EXPECT_EQ(3, eventc.log_count());
+      EXPECT_EQ(eventb.get_managed_size(), eventc.get_managed_size());
+
+      EXPECT_EQ(3, eventb.remove_logs(ids, 3));
+      EXPECT_EQ(0, eventb.log_count());
+      EXPECT_EQ(metaBytes(), eventb.get_managed_size());
+   }
+}
+
+/* Ids that are unknown or listed twice do not count as removed */
+TEST_F(TestEnv, BatchRemoveUnknown) {
+   for (bool ring : { true, false }) {
+      event_manager eventb(eventsDir, 0, 0);
+      eventb.set_io_ring(ring);
+
+      auto rec = build_event_record("Testing Message1", "Info",
+                               "Association", "Test", p, 4);
+      uint16_t first = eventb.create(&rec);
+      eventb.create(&rec);
+      uint16_t last = eventb.create(&rec);
+
+      uint16_t ids[] = { first, first, uint16_t(last + 1), last };
+      EXPECT_EQ(2, eventb.remove_logs(ids, 4));
+      EXPECT_EQ(1, eventb.log_count());
+      EXPECT_EQ(1, eventb.count_logs(event_filter_all()));
+
+      EXPECT_EQ(0, eventb.remove(last));
+      EXPECT_EQ(1, eventb.log_count());
+
+      uint16_t rest = first + 1;
+      EXPECT_EQ(1, eventb.remove_logs(&rest, 1));
+      EXPECT_EQ(0, eventb.log_count());
+   }
+}
+
+TEST_F(TestEventManager, ExpireBySeverity) {
+   time_t now = time(NULL);
+   auto crit = build_event_record("Testing Critical", "Critical",
+                            "Association", "Test", p, 4);
+
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, eventManager.create(&crit));
+   EXPECT_EQ(0, eventManager.next_expiry());
+
+   eventManager.set_ttl("Info", 60);
+   eventManager.set_ttl("Critical", 3600);
+   EXPECT_NE(0, eventManager.next_expiry());
+   EXPECT_LE(eventManager.next_expiry(), now + 60);
+
+   EXPECT_EQ(0, eventManager.expire(now));
+   EXPECT_EQ(1, eventManager.expire(now + 61));
+   EXPECT_EQ(1, eventManager.log_count());
+
+   uint16_t logid;
+   EXPECT_EQ(MESSAGE_LOG_REMOVED, eventManager.next_change(&logid));
+   EXPECT_EQ(1, logid);
+
+   /* the schedule comes back from the stored timestamps */
+   event_manager eventr(eventsDir, 0, 0);
+   eventr.set_ttl("Critical", 3600);
+   EXPECT_EQ(0, eventr.expire(now + 61));
+   EXPECT_EQ(1, eventr.expire(now + 3601));
+   EXPECT_EQ(0, eventr.log_count());
+   EXPECT_EQ(0, eventr.next_expiry());
+}
+
+TEST_F(TestEventManager, DebugDataBlobs) {
+   std::vector<uint8_t> esel(1000, 0xe5);
+   auto rec = build_event_record("Testing Storm", "Info",
+                            "Association", "Test", esel.data(), esel.size());
+
+   EXPECT_EQ(1, eventManager.create(&rec));
+   size_t first = eventManager.get_managed_size() - metaBytes();
+   EXPECT_GT(first, esel.size());
+   EXPECT_EQ(2, eventManager.create(&rec));
+   EXPECT_EQ(3, eventManager.create(&rec));
+
+   /* the payload is stored once, later records only add a reference */
+   size_t each = eventManager.get_managed_size() - metaBytes() - first;
+   EXPECT_EQ(2 * (first - esel.size()), each);
+
+   event_record_t *prec;
+   EXPECT_EQ(2, eventManager.open(2, &prec, true));
+   EXPECT_EQ(esel.size(), prec->n);
+   EXPECT_EQ(0, memcmp(esel.data(), prec->p, esel.size()));
+   eventManager.close(prec);
+
+   /* refcounts come back from the records after a restart */
+   {
+      event_manager eventr(eventsDir, 0, 0);
+      EXPECT_EQ(eventManager.get_managed_size(), eventr.get_managed_size());
+   }
+
+   EXPECT_EQ(0, eventManager.remove(1));
+   EXPECT_EQ(0, eventManager.remove(2));
+   EXPECT_GT(eventManager.get_managed_size(), esel.size());
+   EXPECT_EQ(0, eventManager.remove(3));
+   EXPECT_EQ(metaBytes(), eventManager.get_managed_size());
+}
+
+/* A blob shorter than its record claims is corruption, whether or not */
+/* the record is verified, and is not charged after a restart          */
+TEST_F(TestEventManager, DebugDataBlobLength) {
+   std::vector<uint8_t> esel(1000, 0xe5);
+   auto rec = build_event_record("Testing Storm", "Info",
+                            "Association", "Test", esel.data(), esel.size());
+   blob_ref_t ref;
+   char name[40];
+
+   EXPECT_EQ(1, eventManager.create(&rec));
+   murmur3_128(esel.data(), esel.size(), 0, ref.hash);
+   blob_name(ref, name);
+   std::string path = std::string(eventsDir) + "/.blobs/" + name;
+   ASSERT_EQ(0, truncate(path.c_str(), 10));
+
+   event_record_t *prec;
+   EXPECT_EQ(0, eventManager.open(1, &prec, false));
+   EXPECT_EQ(1, eventManager.corrupt_count());
+
+   {
+      event_manager eventr(eventsDir, 0, 0);
+      EXPECT_EQ(1, eventr.corrupt_count());
+      EXPECT_LT(eventr.get_managed_size() - metaBytes(), esel.size());
+   }
+
+   /* nothing that long is taken in the first place */
+   std::vector<uint8_t> huge(MESSAGE_BLOB_MAX + 1, 0x5a);
+   rec = build_event_record("Testing Huge", "Info",
+                            "Association", "Test", huge.data(), huge.size());
+   EXPECT_EQ(0, eventManager.create(&rec));
+}
+
+/* Data whose hash matches a stored blob is only shared when the bytes */
+/* are the same, otherwise it stays in its own record                 */
+TEST_F(TestEventManager, DebugDataBlobCollision) {
+   std::vector<uint8_t> esel(1000, 0xe5), forged(1000, 0x11);
+   auto rec = build_event_record("Testing Storm", "Info",
+                            "Association", "Test", esel.data(), esel.size());
+   blob_ref_t ref;
+   char name[40];
+
+   EXPECT_EQ(1, eventManager.create(&rec));
+
+   /* stand in for a collision: same name and length, other bytes */
+   murmur3_128(esel.data(), esel.size(), 0, ref.hash);
+   blob_name(ref, name);
+   std::string path = std::string(eventsDir) + "/.blobs/" + name;
+   {
+      std::ofstream f(path, std::ios::binary | std::ios::trunc);
+      f.write((const char *) forged.data(), forged.size());
+   }
+
+   size_t before = eventManager.get_managed_size();
+   EXPECT_EQ(2, eventManager.create(&rec));
+   EXPECT_GT(eventManager.get_managed_size() - before, esel.size());
+
+   event_record_t *prec;
+   EXPECT_EQ(2, eventManager.open(2, &prec, true));
+   EXPECT_EQ(esel.size(), prec->n);
+   EXPECT_EQ(0, memcmp(esel.data(), prec->p, esel.size()));
+   eventManager.close(prec);
+}
+
+/* Writers sharing a store agree on codes, and decoded records share */
+/* one copy of each string                                           */
+TEST_F(TestEventManager, DictionaryCodes) {
+   int dirfd = open(eventsDir, O_RDONLY | O_DIRECTORY);
+   string_dict a, b;
+   ASSERT_TRUE(a.open(dirfd, MESSAGE_DICT_FILE, true));
+   ASSERT_TRUE(b.open(dirfd, MESSAGE_DICT_FILE, true));
+   close(dirfd);
+
+   EXPECT_EQ(0, a.code("Info"));
+   EXPECT_EQ(1, b.code("Critical"));
+   EXPECT_EQ(-1, a.lookup("Critical"));
+   EXPECT_EQ(1, a.code("Critical"));
+   EXPECT_EQ(0, b.code("Info"));
+   EXPECT_STREQ("Critical", b.str(1));
+   EXPECT_EQ(nullptr, b.str(2));
+
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, prepareEventLog2());
+
+   event_manager eventr(eventsDir, 0, 0);
+   event_record_t *r1, *r2;
+   EXPECT_EQ(1, eventr.open(1, &r1, true));
+   EXPECT_EQ(2, eventr.open(2, &r2, true));
+   EXPECT_STREQ("Info", r1->severity);
+   EXPECT_STREQ("Association", r2->association);
+   EXPECT_EQ(r1->severity, r2->severity);
+   EXPECT_EQ(r1->reportedby, r2->reportedby);
+   eventr.close(r1);
+   eventr.close(r2);
+}
+
+/* Host supplied associations only get codes while there are few */
+TEST_F(TestEventManager, DictionaryBounds) {
+   std::string path(200, 'a');
+   auto rec = build_event_record("Testing Message1", "Info",
+                            path.c_str(), "Test", p, 4);
+   EXPECT_EQ(1, eventManager.create(&rec));
+   size_t small = dictBytes();
+   EXPECT_GT(small, 0);
+
+   /* too long to code */
+   EXPECT_EQ(small, (size_t) (8 + strlen("Info") + 1 + 8 + strlen("Test") + 1));
+
+   char assoc[32];
+   for (int i = 0; i < 200; i++) {
+      snprintf(assoc, sizeof(assoc), "/sensor/%d", i);
+      rec.association = assoc;
+      EXPECT_EQ(i + 2, eventManager.create(&rec));
+   }
+   EXPECT_LT(dictBytes(), 64 * (8 + 48));
+}
+
+TEST_F(TestEventManager, ArchiveColdEvents) {
+   time_t now = time(NULL);
+   std::vector<uint16_t> ids;
+   event_record_t *prec;
+   char name[64];
+
+   for (int i = 0; i < 20; i++)
+      ids.push_back(prepareEventLog1());
+   size_t loose = eventManager.get_managed_size();
+
+   EXPECT_EQ(0, eventManager.archive(now + 3600));
+   eventManager.set_archive_age(60);
+   EXPECT_EQ(0, eventManager.archive(now));
+   EXPECT_EQ(20, eventManager.archive(now + 61));
+   EXPECT_EQ(0, eventManager.archive(now + 61));
+
+   /* the files are gone, the records are not */
+   snprintf(name, sizeof(name), "%s/5", eventsDir);
+   EXPECT_NE(0, access(name, F_OK));
+   EXPECT_LT(eventManager.get_managed_size(), loose);
+   EXPECT_EQ(20, eventManager.log_count());
+   EXPECT_EQ(5, eventManager.open(5, &prec, true));
+   EXPECT_STREQ("Testing Message1", prec->message);
+   eventManager.close(prec);
+
+   int listed = 0;
+   eventManager.next_log_refresh();
+   while (eventManager.next_log())
+      listed++;
+   EXPECT_EQ(20, listed);
+
+   {
+      event_manager eventr(eventsDir, 0, 0);
+      EXPECT_EQ(20, eventr.log_count());
+      EXPECT_EQ(20, eventr.latest_log_id());
+      EXPECT_EQ(7, eventr.open(7, &prec, true));
+      EXPECT_STREQ("Test", prec->reportedby);
+      eventr.close(prec);
+   }
+
+   /* removal is remembered without rewriting the segment */
+   EXPECT_EQ(0, eventManager.remove(3));
+   EXPECT_EQ(19, eventManager.log_count());
+   {
+      event_manager eventr(eventsDir, 0, 0);
+      EXPECT_EQ(19, eventr.log_count());
+      EXPECT_EQ(0, eventr.open(3, &prec, false));
+   }
+
+   ids.erase(ids.begin() + 2);
+   EXPECT_EQ(19, eventManager.remove_logs(ids.data(), ids.size()));
+   EXPECT_EQ(0, eventManager.log_count());
+   EXPECT_EQ(metaBytes(), eventManager.get_managed_size());
+}
+
+/* A copy of the table stays as it was while the original is changed, */
+/* across chunk splits, merges and removals                           */
+TEST(EventTable, CopyOnWriteChunks) {
+   std::vector<uint16_t> ids;
+   std::map<uint16_t, uint32_t> before, after;
+   event_table live;
+
+   for (uint16_t id = 1; id <= 3 * g_table_chunk; id++)
+      ids.push_back(id);
+   std::shuffle(ids.begin(), ids.end(), std::mt19937(42));
+   for (uint16_t id : ids) {
+      live.insert(id, 1000 + id, id % 3, id % 5, id);
+      before[id] = id;
+   }
+
+   event_table copy = live;
+
+   for (size_t i = 0; i < ids.size(); i += 2)
+      EXPECT_TRUE(live.erase(ids[i]));
+   live.insert(9999, 0, 0, 0, 7);
+   live.set_bytes(live.find(ids[1]), 1);
+
+   after = before;
+   for (size_t i = 0; i < ids.size(); i += 2)
+      after.erase(ids[i]);
+   after[9999] = 7;
+   after[ids[1]] = 1;
+
+   for (auto *t : { &copy, &live }) {
+      auto &want = (t == &copy) ? before : after;
+      auto it = want.begin();
+
+      ASSERT_EQ(want.size(), t->size());
+      for (size_t row = 0; row < t->size(); row++, it++) {
+         EXPECT_EQ(it->first, t->logid(row));
+         EXPECT_EQ(it->second, t->bytes(row));
+         EXPECT_EQ((int) row, t->find(it->first));
+      }
+   }
+
+   EXPECT_EQ(g_table_chunk, copy.count(event_filter_t{0, 0, 1, -1}));
+   EXPECT_EQ(-1, live.find(ids[0]));
+}
+
+/* Readers on other threads always see a consistent index while the */
+/* writer goes on creating and removing records                     */
+TEST_F(TestEventManager, ConcurrentSnapshots) {
+   std::atomic<bool> done(false);
+   std::atomic<int> bad(0);
+   std::vector<std::thread> readers;
+
+   for (int r = 0; r < 4; r++)
+      readers.emplace_back([&] {
+         while (!done) {
+            auto snap = eventManager.snapshot();
+            std::vector<uint16_t> ids;
+
+            snap->table.filter(event_filter_all(), ids);
+            if (ids.size() != snap->logcount ||
+                !std::is_sorted(ids.begin(), ids.end()) ||
+                (!ids.empty() && ids.back() > snap->latestid))
+               bad++;
+
+            /* the queries the ingest threads answer go the same way */
+            event_filter_t f = event_filter_all();
+            f.severity = eventManager.severity_code("Info");
+            if (eventManager.count_logs(f) > 40)
+               bad++;
+         }
+      });
+
+   auto before = eventManager.snapshot();
+   for (int i = 0; i < 40; i++)
+      prepareEventLog1();
+   for (uint16_t id = 1; id <= 40; id += 3)
+      eventManager.remove(id);
+
+   done = true;
+   for (auto &t : readers)
+      t.join();
+
+   EXPECT_EQ(0, bad);
+   EXPECT_EQ(0, before->logcount);
+   EXPECT_EQ(0, before->table.size());
+   EXPECT_EQ(26, eventManager.log_count());
+   EXPECT_EQ(26, eventManager.count_logs(event_filter_all()));
+}
+
+/* Records submitted from several threads at once each get their own */
+/* logid and are all stored by the writer                            */
+TEST_F(TestEventManager, ConcurrentIngest) {
+   const int producers = 4, each = 25;
+   std::vector<std::vector<uint16_t>> given(producers);
+   std::vector<std::thread> threads;
+   std::atomic<int> running(producers);
+   std::vector<uint16_t> stored;
+   uint16_t ids[16];
+   size_t n;
+
+   EXPECT_EQ(1, prepareEventLog1());
+   ASSERT_GE(eventManager.ingest_start(), 0);
+
+   for (int t = 0; t < producers; t++)
+      threads.emplace_back([&, t] {
+         auto rec = build_event_record("Testing Ingest", "Info",
+                                       "Association", "Host", p, 4);
+         for (int i = 0; i < each; i++)
+            given[t].push_back(eventManager.submit(&rec));
+         running--;
+      });
+
+   /* the writer commits while the producers are still going */
+   do {
+      n = eventManager.commit_ingested(ids, 16);
+      stored.insert(stored.end(), ids, ids + n);
+   } while (running || n);
+   for (auto &t : threads)
+      t.join();
+   while ((n = eventManager.commit_ingested(ids, 16)))
+      stored.insert(stored.end(), ids, ids + n);
+
+   std::vector<uint16_t> all;
+   for (auto &g : given)
+      all.insert(all.end(), g.begin(), g.end());
+   std::sort(all.begin(), all.end());
+   std::sort(stored.begin(), stored.end());
+
+   EXPECT_EQ(all, stored);
+   EXPECT_EQ(all.end(), std::adjacent_find(all.begin(), all.end()));
+   EXPECT_EQ(2, all.front());
+   EXPECT_EQ(1 + producers * each, eventManager.log_count());
+   EXPECT_EQ(1 + producers * each, eventManager.latest_log_id());
+
+   event_record_t *prec;
+   EXPECT_EQ(all.back(), eventManager.open(all.back(), &prec, true));
+   EXPECT_STREQ("Host", prec->reportedby);
+   eventManager.close(prec);
+}
+
+/* A caller waiting on a channel hears the logid its record was stored */
+/* under, or 0 once the writer refused it                              */
+TEST_F(TestEventManager, IngestReplies) {
+   auto rec = build_event_record("Testing Message1", "Info",
+                                 "Association", "Host", p, 4);
+   int first, second;
+   uint16_t ids[16], logid;
+   void *ctx;
+
+   eventManager.set_quota("Host", 100);
+   ASSERT_GE(eventManager.ingest_start(), 0);
+   ingest_channel_t *ch = ingest_channel_new();
+   ASSERT_NE(nullptr, ch);
+
+   EXPECT_NE(0, eventManager.submit(&rec, ch, &first));
+   EXPECT_NE(0, eventManager.submit(&rec, ch, &second));
+   EXPECT_EQ(2, eventManager.ingest_pending());
+
+   /* nothing is answered before the writer has run */
+   EXPECT_FALSE(ingest_channel_next(ch, &ctx, &logid));
+
+   EXPECT_EQ(1, eventManager.commit_ingested(ids, 16));
+   EXPECT_EQ(0, eventManager.ingest_pending());
+
+   ASSERT_TRUE(ingest_channel_next(ch, &ctx, &logid));
+   EXPECT_EQ(&first, ctx);
+   EXPECT_EQ(ids[0], logid);
+   ASSERT_TRUE(ingest_channel_next(ch, &ctx, &logid));
+   EXPECT_EQ(&second, ctx);
+   EXPECT_EQ(0, logid);
+   EXPECT_FALSE(ingest_channel_next(ch, &ctx, &logid));
+
+   EXPECT_EQ(1, eventManager.log_count());
+   ingest_channel_free(ch);
+}
+
+/* A reader following the journal sees each create and delete once and */
+/* in order, and is sent back to a full listing when it falls behind   */
+TEST_F(TestEventManager, ChangesSince) {
+   std::vector<journal_entry_t> seen;
+   uint64_t cursor, next;
+
+   EXPECT_FALSE(eventManager.changes_since(0, 16, seen, &cursor));
+
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, prepareEventLog1());
+   EXPECT_EQ(0, eventManager.remove(1));
+
+   ASSERT_TRUE(eventManager.changes_since(cursor, 16, seen, &next));
+   ASSERT_EQ(3, seen.size());
+   EXPECT_EQ(cursor + 1, seen[0].seq);
+   EXPECT_EQ(next, seen[2].seq);
+   EXPECT_EQ(MESSAGE_LOG_ADDED, seen[0].op);
+   EXPECT_EQ(1, seen[0].logid);
+   EXPECT_EQ(MESSAGE_LOG_ADDED, seen[1].op);
+   EXPECT_EQ(2, seen[1].logid);
+   EXPECT_EQ(MESSAGE_LOG_REMOVED, seen[2].op);
+   EXPECT_EQ(1, seen[2].logid);
+
+   /* a short read picks up where it stopped, a caught up one is empty */
+   ASSERT_TRUE(eventManager.changes_since(cursor, 2, seen, &next));
+   EXPECT_EQ(2, seen.size());
+   ASSERT_TRUE(eventManager.changes_since(next, 16, seen, &next));
+   EXPECT_EQ(1, seen.size());
+   ASSERT_TRUE(eventManager.changes_since(next, 16, seen, &cursor));
+   EXPECT_EQ(0, seen.size());
+   EXPECT_EQ(next, cursor);
+   EXPECT_FALSE(eventManager.changes_since(next + 1, 16, seen, &cursor));
+
+   /* removing what is not there is no change */
+   EXPECT_EQ(0, eventManager.remove(1));
+   EXPECT_EQ(0, eventManager.remove(9));
+   ASSERT_TRUE(eventManager.changes_since(next, 16, seen, &cursor));
+   EXPECT_EQ(0, seen.size());
+}
+
+/* The journal keeps its numbering across a clean close, forgets what */
+/* it held after an unclean one and drops what the ring overwrote     */
+TEST_F(TestEnv, ChangeJournalRestart) {
+   std::vector<journal_entry_t> seen;
+   uint64_t cursor;
+   int dirfd = ::open(eventsDir, O_RDONLY | O_DIRECTORY);
+   ASSERT_GE(dirfd, 0);
+
+   {
+      change_journal j;
+      ASSERT_TRUE(j.open(dirfd, ".journal", 8));
+      cursor = j.last();
+      for (int i = 1; i <= 5; i++)
+         j.append(MESSAGE_LOG_ADDED, i);
+   }
+   {
+      change_journal j;
+      ASSERT_TRUE(j.open(dirfd, ".journal", 8));
+      EXPECT_EQ(cursor + 5, j.last());
+      ASSERT_TRUE(j.since(cursor, 16, seen));
+      ASSERT_EQ(5, seen.size());
+      EXPECT_EQ(5, seen[4].logid);
+
+      /* the ring only reaches back eight changes */
+      for (int i = 6; i <= 10; i++)
+         j.append(MESSAGE_LOG_REMOVED, i);
+      EXPECT_FALSE(j.since(cursor, 16, seen));
+      ASSERT_TRUE(j.since(cursor + 2, 16, seen));
+      EXPECT_EQ(8, seen.size());
+      EXPECT_EQ(3, seen[0].logid);
+
+      cursor = j.last();
+      j.append(MESSAGE_LOG_ADDED, 11);
+
+      /* a second open finds the file still marked in use, as after a crash */
+      change_journal crashed;
+      ASSERT_TRUE(crashed.open(dirfd, ".journal", 8));
+      EXPECT_GT(crashed.last(), cursor + 8);
+      EXPECT_FALSE(crashed.since(cursor, 16, seen));
+   }
+
+   ::close(dirfd);
+}
+
+/* Only records matching every part of the predicate are deleted */
+TEST_F(TestEventManager, DeleteWhere) {
+   const char *assoc[] = { "/org/a/cpu0 /org/b/x", "/org/b/dimm",
+                           "/org/a/cpu1", "/org/a/fan", "" };
+   const char *sev[] = { "Info", "Info", "Error", "Info", "Info" };
+   const char *rep[] = { "Host", "Host", "Host", "BMC", "Host" };
+   std::vector<uint16_t> removed;
+
+   for (int i = 0; i < 5; i++) {
+      auto rec = build_event_record("Testing Delete", sev[i], assoc[i],
+                                    rep[i], p, 4);
+      EXPECT_EQ(i + 1, eventManager.create(&rec));
+   }
+
+   event_filter_t f = event_filter_all();
+   f.severity = eventManager.severity_code("Info");
+   f.reporter = eventManager.reporter_code("Host");
+   EXPECT_EQ(1, eventManager.remove_where(f, "/org/a/", removed));
+   EXPECT_EQ(std::vector<uint16_t>{1}, removed);
+
+   f.since = time(NULL) + 3600;
+   EXPECT_EQ(0, eventManager.remove_where(f, NULL, removed));
+   EXPECT_EQ(4, eventManager.log_count());
+
+   /* the prefix is checked against every path in the association */
+   EXPECT_EQ(2, eventManager.remove_where(event_filter_all(), "/org/a",
+                                          removed));
+   EXPECT_EQ((std::vector<uint16_t>{3, 4}), removed);
+   EXPECT_EQ(2, eventManager.remove_where(event_filter_all(), "", removed));
+   EXPECT_EQ(0, eventManager.log_count());
+   EXPECT_EQ(metaBytes(), eventManager.get_managed_size());
+}
+
+/* Substring search ignores case, looks only in the fields asked for, */
+/* ranks the newest first and forgets records once they are removed  */
+TEST_F(TestEventManager, SearchText) {
+   const char *msg[] = { "DIMM 3 correctable ECC", "CPU thermal trip",
+                         "dimm 7 missing", "PCIe link down" };
+   const char *assoc[] = { "/org/openbmc/dimm3", "/org/openbmc/cpu0",
+                           "/org/openbmc/dimm7", "/org/openbmc/pcie" };
+   std::vector<uint16_t> ids;
+
+   for (int i = 0; i < 4; i++) {
+      auto rec = build_event_record(msg[i], "Info", assoc[i], "Host", p, 4);
+      EXPECT_EQ(i + 1, eventManager.create(&rec));
+   }
+
+   EXPECT_EQ(2, eventManager.search_logs("Dimm", MESSAGE_SEARCH_MESSAGE,
+                                         10, ids));
+   EXPECT_EQ((std::vector<uint16_t>{3, 1}), ids);
+   EXPECT_EQ(2, eventManager.search_logs("dimm", MESSAGE_SEARCH_MESSAGE,
+                                         1, ids));
+   EXPECT_EQ(std::vector<uint16_t>{3}, ids);
+
+   /* every trigram of "mmid" is present in record 1, the text is not */
+   EXPECT_EQ(0, eventManager.search_logs("mmid", MESSAGE_SEARCH_MESSAGE,
+                                         10, ids));
+   EXPECT_EQ(4, eventManager.search_logs("bmc", MESSAGE_SEARCH_ASSOCIATION,
+                                         10, ids));
+   EXPECT_EQ(0, eventManager.search_logs("bmc", MESSAGE_SEARCH_MESSAGE,
+                                         10, ids));
+   EXPECT_EQ(1, eventManager.search_logs("cpu", MESSAGE_SEARCH_MESSAGE |
+                                         MESSAGE_SEARCH_ASSOCIATION, 10, ids));
+   EXPECT_EQ(3, eventManager.search_logs("e", MESSAGE_SEARCH_MESSAGE,
+                                         10, ids));
+
+   EXPECT_EQ(0, eventManager.remove(3));
+   EXPECT_EQ(1, eventManager.search_logs("DIMM", MESSAGE_SEARCH_MESSAGE,
+                                         10, ids));
+   EXPECT_EQ(std::vector<uint16_t>{1}, ids);
+
+   /* rebuilt from the store on the next start */
+   event_manager eventr(eventsDir, 0, 0);
+   EXPECT_EQ(1, eventr.search_logs("link", MESSAGE_SEARCH_MESSAGE, 10, ids));
+   EXPECT_EQ(std::vector<uint16_t>{4}, ids);
+}
+
+/* Rollups count each record in its minute, hour and day, forget it */
+/* again on removal and read 0 for a period the ring has moved past */
+TEST(RollupRings, Periods) {
+   const uint32_t t = 1700000000 - 1700000000 % 86400;
+   std::vector<uint32_t> counts;
+   rollup_rings r;
+
+   r.add(0, 1, t + 30);
+   r.add(0, 1, t + 45);
+   r.add(1, 0, t + 90);
+   r.add(0, 1, t - 86400 * 40);   // older than every ring
+
+   EXPECT_EQ(t + 120 - 59 * 60, r.series(rollup_rings::minutes, t + 120,
+                                        2, 2, counts));
+   ASSERT_EQ(2 * 2 * 60, counts.size());
+   EXPECT_EQ(2, counts[(0 * 2 + 1) * 60 + 57]);
+   EXPECT_EQ(1, counts[(1 * 2 + 0) * 60 + 58]);
+   EXPECT_EQ(0, counts[(1 * 2 + 0) * 60 + 59]);
+
+   r.series(rollup_rings::days, t + 120, 2, 2, counts);
+   EXPECT_EQ(2, counts[(0 * 2 + 1) * 31 + 30]);
+   EXPECT_EQ(1, counts[(1 * 2 + 0) * 31 + 30]);
+   EXPECT_EQ(0, counts[(0 * 2 + 1) * 31 + 0]);
+
+   r.remove(0, 1, t + 30);
+   r.series(rollup_rings::hours, t + 120, 2, 2, counts);
+   EXPECT_EQ(1, counts[(0 * 2 + 1) * 48 + 47]);
+
+   /* an hour on, the minute buckets are reused for new periods */
+   r.add(0, 1, t + 3600 + 40);
+   r.series(rollup_rings::minutes, t + 3600 + 60, 2, 2, counts);
+   EXPECT_EQ(1, counts[(0 * 2 + 1) * 60 + 58]);
+   EXPECT_EQ(0, std::accumulate(counts.begin() + 2 * 60,
+                                counts.begin() + 3 * 60, 0));
+   r.series(rollup_rings::hours, t + 3600 + 60, 2, 2, counts);
+   EXPECT_EQ(1, counts[(0 * 2 + 1) * 48 + 46]);
+   EXPECT_EQ(1, counts[(0 * 2 + 1) * 48 + 47]);
+}
+
+TEST_F(TestEventManager, Rollup) {
+   std::vector<std::string> sevs, reps;
+   std::vector<uint32_t> counts;
+   auto cell = [&](int sev, int rep) {
+      auto at = counts.begin() + (sev * reps.size() + rep) * 48;
+      return std::accumulate(at, at + 48, 0);
+   };
+
+   auto rec = build_event_record("Testing Rollup", "Error", "Association",
+                                 "BMC", p, 4);
+   EXPECT_EQ(1, prepareEventLog1());
+   EXPECT_EQ(2, prepareEventLog1());
+   EXPECT_EQ(3, eventManager.create(&rec));
+
+   eventManager.rollup(rollup_rings::hours, time(NULL), counts, sevs, reps);
+   ASSERT_EQ((std::vector<std::string>{"Info", "Error"}), sevs);
+   ASSERT_EQ((std::vector<std::string>{"Test", "BMC"}), reps);
+   EXPECT_EQ(2, cell(0, 0));
+   EXPECT_EQ(0, cell(0, 1));
+   EXPECT_EQ(1, cell(1, 1));
+
+   EXPECT_EQ(0, eventManager.remove(1));
+   eventManager.rollup(rollup_rings::hours, time(NULL), counts, sevs, reps);
+   EXPECT_EQ(1, cell(0, 0));
+   EXPECT_EQ(2, std::accumulate(counts.begin(), counts.end(), 0));
+}
+
+/* The same manager over records held in memory, nothing reaches the */
+/* directory it was given */
+TEST_F(TestEnv, MemoryStore) {
+   basic_event_manager<memory_store> eventm(eventsDir, 0, 0);
+   std::vector<uint16_t> ids;
+   event_record_t *prec;
+
+   auto rec = build_event_record("Testing Message1", "Info",
+                                 "Association", "Test", p, 4);
+   EXPECT_EQ(1, eventm.create(&rec));
+   /* no dictionary without a directory, the strings stay in the record */
+   size_t one = eventm.get_managed_size();
+   EXPECT_LT(61, one);
+   rec.message = const_cast<char*>("Testing Message2");
+   EXPECT_EQ(2, eventm.create(&rec));
+   EXPECT_EQ(2 * one, eventm.get_managed_size());
+   EXPECT_EQ(2, eventm.log_count());
+
+   EXPECT_EQ(2, eventm.open(2, &prec));
+   EXPECT_STREQ("Testing Message2", prec->message);
+   EXPECT_EQ(4, prec->n);
+   eventm.close(prec);
+
+   eventm.next_log_refresh();
+   EXPECT_EQ(1, eventm.next_log());
+   EXPECT_EQ(2, eventm.next_log());
+   EXPECT_EQ(0, eventm.next_log());
+
+   EXPECT_EQ(1, eventm.search_logs("message1", MESSAGE_SEARCH_MESSAGE,
+                                   10, ids));
+   EXPECT_EQ(std::vector<uint16_t>{1}, ids);
+
+   EXPECT_EQ(0, eventm.remove(1));
+   EXPECT_EQ(0, eventm.open(1, &prec));
+   EXPECT_EQ(one, eventm.get_managed_size());
+   EXPECT_EQ(1, eventm.log_count());
+   EXPECT_EQ(2, eventm.latest_log_id());
+
+   std::string cmd = std::string("test -z \"$(ls -A ") + eventsDir + ")\"";
+   EXPECT_EQ(0, system(cmd.c_str()));
+}
+
+/* The size and count limits hold with the records in memory, and */
+/* removing a record makes room again                              */
+TEST_F(TestEnv, MemoryStoreLimits) {
+   auto rec = build_event_record("Testing Message1", "Info",
+                                 "Association", "Test", p, 4);
+   size_t one;
+   {
+      basic_event_manager<memory_store> eventm(eventsDir, 0, 0);
+      EXPECT_EQ(1, eventm.create(&rec));
+      one = eventm.get_managed_size();
+   }
+
+   basic_event_manager<memory_store> sized(eventsDir, 2 * one, 0);
+   EXPECT_EQ(1, sized.create(&rec));
+   EXPECT_EQ(0, sized.create(&rec));
+   EXPECT_EQ(1, sized.log_count());
+   EXPECT_EQ(0, sized.remove(1));
+   EXPECT_EQ(0, sized.get_managed_size());
+   /* as on flash, a refused log still used up its id */
+   EXPECT_EQ(3, sized.create(&rec));
+
+   basic_event_manager<memory_store> counted(eventsDir, 0, 2);
+   EXPECT_EQ(1, counted.create(&rec));
+   EXPECT_EQ(2, counted.create(&rec));
+   EXPECT_EQ(0, counted.create(&rec));
+   EXPECT_EQ(2, counted.log_count());
+
+   /* an id it never had changes nothing */
+   EXPECT_EQ(0, counted.remove(9));
+   EXPECT_EQ(2, counted.log_count());
+   EXPECT_EQ(2 * one, counted.get_managed_size());
+
+   EXPECT_EQ(0, counted.remove(1));
+   EXPECT_EQ(4, counted.create(&rec));
+   EXPECT_EQ(2, counted.log_count());
+}
+
+/* Nothing outlives the manager, a restart starts over from log 1 */
+TEST_F(TestEnv, MemoryStoreRestart) {
+   auto rec = build_event_record("Testing Message1", "Info",
+                                 "Association", "Test", p, 4);
+   event_record_t *prec;
+   {
+      basic_event_manager<memory_store> eventm(eventsDir, 0, 0);
+      EXPECT_EQ(1, eventm.create(&rec));
+      EXPECT_EQ(2, eventm.create(&rec));
+      EXPECT_EQ(0, eventm.remove(1));
+   }
+
+   basic_event_manager<memory_store> eventn(eventsDir, 0, 0);
+   EXPECT_EQ(0, eventn.log_count());
+   EXPECT_EQ(0, eventn.latest_log_id());
+   EXPECT_EQ(0, eventn.get_managed_size());
+   EXPECT_EQ(0, eventn.open(2, &prec));
+   eventn.next_log_refresh();
+   EXPECT_EQ(0, eventn.next_log());
+   EXPECT_EQ(1, eventn.create(&rec));
+}
+
+/* A replica over a socketpair, resynced in full the first time and */
+/* caught up from what it acknowledged after it reconnects          */
+TEST_F(TestEnv, Replication) {
+   char replicaDir[] = "./replicaXXXXXX";
+   ASSERT_NE(nullptr, mkdtemp(replicaDir));
+   event_manager primary(eventsDir, 0, 0);
+   event_record_t *prec;
+   uint16_t id;
+   int sv[2];
+
+   auto pump = [&](event_manager &replica) {
+      for (int i = 0; i < 20; i++) {
+         primary.replication_process();
+         replica.replication_process();
+      }
+   };
+
+   auto rec = build_event_record("Replicated", "Info",
+                                 "Association", "Test", p, 4);
+   EXPECT_EQ(1, primary.create(&rec));
+   EXPECT_EQ(2, primary.create(&rec));
+
+   {
+      event_manager replica(replicaDir, 0, 0);
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+      EXPECT_EQ(0, primary.replicate_to(sv[0]));
+      EXPECT_EQ(0, replica.replicate_from(sv[1]));
+      pump(replica);
+
+      EXPECT_EQ(2, replica.log_count());
+      EXPECT_EQ(1, primary.replication_stats().resyncs);
+
+      rec.message = const_cast<char*>("After the resync");
+      EXPECT_EQ(3, primary.create(&rec));
+      EXPECT_EQ(0, primary.remove(1));
+      pump(replica);
+
+      EXPECT_EQ(2, replica.log_count());
+      EXPECT_EQ(3, replica.latest_log_id());
+      EXPECT_EQ(0, replica.open(1, &prec));
+      EXPECT_EQ(3, replica.open(3, &prec));
+      EXPECT_STREQ("After the resync", prec->message);
+      replica.close(prec);
+      EXPECT_EQ(primary.replication_stats().shipped,
+                primary.replication_stats().acked);
+
+      /* dbus on the replica follows along */
+      int added = 0, removed = 0;
+      int op;
+      while ((op = replica.next_change(&id)))
+         (op == MESSAGE_LOG_ADDED ? added : removed)++;
+      EXPECT_EQ(3, added);
+      EXPECT_EQ(1, removed);
+
+      close(sv[1]);
+      EXPECT_EQ(-1, primary.replication_process());
+      close(sv[0]);
+   }
+
+   /* changes made while the replica is away */
+   uint32_t sent = primary.replication_stats().records;
+   rec.message = const_cast<char*>("While away");
+   EXPECT_EQ(4, primary.create(&rec));
+   EXPECT_EQ(0, primary.remove(2));
+
+   {
+      event_manager replica(replicaDir, 0, 0);
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+      EXPECT_EQ(0, primary.replicate_to(sv[0]));
+      EXPECT_EQ(0, replica.replicate_from(sv[1]));
+      pump(replica);
+
+      EXPECT_EQ(1, primary.replication_stats().resyncs);
+      EXPECT_EQ(sent + 1, primary.replication_stats().records);
+      EXPECT_EQ(2, replica.log_count());
+      EXPECT_EQ(0, replica.open(2, &prec));
+      EXPECT_EQ(4, replica.open(4, &prec));
+      EXPECT_STREQ("While away", prec->message);
+      replica.close(prec);
+
+      /* with its records gone the replica is charged for the journal */
+      /* and replication state, before and after a restart            */
+      EXPECT_EQ(0, replica.remove(3));
+      EXPECT_EQ(0, replica.remove(4));
+      EXPECT_EQ(metaBytes(replicaDir), replica.get_managed_size());
+      event_manager restarted(replicaDir, 0, 0);
+      EXPECT_EQ(metaBytes(replicaDir), restarted.get_managed_size());
+
+      primary.replication_stop();
+      close(sv[0]);
+      close(sv[1]);
+   }
+
+   std::string cmd = std::string("exec rm -r ") + replicaDir;
+   EXPECT_EQ(0, system(cmd.c_str()));
+}
+
+/* The primary has admitted what it sends, a replica with a smaller */
+/* maxlogs or a quota of its own still keeps all of it               */
+TEST_F(TestEnv, ReplicaSkipsAdmission) {
+   char replicaDir[] = "./replicaXXXXXX";
+   ASSERT_NE(nullptr, mkdtemp(replicaDir));
+   event_manager primary(eventsDir, 0, 0);
+   int sv[2];
+
+   auto rec = build_event_record("Replicated", "Info",
+                                 "Association", "Test", p, 4);
+   for (int i = 0; i < 3; i++)
+      EXPECT_EQ(i + 1, primary.create(&rec));
+
+   {
+      event_manager replica(replicaDir, 0, 1);
+      replica.set_quota("Test", 10);
+      ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+      EXPECT_EQ(0, primary.replicate_to(sv[0]));
+      EXPECT_EQ(0, replica.replicate_from(sv[1]));
+      for (int i = 0; i < 20; i++) {
+         primary.replication_process();
+         replica.replication_process();
+      }
+
+      EXPECT_EQ(3, replica.log_count());
+      EXPECT_EQ(primary.replication_stats().shipped,
+                primary.replication_stats().acked);
+
+      /* local callers are still held to the replica's limits */
+      EXPECT_EQ(0, replica.create(&rec));
+
+      primary.replication_stop();
+      close(sv[0]);
+      close(sv[1]);
+   }
+
+   std::string cmd = std::string("exec rm -r ") + replicaDir;
+   EXPECT_EQ(0, system(cmd.c_str()));
+}
+
+/* A replica still only keeps what fits in its own maxsize, a record */
+/* past that is never acknowledged                                   */
+TEST_F(TestEnv, ReplicaCapacity) {
+   char replicaDir[] = "./replicaXXXXXX";
+   ASSERT_NE(nullptr, mkdtemp(replicaDir));
+   event_manager primary(eventsDir, 0, 0);
+   int sv[2];
+
+   auto rec = build_event_record("Replicated", "Info",
+                                 "Association", "Test", p, 4);
+   ASSERT_EQ(0, socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+   EXPECT_EQ(0, primary.replicate_to(sv[0]));
+   EXPECT_EQ(1, primary.create(&rec));
+   /* what the replica holds with one record, state and journal included */
+   size_t full = primary.get_managed_size();
+   EXPECT_EQ(2, primary.create(&rec));
+   size_t one = primary.get_managed_size() - full;
+   EXPECT_EQ(3, primary.create(&rec));
+
+   {
+      event_manager replica(replicaDir, full + one / 2, 0);
+      EXPECT_EQ(0, replica.replicate_from(sv[1]));
+      for (int i = 0; i < 20; i++) {
+         primary.replication_process();
+         replica.replication_process();
+      }
+
+      EXPECT_EQ(1, replica.log_count());
+      EXPECT_LT(replica.get_managed_size(), full + one / 2);
+      EXPECT_LT(primary.replication_stats().acked,
+                primary.replication_stats().shipped);
+
+      primary.replication_stop();
+      close(sv[0]);
+      close(sv[1]);
+   }
+
+   std::string cmd = std::string("exec rm -r ") + replicaDir;
+   EXPECT_EQ(0, system(cmd.c_str()));
+}
+
+namespace {
+struct log_lines {
+   std::mutex lock;
+   std::condition_variable cv;
+   bool held = false, waiting = false;
+   std::vector<std::pair<int, uint32_t>> got;   // kind, count
+   std::vector<std::string> messages;
+};
+
+void collect_line(void *ctx, const log_queue_entry_t *e)
+{
+   log_lines *l = (log_lines *) ctx;
+   std::unique_lock<std::mutex> g(l->lock);
+
+   l->waiting = true;
+   l->cv.notify_all();
+   l->cv.wait(g, [l] { return !l->held; });
+   l->got.push_back(std::make_pair(e->kind, e->count));
+   l->messages.push_back(e->message ? e->message : "");
+}
+}
+
+TEST(LogQueue, SuppressRepeats) {
+   log_lines lines;
+   log_queue_stats_t stats;
+
+   {
+      log_queue q(16, 3600, 2, collect_line, &lines);
+
+      for (int i = 0; i < 5; i++)
+         q.push(i + 1, "Info", "BMC", "/dimm3", "Fan stalled");
+      q.push(6, "Info", "BMC", "/dimm3", "Fan restarted");
+      q.push(7, "Info", "Host", "/dimm3", "Fan stalled");
+
+      stats = q.stats();
+      EXPECT_EQ(4, stats.queued);
+      EXPECT_EQ(3, stats.suppressed);
+      EXPECT_EQ(0, stats.dropped);
+   }
+
+   /* the summary goes out on the way down, the window being an hour */
+   ASSERT_EQ(5, lines.got.size());
+   EXPECT_EQ("Fan stalled", lines.messages[0]);
+   EXPECT_EQ("Fan restarted", lines.messages[2]);
+   EXPECT_EQ(LOG_QUEUE_SUPPRESSED, lines.got[4].first);
+   EXPECT_EQ(3, lines.got[4].second);
+   EXPECT_EQ("Fan stalled", lines.messages[4]);
+}
+
+TEST(LogQueue, CountOverflow) {
+   log_lines lines;
+   char msg[32];
+
+   lines.held = true;
+
+   {
+      log_queue q(4, 3600, 100, collect_line, &lines);
+
+      q.push(1, "Info", "BMC", "", "line 0");
+      {
+         /* the worker has taken line 0 and is stuck delivering it */
+         std::unique_lock<std::mutex> g(lines.lock);
+         lines.cv.wait(g, [&lines] { return lines.waiting; });
+      }
+
+      for (int i = 1; i < 8; i++) {
+         snprintf(msg, sizeof(msg), "line %d", i);
+         q.push(i + 1, "Info", "BMC", "", msg);
+      }
+      EXPECT_EQ(3, q.stats().dropped);
+
+      std::lock_guard<std::mutex> g(lines.lock);
+      lines.held = false;
+      lines.cv.notify_all();
+   }
+
+   ASSERT_EQ(6, lines.got.size());
+   EXPECT_EQ("line 4", lines.messages[4]);
+   EXPECT_EQ(LOG_QUEUE_DROPPED, lines.got[5].first);
+   EXPECT_EQ(3, lines.got[5].second);
+}
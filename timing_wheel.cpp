@@ -0,0 +1,202 @@
+#include "timing_wheel.hpp"
+
+const uint16_t g_unlinked = UINT16_MAX;
+
+
+timing_wheel::timing_wheel(uint32_t start)
+{
+	now = start;
+	clear();
+}
+
+void timing_wheel::clear(void)
+{
+	for (int32_t &h : heads)
+		h = -1;
+	for (uint64_t &o : occupied)
+		o = 0;
+
+	nodes.clear();
+
+	return;
+}
+
+bool timing_wheel::pending(uint16_t logid) const
+{
+	return logid < nodes.size() && nodes[logid].slot != g_unlinked;
+}
+
+/* Level of the highest 6 bit group where expiry and now differ */
+static int level_of(uint32_t expiry, uint32_t now)
+{
+	uint32_t diff = expiry ^ now;
+
+	if (!diff)
+		return 0;
+
+	return (31 - __builtin_clz(diff)) / 6;
+}
+
+void timing_wheel::link(uint16_t logid, uint32_t expiry)
+{
+	int level, index, slot;
+	node &n = nodes[logid];
+
+	// already due, it goes out with the next advance
+	if (expiry < now)
+		expiry = now;
+
+	level = level_of(expiry, now);
+	index = (expiry >> (level * bits)) & (slots - 1);
+	slot  = level * slots + index;
+
+	n.expiry = expiry;
+	n.slot   = slot;
+	n.prev   = -1;
+	n.next   = heads[slot];
+
+	if (n.next >= 0)
+		nodes[n.next].prev = logid;
+
+	heads[slot] = logid;
+	occupied[level] |= 1ULL << index;
+
+	return;
+}
+
+void timing_wheel::unlink(uint16_t logid)
+{
+	node &n = nodes[logid];
+	int slot = n.slot;
+
+	if (n.prev >= 0)
+		nodes[n.prev].next = n.next;
+	else
+		heads[slot] = n.next;
+
+	if (n.next >= 0)
+		nodes[n.next].prev = n.prev;
+
+	if (heads[slot] < 0)
+		occupied[slot / slots] &= ~(1ULL << (slot % slots));
+
+	n.slot = g_unlinked;
+
+	return;
+}
+
+void timing_wheel::add(uint16_t logid, uint32_t expiry)
+{
+	if (logid >= nodes.size())
+		nodes.resize(logid + 1, node{ -1, -1, 0, g_unlinked });
+
+	if (nodes[logid].slot != g_unlinked)
+		unlink(logid);
+
+	link(logid, expiry);
+
+	return;
+}
+
+void timing_wheel::cancel(uint16_t logid)
+{
+	if (pending(logid))
+		unlink(logid);
+
+	return;
+}
+
+/* At the start of a slot of a higher level, spread what it holds */
+/* over the levels below.  Highest level first, so entries moved  */
+/* down land in slots that are cascaded in turn.                   */
+void timing_wheel::cascade(void)
+{
+	for (int level = levels - 1; level > 0; level--) {
+		int shift = level * bits;
+		int index, slot;
+		int32_t id, next;
+
+		if (shift >= 32 || (now & ((1U << shift) - 1)))
+			continue;
+
+		index = (now >> shift) & (slots - 1);
+		slot  = level * slots + index;
+
+		for (id = heads[slot]; id >= 0; id = next) {
+			next = nodes[id].next;
+			uint32_t expiry = nodes[id].expiry;
+			unlink(id);
+			link(id, expiry);
+		}
+	}
+
+	return;
+}
+
+void timing_wheel::fire(int slot, std::vector<uint16_t> &expired)
+{
+	int32_t id, next;
+
+	for (id = heads[slot]; id >= 0; id = next) {
+		next = nodes[id].next;
+		unlink(id);
+		expired.push_back(id);
+	}
+
+	return;
+}
+
+/* Lowest slot start at or after now that holds something, 0 if none.   */
+/* Level 0 slots are exact expiry times, a higher level slot is the time */
+/* it has to be cascaded.                                                */
+uint32_t timing_wheel::next_due(void) const
+{
+	for (int level = 0; level < levels; level++) {
+		int shift = level * bits;
+		uint32_t index = (now >> shift) & (slots - 1);
+		uint64_t ahead;
+
+		// entries above level 0 always sit strictly ahead of now
+		ahead = occupied[level] & (~0ULL << index);
+		if (level && index == slots - 1)
+			ahead = 0;
+		else if (level)
+			ahead &= ~0ULL << (index + 1);
+
+		if (!ahead)
+			continue;
+
+		uint64_t base  = (uint64_t) now >> (shift + bits) << (shift + bits);
+		uint64_t start = base | ((uint64_t) __builtin_ctzll(ahead) << shift);
+
+		return start > UINT32_MAX ? UINT32_MAX : start;
+	}
+
+	return 0;
+}
+
+void timing_wheel::advance(uint32_t until, std::vector<uint16_t> &expired)
+{
+	uint32_t due;
+
+	while ((due = next_due()) && due <= until && due >= now) {
+		now = due;
+		cascade();
+
+		if (occupied[0] & (1ULL << (now & (slots - 1)))) {
+			fire(now & (slots - 1), expired);
+
+			if (now == UINT32_MAX)
+				return;
+			now++;
+			cascade();
+		}
+	}
+
+	if (until >= now)
+		now = until == UINT32_MAX ? until : until + 1;
+
+	cascade();
+
+	return;
+}
@@ -0,0 +1,51 @@
+#ifndef __TIMING_WHEEL_HPP__
+#define __TIMING_WHEEL_HPP__
+
+#include <cstdint>
+#include <vector>
+
+/* Hierarchical timing wheel of logids keyed on an expiry time in      */
+/* seconds.  Six levels of 64 slots cover the whole 32 bit range: a    */
+/* logid sits at the level of the highest 6 bit group in which its     */
+/* expiry differs from the wheel's current time, and is moved down a   */
+/* level each time the wheel reaches the start of its slot.  Adding    */
+/* and cancelling are O(1), each logid is moved at most five times     */
+/* before it expires, and advancing skips empty slots using a bitmap   */
+/* per level, so a long gap costs no more than a short one.            */
+class timing_wheel {
+	static const int levels = 6;
+	static const int bits   = 6;
+	static const int slots  = 1 << bits;
+
+	struct node {
+		int32_t  next, prev;  // logids, -1 ends the list
+		uint32_t expiry;
+		uint16_t slot;        // level * slots + index, or unlinked
+	};
+
+	std::vector<node> nodes;  // indexed by logid
+	int32_t  heads[levels * slots];
+	uint64_t occupied[levels];
+	uint32_t now;             // next second to be processed
+
+	void link(uint16_t logid, uint32_t expiry);
+	void unlink(uint16_t logid);
+	void cascade(void);
+	void fire(int slot, std::vector<uint16_t> &expired);
+
+public:
+	explicit timing_wheel(uint32_t start = 0);
+
+	void   add(uint16_t logid, uint32_t expiry);
+	void   cancel(uint16_t logid);
+	void   clear(void);
+	bool   pending(uint16_t logid) const;
+
+	// moves the wheel up to and including until, appending what expired
+	void   advance(uint32_t until, std::vector<uint16_t> &expired);
+
+	// earliest time advance() has work to do, 0 if the wheel is empty
+	uint32_t next_due(void) const;
+};
+
+#endif
@@ -0,0 +1,193 @@
+#include <algorithm>
+#include "trigram_index.hpp"
+
+using namespace std;
+
+
+static string fold(const char *s)
+{
+	string out(s ? s : "");
+
+	for (char &c : out)
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+
+	return out;
+}
+
+/* Distinct trigrams of s, the field in the top byte of each key */
+static void trigrams(int field, const string &s, vector<uint32_t> &keys)
+{
+	const uint8_t *p = (const uint8_t*) s.data();
+
+	keys.clear();
+
+	for (size_t i = 0; i + 3 <= s.size(); i++)
+		keys.push_back((uint32_t) field << 24 | p[i] << 16 |
+			       p[i + 1] << 8 | p[i + 2]);
+
+	sort(keys.begin(), keys.end());
+	keys.erase(unique(keys.begin(), keys.end()), keys.end());
+
+	return;
+}
+
+
+trigram_index::trigram_index() : count(0)
+{
+}
+
+void trigram_index::clear(void)
+{
+	docs.clear();
+	postings.clear();
+	count = 0;
+
+	return;
+}
+
+void trigram_index::insert(uint16_t logid, uint32_t timestamp,
+			   const char *const text[nfields])
+{
+	vector<uint32_t> keys;
+
+	erase(logid);
+
+	if (logid >= docs.size())
+		docs.resize(logid + 1);
+
+	doc_t &d = docs[logid];
+
+	d.live      = true;
+	d.timestamp = timestamp;
+	count++;
+
+	for (int f = 0; f < nfields; f++) {
+		d.text[f] = fold(text[f]);
+		trigrams(f, d.text[f], keys);
+
+		for (uint32_t k : keys) {
+			vector<uint16_t> &p = postings[k];
+
+			if (p.empty() || p.back() < logid) {
+				p.push_back(logid);
+			} else {
+				auto at = lower_bound(p.begin(), p.end(), logid);
+				if (*at != logid)
+					p.insert(at, logid);
+			}
+		}
+	}
+
+	return;
+}
+
+void trigram_index::erase(uint16_t logid)
+{
+	vector<uint32_t> keys;
+
+	if (logid >= docs.size() || !docs[logid].live)
+		return;
+
+	doc_t &d = docs[logid];
+
+	for (int f = 0; f < nfields; f++) {
+		trigrams(f, d.text[f], keys);
+
+		for (uint32_t k : keys) {
+			auto it = postings.find(k);
+			if (it == postings.end())
+				continue;
+
+			vector<uint16_t> &p = it->second;
+			auto at = lower_bound(p.begin(), p.end(), logid);
+
+			if (at != p.end() && *at == logid)
+				p.erase(at);
+			if (p.empty())
+				postings.erase(it);
+		}
+
+		string().swap(d.text[f]);
+	}
+
+	d.live = false;
+	count--;
+
+	return;
+}
+
+/* Appends every live logid whose field holds q */
+void trigram_index::match(int field, const string &q,
+			  vector<uint16_t> &hits) const
+{
+	vector<const vector<uint16_t>*> lists;
+	vector<uint32_t> keys;
+
+	if (q.size() < 3) {
+		for (size_t id = 0; id < docs.size(); id++)
+			if (docs[id].live &&
+			    docs[id].text[field].find(q) != string::npos)
+				hits.push_back(id);
+		return;
+	}
+
+	trigrams(field, q, keys);
+
+	for (uint32_t k : keys) {
+		auto it = postings.find(k);
+		if (it == postings.end())
+			return;
+		lists.push_back(&it->second);
+	}
+
+	sort(lists.begin(), lists.end(),
+	     [](const vector<uint16_t> *a, const vector<uint16_t> *b) {
+		return a->size() < b->size();
+	     });
+
+	for (uint16_t id : *lists[0]) {
+		size_t i;
+
+		for (i = 1; i < lists.size(); i++)
+			if (!binary_search(lists[i]->begin(), lists[i]->end(), id))
+				break;
+
+		// holding every trigram is not quite holding the substring
+		if (i == lists.size() &&
+		    docs[id].text[field].find(q) != string::npos)
+			hits.push_back(id);
+	}
+
+	return;
+}
+
+size_t trigram_index::search(const char *query, unsigned fields, size_t max,
+			     vector<uint16_t> &ids) const
+{
+	string q = fold(query);
+	vector<uint16_t> hits;
+	size_t total, keep;
+
+	for (int f = 0; f < nfields; f++)
+		if (fields & (1u << f))
+			match(f, q, hits);
+
+	sort(hits.begin(), hits.end());
+	hits.erase(unique(hits.begin(), hits.end()), hits.end());
+
+	total = hits.size();
+	keep  = min(total, max);
+	partial_sort(hits.begin(), hits.begin() + keep, hits.end(),
+		     [this](uint16_t a, uint16_t b) {
+		if (docs[a].timestamp != docs[b].timestamp)
+			return docs[a].timestamp > docs[b].timestamp;
+		return a > b;
+	});
+
+	hits.resize(keep);
+
+	ids.swap(hits);
+
+	return total;
+}
@@ -0,0 +1,53 @@
+#ifndef __TRIGRAM_INDEX_HPP__
+#define __TRIGRAM_INDEX_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/* Inverted index from each three byte run of some text fields to the   */
+/* logids holding it, for substring search.  Text is folded to lower    */
+/* case.  A query looks up its own trigrams, intersects their posting   */
+/* lists starting from the shortest, and checks each survivor against   */
+/* the folded text kept here, so the answer is exact and costs about    */
+/* the size of the rarest trigram rather than the number of records.    */
+/* Queries under three bytes have no trigram and scan every record.     */
+/* Postings are kept sorted by logid, which is the order records are    */
+/* created in, so adding one is nearly always an append.                */
+class trigram_index {
+public:
+	static const int nfields = 3;
+
+private:
+	struct doc_t {
+		bool        live;
+		uint32_t    timestamp;
+		std::string text[nfields];
+	};
+
+	std::vector<doc_t> docs;   // indexed by logid
+	std::unordered_map<uint32_t, std::vector<uint16_t>> postings;
+	size_t count;
+
+	void match(int field, const std::string &q,
+		   std::vector<uint16_t> &hits) const;
+
+public:
+	trigram_index();
+
+	void   insert(uint16_t logid, uint32_t timestamp,
+		      const char *const text[nfields]);
+	void   erase(uint16_t logid);
+	void   clear(void);
+	size_t size(void) const { return count; }
+
+	// logids with query in any field set in fields (bit i for field
+	// i), newest first by timestamp then logid, at most max of them.
+	// Returns how many matched in all, which may be more than max.
+	size_t search(const char *query, unsigned fields, size_t max,
+		      std::vector<uint16_t> &ids) const;
+};
+
+#endif